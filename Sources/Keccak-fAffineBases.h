@@ -121,6 +121,11 @@ private:
 
 /** This class implements an iterator over the affine space generated by the given
   * base and offset.
+  * The elements are visited in Gray-code order: the element of index <i>i</i>
+  * is the offset plus the generators selected by the bits of <i>i</i> XOR (<i>i</i> &gt;&gt; 1).
+  * Hence, going from one element to the next adds exactly one generator.
+  * The range of indexes can be split into chunks, e.g., to let several threads
+  * each iterate over a part of the same affine space.
   */
 template<class T>
 class AffineSpaceIterator {
@@ -128,7 +133,7 @@ private:
     vector<vector<T> > *emptyBase;
     const vector<vector<T> > *base;
     vector<T> current;
-    UINT64 i, end;
+    UINT64 i, begin, end;
 public:
     /** This constructor creates an empty iterator. */
     AffineSpaceIterator();
@@ -139,6 +144,17 @@ public:
       * @param   aOffset    The offset, as a reference to a vector of elements of template type @a T.
       */
     AffineSpaceIterator(const vector<vector<T> >& aBase, const vector<T>& aOffset);
+    /** This constructor initializes the affine space iterator with a given generator base
+      * and a given offset, restricted to one of @a nrChunks chunks of (almost) equal size.
+      * Iterating over the chunks 0 to @a nrChunks-1 visits each element of the affine space exactly once.
+      * @param   aBase      The generator base, as a reference to the set (vector) of generators.
+      * @param   aOffset    The offset, as a reference to a vector of elements of template type @a T.
+      * @param   chunkIndex The index of the chunk, between 0 and @a nrChunks-1.
+      * @param   nrChunks   The number of chunks the affine space is split into, at least 1.
+      *                     Otherwise, or if @a chunkIndex is not lower than @a nrChunks,
+      *                     a KeccakException is thrown.
+      */
+    AffineSpaceIterator(const vector<vector<T> >& aBase, const vector<T>& aOffset, unsigned int chunkIndex, unsigned int nrChunks);
     /** The destructor. */
     ~AffineSpaceIterator();
     /** This method tells whether the last element of the affine space
@@ -152,26 +168,50 @@ public:
       * @return The current element in the affine space.
       */
     const vector<T>& operator*() const;
+    /** This method calls @a f on each of the remaining elements of the affine space,
+      * in the same order as with operator++(), and leaves the iterator at its end.
+      * @param   f          A function or function object callable as f(const vector<T>&).
+      */
+    template<class F> void forEach(F& f);
     /** This method displays the offset and generators. 
       * @param   fout       The stream to display to.
       */
     void display(ostream& fout) const;
-    /** This method returns the number of elements in the affine space.
+    /** This method returns the number of elements in the affine space,
+      * or in the chunk if the iterator is restricted to one.
       * @return The number of elements in the affine space.
       */
     UINT64 getCount() const;
+private:
+    void addGenerator(unsigned int index);
 };
 
 template<class T>
 AffineSpaceIterator<T>::AffineSpaceIterator()
-    : emptyBase(new vector<vector<T> >), base(emptyBase), current(), i(0), end(0)
+    : emptyBase(new vector<vector<T> >), base(emptyBase), current(), i(0), begin(0), end(0)
 {
 }
 
 template<class T>
 AffineSpaceIterator<T>::AffineSpaceIterator(const vector<vector<T> >& aBase, const vector<T>& aOffset)
-    : emptyBase(0), base(&aBase), current(aOffset), i(0), end((UINT64)1<<base->size())
+    : emptyBase(0), base(&aBase), current(aOffset), i(0), begin(0), end((UINT64)1<<base->size())
+{
+}
+
+template<class T>
+AffineSpaceIterator<T>::AffineSpaceIterator(const vector<vector<T> >& aBase, const vector<T>& aOffset, unsigned int chunkIndex, unsigned int nrChunks)
+    : emptyBase(0), base(&aBase), current(aOffset)
 {
+    if (chunkIndex >= nrChunks)
+        throw KeccakException("AffineSpaceIterator: the chunk index must be lower than the number of chunks, which must be at least 1.");
+    UINT64 count = (UINT64)1<<base->size();
+    begin = (count/nrChunks)*chunkIndex + ((chunkIndex < count%nrChunks) ? chunkIndex : count%nrChunks);
+    end = begin + count/nrChunks + ((chunkIndex < count%nrChunks) ? 1 : 0);
+    i = begin;
+    UINT64 gray = (begin < end) ? (begin ^ (begin >> 1)) : 0;
+    for(unsigned int index=0; gray != 0; index++, gray >>= 1)
+        if ((gray & 1) != 0)
+            addGenerator(index);
 }
 
 template<class T>
@@ -187,17 +227,20 @@ bool AffineSpaceIterator<T>::isEnd() const
     return i >= end;
 }
 
+template<class T>
+void AffineSpaceIterator<T>::addGenerator(unsigned int index)
+{
+    const vector<T>& generator = (*base)[index];
+    for(unsigned int z=0; z<current.size(); z++)
+        current[z] ^= generator[z];
+}
+
 template<class T>
 void AffineSpaceIterator<T>::operator++()
 {
-    if (i < (end-1)) {
-        unsigned int index = 0;
-        while((i & ((UINT64)1<<index)) != 0) 
-            index++;
-        for(unsigned int z=0; z<current.size(); z++)
-            current[z] ^= (*base)[index][z];
-    }
     i++;
+    if (i < end)
+        addGenerator(getTrailingZeros(i));
 }
 
 template<class T>
@@ -206,6 +249,18 @@ const vector<T>& AffineSpaceIterator<T>::operator*() const
     return current;
 }
 
+template<class T> template<class F>
+void AffineSpaceIterator<T>::forEach(F& f)
+{
+    if (i >= end)
+        return;
+    f(current);
+    for(i++; i<end; i++) {
+        addGenerator(getTrailingZeros(i));
+        f(current);
+    }
+}
+
 template<class T>
 void AffineSpaceIterator<T>::display(ostream& fout) const
 {
@@ -226,7 +281,7 @@ void AffineSpaceIterator<T>::display(ostream& fout) const
 template<class T>
 UINT64 AffineSpaceIterator<T>::getCount() const
 {
-    return end;
+    return end - begin;
 }
 
 /** This class implements an iterator over the affine space generated by the given
@@ -219,100 +219,17 @@ void KeccakFDCLC::displayAll(ostream& fout, KeccakFPropagation *DC, KeccakFPropa
     }
 }
 
+/** The version of the layout of the cached λ look-up tables.
+  * It must be incremented whenever their contents or layout change,
+  * so that stale cache files are ignored.
+  */
+static const unsigned int lambdaTablesVersion = 1;
+
 void KeccakFDCLC::initializeLambdaLookupTables()
 {
-    // lambdaRowToSlice
-    {
-        string fileName = buildFileName("", "-lambda.cache");
-        ifstream fin(fileName.c_str(), ios::binary);
-        if (!fin) {
-            for(unsigned int m=0; m<KeccakFDCLC::EndOfLambdaModes ; m++) {
-                vector<vector<vector<vector<SliceValue> > > > vvvv;
-                for(unsigned int outputSlice=0; outputSlice<laneSize; outputSlice++) {
-                    vector<vector<vector<SliceValue> > > vvv;
-                    for(unsigned int inputSlice=0; inputSlice<laneSize; inputSlice++) {
-                        vector<vector<SliceValue> > vv;
-                        for(unsigned int y=0; y<nrRowsAndColumns; y++) {
-                            vector<SliceValue> v(1<<nrRowsAndColumns);
-                            for(RowValue row=0; row<(1<<nrRowsAndColumns); row++) {
-                                vector<LaneValue> state(nrRowsAndColumns*nrRowsAndColumns, 0);
-                                setRow(state, row, y, inputSlice);
-                                lambda(state,KeccakFDCLC::LambdaMode(m));
-                                v[row] = getSlice(state, outputSlice);
-                            }
-                            vv.push_back(v);
-                        }
-                        vvv.push_back(vv);
-                    }
-                    vvvv.push_back(vvv);
-                }
-                lambdaRowToSlice.push_back(vvvv);
-            }
-            ofstream fout(fileName.c_str(), ios::binary);
-            for(unsigned int m=0; m<KeccakFDCLC::EndOfLambdaModes ; m++)
-            for(unsigned int outputSlice=0; outputSlice<laneSize; outputSlice++)
-            for(unsigned int inputSlice=0; inputSlice<laneSize; inputSlice++)
-            for(unsigned int y=0; y<nrRowsAndColumns; y++)
-            for(RowValue row=0; row<(1<<nrRowsAndColumns); row++) {
-                static unsigned char tmp[4];
-                SliceValue v = lambdaRowToSlice[m][outputSlice][inputSlice][y][row];
-                tmp[0] =  v&0xFF;
-                tmp[1] = (v>>8)&0xFF;
-                tmp[2] = (v>>16)&0xFF;
-                tmp[3] = (v>>24)&0xFF;
-                fout.write((char *)tmp, 4);
-            }
-        }
-        else {
-            for(unsigned int m=0; m<KeccakFDCLC::EndOfLambdaModes ; m++) {
-                vector<vector<vector<vector<SliceValue> > > > vvvv;
-                for(unsigned int outputSlice=0; outputSlice<laneSize; outputSlice++) {
-                    vector<vector<vector<SliceValue> > > vvv;
-                    for(unsigned int inputSlice=0; inputSlice<laneSize; inputSlice++) {
-                        vector<vector<SliceValue> > vv;
-                        for(unsigned int y=0; y<nrRowsAndColumns; y++) {
-                            vector<SliceValue> v(1<<nrRowsAndColumns);
-                            for(RowValue row=0; row<(1<<nrRowsAndColumns); row++) {
-                                static unsigned char tmp[4]; 
-                                fin.read((char *)tmp, 4);
-                                v[row]  = tmp[3];  v[row] <<= 8;
-                                v[row] ^= tmp[2];  v[row] <<= 8;
-                                v[row] ^= tmp[1];  v[row] <<= 8;
-                                v[row] ^= tmp[0];
-                            }
-                            vv.push_back(v);
-                        }
-                        vvv.push_back(vv);
-                    }
-                    vvvv.push_back(vvv);
-                }
-                lambdaRowToSlice.push_back(vvvv);
-            }
-        }
-    }
-    // lambdaBeforeThetaRowToSlice
-    for(unsigned int m=0; m<KeccakFDCLC::EndOfLambdaModes ; m++) {
-        vector<vector<vector<vector<SliceValue> > > > vvvv;
-        for(unsigned int outputSlice=0; outputSlice<laneSize; outputSlice++) {
-            vector<vector<vector<SliceValue> > > vvv;
-            for(unsigned int inputSlice=0; inputSlice<laneSize; inputSlice++) {
-                vector<vector<SliceValue> > vv;
-                for(unsigned int y=0; y<nrRowsAndColumns; y++) {
-                    vector<SliceValue> v(1<<nrRowsAndColumns);
-                    for(RowValue row=0; row<(1<<nrRowsAndColumns); row++) {
-                        vector<LaneValue> state(nrRowsAndColumns*nrRowsAndColumns, 0);
-                        setRow(state, row, y, inputSlice);
-                        lambdaBeforeTheta(state, KeccakFDCLC::LambdaMode(m));
-                        v[row] = getSlice(state, outputSlice);
-                    }
-                    vv.push_back(v);
-                }
-                vvv.push_back(vv);
-            }
-            vvvv.push_back(vvv);
-        }
-        lambdaBeforeThetaRowToSlice.push_back(vvvv);
-    }
+    initializeLambdaLookupTable(lambdaRowToSlice, 0, "-lambda.cache");
+    initializeLambdaLookupTable(lambdaBeforeThetaRowToSlice, 1, "-lambdaBeforeTheta.cache");
+    initializeLambdaLookupTable(lambdaAfterThetaRowToSlice, 2, "-lambdaAfterTheta.cache");
     // thetaJustAfterChi
     for(unsigned int mode=0; mode<KeccakFDCLC::EndOfLambdaModes ; mode++) {
         if ((mode == Straight) || (mode == Dual))
@@ -327,58 +244,63 @@ void KeccakFDCLC::initializeLambdaLookupTables()
         else if ((mode == Transpose) || (mode == Inverse))
             thetaJustBeforeChi.push_back(true);
     }
-    // lambdaAfterThetaRowToSlice
-    for(unsigned int m=0; m<KeccakFDCLC::EndOfLambdaModes ; m++) {
-        vector<vector<vector<vector<SliceValue> > > > vvvv;
-        for(unsigned int outputSlice=0; outputSlice<laneSize; outputSlice++) {
-            vector<vector<vector<SliceValue> > > vvv;
-            for(unsigned int inputSlice=0; inputSlice<laneSize; inputSlice++) {
-                vector<vector<SliceValue> > vv;
-                for(unsigned int y=0; y<nrRowsAndColumns; y++) {
-                    vector<SliceValue> v(1<<nrRowsAndColumns);
-                    for(RowValue row=0; row<(1<<nrRowsAndColumns); row++) {
-                        vector<LaneValue> state(nrRowsAndColumns*nrRowsAndColumns, 0);
-                        setRow(state, row, y, inputSlice);
-                        lambdaAfterTheta(state, KeccakFDCLC::LambdaMode(m));
-                        v[row] = getSlice(state, outputSlice);
-                    }
-                    vv.push_back(v);
-                }
-                vvv.push_back(vv);
-            }
-            vvvv.push_back(vvv);
-        }
-        lambdaAfterThetaRowToSlice.push_back(vvvv);
+}
+
+void KeccakFDCLC::initializeLambdaLookupTable(CachedTable& table, unsigned int part, const string& suffix)
+{
+    static const char *tags[3] = { "lambda", "lambdaBeforeTheta", "lambdaAfterTheta" };
+    string fileName = buildFileName("", suffix);
+    size_t nrEntries = getLambdaTableIndex(KeccakFDCLC::EndOfLambdaModes, 0, 0, 0);
+    if (table.load(fileName, tags[part], width, lambdaTablesVersion, nrEntries*sizeof(SliceValue)))
+        return;
+    SliceValue *entries = (SliceValue *)table.allocate(nrEntries*sizeof(SliceValue));
+    for(unsigned int m=0; m<KeccakFDCLC::EndOfLambdaModes ; m++)
+    for(unsigned int inputSlice=0; inputSlice<laneSize; inputSlice++)
+    for(unsigned int y=0; y<nrRowsAndColumns; y++)
+    for(RowValue row=0; row<(1<<nrRowsAndColumns); row++) {
+        vector<LaneValue> state(nrRowsAndColumns*nrRowsAndColumns, 0);
+        setRow(state, row, y, inputSlice);
+        if (part == 0)
+            lambda(state, KeccakFDCLC::LambdaMode(m));
+        else if (part == 1)
+            lambdaBeforeTheta(state, KeccakFDCLC::LambdaMode(m));
+        else
+            lambdaAfterTheta(state, KeccakFDCLC::LambdaMode(m));
+        size_t index = getLambdaTableIndex(m, inputSlice, y, row);
+        for(unsigned int outputSlice=0; outputSlice<laneSize; outputSlice++)
+            entries[index+outputSlice] = getSlice(state, outputSlice);
     }
+    table.save(fileName, tags[part], width, lambdaTablesVersion);
 }
 
-void KeccakFDCLC::lambda(const vector<SliceValue>& in, vector<SliceValue>& out, LambdaMode mode) const
+void KeccakFDCLC::applyLambdaLookupTable(const CachedTable& table, const vector<SliceValue>& in, vector<SliceValue>& out, LambdaMode mode) const
 {
     // This assumes that 'in' has size equal to 'laneSize'
+    const SliceValue *entries = table.getDataAs<SliceValue>();
     out.assign(laneSize, 0);
     for(unsigned int inputSlice=0; inputSlice<laneSize; inputSlice++)
     for(unsigned int y=0; y<nrRowsAndColumns; y++) {
         RowValue row = getRowFromSlice(in[inputSlice], y);
-        for(unsigned int outputSlice=0; outputSlice<laneSize; outputSlice++)
-            out[outputSlice] ^= lambdaRowToSlice[mode][outputSlice][inputSlice][y][row];
+        if (row != 0) {
+            const SliceValue *contribution = entries + getLambdaTableIndex(mode, inputSlice, y, row);
+            for(unsigned int outputSlice=0; outputSlice<laneSize; outputSlice++)
+                out[outputSlice] ^= contribution[outputSlice];
+        }
     }
 }
 
+void KeccakFDCLC::lambda(const vector<SliceValue>& in, vector<SliceValue>& out, LambdaMode mode) const
+{
+    applyLambdaLookupTable(lambdaRowToSlice, in, out, mode);
+}
+
 void KeccakFDCLC::lambdaBeforeTheta(const vector<SliceValue>& in, vector<SliceValue>& out, LambdaMode mode) const
 {
     if (thetaJustAfterChi[mode]) {
         out = in;
     }
-    else {
-        // This assumes that 'in' has size equal to 'laneSize'
-        out.assign(laneSize, 0);
-        for(unsigned int inputSlice=0; inputSlice<laneSize; inputSlice++)
-        for(unsigned int y=0; y<nrRowsAndColumns; y++) {
-            RowValue row = getRowFromSlice(in[inputSlice], y);
-            for(unsigned int outputSlice=0; outputSlice<laneSize; outputSlice++)
-                out[outputSlice] ^= lambdaBeforeThetaRowToSlice[mode][outputSlice][inputSlice][y][row];
-        }
-    }
+    else
+        applyLambdaLookupTable(lambdaBeforeThetaRowToSlice, in, out, mode);
 }
 
 void KeccakFDCLC::lambdaAfterTheta(const vector<SliceValue>& in, vector<SliceValue>& out, LambdaMode mode) const
@@ -386,16 +308,8 @@ void KeccakFDCLC::lambdaAfterTheta(const vector<SliceValue>& in, vector<SliceVal
     if (thetaJustBeforeChi[mode]) {
         out = in;
     }
-    else {
-        // This assumes that 'in' has size equal to 'laneSize'
-        out.assign(laneSize, 0);
-        for(unsigned int inputSlice=0; inputSlice<laneSize; inputSlice++)
-        for(unsigned int y=0; y<nrRowsAndColumns; y++) {
-            RowValue row = getRowFromSlice(in[inputSlice], y);
-            for(unsigned int outputSlice=0; outputSlice<laneSize; outputSlice++)
-                out[outputSlice] ^= lambdaAfterThetaRowToSlice[mode][outputSlice][inputSlice][y][row];
-        }
-    }
+    else
+        applyLambdaLookupTable(lambdaAfterThetaRowToSlice, in, out, mode);
 }
 
 void KeccakFDCLC::checkDCTrail(const Trail& trail, KeccakFPropagation *DC) const
@@ -19,6 +19,7 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #include <string>
 #include "Keccak-fParts.h"
 #include "Keccak-fTrails.h"
+#include "tablecache.h"
 
 class KeccakFPropagation;
 
@@ -101,25 +102,28 @@ private:
       * the contribution of an input row to an output slice via the linear
       * function λ.
       *
-      * The indexes are as follows, from outer to inner:
+      * The table is flat, with SliceValue entries, and the indexes are as follows, from outer to inner:
       * - the λ mode (λ, its inverse, its transpose, the transpose of its inverse)
-      * - the output slice index (oz)
       * - the input slice index (iz)
       * - the input row index (iy)
       * - the input row value input[iy,iz]
+      * - the output slice index (oz)
       * 
       * So, given a row value B located at row iy in slice 0&lt;=iz&lt;laneSize,
-      * its linear contribution to the output of the λ function in Straight mode is given
-      * by lambdaRowToSlice[(int)Straight][oz][iz][iy][B], where oz is
-      * varied from 0 to laneSize-1 to see all the output slices.
+      * its linear contribution to the output of the λ function in Straight mode
+      * starts at index getLambdaTableIndex(Straight, iz, iy, B), and the next laneSize entries
+      * give the contributions to all the output slices.
+      * 
+      * The table is memory-mapped from the cache file given by buildFileName("", "-lambda.cache")
+      * if available, and computed (and saved to this file) otherwise.
       */
-    vector<vector<vector<vector<vector<SliceValue> > > > > lambdaRowToSlice;
+    CachedTable lambdaRowToSlice;
     /** Same as lambdaRowToSlice, but only for the linear part before θ.
       */
-    vector<vector<vector<vector<vector<SliceValue> > > > > lambdaBeforeThetaRowToSlice;
+    CachedTable lambdaBeforeThetaRowToSlice;
     /** Same as lambdaRowToSlice, but only for the linear part after θ.
       */
-    vector<vector<vector<vector<vector<SliceValue> > > > > lambdaAfterThetaRowToSlice;
+    CachedTable lambdaAfterThetaRowToSlice;
 public:
     /** In this context, λ represents the linear operations in Keccak-<i>f</i> 
       * between two applications of χ.
@@ -284,6 +288,22 @@ public:
 private:
     void initializeAll();
     void initializeLambdaLookupTables();
+    /** This method initializes one of the λ look-up tables, 
+      * from its cache file if possible.
+      * @param  table   The table to initialize.
+      * @param  part    0 for the whole λ, 1 for the part before θ, 2 for the part after θ.
+      * @param  suffix  The suffix of the cache file name.
+      */
+    void initializeLambdaLookupTable(CachedTable& table, unsigned int part, const string& suffix);
+    /** This method returns the index of the first entry in a λ look-up table
+      * corresponding to the given mode and input row.
+      */
+    inline size_t getLambdaTableIndex(unsigned int mode, unsigned int inputSlice, unsigned int y, RowValue row) const
+    {
+        return ((((size_t)mode*laneSize + inputSlice)*nrRowsAndColumns + y)*(1<<nrRowsAndColumns) + row)*laneSize;
+    }
+    /** This method applies a λ look-up table to a state represented as slices. */
+    void applyLambdaLookupTable(const CachedTable& table, const vector<SliceValue>& in, vector<SliceValue>& out, LambdaMode mode) const;
 };
 
 template<class Lane>
@@ -13,6 +13,7 @@ and related or neighboring rights to the source code in this file.
 http://creativecommons.org/publicdomain/zero/1.0/
 */
 
+#include <atomic>
 #include <sstream>
 #include "Keccak-fParityBounds.h"
 #include "Keccak-fPositions.h"
@@ -29,25 +30,36 @@ unsigned int getBoundOfTotalWeightGivenTotalHammingWeight(const KeccakFPropagati
     // The check was done both for DC and LC.
 }
 
+/** This function tells whether the given row, as the index 64y+z, is in the given set of rows,
+  * represented as one 64-bit word per y.
+  */
+inline bool isRowTaken(const UINT64 rowsTaken[5], unsigned int row)
+{
+    return ((rowsTaken[row >> 6] >> (row & 63)) & 1) != 0;
+}
+
+inline void takeRow(UINT64 rowsTaken[5], unsigned int row)
+{
+    rowsTaken[row >> 6] |= (UINT64)1 << (row & 63);
+}
+
 unsigned int getLowerBoundTotalActiveRowsFromACandUOC(const KeccakFPropagation& DCorLC, 
     const vector<ColumnPosition>& xzAC, const vector<ColumnPosition>& xzUOC)
 {
     unsigned int activeRows = 0;
-    vector<vector<bool> > rowTakenLeft(5, vector<bool>(DCorLC.laneSize, false));
-    vector<vector<bool> > rowTakenRight(5, vector<bool>(DCorLC.laneSize, false));
+    UINT64 rowTakenLeft[5] = {0, 0, 0, 0, 0};
+    UINT64 rowTakenRight[5] = {0, 0, 0, 0, 0};
     
     for(unsigned int i=0; i<xzAC.size(); i++) {
         unsigned int x = xzAC[i].x;
         unsigned int z = xzAC[i].z;
         for(unsigned int y=0; y<5; y++) {
-            BitPosition left(x, y, z);
-            DCorLC.reverseRhoPiBeforeTheta(left);
-            BitPosition right(x, y, z);
-            DCorLC.directRhoPiAfterTheta(right);
-            if ((!rowTakenLeft[left.y][left.z]) && (!rowTakenRight[right.y][right.z])) {
+            unsigned int left = DCorLC.getRowBeforeTheta(x, y, z);
+            unsigned int right = DCorLC.getRowAfterTheta(x, y, z);
+            if ((!isRowTaken(rowTakenLeft, left)) && (!isRowTaken(rowTakenRight, right))) {
                 activeRows++;
-                rowTakenLeft[left.y][left.z] = true;
-                rowTakenRight[right.y][right.z] = true;
+                takeRow(rowTakenLeft, left);
+                takeRow(rowTakenRight, right);
             }
         }
     }
@@ -58,48 +70,52 @@ unsigned int getLowerBoundTotalActiveRowsFromACandUOC(const KeccakFPropagation&
         bool takenLeft = false;
         bool takenRight = false;
         for(unsigned int y=0; y<5; y++) {
-            BitPosition left(x, y, z);
-            DCorLC.reverseRhoPiBeforeTheta(left);
-            BitPosition right(x, y, z);
-            DCorLC.directRhoPiAfterTheta(right);
-            takenLeft |= rowTakenLeft[left.y][left.z];
-            takenRight |= rowTakenRight[right.y][right.z];
-            rowTakenLeft[left.y][left.z] = true;
-            rowTakenRight[right.y][right.z] = true;
+            unsigned int left = DCorLC.getRowBeforeTheta(x, y, z);
+            unsigned int right = DCorLC.getRowAfterTheta(x, y, z);
+            takenLeft |= isRowTaken(rowTakenLeft, left);
+            takenRight |= isRowTaken(rowTakenRight, right);
+            takeRow(rowTakenLeft, left);
+            takeRow(rowTakenRight, right);
         }
         if (!takenLeft)
             activeRows++;
         if (!takenRight)
             activeRows++;
-        for(unsigned int y=0; y<5; y++) {
-            BitPosition left(x, y, z);
-            DCorLC.reverseRhoPiBeforeTheta(left);
-            BitPosition  right(x, y, z);
-            DCorLC.directRhoPiAfterTheta(right);
-            if (takenLeft)
-                rowTakenLeft[left.y][left.z] = true;
-            if (takenRight)
-                rowTakenRight[right.y][right.z] = true;
-        }
     }
 
     return activeRows;
 }
 
+/** This function packs the given parity or θ-effect as one 64-bit word per x, with bit z set if column (x, z) is.
+  */
+void packColumnsPerX(const vector<RowValue>& rows, UINT64 columns[5])
+{
+    for(unsigned int x=0; x<5; x++)
+        columns[x] = 0;
+    for(unsigned int z=0; z<rows.size(); z++)
+        for(unsigned int x=0; x<5; x++)
+            if ((rows[z] >> x) & 1)
+                columns[x] |= (UINT64)1 << z;
+}
+
+void appendColumns(unsigned int x, UINT64 columns, vector<ColumnPosition>& xz)
+{
+    while(columns != 0) {
+        xz.push_back(ColumnPosition(x, getTrailingZeros(columns)));
+        columns &= columns - 1;
+    }
+}
+
 unsigned int getLowerBoundTotalActiveRows(const KeccakFPropagation& DCorLC, 
     const vector<RowValue>& C, const vector<RowValue>& D)
 {
+    UINT64 odd[5], affected[5];
+    packColumnsPerX(C, odd);
+    packColumnsPerX(D, affected);
     vector<ColumnPosition> xzAC, xzUOC;
-    for(unsigned int x=0; x<5; x++)
-    for(unsigned int z=0; z<DCorLC.laneSize; z++) {
-        bool odd = (getBit(C, x, z) != 0);
-        bool affected = (getBit(D, x, z) != 0);
-        if (affected)
-            xzAC.push_back(ColumnPosition(x, z));
-        else  {
-            if (odd)
-                xzUOC.push_back(ColumnPosition(x, z));
-        }
+    for(unsigned int x=0; x<5; x++) {
+        appendColumns(x, affected[x], xzAC);
+        appendColumns(x, odd[x] & ~affected[x], xzUOC);
     }
     return getLowerBoundTotalActiveRowsFromACandUOC(DCorLC, xzAC, xzUOC);
 }
@@ -144,20 +160,35 @@ void ParityAsRuns::toParityAndParityEffect(const KeccakFPropagation& DCorLC, vec
     }
 }
 
-unsigned int ParityAsRuns::getLowerBoundTotalHammingWeight(const KeccakFPropagation& DCorLC) const
+/** This function marks the columns affected by the given runs, as one 64-bit word per x.
+  */
+void getAffectedColumns(const KeccakFPropagation& DCorLC, const vector<Run>& runs, UINT64 affected[5])
 {
-    vector<bool> affected(DCorLC.laneSize*5, false);
+    for(unsigned int x=0; x<5; x++)
+        affected[x] = 0;
     for(unsigned int i=0; i<runs.size(); i++) {
-        affected[DCorLC.translateAlongXinT(runs[i].tStart)] = true;
-        affected[DCorLC.translateAlongXinT(runs[i].tStart + runs[i].length)] = true;
+        unsigned int x, z;
+        DCorLC.getXandZfromT(DCorLC.translateAlongXinT(runs[i].tStart), x, z);
+        affected[x] |= (UINT64)1 << z;
+        DCorLC.getXandZfromT(DCorLC.translateAlongXinT(runs[i].tStart + runs[i].length), x, z);
+        affected[x] |= (UINT64)1 << z;
     }
-    unsigned int total = 5*2*runs.size();
+}
+
+unsigned int ParityAsRuns::getLowerBoundTotalHammingWeight(const KeccakFPropagation& DCorLC) const
+{
+    UINT64 affected[5], odd[5] = {0, 0, 0, 0, 0};
+    getAffectedColumns(DCorLC, runs, affected);
     for(unsigned int i=0; i<runs.size(); i++) {
         for(unsigned int t=runs[i].tStart; t<runs[i].tStart+runs[i].length; t++) {
-            if (!affected[t])
-                total += 2;
+            unsigned int x, z;
+            DCorLC.getXandZfromT(t, x, z);
+            odd[x] |= (UINT64)1 << z;
         }
     }
+    unsigned int total = 5*2*runs.size();
+    for(unsigned int x=0; x<5; x++)
+        total += 2*getHammingWeightLane(odd[x] & ~affected[x]);
     return total;
 }
 
@@ -177,92 +208,389 @@ unsigned int ParityAsRuns::getLowerBoundTotalActiveRowsUsingOnlyAC(const KeccakF
 unsigned int ParityAsRuns::getLowerBoundTotalActiveRows(const KeccakFPropagation& DCorLC) const
 {
     vector<ColumnPosition> xzAC, xzUOC;
-    vector<bool> affected(DCorLC.laneSize*5, false);
+    UINT64 affected[5];
+    getAffectedColumns(DCorLC, runs, affected);
     for(unsigned int i=0; i<runs.size(); i++) {
         unsigned int x, z;
         DCorLC.getXandZfromT(DCorLC.translateAlongXinT(runs[i].tStart), x, z);
         xzAC.push_back(ColumnPosition(x, z));
         DCorLC.getXandZfromT(DCorLC.translateAlongXinT(runs[i].tStart + runs[i].length), x, z);
         xzAC.push_back(ColumnPosition(x, z));
-        affected[DCorLC.translateAlongXinT(runs[i].tStart)] = true;
-        affected[DCorLC.translateAlongXinT(runs[i].tStart + runs[i].length)] = true;
     }
     for(unsigned int i=0; i<runs.size(); i++) {
         for(unsigned int t=runs[i].tStart; t<runs[i].tStart+runs[i].length; t++) {
-            if (!affected[t]) {
-                unsigned int x, z;
-                DCorLC.getXandZfromT(t, x, z);
+            unsigned int x, z;
+            DCorLC.getXandZfromT(t, x, z);
+            if (((affected[x] >> z) & 1) == 0)
                 xzUOC.push_back(ColumnPosition(x, z));
-            }
         }
     }
     return getLowerBoundTotalActiveRowsFromACandUOC(DCorLC, xzAC, xzUOC);
 }
 
-void lookForRunsBelowTargetWeight(const KeccakFPropagation& DCorLC, ostream& out,
-    unsigned int targetWeight, ParityAsRuns& parity, ProgressMeter& progress, bool verbose)
+ParitySaveToFile::ParitySaveToFile(ostream& aFout, bool aVerbose)
+    : fout(aFout), verbose(aVerbose)
+{
+}
+
+void ParitySaveToFile::fetchParity(const ParityAsRuns& /* parity */, const vector<RowValue>& C, const vector<RowValue>& D, unsigned int lowerBound)
 {
-    unsigned int lowerBound;
-    unsigned int weightBoundBasedOnTotalHammingWeight = getBoundOfTotalWeightGivenTotalHammingWeight(DCorLC,
-        parity.getLowerBoundTotalHammingWeight(DCorLC));
-    if (weightBoundBasedOnTotalHammingWeight <= targetWeight) {
-        unsigned int minActiveRows = parity.getLowerBoundTotalActiveRowsUsingOnlyAC(DCorLC);
-        lowerBound = max(minActiveRows*2, weightBoundBasedOnTotalHammingWeight);
+    if (verbose) {
+        displayParity(cout, C, D);
+        cout << "Lower bound = " << dec << lowerBound << endl;
+        cout << endl;
     }
+    vector<RowValue> Cmin;
+    if (5*C.size() <= 64)
+        unpackParity(getSymmetricMinimumPacked(packParity(C), C.size(), 5), Cmin, C.size());
     else
-        lowerBound = weightBoundBasedOnTotalHammingWeight;
-    if (lowerBound <= targetWeight) {
-        unsigned int thisOneLowerBound = parity.getLowerBoundTotalActiveRows(DCorLC)*2;
-        if (thisOneLowerBound <= targetWeight) {
-            vector<RowValue> C, D;
-            parity.toParityAndParityEffect(DCorLC, C, D);
-            unsigned int thisOneLowerBoundAgain = getLowerBoundTotalActiveRows(DCorLC, C, D)*2;
-            if (thisOneLowerBoundAgain <= targetWeight) {
-                if (verbose) {
-                    displayParity(cout, C, D);
-                    cout << "Lower bound = " << dec << max(thisOneLowerBound, thisOneLowerBoundAgain) << endl;
-                    cout << endl;
+        getSymmetricMinimum(C, Cmin);
+    writeParity(fout, Cmin);
+}
+
+SynchronizedParityFetcher::SynchronizedParityFetcher(ParityFetcher& aParitiesOut)
+    : paritiesOut(aParitiesOut)
+{
+}
+
+void SynchronizedParityFetcher::fetchParity(const ParityAsRuns& parity, const vector<RowValue>& C, const vector<RowValue>& D, unsigned int lowerBound)
+{
+    lock_guard<mutex> guard(lock);
+    paritiesOut.fetchParity(parity, C, D, lowerBound);
+}
+
+class ParityAsRunsWithBounds;
+
+/** This class holds what the tasks of lookForRunsBelowTargetWeight() share,
+  * in particular the rows that the bits of each column t go to
+  * on both sides, as in getLowerBoundTotalActiveRowsFromACandUOC().
+  */
+class RunsBelowTargetWeightSearch {
+public:
+    const KeccakFPropagation& DCorLC;
+    unsigned int targetWeight;
+    ParityFetcher& paritiesOut;
+    atomic<UINT64>& count;
+    /** The number of columns, i.e., 5 times the lane size. */
+    unsigned int nrColumns;
+    /** At index 5t+y, the row on the left of bit y of column t, see KeccakFPropagation::getRowBeforeTheta(). */
+    vector<unsigned int> rowsLeft;
+    /** At index 5t+y, the row on the right of bit y of column t, see KeccakFPropagation::getRowAfterTheta(). */
+    vector<unsigned int> rowsRight;
+public:
+    RunsBelowTargetWeightSearch(const KeccakFPropagation& aDCorLC, unsigned int aTargetWeight, ParityFetcher& aParitiesOut, atomic<UINT64>& aCount);
+    void search(ParityAsRunsWithBounds& state, ProgressMeter *progress) const;
+};
+
+/** This class represents a parity as runs, together with the quantities
+  * its lower bounds are computed from. These are updated when a run is
+  * added or removed, instead of being computed again from all the runs.
+  */
+class ParityAsRunsWithBounds {
+public:
+    ParityAsRuns parity;
+protected:
+    const RunsBelowTargetWeightSearch& search;
+    /** For each column t, the number of runs whose θ-effect affects it. */
+    vector<unsigned char> nrAffecting;
+    /** For each column t, whether it is odd. */
+    vector<bool> odd;
+    /** The number of columns that are odd and not affected. */
+    unsigned int nrUnaffectedOdd;
+    vector<bool> rowTakenLeft, rowTakenRight;
+    /** The pairs of rows, left then right, taken by the affected columns,
+      * one pair per active row counted. */
+    vector<unsigned int> takenRows;
+    /** For each run, the size of @a takenRows before it was added. */
+    vector<size_t> takenRowsBeforeRun;
+    vector<unsigned int> newlyTakenLeft, newlyTakenRight;
+    /** The blocks of columns 5b to 5b+4 that no run can start in anymore, from b=0 up.
+      * A translation along z moves t by a multiple of 5, hence rotates the blocks,
+      * and the parity is kept only if its sequence of blocks is the smallest among its rotations.
+      * A block is coded by getBlock().
+      */
+    SymmetricMinimumPrefix<unsigned int> blocks;
+public:
+    ParityAsRunsWithBounds(const RunsBelowTargetWeightSearch& aSearch)
+        : search(aSearch),
+        nrAffecting(aSearch.nrColumns, 0), odd(aSearch.nrColumns, false), nrUnaffectedOdd(0),
+        rowTakenLeft(5*64, false), rowTakenRight(5*64, false) {}
+    /** This method completes the blocks before the one containing column @a tStart,
+      * as no run can start in them once a run starts at @a tStart.
+      * @return False iff no parity with these blocks can be the smallest among its translated versions.
+      */
+    bool completeBlocksBefore(unsigned int tStart)
+    {
+        while(blocks.size() < tStart/5)
+            if (!blocks.push(getBlock(blocks.size())))
+                return false;
+        return true;
+    }
+    /** This method removes the blocks completed after the first @a nrBlocks ones. */
+    void restoreBlocks(unsigned int nrBlocks)
+    {
+        while(blocks.size() > nrBlocks)
+            blocks.pop();
+    }
+    /** This method returns the number of blocks completed so far. */
+    unsigned int getNumberOfCompletedBlocks() const
+    {
+        return blocks.size();
+    }
+    /** This method returns whether the parity, taken as complete, is the smallest among its translated versions,
+      * as a sequence of blocks.
+      */
+    bool isMinimalSymmetrically()
+    {
+        unsigned int nrBlocks = blocks.size();
+        bool minimal = completeBlocksBefore(search.nrColumns) && blocks.isMinimal();
+        restoreBlocks(nrBlocks);
+        return minimal;
+    }
+    void push(const Run& run)
+    {
+        parity.runs.push_back(run);
+        takenRowsBeforeRun.push_back(takenRows.size());
+        unsigned int tStart = search.DCorLC.translateAlongXinT(run.tStart);
+        unsigned int tEnd = search.DCorLC.translateAlongXinT(run.tStart + run.length);
+        affect(tStart);
+        affect(tEnd);
+        takeRowsOfAffectedColumn(tStart);
+        takeRowsOfAffectedColumn(tEnd);
+        for(unsigned int t=run.tStart; t<run.tStart+run.length; t++) {
+            unsigned int column = t % search.nrColumns;
+            odd[column] = true;
+            if (nrAffecting[column] == 0)
+                nrUnaffectedOdd++;
+        }
+    }
+    void pop()
+    {
+        const Run& run = parity.runs.back();
+        for(unsigned int t=run.tStart; t<run.tStart+run.length; t++) {
+            unsigned int column = t % search.nrColumns;
+            odd[column] = false;
+            if (nrAffecting[column] == 0)
+                nrUnaffectedOdd--;
+        }
+        unaffect(search.DCorLC.translateAlongXinT(run.tStart + run.length));
+        unaffect(search.DCorLC.translateAlongXinT(run.tStart));
+        while(takenRows.size() > takenRowsBeforeRun.back()) {
+            rowTakenRight[takenRows.back()] = false;
+            takenRows.pop_back();
+            rowTakenLeft[takenRows.back()] = false;
+            takenRows.pop_back();
+        }
+        takenRowsBeforeRun.pop_back();
+        parity.runs.pop_back();
+    }
+    /** See ParityAsRuns::getLowerBoundTotalHammingWeight(). */
+    unsigned int getLowerBoundTotalHammingWeight() const
+    {
+        return 5*2*parity.runs.size() + 2*nrUnaffectedOdd;
+    }
+    /** See ParityAsRuns::getLowerBoundTotalActiveRowsUsingOnlyAC(). */
+    unsigned int getLowerBoundTotalActiveRowsUsingOnlyAC() const
+    {
+        return takenRows.size()/2;
+    }
+    /** See ParityAsRuns::getLowerBoundTotalActiveRows().
+      * The rows taken by the unaffected odd columns are released before returning.
+      */
+    unsigned int getLowerBoundTotalActiveRows()
+    {
+        unsigned int activeRows = takenRows.size()/2;
+        newlyTakenLeft.clear();
+        newlyTakenRight.clear();
+        for(unsigned int i=0; i<parity.runs.size(); i++)
+        for(unsigned int t=parity.runs[i].tStart; t<parity.runs[i].tStart+parity.runs[i].length; t++) {
+            unsigned int column = t % search.nrColumns;
+            if (nrAffecting[column] == 0) {
+                bool takenLeft = false;
+                bool takenRight = false;
+                for(unsigned int y=0; y<5; y++) {
+                    unsigned int left = search.rowsLeft[5*column+y];
+                    unsigned int right = search.rowsRight[5*column+y];
+                    takenLeft |= rowTakenLeft[left];
+                    takenRight |= rowTakenRight[right];
+                    if (!rowTakenLeft[left]) {
+                        rowTakenLeft[left] = true;
+                        newlyTakenLeft.push_back(left);
+                    }
+                    if (!rowTakenRight[right]) {
+                        rowTakenRight[right] = true;
+                        newlyTakenRight.push_back(right);
+                    }
                 }
-                vector<RowValue> Cmin;
-                getSymmetricMinimum(C, Cmin);
-                writeParity(out, Cmin);
+                if (!takenLeft)
+                    activeRows++;
+                if (!takenRight)
+                    activeRows++;
             }
         }
-        progress.stack("Adding runs to "+parity.display());
-        for(unsigned int tStart=parity.runs.back().tStart+parity.runs.back().length+1; 
-                tStart<DCorLC.laneSize*5; tStart++) {
-            unsigned int maxLength = DCorLC.laneSize*5-1-tStart+parity.runs[0].tStart;
-            for(unsigned int length=1; length<=maxLength; length++) {
-                Run run;
-                run.tStart = tStart;
-                run.length = length;
-                parity.runs.push_back(run);
-                lookForRunsBelowTargetWeight(DCorLC, out, targetWeight, parity, progress, verbose);
-                parity.runs.pop_back();
-                ++progress;
+        for(unsigned int i=0; i<newlyTakenLeft.size(); i++)
+            rowTakenLeft[newlyTakenLeft[i]] = false;
+        for(unsigned int i=0; i<newlyTakenRight.size(); i++)
+            rowTakenRight[newlyTakenRight[i]] = false;
+        return activeRows;
+    }
+protected:
+    /** This method codes block @a b as 31 minus the mask of the runs that start in it,
+      * so that a block where runs start is smaller than an empty one.
+      */
+    unsigned int getBlock(unsigned int b) const
+    {
+        unsigned int starts = 0;
+        for(unsigned int i=0; i<parity.runs.size(); i++)
+            if (parity.runs[i].tStart/5 == b)
+                starts |= 1 << (parity.runs[i].tStart%5);
+        return 31 - starts;
+    }
+    void affect(unsigned int column)
+    {
+        if ((nrAffecting[column] == 0) && odd[column])
+            nrUnaffectedOdd--;
+        nrAffecting[column]++;
+    }
+    void unaffect(unsigned int column)
+    {
+        nrAffecting[column]--;
+        if ((nrAffecting[column] == 0) && odd[column])
+            nrUnaffectedOdd++;
+    }
+    void takeRowsOfAffectedColumn(unsigned int column)
+    {
+        for(unsigned int y=0; y<5; y++) {
+            unsigned int left = search.rowsLeft[5*column+y];
+            unsigned int right = search.rowsRight[5*column+y];
+            if ((!rowTakenLeft[left]) && (!rowTakenRight[right])) {
+                rowTakenLeft[left] = true;
+                rowTakenRight[right] = true;
+                takenRows.push_back(left);
+                takenRows.push_back(right);
             }
         }
-        progress.unstack();
+    }
+};
+
+RunsBelowTargetWeightSearch::RunsBelowTargetWeightSearch(const KeccakFPropagation& aDCorLC, unsigned int aTargetWeight, ParityFetcher& aParitiesOut, atomic<UINT64>& aCount)
+    : DCorLC(aDCorLC), targetWeight(aTargetWeight), paritiesOut(aParitiesOut), count(aCount), nrColumns(aDCorLC.laneSize*5)
+{
+    rowsLeft.reserve(5*nrColumns);
+    rowsRight.reserve(5*nrColumns);
+    for(unsigned int t=0; t<nrColumns; t++) {
+        unsigned int x, z;
+        DCorLC.getXandZfromT(t, x, z);
+        for(unsigned int y=0; y<5; y++) {
+            rowsLeft.push_back(DCorLC.getRowBeforeTheta(x, y, z));
+            rowsRight.push_back(DCorLC.getRowAfterTheta(x, y, z));
+        }
     }
 }
 
-void lookForRunsBelowTargetWeight(const KeccakFPropagation& DCorLC, ostream& out,  unsigned int targetWeight, bool verbose)
+void RunsBelowTargetWeightSearch::search(ParityAsRunsWithBounds& state, ProgressMeter *progress) const
 {
+    unsigned int totalHammingWeight = state.getLowerBoundTotalHammingWeight();
+    unsigned int lowerBound = max(state.getLowerBoundTotalActiveRowsUsingOnlyAC()*2,
+        getBoundOfTotalWeightGivenTotalHammingWeight(DCorLC, totalHammingWeight));
+    if (lowerBound > targetWeight)
+        return;
+    unsigned int thisOneLowerBound = state.getLowerBoundTotalActiveRows()*2;
+    if ((thisOneLowerBound <= targetWeight) && state.isMinimalSymmetrically()) {
+        vector<RowValue> C, D;
+        state.parity.toParityAndParityEffect(DCorLC, C, D);
+        unsigned int thisOneLowerBoundAgain = getLowerBoundTotalActiveRows(DCorLC, C, D)*2;
+        if (thisOneLowerBoundAgain <= targetWeight) {
+            paritiesOut.fetchParity(state.parity, C, D, max(thisOneLowerBound, thisOneLowerBoundAgain));
+            count++;
+        }
+    }
+    // An additional run adds 10 to the bound on the total Hamming weight,
+    // while its two affected columns remove at most 2 unaffected odd columns.
+    if (getBoundOfTotalWeightGivenTotalHammingWeight(DCorLC, totalHammingWeight + 10 - 4) > targetWeight)
+        return;
+    const vector<Run>& runs = state.parity.runs;
+    if (progress)
+        progress->stack("Adding runs to "+state.parity.display());
+    unsigned int nrBlocks = state.getNumberOfCompletedBlocks();
+    for(unsigned int tStart=runs.back().tStart+runs.back().length+1; tStart<nrColumns; tStart++) {
+        // The blocks before the run are then fixed, also for the next values of tStart.
+        if (!state.completeBlocksBefore(tStart))
+            break;
+        unsigned int maxLength = nrColumns-1-tStart+runs[0].tStart;
+        for(unsigned int length=1; length<=maxLength; length++) {
+            state.push(Run(tStart, length));
+            search(state, progress);
+            state.pop();
+            if (progress)
+                ++(*progress);
+        }
+    }
+    state.restoreBlocks(nrBlocks);
+    if (progress)
+        progress->unstack();
+}
+
+/** This task looks for the parities whose first run is given.
+  */
+class RunsBelowTargetWeightTask : public Task {
+protected:
+    const RunsBelowTargetWeightSearch& search;
+    Run firstRun;
+public:
+    RunsBelowTargetWeightTask(const RunsBelowTargetWeightSearch& aSearch, const Run& aFirstRun)
+        : search(aSearch), firstRun(aFirstRun) {}
+    void run()
+    {
+        ParityAsRunsWithBounds state(search);
+        state.push(firstRun);
+        search.search(state, 0);
+    }
+};
+
+UINT64 lookForRunsBelowTargetWeight(const KeccakFPropagation& DCorLC, ParityFetcher& paritiesOut, unsigned int targetWeight, unsigned int nrThreads)
+{
+    SynchronizedParityFetcher synchronizedParitiesOut(paritiesOut);
+    ParityFetcher& sharedParitiesOut = ((nrThreads <= 1) || paritiesOut.isThreadSafe()) ? paritiesOut : synchronizedParitiesOut;
+    atomic<UINT64> count(0);
+    RunsBelowTargetWeightSearch search(DCorLC, targetWeight, sharedParitiesOut, count);
+    ParityAsRunsWithBounds state(search);
+    TaskScheduler *tasks = (nrThreads > 1) ? new TaskScheduler(nrThreads) : 0;
+    const UINT64 maxPendingTasks = 16*nrThreads;
     ProgressMeter progress;
     progress.stack("Initial run starting point", 5);
-    for(unsigned int tStart=0; tStart<5; tStart++) {
-        progress.stack("Initial run length", DCorLC.laneSize*5-1);
-        for(unsigned int length=1; length<=DCorLC.laneSize*5-1; length++) {
-            ParityAsRuns parity;
-            Run run;
-            run.tStart = tStart;
-            run.length = length;
-            parity.runs.push_back(run);
-            lookForRunsBelowTargetWeight(DCorLC, out, targetWeight, parity, progress, verbose);
+    try {
+        for(unsigned int tStart=0; tStart<5; tStart++) {
+            progress.stack("Initial run length", DCorLC.laneSize*5-1);
+            for(unsigned int length=1; length<=DCorLC.laneSize*5-1; length++) {
+                if (tasks == 0) {
+                    state.push(Run(tStart, length));
+                    search.search(state, &progress);
+                    state.pop();
+                }
+                else {
+                    tasks->submit(new RunsBelowTargetWeightTask(search, Run(tStart, length)));
+                    tasks->wait(maxPendingTasks);
+                }
+                ++progress;
+            }
+            progress.unstack();
             ++progress;
         }
-        progress.unstack();
-        ++progress;
+        if (tasks)
+            tasks->wait();
+    }
+    catch(...) {
+        delete tasks;
+        throw;
     }
+    delete tasks;
     progress.unstack();
-}    
+    return count;
+}
+
+void lookForRunsBelowTargetWeight(const KeccakFPropagation& DCorLC, ostream& out,  unsigned int targetWeight, bool verbose)
+{
+    ParitySaveToFile paritiesOut(out, verbose);
+    lookForRunsBelowTargetWeight(DCorLC, paritiesOut, targetWeight, 1);
+}
@@ -16,9 +16,12 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #ifndef _KECCAKFPARITYBOUNDS_H_
 #define _KECCAKFPARITYBOUNDS_H_
 
+#include <iostream>
+#include <mutex>
 #include <vector>
 #include "Keccak-fParts.h"
 #include "Keccak-fPropagation.h"
+#include "taskscheduler.h"
 
 /** Given the parity @a C and the θ-effect @a D, this function computes
   * a lower bound on the total number of active rows before and after λ.
@@ -113,6 +116,58 @@ public:
     unsigned int getLowerBoundTotalActiveRowsUsingOnlyAC(const KeccakFPropagation& DCorLC) const;
 };
 
+/** This abstract class represents an object that receives the parities
+  * found by lookForRunsBelowTargetWeight().
+  */
+class ParityFetcher {
+public:
+    /** Method to call when a parity is found.
+      * @param  parity  The parity as a collection of runs.
+      * @param  C   The parity as a vector or row values.
+      * @param  D   The θ-effect as a vector or row values.
+      * @param  lowerBound  The lower bound on the total weight of any state having this parity.
+      */
+    virtual void fetchParity(const ParityAsRuns& parity, const vector<RowValue>& C, const vector<RowValue>& D, unsigned int lowerBound) = 0;
+    /** This method tells whether fetchParity() can be called from several threads at once.
+      * If not, a SynchronizedParityFetcher must be put in front of it.
+      */
+    virtual bool isThreadSafe() const { return false; }
+    virtual ~ParityFetcher() {}
+};
+
+/** This class implements a ParityFetcher that writes the parities in a file,
+  * each as the smallest of its translated versions along z, see writeParity().
+  */
+class ParitySaveToFile : public ParityFetcher {
+protected:
+    ostream& fout;
+    bool verbose;
+public:
+    /** The constructor.
+      * @param  aFout   The output stream to write the parities to.
+      * @param  aVerbose    If true, the parities are also displayed on the standard output.
+      */
+    ParitySaveToFile(ostream& aFout, bool aVerbose = false);
+    /** See ParityFetcher::fetchParity(). */
+    void fetchParity(const ParityAsRuns& parity, const vector<RowValue>& C, const vector<RowValue>& D, unsigned int lowerBound);
+};
+
+/** This class implements a ParityFetcher that forwards the parities to another
+  * ParityFetcher, one at a time, so that it can be called from several threads.
+  */
+class SynchronizedParityFetcher : public ParityFetcher {
+protected:
+    ParityFetcher& paritiesOut;
+    mutex lock;
+public:
+    /** The constructor.
+      * @param  aParitiesOut    The ParityFetcher to forward the parities to.
+      */
+    SynchronizedParityFetcher(ParityFetcher& aParitiesOut);
+    /** See ParityFetcher::fetchParity(). */
+    void fetchParity(const ParityAsRuns& parity, const vector<RowValue>& C, const vector<RowValue>& D, unsigned int lowerBound);
+};
+
 /** This function looks for all parities (up to translation in z) such that
   * the lower bound provided by ::getLowerBoundTotalActiveRows() is not 
   * higher than a given target.
@@ -122,6 +177,28 @@ public:
   * by 2 times the total number of active rows.
   * The search is done as explained in the paper "Differential propagation of Keccak"
   * at Fast Software Encryption 2012.
+  * The bounds are updated incrementally as runs are added and removed,
+  * and each choice of the first run is searched as a separate task.
+  * As a translation along z moves the columns by a multiple of 5 in @a t,
+  * a parity is considered only in the translated version where the run starts,
+  * taken per block of 5 columns, are the smallest in the order of SymmetricMinimumPrefix,
+  * and the branches that cannot lead to such a version are cut.
+  * The bounds are evaluated on that version; as they hold for all translated versions,
+  * the parities left out are above the target.
+  * A parity whose run starts are periodic but whose runs are not can be found more than once.
+  * @param   DCorLC The propagation context , 
+  *                 as a reference to a KeccakFPropagation object.
+  * @param  paritiesOut The ParityFetcher that receives the parities found,
+  *                 in no particular order if several threads are used.
+  * @param  targetWeight    The target total weight.
+  * @param  nrThreads   The number of threads to use.
+  * @return The number of parities found.
+  */
+UINT64 lookForRunsBelowTargetWeight(const KeccakFPropagation& DCorLC, ParityFetcher& paritiesOut, unsigned int targetWeight,
+    unsigned int nrThreads = TaskScheduler::getDefaultNumberOfThreads());
+
+/** This function is like the one above, with a single thread,
+  * and it writes the parities found using ParitySaveToFile.
   * @param   DCorLC The propagation context , 
   *                 as a reference to a KeccakFPropagation object.
   * @param  out The output file where to store the found parities.
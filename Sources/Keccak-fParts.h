@@ -401,5 +401,20 @@ unsigned int getNrActiveRows(const vector<SliceValue>& slices);
   */
 unsigned int getNrActiveRows(const vector<LaneValue>& lanes);
 
+/** This function returns the number of trailing zero bits in a non-zero 64-bit value.
+  */
+inline unsigned int getTrailingZeros(UINT64 x)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    static const unsigned int deBruijnPositions[64] = {
+         0,  1,  2, 53,  3,  7, 54, 27,  4, 38, 41,  8, 34, 55, 48, 28,
+        62,  5, 39, 46, 44, 42, 22,  9, 24, 35, 59, 56, 49, 18, 29, 11,
+        63, 52,  6, 26, 37, 40, 33, 47, 61, 45, 43, 21, 23, 58, 17, 10,
+        51, 25, 36, 32, 60, 20, 57, 16, 50, 31, 19, 15, 30, 14, 13, 12 };
+    return deBruijnPositions[((x & (~x + 1)) * 0x022FDD63CC95386DULL) >> 58];
+#endif
+}
 
 #endif
@@ -25,6 +25,12 @@ http://creativecommons.org/publicdomain/zero/1.0/
 
 const RowValue maskRowValue = 0x1F;
 
+/** The version of the layout of the cached weight tables.
+  * It must be incremented whenever their contents or layout change,
+  * so that stale cache files are ignored.
+  */
+static const unsigned int weightTablesVersion = 1;
+
 void KeccakFPropagation::directRhoPi(BitPosition& point) const
 {
     if ((lambdaMode == KeccakFDCLC::Straight) || (lambdaMode == KeccakFDCLC::Dual)) {
@@ -75,9 +81,11 @@ KeccakFPropagation::KeccakFPropagation(const KeccakFDCLC& aParent, KeccakFPropag
         reverseRowOutputListPerInput((aDCorLC == DC) ? aParent.diffInvChi : aParent.corrChi)
 {
     initializeAffine();
+    initializeRowWeights();
     initializeWeight();
     initializeMinReverseWeight();
     initializeChiCompatibilityTable();
+    initializeRowsAroundTheta();
 }
 
 void KeccakFPropagation::initializeAffine()
@@ -161,24 +169,40 @@ void KeccakFPropagation::initializeAffine()
     }
 }
 
-void KeccakFPropagation::initializeWeight()
+void KeccakFPropagation::initializeRowWeights()
 {
-    for(SliceValue slice=0; slice<=maxSliceValue; slice++) {
-        unsigned int weightOfThisSlice = weightOfSlice(slice);
-        weightPerSlice.push_back(weightOfThisSlice);
+    for(RowValue row=0; row<(1<<nrRowsAndColumns); row++) {
+        weightPerRow[row] = affinePerInput[row].getWeight();
+        minReverseWeightPerRow[row] = reverseRowOutputListPerInput[row].minWeight;
     }
 }
 
+void KeccakFPropagation::initializeWeight()
+{
+    string fileName = buildFileName("", "-weight.cache");
+    string tag = name + "-weight";
+    if (weightPerSlice.load(fileName, tag, parent.getWidth(), weightTablesVersion, (size_t)maxSliceValue+1))
+        return;
+    unsigned char *table = weightPerSlice.allocate((size_t)maxSliceValue+1);
+    for(SliceValue slice=0; slice<=maxSliceValue; slice++)
+        table[slice] = weightOfSlice(slice);
+    weightPerSlice.save(fileName, tag, parent.getWidth(), weightTablesVersion);
+}
+
 void KeccakFPropagation::initializeMinReverseWeight()
 {
+    string fileName = buildFileName("", "-minReverseWeight.cache");
+    string tag = name + "-minReverseWeight";
+    if (minReverseWeightPerSlice.load(fileName, tag, parent.getWidth(), weightTablesVersion, (size_t)maxSliceValue+1))
+        return;
+    unsigned char *table = minReverseWeightPerSlice.allocate((size_t)maxSliceValue+1);
     for(SliceValue slice=0; slice<=maxSliceValue; slice++) {
         unsigned int minReverseWeight = 0;
-        for(unsigned int y=0; y<nrRowsAndColumns; y++) {
-            RowValue row = getRowFromSlice(slice, y);
-            minReverseWeight += reverseRowOutputListPerInput[row].minWeight;
-        }
-        minReverseWeightPerSlice.push_back(minReverseWeight);
+        for(unsigned int y=0; y<nrRowsAndColumns; y++)
+            minReverseWeight += minReverseWeightPerRow[getRowFromSlice(slice, y)];
+        table[slice] = minReverseWeight;
     }
+    minReverseWeightPerSlice.save(fileName, tag, parent.getWidth(), weightTablesVersion);
 }
 
 KeccakFPropagation::DCorLC KeccakFPropagation::getPropagationType() const
@@ -194,27 +218,38 @@ KeccakFPropagation::DCorLC KeccakFPropagation::getPropagationType() const
 unsigned int KeccakFPropagation::weightOfSlice(SliceValue slice) const
 {
     unsigned int weight = 0;
-    for(unsigned int y=0; y<nrRowsAndColumns; y++) {
-        RowValue row = getRowFromSlice(slice, y);
-        weight += affinePerInput[row].getWeight();
-    }
+    for(unsigned int y=0; y<nrRowsAndColumns; y++)
+        weight += weightPerRow[getRowFromSlice(slice, y)];
     return weight;
 }
 
-unsigned int KeccakFPropagation::getWeight(const vector<SliceValue>& state) const
+/** This function sums the entries of a per-row table for all the rows of a state.
+  * The five rows of a slice are looked up independently, so that the lookups
+  * can be issued in parallel.
+  */
+static inline unsigned int sumPerRow(const unsigned char *perRow, const vector<SliceValue>& state)
 {
     unsigned int weight = 0;
-    for(unsigned int i=0; i<state.size(); i++)
-        weight += getWeight(state[i]);
+    for(unsigned int i=0; i<state.size(); i++) {
+        SliceValue slice = state[i];
+        if (slice != 0)
+            weight += perRow[slice & maskRowValue]
+                + perRow[(slice >> 5) & maskRowValue]
+                + perRow[(slice >> 10) & maskRowValue]
+                + perRow[(slice >> 15) & maskRowValue]
+                + perRow[(slice >> 20) & maskRowValue];
+    }
     return weight;
 }
 
+unsigned int KeccakFPropagation::getWeight(const vector<SliceValue>& state) const
+{
+    return sumPerRow(weightPerRow, state);
+}
+
 unsigned int KeccakFPropagation::getMinReverseWeight(const vector<SliceValue>& state) const
 {
-    unsigned int weight = 0;
-    for(unsigned int i=0; i<state.size(); i++)
-        weight += getMinReverseWeight(state[i]);
-    return weight;
+    return sumPerRow(minReverseWeightPerRow, state);
 }
 
 unsigned int KeccakFPropagation::getMinReverseWeightAfterLambda(const vector<SliceValue>& state) const
@@ -491,10 +526,10 @@ UINT64 KeccakFPropagation::displayTrailsAndCheck(const string& fileNameIn, ostre
     UINT64 totalCount = 0;
     unsigned int minWeight = 0;
     {
-        ifstream fin(fileNameIn.c_str());
-        while(!(fin.eof())) {
+        TrailFileParallelIterator trails(fileNameIn, *this);
+        for( ; !trails.isEnd(); ++trails) {
             try {
-                Trail trail(fin);
+                const Trail& trail = *trails;
                 if (getPropagationType() == KeccakFPropagation::DC)
                     parent.checkDCTrail(trail);
                 else
@@ -542,16 +577,12 @@ UINT64 KeccakFPropagation::displayTrailsAndCheck(const string& fileNameIn, ostre
     fout << "Showing the trails up to weight " << dec << maxWeight << " (in no particular order)." << endl;
     fout << endl;
     {
-        ifstream fin(fileNameIn.c_str());
-        while(!(fin.eof())) {
-            try {
-                Trail trail(fin);
-                if (trail.totalWeight <= maxWeight) {
-                    trail.display(*this, fout);
-                    fout << endl;
-                }
-            }
-            catch(TrailException) {
+        TrailFileParallelIterator trails(fileNameIn, *this);
+        for( ; !trails.isEnd(); ++trails) {
+            const Trail& trail = *trails;
+            if (trail.totalWeight <= maxWeight) {
+                trail.display(*this, fout);
+                fout << endl;
             }
         }
     }
@@ -560,23 +591,109 @@ UINT64 KeccakFPropagation::displayTrailsAndCheck(const string& fileNameIn, ostre
 
 void KeccakFPropagation::initializeChiCompatibilityTable()
 {
-    chiCompatibilityTable.assign(32*32, false);
-    for(RowValue a=0; a<32; a++) for(RowValue b=0; b<32; b++) {
+    for(RowValue a=0; a<32; a++) {
+        chiCompatibilityTable[a] = 0;
         const vector<RowValue>& values = directRowOutputListPerInput[a].values;
-        chiCompatibilityTable[a+32*b] = 
-            find(values.begin(), values.end(), b) != values.end();
+        for(unsigned int i=0; i<values.size(); i++)
+            chiCompatibilityTable[a] |= (UINT32)1 << values[i];
+    }
+}
+
+void KeccakFPropagation::initializeRowsAroundTheta()
+{
+    rowsBeforeTheta.resize(25*laneSize);
+    rowsAfterTheta.resize(25*laneSize);
+    for(unsigned int z=0; z<laneSize; z++)
+    for(unsigned int x=0; x<5; x++)
+    for(unsigned int y=0; y<5; y++) {
+        BitPosition before(x, y, z);
+        reverseRhoPiBeforeTheta(before);
+        rowsBeforeTheta[5*(5*z+x)+y] = 64*before.y + before.z;
+        BitPosition after(x, y, z);
+        directRhoPiAfterTheta(after);
+        rowsAfterTheta[5*(5*z+x)+y] = 64*after.y + after.z;
     }
 }
 
 bool KeccakFPropagation::isChiCompatible(const vector<SliceValue>& beforeChi, const vector<SliceValue>& afterChi) const
 {
     for(unsigned int z=0; z<laneSize; z++)
-    for(unsigned int y=0; y<nrRowsAndColumns; y++)
-        if (!isChiCompatible(getRowFromSlice(beforeChi[z], y), getRowFromSlice(afterChi[z], y)))
-            return false;
+        if ((beforeChi[z] != 0) || (afterChi[z] != 0))
+            for(unsigned int y=0; y<nrRowsAndColumns; y++)
+                if (!isChiCompatible(getRowFromSlice(beforeChi[z], y), getRowFromSlice(afterChi[z], y)))
+                    return false;
     return true;
 }
 
+/** This function computes, for each row index y, a word 
+  * with bit z set iff the row at (y, z) is active.
+  */
+static void getActiveRowsPerY(const vector<SliceValue>& state, UINT64 activeRows[nrRowsAndColumns])
+{
+    for(unsigned int y=0; y<nrRowsAndColumns; y++)
+        activeRows[y] = 0;
+    for(unsigned int z=0; z<state.size(); z++)
+        if (state[z] != 0)
+            for(unsigned int y=0; y<nrRowsAndColumns; y++)
+                if (getRowFromSlice(state[z], y) != 0)
+                    activeRows[y] |= (UINT64)1 << z;
+}
+
+/** This function rotates a word of @a laneSize bits 
+  * so that bit (z+dz) moves to bit z.
+  */
+static inline UINT64 rotateRightInLane(UINT64 word, unsigned int dz, unsigned int laneSize)
+{
+    if (dz == 0)
+        return word;
+    UINT64 mask = (laneSize == 64) ? ~(UINT64)0 : (((UINT64)1 << laneSize) - 1);
+    return ((word >> dz) | (word << (laneSize - dz))) & mask;
+}
+
+UINT64 KeccakFPropagation::getChiCompatibleTranslations(const vector<SliceValue>& beforeChi, const vector<SliceValue>& afterChi) const
+{
+    UINT64 activeBefore[nrRowsAndColumns], activeAfter[nrRowsAndColumns];
+    getActiveRowsPerY(beforeChi, activeBefore);
+    getActiveRowsPerY(afterChi, activeAfter);
+    UINT64 allTranslations = (laneSize == 64) ? ~(UINT64)0 : (((UINT64)1 << laneSize) - 1);
+
+    // Find a reference active row before χ; it must be hit by an active row after χ.
+    unsigned int yRef = 0;
+    while((yRef < nrRowsAndColumns) && (activeBefore[yRef] == 0))
+        yRef++;
+    if (yRef == nrRowsAndColumns) {
+        for(unsigned int y=0; y<nrRowsAndColumns; y++)
+            if (activeAfter[y] != 0)
+                return 0;
+        return allTranslations;
+    }
+    unsigned int zRef = 0;
+    while(((activeBefore[yRef] >> zRef) & 1) == 0)
+        zRef++;
+
+    UINT64 result = 0;
+    for(unsigned int zAfter=0; zAfter<laneSize; zAfter++) {
+        if (((activeAfter[yRef] >> zAfter) & 1) == 0)
+            continue;
+        unsigned int dz = (zAfter + laneSize - zRef) % laneSize;
+        bool sameActiveRows = true;
+        for(unsigned int y=0; (y<nrRowsAndColumns) && sameActiveRows; y++)
+            sameActiveRows = (rotateRightInLane(activeAfter[y], dz, laneSize) == activeBefore[y]);
+        if (!sameActiveRows)
+            continue;
+        bool compatible = true;
+        for(unsigned int z=0; (z<laneSize) && compatible; z++)
+            if (beforeChi[z] != 0) {
+                SliceValue sliceAfter = afterChi[(z+dz)%laneSize];
+                for(unsigned int y=0; (y<nrRowsAndColumns) && compatible; y++)
+                    compatible = isChiCompatible(getRowFromSlice(beforeChi[z], y), getRowFromSlice(sliceAfter, y));
+            }
+        if (compatible)
+            result |= (UINT64)1 << dz;
+    }
+    return result;
+}
+
 bool KeccakFPropagation::isRoundCompatible(const Trail& first, const Trail& second) const
 {
     vector<SliceValue> stateAfterChi;
@@ -735,19 +852,30 @@ void KeccakFPropagation::displayParity(ostream& fout, PackedParity p) const
 }
 
 
-ReverseStateIterator KeccakFPropagation::getReverseStateIterator(const vector<SliceValue>& stateAfterChi, unsigned int maxWeight) const
+ReverseStateIterator KeccakFPropagation::getReverseStateIterator(const vector<SliceValue>& stateAfterChi, unsigned int maxWeight, bool weightOrdered) const
+{
+    return ReverseStateIterator(stateAfterChi, *this, maxWeight, weightOrdered);
+}
+
+DirectStateIterator KeccakFPropagation::getDirectStateIterator(const vector<SliceValue>& stateBeforeChi, unsigned int maxWeight) const
 {
-    return ReverseStateIterator(stateAfterChi, *this, maxWeight);
+    return DirectStateIterator(stateBeforeChi, *this, maxWeight);
 }
 
 ReverseStateIterator::ReverseStateIterator(const vector<SliceValue>& stateAfterChi, const KeccakFPropagation& DCorLC)
-    : maxWeight((nrRowsAndColumns-1)*nrRowsAndColumns*stateAfterChi.size())
+    : maxWeight((nrRowsAndColumns-1)*nrRowsAndColumns*stateAfterChi.size()), weightOrdered(false)
 {
     initialize(stateAfterChi, DCorLC);
 }
 
 ReverseStateIterator::ReverseStateIterator(const vector<SliceValue>& stateAfterChi, const KeccakFPropagation& DCorLC, unsigned int aMaxWeight)
-    : maxWeight(aMaxWeight)
+    : maxWeight(aMaxWeight), weightOrdered(false)
+{
+    initialize(stateAfterChi, DCorLC);
+}
+
+ReverseStateIterator::ReverseStateIterator(const vector<SliceValue>& stateAfterChi, const KeccakFPropagation& DCorLC, unsigned int aMaxWeight, bool aWeightOrdered)
+    : maxWeight(aMaxWeight), weightOrdered(aWeightOrdered)
 {
     initialize(stateAfterChi, DCorLC);
 }
@@ -772,6 +900,7 @@ void ReverseStateIterator::initialize(const vector<SliceValue>& stateAfterChi, c
         }
     }
     currentWeight = minWeight;
+    lastIncremented = 0;
     end = isEmpty();
 }    
 
@@ -803,6 +932,10 @@ unsigned int ReverseStateIterator::getCurrentWeight() const
 
 void ReverseStateIterator::next()
 {
+    if (weightOrdered) {
+        nextInWeightOrder();
+        return;
+    }
     int affordableWeight = maxWeight - currentWeight;
     unsigned int i = 0;
     while(i < size) {
@@ -828,3 +961,226 @@ void ReverseStateIterator::next()
         setRow(current, patterns[j].values[0], Ys[j], Zs[j]);
     }
 }
+
+void ReverseStateIterator::nextInWeightOrder()
+{
+    // Add the successors of the current combination to the frontier
+    for(unsigned int j=lastIncremented; j<size; j++) {
+        unsigned int ij = indexes[j];
+        if (ij+1 < patterns[j].values.size()) {
+            unsigned int weight = currentWeight - patterns[j].weights[ij] + patterns[j].weights[ij+1];
+            if (weight <= maxWeight) {
+                FrontierEntry successor;
+                successor.weight = weight;
+                successor.lastIncremented = j;
+                successor.indexes = indexes;
+                successor.indexes[j]++;
+                frontier.push(successor);
+            }
+        }
+    }
+    if (frontier.empty()) {
+        end = true;
+        return;
+    }
+    // Move to the lightest combination, updating only the rows that change
+    const FrontierEntry& top = frontier.top();
+    for(unsigned int j=0; j<size; j++)
+        if (indexes[j] != top.indexes[j]) {
+            indexes[j] = top.indexes[j];
+            setRow(current, patterns[j].values[indexes[j]], Ys[j], Zs[j]);
+        }
+    currentWeight = top.weight;
+    lastIncremented = top.lastIncremented;
+    frontier.pop();
+}
+
+static UINT32 getSpanWithRow(UINT32 span, RowValue row)
+{
+    UINT32 result = span;
+    for(UINT32 m=span; m!=0; m&=m-1)
+        result |= (UINT32)1 << (getTrailingZeros(m) ^ row);
+    return result;
+}
+
+DirectStateIterator::DirectStateIterator(const vector<SliceValue>& stateBeforeChi, const KeccakFPropagation& DCorLC, unsigned int aMaxWeight)
+    : maxWeight(aMaxWeight)
+{
+    initialize(stateBeforeChi, DCorLC, 0, 0);
+}
+
+DirectStateIterator::DirectStateIterator(const vector<SliceValue>& stateBeforeChi, const KeccakFPropagation& DCorLC, unsigned int aMaxWeight, unsigned int subtreeDepth, UINT64 subtreeIndex)
+    : maxWeight(aMaxWeight)
+{
+    initialize(stateBeforeChi, DCorLC, subtreeDepth, subtreeIndex);
+}
+
+void DirectStateIterator::initialize(const vector<SliceValue>& stateBeforeChi, const KeccakFPropagation& DCorLC, unsigned int subtreeDepth, UINT64 subtreeIndex)
+{
+    for(RowValue row=0; row<(1<<nrRowsAndColumns); row++)
+        weightPerRow[row] = DCorLC.getWeightRow(row);
+
+    unsigned int laneSize = stateBeforeChi.size();
+    vector<SliceValue> offset(laneSize, 0);
+    for(unsigned int z=0; z<laneSize; z++)
+    for(unsigned int y=0; y<nrRowsAndColumns; y++) {
+        RowValue row = getRowFromSlice(stateBeforeChi[z], y);
+        if (row == 0)
+            continue;
+        const AffineSpaceOfRows& affine = DCorLC.affinePerInput[row];
+        offset[z] ^= getSliceFromRow(affine.offset, y);
+        for(unsigned int i=0; i<affine.generators.size(); i++) {
+            vector<SliceValue> v(laneSize, 0);
+            v[z] = getSliceFromRow(affine.generators[i], y);
+            vector<SliceValue> vAfterLambda;
+            DCorLC.directLambda(v, vAfterLambda);
+            vector<GeneratorRow> generator;
+            for(unsigned int zz=0; zz<laneSize; zz++)
+                if (vAfterLambda[zz] != 0)
+                    for(unsigned int yy=0; yy<nrRowsAndColumns; yy++) {
+                        RowValue value = getRowFromSlice(vAfterLambda[zz], yy);
+                        if (value != 0) {
+                            GeneratorRow g;
+                            g.y = yy;
+                            g.z = zz;
+                            g.value = value;
+                            generator.push_back(g);
+                        }
+                    }
+            generators.push_back(generator);
+        }
+    }
+    DCorLC.directLambda(offset, current);
+
+    vector<UINT32> spans(laneSize*nrRowsAndColumns, 1);
+    for(int d=(int)generators.size()-1; d>=0; d--)
+        for(unsigned int i=0; i<generators[d].size(); i++) {
+            GeneratorRow& g = generators[d][i];
+            UINT32& span = spans[g.z*nrRowsAndColumns + g.y];
+            g.spanAfter = span;
+            span = getSpanWithRow(span, g.value);
+            g.spanBefore = span;
+        }
+    unsigned int lowerBound = 0;
+    for(unsigned int z=0; z<laneSize; z++)
+    for(unsigned int y=0; y<nrRowsAndColumns; y++)
+        lowerBound += getMinWeight(getRowFromSlice(current[z], y), spans[z*nrRowsAndColumns + y]);
+
+    lowerBounds.assign(generators.size()+1, 0);
+    lowerBounds[0] = lowerBound;
+    included.assign(generators.size(), false);
+    depth = 0;
+    minDepth = 0;
+    end = (lowerBound > maxWeight);
+    if (subtreeDepth > generators.size())
+        throw KeccakException("DirectStateIterator::initialize(): the subtree depth exceeds the number of generators.");
+    while(!end && (depth < subtreeDepth))
+        end = !moveToChild(((subtreeIndex >> depth) & 1) != 0);
+    minDepth = subtreeDepth;
+    if (!end)
+        moveToLeaf();
+}
+
+bool DirectStateIterator::isEnd() const
+{
+    return end;
+}
+
+void DirectStateIterator::operator++()
+{
+    if (end)
+        return;
+    if (moveToNextSibling())
+        moveToLeaf();
+    else
+        end = true;
+}
+
+const vector<SliceValue>& DirectStateIterator::operator*() const
+{
+    return current;
+}
+
+unsigned int DirectStateIterator::getCurrentWeight() const
+{
+    return lowerBounds[depth];
+}
+
+unsigned int DirectStateIterator::getNumberOfGenerators() const
+{
+    return generators.size();
+}
+
+unsigned int DirectStateIterator::getMinWeight(RowValue row, UINT32 span) const
+{
+    if (span == 1)
+        return weightPerRow[row];
+    if (((span >> row) & 1) != 0)
+        return 0;
+    unsigned int minWeight = weightPerRow[row];
+    for(UINT32 m=span; m!=0; m&=m-1) {
+        unsigned int weight = weightPerRow[row ^ getTrailingZeros(m)];
+        if (weight < minWeight)
+            minWeight = weight;
+    }
+    return minWeight;
+}
+
+int DirectStateIterator::getDeltaLowerBound(bool include) const
+{
+    int delta = 0;
+    const vector<GeneratorRow>& generator = generators[depth];
+    for(unsigned int i=0; i<generator.size(); i++) {
+        const GeneratorRow& g = generator[i];
+        RowValue row = getRowFromSlice(current[g.z], g.y);
+        delta -= getMinWeight(row, g.spanBefore);
+        delta += getMinWeight(include ? (row ^ g.value) : row, g.spanAfter);
+    }
+    return delta;
+}
+
+void DirectStateIterator::addGenerator()
+{
+    const vector<GeneratorRow>& generator = generators[depth];
+    for(unsigned int i=0; i<generator.size(); i++)
+        current[generator[i].z] ^= getSliceFromRow(generator[i].value, generator[i].y);
+}
+
+bool DirectStateIterator::moveToChild(bool include)
+{
+    int lowerBound = (int)lowerBounds[depth] + getDeltaLowerBound(include);
+    if (lowerBound > (int)maxWeight)
+        return false;
+    included[depth] = include;
+    if (include)
+        addGenerator();
+    depth++;
+    lowerBounds[depth] = lowerBound;
+    return true;
+}
+
+bool DirectStateIterator::moveToNextSibling()
+{
+    while(depth > minDepth) {
+        depth--;
+        if (included[depth])
+            addGenerator();
+        else if (moveToChild(true))
+            return true;
+    }
+    return false;
+}
+
+void DirectStateIterator::moveToLeaf()
+{
+    while(depth < generators.size()) {
+        if (moveToChild(false))
+            continue;
+        if (moveToChild(true))
+            continue;
+        if (!moveToNextSibling()) {
+            end = true;
+            return;
+        }
+    }
+}
@@ -16,13 +16,16 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #ifndef _KECCAKFPROPAGATION_H_
 #define _KECCAKFPROPAGATION_H_
 
+#include <queue>
 #include <string>
 #include "Keccak-fAffineBases.h"
 #include "Keccak-fDCLC.h"
 #include "Keccak-fParts.h"
+#include "tablecache.h"
 using namespace std;
 
 class ReverseStateIterator;
+class DirectStateIterator;
 
 /** This class provides the necessary tools to compute the propagation of
   * either differences or linear patterns through the rounds of Keccak-<i>f</i>.
@@ -71,17 +74,30 @@ protected:
       */
     KeccakFDCLC::LambdaMode reverseLambdaMode;
 private:
+    /** This attribute contains the propagation weight of every possible row value.
+      */
+    unsigned char weightPerRow[1<<nrRowsAndColumns];
+    /** This attribute contains the minimum reverse weight of every possible row value.
+      */
+    unsigned char minReverseWeightPerRow[1<<nrRowsAndColumns];
     /** This attribute contains the propagation weight of every possible slice value.
+      * It is memory-mapped from the cache file given by buildFileName("", "-weight.cache")
+      * if available, and computed (and saved to this file) otherwise.
       */
-    vector<unsigned char> weightPerSlice;
+    CachedTable weightPerSlice;
     /** This attribute contains the minimum reverse weight of every possible slice value.
+      * It is cached like weightPerSlice, in buildFileName("", "-minReverseWeight.cache").
       */
-    vector<unsigned char> minReverseWeightPerSlice;
-    /** This vector tells whether a pattern x at the input of χ is compatible
-      * with output y. This can be found in chiCompatibilityTable[x+32*y].
+    CachedTable minReverseWeightPerSlice;
+    /** This table tells whether a pattern x at the input of χ is compatible
+      * with output y. This can be found in bit y of chiCompatibilityTable[x].
       * See also isChiCompatible().
       */
-    vector<bool> chiCompatibilityTable;
+    UINT32 chiCompatibilityTable[1<<nrRowsAndColumns];
+    /** At index 5(5z+x)+y, the row of bit y of column (x, z) given by getRowBeforeTheta(). */
+    vector<UINT16> rowsBeforeTheta;
+    /** At index 5(5z+x)+y, the row of bit y of column (x, z) given by getRowAfterTheta(). */
+    vector<UINT16> rowsAfterTheta;
 public:
     /** This type allows one to specify the type of propagation: differential (DC) or linear (LC). */
     enum DCorLC { DC = 0, LC };
@@ -106,11 +122,14 @@ public:
       */
     inline unsigned int getWeight(const SliceValue& slice) const { return weightPerSlice[slice]; }
     /** This method returns the propagation weight of a row.
-      * @param   row    The value of a slice.
+      * @param   row    The value of a row.
       * @return The propagation weight of the given row.
       */
-    inline unsigned int getWeightRow(const RowValue& row) const { return getWeight(getSliceFromRow(row, 0)); }
+    inline unsigned int getWeightRow(const RowValue& row) const { return weightPerRow[row]; }
     /** This method returns the propagation weight of a state.
+      * As the weight is additive over the rows, it is computed with lookups
+      * in the small weightPerRow table rather than in weightPerSlice, 
+      * so that it does not cause cache misses.
       * @param   state  The value of a state given as a vector of slices.
       * @return The propagation weight of the given state.
       */
@@ -120,16 +139,80 @@ public:
       * @return The minimum weight of the given slice.
       */
     inline unsigned int getMinReverseWeight(const SliceValue& slice) const { return minReverseWeightPerSlice[slice]; }
-    /** This method returns the minimum reverse weight of a slice.
-      * @param   slice  The value of a slice.
-      * @return The minimum weight of the given slice.
+    /** This method returns the minimum reverse weight of a row.
+      * @param   row    The value of a row.
+      * @return The minimum weight of the given row.
       */
-    inline unsigned int getMinReverseWeightRow(const RowValue& row) const { return getMinReverseWeight(getSliceFromRow(row, 0)); }
+    inline unsigned int getMinReverseWeightRow(const RowValue& row) const { return minReverseWeightPerRow[row]; }
     /** This method returns the minimum reverse weight of a state.
+      * Like getWeight(const vector<SliceValue>&), it uses a per-row table.
       * @param   state  The value of a state given as a vector of slices.
       * @return The minimum reverse weight of the given state.
       */
     unsigned int getMinReverseWeight(const vector<SliceValue>& state) const;
+    /** This method sets a bit of a state to 1 and returns the resulting
+      * change in the propagation weight of the state.
+      * Only the row containing the bit is looked at.
+      * @param   state  The state given as a vector of slices, to be modified.
+      * @param   p      The position of the bit.
+      * @return The propagation weight after the change minus the one before.
+      */
+    inline int setBitToOneAndGetDeltaWeight(vector<SliceValue>& state, const BitPosition& p) const
+    {
+        RowValue before = getRowFromSlice(state[p.z], p.y);
+        setBitToOne(state, p);
+        return (int)weightPerRow[before | (1 << p.x)] - (int)weightPerRow[before];
+    }
+    /** This method is like setBitToOneAndGetDeltaWeight(), but sets the bit to 0.
+      */
+    inline int setBitToZeroAndGetDeltaWeight(vector<SliceValue>& state, const BitPosition& p) const
+    {
+        RowValue before = getRowFromSlice(state[p.z], p.y);
+        setBitToZero(state, p);
+        return (int)weightPerRow[before & ~(1 << p.x)] - (int)weightPerRow[before];
+    }
+    /** This method sets a bit of a state to 1 and returns the resulting
+      * change in the minimum reverse weight of the state.
+      * @param   state  The state given as a vector of slices, to be modified.
+      * @param   p      The position of the bit.
+      * @return The minimum reverse weight after the change minus the one before.
+      */
+    inline int setBitToOneAndGetDeltaMinReverseWeight(vector<SliceValue>& state, const BitPosition& p) const
+    {
+        RowValue before = getRowFromSlice(state[p.z], p.y);
+        setBitToOne(state, p);
+        return (int)minReverseWeightPerRow[before | (1 << p.x)] - (int)minReverseWeightPerRow[before];
+    }
+    /** This method is like setBitToOneAndGetDeltaMinReverseWeight(), but sets the bit to 0.
+      */
+    inline int setBitToZeroAndGetDeltaMinReverseWeight(vector<SliceValue>& state, const BitPosition& p) const
+    {
+        RowValue before = getRowFromSlice(state[p.z], p.y);
+        setBitToZero(state, p);
+        return (int)minReverseWeightPerRow[before & ~(1 << p.x)] - (int)minReverseWeightPerRow[before];
+    }
+    /** This method sets a row of a state to the given value and returns the resulting
+      * change in the propagation weight of the state.
+      * @param   state  The state given as a vector of slices, to be modified.
+      * @param   row    The new value of the row.
+      * @param   y      The y coordinate of the row.
+      * @param   z      The z coordinate of the row.
+      * @return The propagation weight after the change minus the one before.
+      */
+    inline int setRowAndGetDeltaWeight(vector<SliceValue>& state, RowValue row, unsigned int y, unsigned int z) const
+    {
+        RowValue before = getRowFromSlice(state[z], y);
+        state[z] ^= getSliceFromRow(before ^ row, y);
+        return (int)weightPerRow[row] - (int)weightPerRow[before];
+    }
+    /** This method is like setRowAndGetDeltaWeight(), but returns the change in the minimum reverse weight.
+      */
+    inline int setRowAndGetDeltaMinReverseWeight(vector<SliceValue>& state, RowValue row, unsigned int y, unsigned int z) const
+    {
+        RowValue before = getRowFromSlice(state[z], y);
+        state[z] ^= getSliceFromRow(before ^ row, y);
+        return (int)minReverseWeightPerRow[row] - (int)minReverseWeightPerRow[before];
+    }
     /** This method returns the minimum reverse weight of a state, to which
       * the reverse λ is first applied. 
       * This allows to give a state value before χ (so after λ),
@@ -179,6 +262,22 @@ public:
       * @param  point   The coordinates (x, y, z) to update.
       */
     void reverseRhoPiBeforeTheta(BitPosition& point) const;
+    /** This method returns the row that bit y of column (x, z) goes to
+      * through reverseRhoPiBeforeTheta(), as the index 64y'+z' of the resulting row (y', z').
+      * It is tabulated, so that the lower bounds of Keccak-fParityBounds.h
+      * can keep the rows they take as one 64-bit word per y'.
+      */
+    inline unsigned int getRowBeforeTheta(unsigned int x, unsigned int y, unsigned int z) const
+    {
+        return rowsBeforeTheta[5*(5*z+x)+y];
+    }
+    /** This method returns the row that bit y of column (x, z) goes to
+      * through directRhoPiAfterTheta(), as the index 64y'+z' of the resulting row (y', z').
+      */
+    inline unsigned int getRowAfterTheta(unsigned int x, unsigned int y, unsigned int z) const
+    {
+        return rowsAfterTheta[5*(5*z+x)+y];
+    }
     /** This method computes a lower bound on the propagation weight 
       * for any state having the given the Hamming weight.
       * The formula is given in Section 3.1 of "The Keccak reference".
@@ -265,9 +364,19 @@ public:
       * @param   stateAfterChi  The state just after χ given as a vector of slices.
       * @param   maxWeight      The maximum propagation weight considered by the iterator.
       *                         If 0, the iterator runs through all the possible states.
+      * @param   weightOrdered  If true, the states are given in nondecreasing weight order.
+      *                         See ReverseStateIterator::ReverseStateIterator().
       * @return The iterator as a ReverseStateIterator object.
       */
-    ReverseStateIterator getReverseStateIterator(const vector<SliceValue>& stateAfterChi, unsigned int maxWeight = 0) const;
+    ReverseStateIterator getReverseStateIterator(const vector<SliceValue>& stateAfterChi, unsigned int maxWeight = 0, bool weightOrdered = false) const;
+    /** This method builds an iterator over the states in the affine space 
+      * given by buildStateBase(), i.e., after χ and λ in the "direct" direction,
+      * whose propagation weight is not higher than a given maximum.
+      * @param   stateBeforeChi The state just before χ given as a vector of slices.
+      * @param   maxWeight      The maximum propagation weight considered by the iterator.
+      * @return The iterator as a DirectStateIterator object.
+      */
+    DirectStateIterator getDirectStateIterator(const vector<SliceValue>& stateBeforeChi, unsigned int maxWeight) const;
     /** This method returns true iff the input row pattern is compatible with the output row pattern.
       * @param   beforeChi  The row value at the input of χ.
       * @param   afterChi   The row value at the output of χ.
@@ -275,7 +384,7 @@ public:
       */
     inline bool isChiCompatible(const RowValue& beforeChi, const RowValue& afterChi) const
     {
-        return chiCompatibilityTable[beforeChi+32*afterChi];
+        return ((chiCompatibilityTable[beforeChi] >> afterChi) & 1) != 0;
     }
     /** This method returns true iff the given state before χ is compatible with the given state after χ.
       * @param   beforeChi  The state value at the input of χ.
@@ -283,6 +392,18 @@ public:
       * @return It returns true iff the given values are compatible through χ.
       */
     bool isChiCompatible(const vector<SliceValue>& beforeChi, const vector<SliceValue>& afterChi) const;
+    /** This method tests at once all the translations along z of a state after χ
+      * for compatibility with a given state before χ.
+      * As χ is invertible, a row is compatible with the zero row only if it is zero,
+      * so the active rows must coincide. This is first checked with one word per row index y,
+      * with bit z set if the row at (y, z) is active, and only the remaining 
+      * translations are checked row by row.
+      * @param   beforeChi  The state value at the input of χ.
+      * @param   afterChi   The state value at the output of χ, before translation.
+      * @return A mask with bit dz set iff @a beforeChi is compatible through χ
+      *     with the state obtained by moving slice (z+dz) of @a afterChi to slice z.
+      */
+    UINT64 getChiCompatibleTranslations(const vector<SliceValue>& beforeChi, const vector<SliceValue>& afterChi) const;
     /** This method returns true iff two trails can be chained, i.e., if last state of the first trail
       * is compatible through χ and λ with the first state of the second trail.
       * @param   first  The first trail.
@@ -420,24 +541,50 @@ private:
     /** This method initializes affinePerInput.
       */
     void initializeAffine();
-    /** This method initializes weightPerSlice.
+    /** This method initializes weightPerRow and minReverseWeightPerRow.
+      */
+    void initializeRowWeights();
+    /** This method initializes weightPerSlice, from the cache file if possible.
       */
     void initializeWeight();
-    /** This method initializes minReverseWeightPerSlice.
+    /** This method initializes minReverseWeightPerSlice, from the cache file if possible.
       */
     void initializeMinReverseWeight();
     /** This method initializes chiCompatibilityTable.
       */
     void initializeChiCompatibilityTable();
+    /** This method initializes rowsBeforeTheta and rowsAfterTheta.
+      */
+    void initializeRowsAroundTheta();
     unsigned int weightOfSlice(SliceValue slice) const;
 };
 
 /** This class implements an iterator over the possible state values
   * before χ given a state after χ.
+  * Each active row after χ has a list of compatible row values, sorted by weight.
+  * By default, the iterator runs through the combinations as a mixed-radix counter,
+  * skipping the combinations above the maximum weight.
+  * In weight-ordered mode, it instead runs through them in nondecreasing weight order,
+  * keeping a frontier of the combinations to visit in a priority queue.
+  * In both modes, only the rows that change are updated in the current state.
   */
 class ReverseStateIterator
 {
 private:
+    /** A combination of row values in the frontier of the weight-ordered mode. */
+    class FrontierEntry {
+    public:
+        /** The weight of the combination. */
+        unsigned int weight;
+        /** The last row whose index was incremented to obtain this combination.
+          * Only the rows from this one on are incremented to obtain its successors,
+          * so that each combination is reached once. */
+        unsigned int lastIncremented;
+        /** The index of the row value in the list of each row. */
+        vector<unsigned int> indexes;
+        /** The order used in the priority queue, which puts the lowest weight on top. */
+        bool operator<(const FrontierEntry& other) const { return weight > other.weight; }
+    };
     vector<ListOfRowPatterns> patterns;
     vector<unsigned int> Ys, Zs;
     vector<unsigned int> indexes;
@@ -447,6 +594,9 @@ private:
     unsigned int currentWeight;
     UINT64 index;
     bool end;
+    bool weightOrdered;
+    unsigned int lastIncremented;
+    priority_queue<FrontierEntry> frontier;
 public:
     /** This constructor initializes the iterator based on a state value after χ,
       * the KeccakFPropagation instance, which determines the compatible states.
@@ -467,6 +617,16 @@ public:
       *                         weight is not higher than this parameter. 
       */
     ReverseStateIterator(const vector<SliceValue>& stateAfterChi, const KeccakFPropagation& DCorLC, unsigned int aMaxWeight);
+    /** This constructor is like the previous one, but it can also 
+      * select the weight-ordered mode.
+      * @param   stateAfterChi  The state value after χ as a vector of slices.
+      * @param   DCorLC         A reference to the KeccakFPropagation instance that
+      *                         determines the type of propagation.
+      * @param   aMaxWeight     The iterator will run through the states whose propagation
+      *                         weight is not higher than this parameter. 
+      * @param   aWeightOrdered If true, the states are given in nondecreasing weight order.
+      */
+    ReverseStateIterator(const vector<SliceValue>& stateAfterChi, const KeccakFPropagation& DCorLC, unsigned int aMaxWeight, bool aWeightOrdered);
     /** This method tells whether the iterator has reached the end of the possible states.
       * @return It returns true iff there are no more states to run through.
       */
@@ -488,6 +648,97 @@ public:
 private:
     void initialize(const vector<SliceValue>& stateAfterChi, const KeccakFPropagation& DCorLC);
     void next();
+    void nextInWeightOrder();
+};
+
+/** This class implements an iterator over the possible state values
+  * after χ and λ given a state before χ, restricted to those whose
+  * propagation weight is not higher than a given maximum.
+  * The states form the affine space given by KeccakFPropagation::buildStateBase().
+  * The iterator decides on the generators one by one in a depth-first search.
+  * At each node of the search, it keeps a lower bound on the weight of the states below:
+  * a row that none of the remaining generators touches contributes its weight,
+  * and the other rows contribute the minimum weight over the values they can still take.
+  * The subtrees whose lower bound exceeds the maximum weight are skipped.
+  * At the leaves, the lower bound is the weight of the state.
+  */
+class DirectStateIterator
+{
+private:
+    /** The effect of a generator on a row after λ. */
+    class GeneratorRow {
+    public:
+        /** The coordinates of the row. */
+        unsigned int y, z;
+        /** The value of the generator in this row. */
+        RowValue value;
+        /** The set of values that the generators from this one on can add to this row,
+          * as a 32-bit mask where bit v is set iff the row value v is in the set. */
+        UINT32 spanBefore;
+        /** The same as spanBefore, but for the generators after this one. */
+        UINT32 spanAfter;
+    };
+    unsigned char weightPerRow[1<<nrRowsAndColumns];
+    vector<vector<GeneratorRow> > generators;
+    vector<unsigned int> lowerBounds;
+    vector<bool> included;
+    unsigned int depth;
+    unsigned int minDepth;
+    unsigned int maxWeight;
+    vector<SliceValue> current;
+    bool end;
+public:
+    /** This constructor initializes the iterator based on a state value before χ,
+      * the KeccakFPropagation instance, which determines the compatible states,
+      * and a maximum of the propagation weight.
+      * @param   stateBeforeChi The state value before χ as a vector of slices.
+      * @param   DCorLC         A reference to the KeccakFPropagation instance that
+      *                         determines the type of propagation.
+      * @param   aMaxWeight     The iterator will run through the states whose propagation
+      *                         weight is not higher than this parameter. 
+      */
+    DirectStateIterator(const vector<SliceValue>& stateBeforeChi, const KeccakFPropagation& DCorLC, unsigned int aMaxWeight);
+    /** This constructor is like the previous one, but it restricts the iterator to a subtree
+      * of the search, i.e., to the states where the inclusion of the first @a subtreeDepth generators
+      * is given by the bits of @a subtreeIndex (bit <i>d</i> for generator <i>d</i>).
+      * The subtrees for all values of @a subtreeIndex between 0 and 2^@a subtreeDepth-1
+      * together cover the same states as the whole iterator, so they can be iterated in parallel.
+      * @param   stateBeforeChi The state value before χ as a vector of slices.
+      * @param   DCorLC         A reference to the KeccakFPropagation instance that
+      *                         determines the type of propagation.
+      * @param   aMaxWeight     The iterator will run through the states whose propagation
+      *                         weight is not higher than this parameter. 
+      * @param   subtreeDepth   The number of generators fixed by @a subtreeIndex,
+      *                         at most the number of generators and at most 63.
+      * @param   subtreeIndex   The inclusion of the first @a subtreeDepth generators.
+      */
+    DirectStateIterator(const vector<SliceValue>& stateBeforeChi, const KeccakFPropagation& DCorLC, unsigned int aMaxWeight, unsigned int subtreeDepth, UINT64 subtreeIndex);
+    /** This method tells whether the iterator has reached the end of the possible states.
+      * @return It returns true iff there are no more states to run through.
+      */
+    bool isEnd() const;
+    /** This method moves the iterator to the next state. */
+    void operator++();
+    /** This method returns a constant reference to the current state.
+      * @return A constant reference to the current state after λ as a vector of slices.
+      */
+    const vector<SliceValue>& operator*() const;
+    /** This method returns the propagation weight of the current state.
+      * @return The weight of the current state.
+      */
+    unsigned int getCurrentWeight() const;
+    /** This method returns the number of generators of the affine space.
+      * @return The number of generators.
+      */
+    unsigned int getNumberOfGenerators() const;
+private:
+    void initialize(const vector<SliceValue>& stateBeforeChi, const KeccakFPropagation& DCorLC, unsigned int subtreeDepth, UINT64 subtreeIndex);
+    unsigned int getMinWeight(RowValue row, UINT32 span) const;
+    int getDeltaLowerBound(bool include) const;
+    void addGenerator();
+    bool moveToChild(bool include);
+    bool moveToNextSibling();
+    void moveToLeaf();
 };
 
 #endif
@@ -20,3 +20,74 @@ http://creativecommons.org/publicdomain/zero/1.0/
 
 using namespace std;
 
+
+void SparseStateAsSlices::makeDense()
+{
+    // When not dense, denseValues is either empty or all zero.
+    denseValues.resize(maxNrSlices, 0);
+    activeSlices = 0;
+    for(unsigned int i=0; i<nrSlices; i++) {
+        denseValues[sparseZ[i]] = sparseValues[i];
+        activeSlices |= (UINT64)1 << sparseZ[i];
+    }
+    dense = true;
+}
+
+void SparseStateAsSlices::addState(const SparseStateAsSlices& other, unsigned int dz, unsigned int laneSize)
+{
+    if (&other == this) {
+        SparseStateAsSlices copy(other);
+        addState(copy, dz, laneSize);
+        return;
+    }
+    unsigned int z;
+    for(bool found = other.nextSlice(z, false); found; found = other.nextSlice(z, true)) {
+        unsigned int targetZ = (z + dz) % laneSize;
+        setSlice(targetZ, getSlice(targetZ) ^ other.getSlice(z));
+    }
+}
+
+void SparseStateAsSlices::mergeState(const SparseStateAsSlices& other, unsigned int dz, unsigned int laneSize)
+{
+    if (&other == this) {
+        SparseStateAsSlices copy(other);
+        mergeState(copy, dz, laneSize);
+        return;
+    }
+    unsigned int z;
+    for(bool found = other.nextSlice(z, false); found; found = other.nextSlice(z, true)) {
+        unsigned int targetZ = (z + dz) % laneSize;
+        setSlice(targetZ, getSlice(targetZ) | other.getSlice(z));
+    }
+}
+
+bool SparseStateAsSlices::isDisjoint(const SparseStateAsSlices& other) const
+{
+    const SparseStateAsSlices& smaller = (nrSlices <= other.nrSlices) ? *this : other;
+    const SparseStateAsSlices& larger = (nrSlices <= other.nrSlices) ? other : *this;
+    unsigned int z;
+    for(bool found = smaller.nextSlice(z, false); found; found = smaller.nextSlice(z, true))
+        if ((smaller.getSlice(z) & larger.getSlice(z)) != 0)
+            return false;
+    return true;
+}
+
+void SparseStateAsSlices::toVector(vector<SliceValue>& state) const
+{
+    for(unsigned int z=0; z<state.size(); z++)
+        state[z] = 0;
+    unsigned int z;
+    for(bool found = nextSlice(z, false); found; found = nextSlice(z, true))
+        state[z] = getSlice(z);
+}
+
+bool SparseStateAsSlices::operator==(const SparseStateAsSlices& other) const
+{
+    if (nrSlices != other.nrSlices)
+        return false;
+    unsigned int z;
+    for(bool found = nextSlice(z, false); found; found = nextSlice(z, true))
+        if (getSlice(z) != other.getSlice(z))
+            return false;
+    return true;
+}
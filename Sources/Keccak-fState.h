@@ -132,17 +132,141 @@ public:
     
 };
 
-/** The SparseState type codes a state as map of z-coordinate, SliceValue couples.
+/** The SparseStateAsSlices type codes a state as a set of (z-coordinate, SliceValue) couples.
   * It is compact for sparse states as it only stores the nonzero slices.
+  * Up to inlineCapacity nonzero slices are kept inside the object, in an array sorted by z.
+  * Beyond that, the state switches to a dense representation: an array indexed by z,
+  * allocated once and reused, together with a 64-bit mask of the nonzero slices.
+  * Hence, the z coordinates must be lower than maxNrSlices, which covers all Keccak-<i>f</i> lane sizes,
+  * and setting or clearing bits in a state never allocates memory, except when it first becomes dense.
   * The convention used and maintained by the getSlice(), setSlice(), getBit(), 
   * setBitToZero() and invertBit() functions is that a slice with value zero 
-  * does not appear in the map.
+  * is not stored.
   */
 class SparseStateAsSlices {
 public:
-    map<unsigned int, SliceValue> slices;
+    /** The bound on the z coordinates. */
+    static const unsigned int maxNrSlices = 64;
+    /** The number of nonzero slices kept in the sorted array. */
+    static const unsigned int inlineCapacity = 8;
+protected:
+    /** The number of nonzero slices. */
+    unsigned int nrSlices;
+    /** Whether the dense representation is used. */
+    bool dense;
+    /** In the sparse representation, the z coordinates of the nonzero slices, in increasing order. */
+    unsigned char sparseZ[inlineCapacity];
+    /** In the sparse representation, the values of the nonzero slices, in the same order as sparseZ. */
+    SliceValue sparseValues[inlineCapacity];
+    /** In the dense representation, the mask with bit z set iff slice z is nonzero. */
+    UINT64 activeSlices;
+    /** In the dense representation, the value of each slice. */
+    vector<SliceValue> denseValues;
 public:
-    SparseStateAsSlices() {}
+    SparseStateAsSlices() : nrSlices(0), dense(false), activeSlices(0) {}
+
+    /** This method returns the number of nonzero slices. */
+    inline unsigned int getNumberOfSlices() const { return nrSlices; }
+
+    /** This method returns whether the state is all-zero. */
+    inline bool isEmpty() const { return nrSlices == 0; }
+
+    /** This method sets the state to zero. */
+    inline void clear()
+    {
+        if (dense)
+            for(UINT64 mask = activeSlices; mask != 0; mask &= mask - 1)
+                denseValues[getTrailingZeros(mask)] = 0;
+        nrSlices = 0;
+        dense = false;
+        activeSlices = 0;
+    }
+
+    /** This method returns the value of a given slice in a state.
+      *
+      * @param  z   The z coordinate.
+      */
+    inline SliceValue getSlice(unsigned int z) const
+    {
+        if (z >= maxNrSlices)
+            return 0;
+        if (dense)
+            return denseValues[z];
+        unsigned int i = findSparse(z);
+        if ((i < nrSlices) && (sparseZ[i] == z))
+            return sparseValues[i];
+        else
+            return 0;
+    }
+
+    /** This method sets the value of a given slice in a state.
+      *
+      * An exception KeccakException is thrown if @a z is not lower than maxNrSlices.
+      * @param  z   The z coordinate.
+      * @param  value   The new slice value.
+      */
+    inline void setSlice(unsigned int z, SliceValue value)
+    {
+        if (z >= maxNrSlices)
+            throw KeccakException("SparseStateAsSlices::setSlice(): the z coordinate must be lower than maxNrSlices.");
+        if (dense) {
+            setDenseSlice(z, value);
+            return;
+        }
+        unsigned int i = findSparse(z);
+        if ((i < nrSlices) && (sparseZ[i] == z)) {
+            if (value != 0)
+                sparseValues[i] = value;
+            else {
+                for(unsigned int j=i+1; j<nrSlices; j++) {
+                    sparseZ[j-1] = sparseZ[j];
+                    sparseValues[j-1] = sparseValues[j];
+                }
+                nrSlices--;
+            }
+        }
+        else if (value != 0) {
+            if (nrSlices == inlineCapacity) {
+                makeDense();
+                setDenseSlice(z, value);
+                return;
+            }
+            for(unsigned int j=nrSlices; j>i; j--) {
+                sparseZ[j] = sparseZ[j-1];
+                sparseValues[j] = sparseValues[j-1];
+            }
+            sparseZ[i] = (unsigned char)z;
+            sparseValues[i] = value;
+            nrSlices++;
+        }
+    }
+
+    /** This method looks for the nonzero slice following a given z coordinate, or the first one.
+      * This allows iterating over the nonzero slices in increasing order of z.
+      * @param  z   The z coordinate. If @a zIsInitialized is true, it contains
+      *             the z coordinate after which to look. 
+      *             If successful, it receives the z coordinate of the slice found.
+      * @param  zIsInitialized  Whether z is already initialized.
+      *             If set to false, it looks for the first nonzero slice.
+      * @return Whether a nonzero slice was found.
+      */
+    inline bool nextSlice(unsigned int& z, bool zIsInitialized) const
+    {
+        if (dense) {
+            UINT64 mask = activeSlices;
+            if (zIsInitialized)
+                mask = (z >= maxNrSlices-1) ? 0 : (mask & ((~(UINT64)0) << (z+1)));
+            if (mask == 0)
+                return false;
+            z = getTrailingZeros(mask);
+            return true;
+        }
+        unsigned int i = zIsInitialized ? findSparse(z+1) : 0;
+        if (i >= nrSlices)
+            return false;
+        z = sparseZ[i];
+        return true;
+    }
 
     /** This method returns the value of a given bit in a state.
       *
@@ -152,11 +276,7 @@ public:
       */
     inline int getBit(unsigned int x, unsigned int y, unsigned int z) const
     {
-        map<unsigned int, SliceValue>::const_iterator slice = slices.find(z);
-        if (slice == slices.end())
-            return 0;
-        else
-            return ((slice->second) >> (x+5*y)) & 1;
+        return (getSlice(z) >> (x+5*y)) & 1;
     }
 
     /** This method returns the value of a given bit in a state.
@@ -176,12 +296,7 @@ public:
       */
     inline void setBitToZero(unsigned int x, unsigned int y, unsigned int z)
     {
-        map<unsigned int, SliceValue>::iterator slice = slices.find(z);
-        if (slice != slices.end()) {
-            slice->second &= ~getSlicePoint(x, y);
-            if (slice->second == 0)
-                slices.erase(slice);
-        }
+        setSlice(z, getSlice(z) & ~getSlicePoint(x, y));
     }
 
     /** This method sets to 0 a particular bit in a state.
@@ -201,11 +316,7 @@ public:
       */
     inline void setBitToOne(unsigned int x, unsigned int y, unsigned int z)
     {
-        map<unsigned int, SliceValue>::iterator slice = slices.find(z);
-        if (slice != slices.end())
-            slice->second |= getSlicePoint(x, y);
-        else
-            slices[z] = getSlicePoint(x, y);
+        setSlice(z, getSlice(z) | getSlicePoint(x, y));
     }
 
     /** This method sets to 1 a particular bit in a state.
@@ -225,14 +336,7 @@ public:
       */
     inline void invertBit(unsigned int x, unsigned int y, unsigned int z)
     {
-        map<unsigned int, SliceValue>::iterator slice = slices.find(z);
-        if (slice != slices.end()) {
-            slice->second ^= getSlicePoint(x, y);
-            if (slice->second == 0)
-                slices.erase(slice);
-        }
-        else
-            slices[z] = getSlicePoint(x, y);
+        setSlice(z, getSlice(z) ^ getSlicePoint(x, y));
     }
 
     /** This method inverts a particular bit in a state.
@@ -244,39 +348,65 @@ public:
         invertBit(p.x, p.y, p.z);
     }
 
-    /** This method returns the value of a given slice in a state.
-      *
-      * @param  z   The z coordinate.
+    /** This method adds (XORs) another state to this one,
+      * possibly translated along z.
+      * @param  other   The state to add.
+      * @param  dz      The translation offset along z applied to @a other.
+      * @param  laneSize    The lane size, modulo which the translated z coordinates are taken.
       */
-    inline SliceValue getSlice(unsigned int z) const
+    void addState(const SparseStateAsSlices& other, unsigned int dz = 0, unsigned int laneSize = maxNrSlices);
+
+    /** This method merges (ORs) another state into this one,
+      * possibly translated along z.
+      * @param  other   The state to merge.
+      * @param  dz      The translation offset along z applied to @a other.
+      * @param  laneSize    The lane size, modulo which the translated z coordinates are taken.
+      */
+    void mergeState(const SparseStateAsSlices& other, unsigned int dz = 0, unsigned int laneSize = maxNrSlices);
+
+    /** This method returns whether this state and another one have no active bit in common.
+      */
+    bool isDisjoint(const SparseStateAsSlices& other) const;
+
+    /** This method writes the state to a state given as a vector of slices.
+      * @param  state   The state to write to, whose size is the lane size.
+      */
+    void toVector(vector<SliceValue>& state) const;
+
+    /** The equality operator. */
+    bool operator==(const SparseStateAsSlices& other) const;
+
+protected:
+    /** This method returns the index of the first entry of the sorted array 
+      * with a z coordinate not lower than @a z. 
+      */
+    inline unsigned int findSparse(unsigned int z) const
     {
-        map<unsigned int, SliceValue>::const_iterator slice = slices.find(z);
-        if (slice == slices.end())
-            return 0;
-        else
-            return slice->second;
+        unsigned int i = 0;
+        while((i < nrSlices) && (sparseZ[i] < z))
+            i++;
+        return i;
     }
 
-    /** This method sets the value of a given slice in a state.
-      *
-      * @param  z   The z coordinate.
-      * @param  value   The new slice value.
-      */
-    inline void setSlice(unsigned int z, SliceValue value)
+    /** This method sets a slice in the dense representation. */
+    inline void setDenseSlice(unsigned int z, SliceValue value)
     {
-        map<unsigned int, SliceValue>::iterator slice = slices.find(z);
-        if (slice == slices.end()) {
-            if (value != 0)
-                slices[z] = value;
+        UINT64 bit = (UINT64)1 << z;
+        if (value != 0) {
+            if ((activeSlices & bit) == 0) {
+                activeSlices |= bit;
+                nrSlices++;
+            }
         }
-        else {
-            if (value == 0)
-                slices.erase(slice);
-            else
-                slice->second = value;
+        else if ((activeSlices & bit) != 0) {
+            activeSlices &= ~bit;
+            nrSlices--;
         }
+        denseValues[z] = value;
     }
 
+    /** This method switches to the dense representation. */
+    void makeDense();
 };
 
 #endif
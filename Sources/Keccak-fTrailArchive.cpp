@@ -0,0 +1,495 @@
+/*
+KeccakTools
+
+The Keccak sponge function, designed by Guido Bertoni, Joan Daemen,
+Michaël Peeters and Gilles Van Assche. For more information, feedback or
+questions, please refer to our website: http://keccak.noekeon.org/
+
+Implementation by the designers,
+hereby denoted as "the implementer".
+
+To the extent possible under law, the implementer has waived all copyright
+and related or neighboring rights to the source code in this file.
+http://creativecommons.org/publicdomain/zero/1.0/
+*/
+
+#include <string.h>
+#include "Keccak-fTrailArchive.h"
+
+// An archive starts with a header: the magic string (8 bytes) and the version (32 bits).
+// Then come the blocks, each made of the size of its compressed contents (32 bits),
+// the size of its decompressed contents (32 bits), the number of trails it contains (32 bits)
+// and the compressed contents. All integers in the headers are little-endian.
+static const char trailArchiveMagic[8] = { 'K', 'T', 'A', 'R', 'C', 'H', 'V', 0 };
+static const UINT32 trailArchiveVersion = 1;
+static const size_t trailArchiveHeaderSize = 12;
+static const size_t trailArchiveBlockHeaderSize = 12;
+
+static void appendUINT32(string& buffer, UINT32 value)
+{
+    for(unsigned int i=0; i<4; i++)
+        buffer += (char)((value >> (8*i)) & 0xFF);
+}
+
+static UINT32 readUINT32(const unsigned char *data)
+{
+    return (UINT32)data[0] | ((UINT32)data[1] << 8) | ((UINT32)data[2] << 16) | ((UINT32)data[3] << 24);
+}
+
+static void appendVarint(string& buffer, UINT32 value)
+{
+    while(value >= 0x80) {
+        buffer += (char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer += (char)value;
+}
+
+static UINT32 readVarint(const vector<unsigned char>& buffer, size_t& position)
+{
+    UINT32 value = 0;
+    for(unsigned int shift=0; shift<35; shift+=7) {
+        if (position >= buffer.size())
+            throw TrailException("Truncated trail archive.");
+        unsigned char byte = buffer[position++];
+        // The fifth byte carries only the 4 most significant bits.
+        if ((shift == 28) && ((byte & 0x70) != 0))
+            throw TrailException("Invalid trail archive.");
+        value |= (UINT32)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+    throw TrailException("Invalid trail archive.");
+}
+
+// -------------------------------------------------------------
+//
+// Block compression
+//
+// -------------------------------------------------------------
+
+// The compressed form is a sequence of sequences, as in LZ4: a token whose high nibble is the number
+// of literals and low nibble the match length minus 4 (15 meaning that more bytes of length follow,
+// each adding up to 255), the literals, then the offset of the match (16 bits), except in the last sequence,
+// which has only literals.
+static const unsigned int minMatchLength = 4;
+static const unsigned int hashLog = 14;
+
+static void appendLength(string& out, size_t length)
+{
+    while(length >= 255) {
+        out += (char)255;
+        length -= 255;
+    }
+    out += (char)length;
+}
+
+static void appendSequence(string& out, const unsigned char *literals, size_t nrLiterals, size_t offset, size_t matchLength)
+{
+    size_t extraMatchLength = (matchLength > 0) ? matchLength - minMatchLength : 0;
+    unsigned char token = (unsigned char)(((nrLiterals >= 15) ? 15 : nrLiterals) << 4);
+    if (matchLength > 0)
+        token |= (unsigned char)((extraMatchLength >= 15) ? 15 : extraMatchLength);
+    out += (char)token;
+    if (nrLiterals >= 15)
+        appendLength(out, nrLiterals - 15);
+    out.append((const char *)literals, nrLiterals);
+    if (matchLength > 0) {
+        out += (char)(offset & 0xFF);
+        out += (char)((offset >> 8) & 0xFF);
+        if (extraMatchLength >= 15)
+            appendLength(out, extraMatchLength - 15);
+    }
+}
+
+static void compressBlock(const string& in, string& out)
+{
+    out.clear();
+    const unsigned char *data = (const unsigned char *)in.data();
+    size_t size = in.size();
+    vector<UINT32> lastPosition(1 << hashLog, ~(UINT32)0);
+    size_t anchor = 0;
+    size_t i = 0;
+    while(i + minMatchLength <= size) {
+        UINT32 sequence;
+        memcpy(&sequence, data+i, 4);
+        UINT32 h = (sequence * 2654435761U) >> (32 - hashLog);
+        UINT32 candidate = lastPosition[h];
+        lastPosition[h] = (UINT32)i;
+        if ((candidate != ~(UINT32)0) && (i - candidate <= 0xFFFF) && (memcmp(data+candidate, data+i, minMatchLength) == 0)) {
+            size_t matchLength = minMatchLength;
+            while((i + matchLength < size) && (data[candidate + matchLength] == data[i + matchLength]))
+                matchLength++;
+            appendSequence(out, data+anchor, i-anchor, i-candidate, matchLength);
+            i += matchLength;
+            anchor = i;
+        }
+        else
+            i++;
+    }
+    appendSequence(out, data+anchor, size-anchor, 0, 0);
+}
+
+static size_t readLength(const vector<unsigned char>& in, size_t& position, size_t length)
+{
+    if (length == 15) {
+        unsigned char byte;
+        do {
+            if (position >= in.size())
+                throw TrailException("Truncated trail archive.");
+            byte = in[position++];
+            length += byte;
+        } while(byte == 255);
+    }
+    return length;
+}
+
+static void decompressBlock(const vector<unsigned char>& in, vector<unsigned char>& out, size_t expectedSize)
+{
+    out.clear();
+    out.reserve(expectedSize);
+    size_t position = 0;
+    while(position < in.size()) {
+        unsigned char token = in[position++];
+        size_t nrLiterals = readLength(in, position, token >> 4);
+        if ((nrLiterals > in.size() - position) || (out.size() + nrLiterals > expectedSize))
+            throw TrailException("Invalid trail archive.");
+        out.insert(out.end(), in.begin() + position, in.begin() + position + nrLiterals);
+        position += nrLiterals;
+        if (position == in.size())
+            break;
+        if (position + 2 > in.size())
+            throw TrailException("Truncated trail archive.");
+        size_t offset = (size_t)in[position] | ((size_t)in[position+1] << 8);
+        position += 2;
+        size_t matchLength = readLength(in, position, token & 0x0F) + minMatchLength;
+        if ((offset == 0) || (offset > out.size()) || (out.size() + matchLength > expectedSize))
+            throw TrailException("Invalid trail archive.");
+        // The match may overlap the bytes it produces.
+        size_t start = out.size() - offset;
+        for(size_t j=0; j<matchLength; j++)
+            out.push_back(out[start + j]);
+    }
+    if (out.size() != expectedSize)
+        throw TrailException("Invalid trail archive.");
+}
+
+// -------------------------------------------------------------
+//
+// Trail encoding
+//
+// -------------------------------------------------------------
+
+// A trail is encoded as varints: the flags (firstStateSpecified, stateAfterLastChiSpecified), the lane size,
+// the total weight, the number of weights, the weights, then each state that is specified and the state after
+// the last χ if specified, as its number of non-zero slices followed, for each, by the difference
+// between its z coordinate and that of the previous one (or z itself for the first) and its value.
+
+static void appendSparseState(string& buffer, const vector<SliceValue>& state)
+{
+    unsigned int nrActiveSlices = 0;
+    for(unsigned int z=0; z<state.size(); z++)
+        if (state[z] != 0)
+            nrActiveSlices++;
+    appendVarint(buffer, nrActiveSlices);
+    unsigned int previousZ = 0;
+    for(unsigned int z=0; z<state.size(); z++)
+        if (state[z] != 0) {
+            appendVarint(buffer, z - previousZ);
+            appendVarint(buffer, state[z]);
+            previousZ = z;
+        }
+}
+
+static void readSparseState(const vector<unsigned char>& buffer, size_t& position, unsigned int laneSize, vector<SliceValue>& state)
+{
+    unsigned int nrActiveSlices = readVarint(buffer, position);
+    state.assign(laneSize, 0);
+    unsigned int z = 0;
+    for(unsigned int i=0; i<nrActiveSlices; i++) {
+        z += readVarint(buffer, position);
+        if (z >= laneSize)
+            throw TrailException("Invalid trail archive.");
+        state[z] = readVarint(buffer, position);
+    }
+}
+
+static void appendTrail(string& buffer, const Trail& trail)
+{
+    unsigned int laneSize = 0;
+    for(unsigned int i=0; (i<trail.states.size()) && (laneSize == 0); i++)
+        laneSize = trail.states[i].size();
+    appendVarint(buffer, (trail.firstStateSpecified ? 1 : 0) | (trail.stateAfterLastChiSpecified ? 2 : 0));
+    appendVarint(buffer, laneSize);
+    appendVarint(buffer, trail.totalWeight);
+    appendVarint(buffer, trail.weights.size());
+    for(unsigned int i=0; i<trail.weights.size(); i++)
+        appendVarint(buffer, trail.weights[i]);
+    for(unsigned int i=(trail.firstStateSpecified ? 0 : 1); i<trail.states.size(); i++)
+        appendSparseState(buffer, trail.states[i]);
+    if (trail.stateAfterLastChiSpecified)
+        appendSparseState(buffer, trail.stateAfterLastChi);
+}
+
+static void readTrail(const vector<unsigned char>& buffer, size_t& position, Trail& trail)
+{
+    unsigned int flags = readVarint(buffer, position);
+    trail.firstStateSpecified = ((flags & 1) != 0);
+    trail.stateAfterLastChiSpecified = ((flags & 2) != 0);
+    unsigned int laneSize = readVarint(buffer, position);
+    trail.totalWeight = readVarint(buffer, position);
+    unsigned int nrWeights = readVarint(buffer, position);
+    if (nrWeights > buffer.size() - position)
+        throw TrailException("Invalid trail archive.");
+    trail.weights.resize(nrWeights);
+    for(unsigned int i=0; i<nrWeights; i++)
+        trail.weights[i] = readVarint(buffer, position);
+    trail.states.clear();
+    if (!trail.firstStateSpecified)
+        trail.states.push_back(vector<SliceValue>());
+    while(trail.states.size() < nrWeights) {
+        trail.states.push_back(vector<SliceValue>());
+        readSparseState(buffer, position, laneSize, trail.states.back());
+    }
+    trail.stateAfterLastChi.clear();
+    if (trail.stateAfterLastChiSpecified)
+        readSparseState(buffer, position, laneSize, trail.stateAfterLastChi);
+}
+
+// -------------------------------------------------------------
+//
+// TrailArchiveWriter
+//
+// -------------------------------------------------------------
+
+TrailArchiveWriter::TrailArchiveWriter(const string& aFileName, size_t aBlockSize, TrailDuplicateFilter *aDuplicateFilter)
+    : fileName(aFileName), fout(aFileName.c_str(), ios::binary), blockSize(aBlockSize), duplicateFilter(aDuplicateFilter),
+    nrTrailsInBlock(0), count(0)
+{
+    if (!fout)
+        throw TrailException("File '" + fileName + "' cannot be written.");
+    string header(trailArchiveMagic, sizeof(trailArchiveMagic));
+    appendUINT32(header, trailArchiveVersion);
+    fout.write(header.data(), header.size());
+}
+
+TrailArchiveWriter::~TrailArchiveWriter()
+{
+    if (fout.is_open()) {
+        try {
+            close();
+        }
+        catch(TrailException) {
+        }
+    }
+}
+
+void TrailArchiveWriter::fetchTrail(const Trail& trail)
+{
+    if ((duplicateFilter != 0) && !duplicateFilter->isNew(trail))
+        return;
+    Trail canonicalTrail(trail);
+    TranslationDuplicateFilter::translateToCanonical(canonicalTrail);
+    appendTrail(block, canonicalTrail);
+    nrTrailsInBlock++;
+    count++;
+    if (block.size() >= blockSize)
+        writeBlock();
+}
+
+void TrailArchiveWriter::writeBlock()
+{
+    if (nrTrailsInBlock == 0)
+        return;
+    string compressedBlock;
+    compressBlock(block, compressedBlock);
+    string header;
+    appendUINT32(header, compressedBlock.size());
+    appendUINT32(header, block.size());
+    appendUINT32(header, nrTrailsInBlock);
+    fout.write(header.data(), header.size());
+    fout.write(compressedBlock.data(), compressedBlock.size());
+    block.clear();
+    nrTrailsInBlock = 0;
+}
+
+void TrailArchiveWriter::flush()
+{
+    writeBlock();
+    fout.flush();
+}
+
+UINT64 TrailArchiveWriter::close()
+{
+    writeBlock();
+    fout.close();
+    if (!fout)
+        throw TrailException("File '" + fileName + "' cannot be written.");
+    return count;
+}
+
+// -------------------------------------------------------------
+//
+// TrailArchiveIterator
+//
+// -------------------------------------------------------------
+
+TrailArchiveIterator::TrailArchiveIterator(const string& aFileName, const KeccakFPropagation& aDCorLC)
+    : TrailIterator(aDCorLC), fileName(aFileName)
+{
+    initialize();
+    next();
+}
+
+TrailArchiveIterator::TrailArchiveIterator(const string& aFileName, const KeccakFPropagation& aDCorLC, TrailFilter *aFilter)
+    : TrailIterator(aDCorLC, aFilter), fileName(aFileName)
+{
+    initialize();
+    next();
+}
+
+void TrailArchiveIterator::rewind()
+{
+    fin.clear();
+    fin.seekg(trailArchiveHeaderSize, ios_base::beg);
+    block.clear();
+    position = 0;
+}
+
+void TrailArchiveIterator::initialize()
+{
+    fin.open(fileName.c_str(), ios::binary);
+    if (!fin)
+        throw TrailException((string)"File '" + fileName + (string)"' cannot be read.");
+    unsigned char header[trailArchiveHeaderSize];
+    fin.read((char *)header, trailArchiveHeaderSize);
+    if ((!fin) || (memcmp(header, trailArchiveMagic, sizeof(trailArchiveMagic)) != 0)
+            || (readUINT32(header+8) != trailArchiveVersion))
+        throw TrailException((string)"File '" + fileName + (string)"' is not a trail archive.");
+    // The trails are counted from the block headers, skipping the compressed contents.
+    unfilteredCount = 0;
+    unsigned char blockHeader[trailArchiveBlockHeaderSize];
+    while(fin.read((char *)blockHeader, trailArchiveBlockHeaderSize)) {
+        unfilteredCount += readUINT32(blockHeader+8);
+        fin.seekg(readUINT32(blockHeader), ios_base::cur);
+    }
+    if (filter) {
+        rewind();
+        count = 0;
+        Trail trail;
+        while(readNextTrail(trail))
+            if (filter->filter(DCorLC, trail))
+                count++;
+    }
+    else
+        count = unfilteredCount;
+    rewind();
+    i = 0;
+}
+
+bool TrailArchiveIterator::readNextTrail(Trail& trail)
+{
+    while(position >= block.size()) {
+        unsigned char blockHeader[trailArchiveBlockHeaderSize];
+        if (!fin.read((char *)blockHeader, trailArchiveBlockHeaderSize))
+            return false;
+        compressed.resize(readUINT32(blockHeader));
+        if ((compressed.size() > 0) && !fin.read((char *)&compressed[0], compressed.size()))
+            throw TrailException((string)"File '" + fileName + (string)"' is truncated.");
+        decompressBlock(compressed, block, readUINT32(blockHeader+4));
+        position = 0;
+    }
+    readTrail(block, position, trail);
+    return true;
+}
+
+void TrailArchiveIterator::next()
+{
+    end = true;
+    while(readNextTrail(current)) {
+        if ((!filter) || filter->filter(DCorLC, current)) {
+            end = false;
+            break;
+        }
+    }
+}
+
+bool TrailArchiveIterator::isEnd()
+{
+    return end;
+}
+
+bool TrailArchiveIterator::isEmpty()
+{
+    return (count == 0);
+}
+
+void TrailArchiveIterator::operator++()
+{
+    next();
+    i++;
+}
+
+const Trail& TrailArchiveIterator::operator*()
+{
+    return current;
+}
+
+bool TrailArchiveIterator::isBounded()
+{
+    return true;
+}
+
+UINT64 TrailArchiveIterator::getIndex()
+{
+    return i;
+}
+
+UINT64 TrailArchiveIterator::getCount()
+{
+    return count;
+}
+
+void TrailArchiveIterator::display(ostream& fout) const
+{
+    fout << "'" << fileName << "' containing " << dec << count << " trails";
+    if (filter)
+        fout << " (" << dec << unfilteredCount << " before filtering)";
+}
+
+ostream& operator<<(ostream& a, const TrailArchiveIterator& tai)
+{
+    tai.display(a);
+    return a;
+}
+
+UINT64 convertTrailFileToArchive(const string& textFileName, const string& archiveFileName, bool dropTranslatedDuplicates)
+{
+    ifstream fin(textFileName.c_str());
+    if (!fin)
+        throw TrailException("File '" + textFileName + "' cannot be read.");
+    TranslationDuplicateFilter duplicateFilter;
+    TrailArchiveWriter trailsOut(archiveFileName, 1 << 20, dropTranslatedDuplicates ? &duplicateFilter : 0);
+    while(!(fin.eof())) {
+        try {
+            Trail trail(fin);
+            trailsOut.fetchTrail(trail);
+        }
+        catch(TrailException) {
+        }
+    }
+    return trailsOut.close();
+}
+
+UINT64 convertTrailArchiveToText(const string& archiveFileName, const KeccakFPropagation& DCorLC, const string& textFileName)
+{
+    ofstream fout(textFileName.c_str());
+    if (!fout)
+        throw TrailException("File '" + textFileName + "' cannot be written.");
+    UINT64 n = 0;
+    for(TrailArchiveIterator i(archiveFileName, DCorLC); !i.isEnd(); ++i) {
+        (*i).save(fout);
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,143 @@
+/*
+KeccakTools
+
+The Keccak sponge function, designed by Guido Bertoni, Joan Daemen,
+Michaël Peeters and Gilles Van Assche. For more information, feedback or
+questions, please refer to our website: http://keccak.noekeon.org/
+
+Implementation by the designers,
+hereby denoted as "the implementer".
+
+To the extent possible under law, the implementer has waived all copyright
+and related or neighboring rights to the source code in this file.
+http://creativecommons.org/publicdomain/zero/1.0/
+*/
+
+#ifndef _KECCAKFTRAILARCHIVE_H_
+#define _KECCAKFTRAILARCHIVE_H_
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include "Keccak-fTrails.h"
+
+using namespace std;
+
+/** This class implements a TrailFetcher that saves the trails in a compressed archive.
+  * Each trail is first replaced by its translated version along z that is the smallest,
+  * as given by getSymmetricMinimum(), so that trails that differ only by translation
+  * are stored identically. The trail is then encoded with variable-length integers,
+  * each state as the list of its non-zero slices, with their z coordinates
+  * given as differences from the previous one.
+  * The encoded trails are grouped in blocks, and each block is compressed
+  * with a fast LZ77 codec. The blocks are independent, so that the archive
+  * can be read block by block, see TrailArchiveIterator.
+  */
+class TrailArchiveWriter : public TrailFetcher {
+protected:
+    string fileName;
+    ofstream fout;
+    size_t blockSize;
+    TrailDuplicateFilter *duplicateFilter;
+    string block;
+    unsigned int nrTrailsInBlock;
+    UINT64 count;
+public:
+    /** The constructor.
+      * @param  aFileName   The name of the archive to write.
+      * @param  aBlockSize  The size in bytes of the encoded trails above which a block is compressed and written.
+      * @param  aDuplicateFilter    If not 0, a pointer to the filter that drops duplicate trails,
+      *                     typically a TranslationDuplicateFilter. It is not freed by the destructor.
+      */
+    TrailArchiveWriter(const string& aFileName, size_t aBlockSize = 1 << 20, TrailDuplicateFilter *aDuplicateFilter = 0);
+    /** The destructor closes the archive, if not done yet. */
+    ~TrailArchiveWriter();
+    /** See TrailFetcher::fetchTrail().*/
+    void fetchTrail(const Trail& trail);
+    /** See TrailFetcher::flush(). This ends the current block. */
+    void flush();
+    /** This method writes the last block and closes the archive.
+      * @return The number of trails in the archive.
+      */
+    UINT64 close();
+protected:
+    void writeBlock();
+};
+
+/** This class implements an iterator on the trails of an archive written by TrailArchiveWriter.
+  * The archive is read and decompressed one block at a time.
+  * The number of trails is obtained from the block headers, without decompressing them.
+  */
+class TrailArchiveIterator : public TrailIterator {
+protected:
+    string fileName;
+    ifstream fin;
+    UINT64 i, count, unfilteredCount;
+    bool end;
+    Trail current;
+    /** The current decompressed block. */
+    vector<unsigned char> block;
+    /** The position of the next trail in @a block. */
+    size_t position;
+    vector<unsigned char> compressed;
+public:
+    /** The constructor of the iterator.
+      * @param  aFileName   The name of the archive to read from.
+      * @param   DCorLC     The propagation context of the trails,
+      *                     as a reference to a KeccakFPropagation object.
+      */
+    TrailArchiveIterator(const string& aFileName, const KeccakFPropagation& aDCorLC);
+    /** The constructor of the iterator, with one filter.
+      * If a filter is given, the archive is first read completely to count the trails that pass the filter.
+      * @param  aFileName   The name of the archive to read from.
+      * @param   DCorLC     The propagation context of the trails,
+      *                     as a reference to a KeccakFPropagation object.
+      * @param  aFilter A pointer to the filter.
+      */
+    TrailArchiveIterator(const string& aFileName, const KeccakFPropagation& aDCorLC, TrailFilter *aFilter);
+    /** See TrailIterator::isEnd(). */
+    virtual bool isEnd();
+    /** See TrailIterator::isEmpty(). */
+    virtual bool isEmpty();
+    /** See TrailIterator::operator++(). */
+    virtual void operator++();
+    /** See TrailIterator::operator*(). */
+    virtual const Trail& operator*();
+    /** See TrailIterator::isBounded(). */
+    virtual bool isBounded();
+    /** See TrailIterator::getIndex(). */
+    virtual UINT64 getIndex();
+    /** See TrailIterator::getCount(). */
+    virtual UINT64 getCount();
+    /** This method displays information about the archive being read.
+      * @param  fout    The stream to display to.
+      */
+    void display(ostream& fout) const;
+    friend ostream& operator<<(ostream& a, const TrailArchiveIterator& tai);
+protected:
+    void initialize();
+    void rewind();
+    bool readNextTrail(Trail& trail);
+    void next();
+};
+
+/** This function converts a file of trails in text form, as saved by Trail::save(),
+  * into an archive, as written by TrailArchiveWriter.
+  * @param  textFileName    The name of the file to read from.
+  * @param  archiveFileName The name of the archive to write to.
+  * @param  dropTranslatedDuplicates    Whether to keep only one trail among those equal up to translation.
+  * @return The number of trails in the archive.
+  */
+UINT64 convertTrailFileToArchive(const string& textFileName, const string& archiveFileName, bool dropTranslatedDuplicates = false);
+
+/** This function converts an archive, as written by TrailArchiveWriter,
+  * into a file in text form, as saved by Trail::save().
+  * @param  archiveFileName The name of the archive to read from.
+  * @param   DCorLC     The propagation context of the trails,
+  *                     as a reference to a KeccakFPropagation object.
+  * @param  textFileName    The name of the file to write to.
+  * @return The number of trails converted.
+  */
+UINT64 convertTrailArchiveToText(const string& archiveFileName, const KeccakFPropagation& DCorLC, const string& textFileName);
+
+#endif
@@ -13,12 +13,100 @@ and related or neighboring rights to the source code in this file.
 http://creativecommons.org/publicdomain/zero/1.0/
 */
 
+#include <sstream>
 #include "Keccak-fDisplay.h"
 #include "Keccak-fTrailCore3Rounds.h"
 #include "translationsymmetry.h"
 
 using namespace std; 
 
+static const unsigned int knotInfoVersion = 1;
+static const unsigned int vortexBaseVersion = 1;
+
+VortexBase::VortexBase()
+{
+    build(vector<vector<VortexToAdd> >());
+}
+
+bool VortexBase::setPointers()
+{
+    size_t nrWords = table.getSize()/sizeof(UINT32);
+    const UINT32 *words = table.getDataAs<UINT32>();
+    if ((nrWords < 2) || (words[0] == 0) || (nrWords < 3 + (size_t)words[0]))
+        return false;
+    nrLengths = words[0];
+    UINT32 nrSlices = words[1];
+    firstVortexPerLength = words + 2;
+    UINT32 nrVortices = firstVortexPerLength[nrLengths];
+    size_t expectedNrWords = 3 + (size_t)nrLengths 
+        + (size_t)nrVortices*sizeof(Vortex)/sizeof(UINT32)
+        + (size_t)nrSlices*sizeof(Slice)/sizeof(UINT32);
+    if (table.getSize() != expectedNrWords*sizeof(UINT32))
+        return false;
+    vortices = (const Vortex *)(firstVortexPerLength + nrLengths + 1);
+    slices = (const Slice *)(vortices + nrVortices);
+    for(unsigned int u=0; u<nrLengths; u++)
+        if (firstVortexPerLength[u] > firstVortexPerLength[u+1])
+            return false;
+    for(UINT32 i=0; i<nrVortices; i++)
+        if ((UINT64)vortices[i].firstSlice + vortices[i].nrSlices > nrSlices)
+            return false;
+    return true;
+}
+
+bool VortexBase::load(const string& fileName, const string& tag, unsigned int width)
+{
+    if (table.load(fileName, tag, width, vortexBaseVersion) && setPointers())
+        return true;
+    build(vector<vector<VortexToAdd> >());
+    return false;
+}
+
+void VortexBase::build(const vector<vector<VortexToAdd> >& vorticesPerLength)
+{
+    // There is always at least the entry for length 0, which has no vortex.
+    UINT32 theNrLengths = max((size_t)1, vorticesPerLength.size());
+    UINT32 nrVortices = 0;
+    UINT32 nrSlices = 0;
+    for(unsigned int u=0; u<vorticesPerLength.size(); u++) {
+        nrVortices += vorticesPerLength[u].size();
+        for(unsigned int i=0; i<vorticesPerLength[u].size(); i++)
+            nrSlices += vorticesPerLength[u][i].slicesAtB.size();
+    }
+    size_t nrWords = 3 + (size_t)theNrLengths
+        + (size_t)nrVortices*sizeof(Vortex)/sizeof(UINT32)
+        + (size_t)nrSlices*sizeof(Slice)/sizeof(UINT32);
+    UINT32 *words = (UINT32 *)table.allocate(nrWords*sizeof(UINT32));
+    words[0] = theNrLengths;
+    words[1] = nrSlices;
+    UINT32 *firstVortex = words + 2;
+    Vortex *vortex = (Vortex *)(firstVortex + theNrLengths + 1);
+    Slice *slice = (Slice *)(vortex + nrVortices);
+    UINT32 vortexIndex = 0;
+    UINT32 sliceIndex = 0;
+    for(unsigned int u=0; u<theNrLengths; u++) {
+        firstVortex[u] = vortexIndex;
+        if (u < vorticesPerLength.size())
+            for(unsigned int i=0; i<vorticesPerLength[u].size(); i++) {
+                const VortexToAdd& v = vorticesPerLength[u][i];
+                vortex[vortexIndex].nrActiveRowsAtA = v.nrActiveRowsAtA;
+                vortex[vortexIndex].nrActiveRowsAtD = v.nrActiveRowsAtD;
+                vortex[vortexIndex].firstSlice = sliceIndex;
+                vortex[vortexIndex].nrSlices = v.slicesAtB.size();
+                for(unsigned int j=0; j<v.slicesAtB.size(); j++)
+                    slice[sliceIndex++] = v.slicesAtB[j];
+                vortexIndex++;
+            }
+    }
+    firstVortex[theNrLengths] = vortexIndex;
+    setPointers();
+}
+
+bool VortexBase::save(const string& fileName, const string& tag, unsigned int width) const
+{
+    return table.save(fileName, tag, width, vortexBaseVersion);
+}
+
 TrailCore3Rounds::TrailCore3Rounds(const vector<SliceValue>& backgroundAtA,
                                    const vector<SliceValue>& aTabooAtB,
                                    unsigned int aMaxWeight,
@@ -36,6 +124,30 @@ TrailCore3Rounds::TrailCore3Rounds(const vector<SliceValue>& backgroundAtA,
     stateAtB.assign(laneSize,0);
 
     minimumWorkingChainLength = 2;
+
+    isFirstChainStartPointFixed = false;
+}
+
+TrailCore3Rounds::TrailCore3Rounds(const TrailCore3Rounds& other) :
+    KeccakFPropagation(other.parent, other.getPropagationType()),
+    knotInfoLUT(other.knotInfoLUT),
+    maxWeight(other.maxWeight),
+    knots(other.knots),
+    knotsWithBackground(other.knotsWithBackground),
+    chains(other.chains),
+    yOffsets(other.yOffsets),
+    knotPointAddedKnot(other.knotPointAddedKnot),
+    stateAtA(other.stateAtA),
+    stateAtB(other.stateAtB),
+    tabooAtB(other.tabooAtB),
+    minimumWorkingChainLength(other.minimumWorkingChainLength),
+    startPointWorkingChainIsFree(other.startPointWorkingChainIsFree),
+    nrActiveRowsAtA(other.nrActiveRowsAtA),
+    hammingWeightAtA(other.hammingWeightAtA),
+    vortexBase(other.vortexBase),
+    isFirstChainStartPointFixed(other.isFirstChainStartPointFixed),
+    firstChainStartPoint(other.firstChainStartPoint)
+{
 }
 
 void TrailCore3Rounds::populateStatesWithBackground(const vector<SliceValue>& backgroundAtA)
@@ -58,9 +170,11 @@ void TrailCore3Rounds::populateStatesWithBackground(const vector<SliceValue>& ba
 void TrailCore3Rounds::initializeKnotInfoLUT()
 {
     if (getPropagationType() == KeccakFPropagation::DC){
-        string fileName = "KnotInfoDC" + name + ".cache";
-        ifstream fin(fileName.c_str(), ios::binary);
-        if (!fin) {
+        shared_ptr<CachedTable> table(new CachedTable());
+        string fileName = buildFileName("", "-knotInfo.cache");
+        string tag = name + "-knotInfo";
+        if (!table->load(fileName, tag, parent.getWidth(), knotInfoVersion, (size_t)maxSliceValue+1)) {
+            unsigned char *entries = table->allocate((size_t)maxSliceValue+1);
             vector<bool> isTameKnot;
             for(SliceValue s=0; s<=maxSliceValue ; s++) {
                 if ( (0  == (s%0x40000)) ) cout << "phase 1 " << s << " of " << maxSliceValue+1 << endl;
@@ -115,22 +229,11 @@ void TrailCore3Rounds::initializeKnotInfoLUT()
                         }
                     }
                 }
-                knotInfoLUT.push_back(packKnotInfo(knotPointDeficit,knotWeightAtBDeficit,nrActiveRows,isOrbital));
-            }
-            ofstream fout(fileName.c_str(), ios::binary);
-            for(SliceValue s=0 ; s<=maxSliceValue ; s++ ) {
-                static unsigned char tmp[1];
-                tmp[0] =  knotInfoLUT[s];
-                fout.write((char *)tmp, 1);
-            }
-        }
-        else {
-            for(SliceValue s=0 ; s<=maxSliceValue ; s++ ) {
-                unsigned char tmp[1];
-                fin.read((char *)tmp,1);
-                knotInfoLUT.push_back(tmp[0]);
+                entries[s] = packKnotInfo(knotPointDeficit,knotWeightAtBDeficit,nrActiveRows,isOrbital);
             }
+            table->save(fileName, tag, parent.getWidth(), knotInfoVersion);
         }
+        knotInfoLUT = table;
     }
     else throw KeccakException("implementation of KnotInfoLUT for LC is under construction");
 }
@@ -144,7 +247,7 @@ UINT8 TrailCore3Rounds::packKnotInfo(unsigned int knotPointDeficit,unsigned int
 
 void TrailCore3Rounds::populateKnotInfo(KnotInformation& aKnotInfo,const SliceValue& aSliceValue, bool knotHasSinglePoint, bool hasBackground) const
 {
-    unsigned int tmp            = knotInfoLUT[aSliceValue];
+    unsigned int tmp            = (*knotInfoLUT)[aSliceValue];
     aKnotInfo.isOrbital         = (1 == (tmp&1));
     if (hasBackground && knotHasSinglePoint){
         aKnotInfo.nrActiveRows         = 1;
@@ -290,31 +393,13 @@ bool TrailCore3Rounds::nextChain()
                 pB = chains.back()[0];
                 removePoint(true);
             }
-            do {
-                if ((!pBisInitialized) || (!pB.nextXY())) {
-                    if (pBisInitialized && (knots.size() == 0)) return false; // implying this is the start point of first chain and the background is zero in which case the first chain shall start in slice 0
-                    pB.x = 0;
-                    pB.y = 0;
-                    if (startPointWorkingChainIsFree) {
-                        // If the start point can be freely chosen, we simply run through the different z coordinates.
-                        if (!pBisInitialized) {
-                            pB.z = 0;
-                            pBisInitialized = true;
-                        }
-                        else
-                            pB.z = pB.z + 1;
-                        if (pB.z == laneSize) return false;
-                    }
-                    else {
-                        // Otherwise, we rely on mayBeStartPointSliceAndGoThere().
-                        if (!mayBeStartPointSliceAndGoThere(pB.z, pBisInitialized)) return false;
-                        pBisInitialized = true;
-                    }
-                }
+            if (isFirstChainStartPointFixed && (chains.size() == 1)) {
+                // The start point of the first chain is given, so there is no other one to try.
+                if (pBisInitialized) return false;
+                pB.set(firstChainStartPoint.x, firstChainStartPoint.y, firstChainStartPoint.z);
             }
-            while((getBit(stateAtB, pB) != 0)  ||   // shall not collide with existing point
-                  (getBit(tabooAtB, pB) != 0)  ||   // shall not be in the taboo zone
-                  ( (stateAtB[pB.z] != 0) && (knots.count(pB.z) == 0) ) );  // shall not be in an orbital slice
+            else if (!nextStartPoint(pB, pBisInitialized))
+                return false;
             addPoint(pB, true);
             updateMinimumWorkingChainLength(); 
         }
@@ -322,9 +407,53 @@ bool TrailCore3Rounds::nextChain()
     while(true);
 }
 
+bool TrailCore3Rounds::nextStartPoint(BitPosition& pB, bool pBisInitialized)
+{
+    do {
+        if ((!pBisInitialized) || (!pB.nextXY())) {
+            if (pBisInitialized && (knots.size() == 0)) return false; // implying this is the start point of first chain and the background is zero in which case the first chain shall start in slice 0
+            pB.x = 0;
+            pB.y = 0;
+            if (startPointWorkingChainIsFree) {
+                // If the start point can be freely chosen, we simply run through the different z coordinates.
+                if (!pBisInitialized) {
+                    pB.z = 0;
+                    pBisInitialized = true;
+                }
+                else
+                    pB.z = pB.z + 1;
+                if (pB.z == laneSize) return false;
+            }
+            else {
+                // Otherwise, we rely on mayBeStartPointSliceAndGoThere().
+                if (!mayBeStartPointSliceAndGoThere(pB.z, pBisInitialized)) return false;
+                pBisInitialized = true;
+            }
+        }
+    }
+    while((getBit(stateAtB, pB) != 0)  ||   // shall not collide with existing point
+          (getBit(tabooAtB, pB) != 0)  ||   // shall not be in the taboo zone
+          ( (stateAtB[pB.z] != 0) && (knots.count(pB.z) == 0) ) );  // shall not be in an orbital slice
+    return true;
+}
+
+void TrailCore3Rounds::getFirstChainStartPoints(vector<BitPosition>& startPoints)
+{
+    startPoints.clear();
+    // Same conditions as in nextWithKnots() when the first chain is pushed.
+    if (!(knots.empty() || canAffordAddingChain())) return;
+    startPointWorkingChainIsFree = canAffordGeneric(2, 1, minimumWorkingChainLength - 2, minimumWorkingChainLength - 2);
+    BitPosition pB;
+    bool pBisInitialized = false;
+    while(nextStartPoint(pB, pBisInitialized)) {
+        startPoints.push_back(pB);
+        pBisInitialized = true;
+    }
+}
+
 bool TrailCore3Rounds::nextWithKnots()
 {
-    if ((!knots.empty()) && chains.empty() && isStateAtBWellFormed()) return true; // this deals with non-zero backgrounds that result in a well-formed state at B
+    if ((!isFirstChainStartPointFixed) && (!knots.empty()) && chains.empty() && isStateAtBWellFormed()) return true; // this deals with non-zero backgrounds that result in a well-formed state at B
     do {
         if (knots.empty() || (canAffordAddingChain())) {
             chains.push_back(vector<BitPosition>());
@@ -390,22 +519,45 @@ void TrailCore3Rounds::removeVortexPoint(vector<BitPosition >& chainAtB,
     yOffset.pop_back();
 }
 
-void TrailCore3Rounds::addVortexToBaseIfMinimal(const vector<BitPosition >& chainAtB, unsigned int theNrActiveRowsAtA, unsigned int theNrActiveRowsAtD)
+void TrailCore3Rounds::addVortexToBaseIfMinimal(const vector<BitPosition >& chainAtB, unsigned int theNrActiveRowsAtA, unsigned int theNrActiveRowsAtD,
+                                                vector<vector<VortexBase::VortexToAdd> >& vorticesPerLength) const
 {
     vector<SliceValue> workState(laneSize,0);
     for (unsigned int i=0 ; i<chainAtB.size() ; i++) setBitToOne(workState,chainAtB[i]);
 
     if ((chainAtB[0] < chainAtB.back()) && (isMinimalSymmetrically(workState))) {
-        while(2*vortexBase.size() <= chainAtB.size()) vortexBase.push_back(vector<VortexInfo>(0));
-        VortexInfo workVortexInfo;
-        workVortexInfo.nrActiveRowsAtA = theNrActiveRowsAtA;
-        workVortexInfo.nrActiveRowsAtD = theNrActiveRowsAtD;
-        for(unsigned int i=0 ; i<chainAtB.size() ; i++) workVortexInfo.stateAtB.setBitToOne(chainAtB[i]);
-        vortexBase[chainAtB.size()/2].push_back(workVortexInfo);
+        while(2*vorticesPerLength.size() <= chainAtB.size()) vorticesPerLength.push_back(vector<VortexBase::VortexToAdd>(0));
+        VortexBase::VortexToAdd workVortex;
+        workVortex.nrActiveRowsAtA = theNrActiveRowsAtA;
+        workVortex.nrActiveRowsAtD = theNrActiveRowsAtD;
+        for(unsigned int z=0 ; z<laneSize ; z++) 
+            if (workState[z] != 0) {
+                VortexBase::Slice slice;
+                slice.z = z;
+                slice.value = workState[z];
+                workVortex.slicesAtB.push_back(slice);
+            }
+        vorticesPerLength[chainAtB.size()/2].push_back(workVortex);
     }
 }
 
 void TrailCore3Rounds::initializeVortexBase()
+{
+    shared_ptr<VortexBase> base(new VortexBase());
+    stringstream suffix, tag;
+    suffix << "-vortexBase-" << maxWeight << ".cache";
+    tag << "vortexBase-" << maxWeight;
+    string fileName = parent.buildFileName("", suffix.str());
+    if (!base->load(fileName, tag.str(), parent.getWidth())) {
+        vector<vector<VortexBase::VortexToAdd> > vorticesPerLength;
+        searchVortices(vorticesPerLength);
+        base->build(vorticesPerLength);
+        base->save(fileName, tag.str(), parent.getWidth());
+    }
+    vortexBase = base;
+}
+
+void TrailCore3Rounds::searchVortices(vector<vector<VortexBase::VortexToAdd> >& vorticesPerLength) const
 {
     vector<BitPosition> chainAtB;
     vector<unsigned int> yOffset;
@@ -444,7 +596,7 @@ void TrailCore3Rounds::initializeVortexBase()
             else if ((pB.z == chainAtB[0].z) && (pB.x == chainAtB[0].x) && (pB.y != chainAtB[0].y)) { // we have hit a vortex
                 addVortexPoint(pB,chainAtB,yOffset,rowsAtA,rowsAtD,slicesAtB);
                 if (2*chainAtB.size() + 2*rowsAtA.size() + 2*rowsAtD.size() <= maxWeight) {
-                    addVortexToBaseIfMinimal(chainAtB,rowsAtA.size(),rowsAtD.size());
+                    addVortexToBaseIfMinimal(chainAtB,rowsAtA.size(),rowsAtD.size(),vorticesPerLength);
                 }
                 removeVortexPoint(chainAtB,yOffset,rowsAtA,rowsAtD,slicesAtB); // after storing the vortex, remove the last point of the working chain
             }
@@ -20,6 +20,8 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #include "Keccak-fPropagation.h"
 #include "Keccak-fState.h"
 #include "Keccak-fDCLC.h"
+#include "tablecache.h"
+#include <memory>
 #include <stack>
 #include <set>
 
@@ -41,15 +43,110 @@ struct KnotInformation {
     unsigned int knotWeightAtBDeficit; 
 };
 
+/** Class that holds a database of vortices, read-only once built.
+  * The vortices are grouped by length and flattened into contiguous arrays,
+  * each vortex pointing to the list of its slices at B,
+  * so that the database can be saved in a CachedTable and memory-mapped 
+  * from the cache file by later runs and by concurrent processes.
+  * The table is a sequence of 32-bit words: the number of lengths, the total number of slices, 
+  * the index of the first vortex for each length (plus one past the last), 
+  * the vortices as Vortex structs and the slices as Slice structs.
+  */
+class VortexBase {
+public:
+    /** Struct that groups information about a vortex, useful when adding vortices to tame states.
+      */
+    struct Vortex {
+        /** Number of active rows at A.
+          */
+        UINT32 nrActiveRowsAtA;
+        /** Number of active rows at D, assuming C is in the kernel.
+          */
+        UINT32 nrActiveRowsAtD;
+        /** Index of the first slice of the vortex at B.
+          */
+        UINT32 firstSlice;
+        /** Number of slices of the vortex at B.
+          */
+        UINT32 nrSlices;
+    };
+    /** Struct that contains an active slice of a vortex at B.
+      */
+    struct Slice {
+        /** The z coordinate of the slice.
+          */
+        UINT32 z;
+        /** The value of the slice.
+          */
+        SliceValue value;
+    };
+    /** Struct that contains a vortex as found when building the database.
+      */
+    struct VortexToAdd {
+        /** Number of active rows at A.
+          */
+        unsigned int nrActiveRowsAtA;
+        /** Number of active rows at D, assuming C is in the kernel.
+          */
+        unsigned int nrActiveRowsAtD;
+        /** The active slices at B, in increasing order of z.
+          */
+        vector<Slice> slicesAtB;
+    };
+protected:
+    CachedTable table;
+    UINT32 nrLengths;
+    const UINT32 *firstVortexPerLength;
+    const Vortex *vortices;
+    const Slice *slices;
+public:
+    /** The constructor of an empty database. */
+    VortexBase();
+    /** This method attempts to load the database from a cache file.
+      * @param  fileName    The name of the cache file.
+      * @param  tag         A short string (at most 31 characters) identifying the database.
+      * @param  width       The Keccak-<i>f</i> width the database was built for.
+      * @return True iff the file exists, its header matches the parameters and its contents are consistent.
+      */
+    bool load(const string& fileName, const string& tag, unsigned int width);
+    /** This method builds the database.
+      * @param  vorticesPerLength   Element u contains the vortices of length 2*u.
+      */
+    void build(const vector<vector<VortexToAdd> >& vorticesPerLength);
+    /** This method saves the database to a cache file.
+      * See CachedTable::save().
+      */
+    bool save(const string& fileName, const string& tag, unsigned int width) const;
+    /** This method returns the number of vortex lengths in the database, i.e., 
+      * the vortices have lengths 2*u with u < size().
+      */
+    inline unsigned int size() const { return nrLengths; }
+    /** This method returns the number of vortices of length 2*u. */
+    inline unsigned int getNumberOfVortices(unsigned int u) const { return firstVortexPerLength[u+1] - firstVortexPerLength[u]; }
+    /** This method returns the vortex with index i among those of length 2*u. */
+    inline const Vortex& getVortex(unsigned int u, unsigned int i) const { return vortices[firstVortexPerLength[u] + i]; }
+    /** This method returns a pointer to the first slice at B of the given vortex. */
+    inline const Slice *beginSlices(const Vortex& vortex) const { return slices + vortex.firstSlice; }
+    /** This method returns a pointer past the last slice at B of the given vortex. */
+    inline const Slice *endSlices(const Vortex& vortex) const { return slices + vortex.firstSlice + vortex.nrSlices; }
+private:
+    bool setPointers();
+    VortexBase(const VortexBase&);
+    VortexBase& operator=(const VortexBase&);
+};
+
 /** Class that implements an iterator over trail seeds for light 3-round trails, given a background. 
   */
 class TrailCore3Rounds  : public KeccakFPropagation
 {
 protected:
 
-    /** Vector with element i containing information about the slice with value i, relevant when it is a knot.
+    /** Table with element i containing information about the slice with value i, relevant when it is a knot.
+      * It is memory-mapped from the cache file given by buildFileName("", "-knotInfo.cache")
+      * if available, and computed (and saved to this file) otherwise.
+      * It is shared by the copies of this object.
       */
-    vector<UINT8> knotInfoLUT;
+    shared_ptr<const CachedTable> knotInfoLUT;
 
     /** Maximum lower weight of 3-round trail cores to be generated.
       */
@@ -124,24 +221,21 @@ protected:
       */
     unsigned int hammingWeightAtA;
 
-    /** Struct that groups information about a vortex, useful when adding vortices to tame tame states. 
+    /** Database of all vortices that lead to 3-round trail cores with weight not above maxWeight.
+      * It is memory-mapped from a cache file specific to the width and maxWeight, if available,
+      * and built (and saved to this file) otherwise.
+      * It is shared by the copies of this object.
       */
-    struct VortexInfo {
-        /** State at B. 
-          */
-        SparseStateAsSlices stateAtB;
-        /** Number of active rows at A. 
-          */
-        unsigned int nrActiveRowsAtA;
-        /** Number of active rows at D, assuming C is in the kernel.
-          */
-        unsigned int nrActiveRowsAtD;
-    };
+    shared_ptr<const VortexBase> vortexBase;
 
-    /** Database of all vortices that lead to 3-round trail cores with weight not above maxWeight.
-      * Vortex[u][v] contains a vortex of length 2*u, v is just an index and has no special significance.
+    /** This attribute indicates whether the start point of the first chain is fixed to firstChainStartPoint,
+      * so that the iteration covers only the states whose first chain starts there.
+      */
+    bool isFirstChainStartPointFixed;
+
+    /** The start point at B of the first chain, if isFirstChainStartPointFixed is true.
       */
-    vector<vector<VortexInfo> > vortexBase;
+    BitPosition firstChainStartPoint;
 
 protected:
     /** This method builds the table knotInfoLUT 
@@ -196,14 +290,21 @@ protected:
                            map<RowPosition,unsigned int>& rowsAtD,
                            map<unsigned int,unsigned int>& slicesAtB) const;
 
-    /** This method adds a vortex to vortexBase, provided the corresponding state at B is minimal in z
+    /** This method adds a vortex to the list in parameter, provided the corresponding state at B is minimal in z
       * @param   chainAtB  Chain containing the coordinates of the vortex points at B.
       * @param   nrActiveRowsAtA  self-explanatory.
       * @param   nrActiveRowsAtD  self-explanatory.
+      * @param   vorticesPerLength  The vortices found so far, per length divided by 2.
       */
     void addVortexToBaseIfMinimal(const vector<BitPosition>& pointsAtB,
                                   unsigned int nrActiveRowsAtA,
-                                  unsigned int nrActiveRowsAtD);
+                                  unsigned int nrActiveRowsAtD,
+                                  vector<vector<VortexBase::VortexToAdd> >& vorticesPerLength) const;
+
+    /** This method looks for all vortices up to and including maxWeight.
+      * @param   vorticesPerLength  The vortices found, per length divided by 2.
+      */
+    void searchVortices(vector<vector<VortexBase::VortexToAdd> >& vorticesPerLength) const;
 
     /** This method assures the vortexBase contains all vortices up to and including maxWeight.
       */
@@ -281,6 +382,22 @@ protected:
       */
     bool nextChain();
 
+    /** This method iterates the start point of the working chain, which is assumed to be empty.
+      * The start point shall not collide with an active point, lie in the taboo zone or in an orbital slice.
+      * @param   pB                 The start point. If @a pBisInitialized is true, it contains
+      *                             the current start point from which to look for the next one.
+      * @param   pBisInitialized    Whether pB is already initialized.
+      *                             If set to false, it looks for the first start point.
+      * @return        Whether a next start point was found.
+      */
+    bool nextStartPoint(BitPosition& pB, bool pBisInitialized);
+
+    /** This method lists the start points that the first chain can have, in the order nextChain() tries them.
+      * It must be called before the iteration starts.
+      * @param   startPoints    The resulting list of start points at B.
+      */
+    void getFirstChainStartPoints(vector<BitPosition>& startPoints);
+
     /** This method updates the minimum required length of the working chain.
       */
     void updateMinimumWorkingChainLength();
@@ -314,6 +431,13 @@ public:
                     unsigned int aMaxWeight,
                     const KeccakFDCLC& aParent,
                     KeccakFPropagation::DCorLC aDCorLC);
+
+    /** Copy constructor. The propagation tables are built again for the copy
+      * and the search state is copied, while the knot information and the vortex base are shared,
+      * so that the copy can be iterated independently, e.g., by another thread.
+      * @param   other  The object to copy.
+      */
+    TrailCore3Rounds(const TrailCore3Rounds& other);
 };
 
 #endif
@@ -13,12 +13,49 @@ and related or neighboring rights to the source code in this file.
 http://creativecommons.org/publicdomain/zero/1.0/
 */
 
+#include <atomic>
+#include <sstream>
 #include "Keccak-fDisplay.h"
 #include "Keccak-fTrailCoreInKernelAtC.h"
 #include "translationsymmetry.h"
 
 using namespace std; 
 
+void TrailCoreInKernelAtCWorkItem::save(ostream& fout) const
+{
+    if (type == firstVortex)
+        fout << dec << "v " << vortexLength << " " << vortexIndex << endl;
+    else if (type == backgroundOnly)
+        fout << "b" << endl;
+    else
+        fout << dec << "c " << startPoint.x << " " << startPoint.y << " " << startPoint.z << endl;
+}
+
+void TrailCoreInKernelAtCWorkItem::load(istream& fin)
+{
+    string line;
+    if (!getline(fin, line))
+        throw TrailException("TrailCoreInKernelAtCWorkItem::load(): no work item to read.");
+    stringstream str(line);
+    string tag;
+    if (!(str >> tag))
+        throw TrailException("TrailCoreInKernelAtCWorkItem::load(): invalid work item.");
+    if (tag == "v") {
+        type = firstVortex;
+        if ((!(str >> dec >> vortexLength >> vortexIndex)) || ((vortexLength%2) != 0))
+            throw TrailException("TrailCoreInKernelAtCWorkItem::load(): invalid work item.");
+    }
+    else if (tag == "b")
+        type = backgroundOnly;
+    else if (tag == "c") {
+        type = firstChain;
+        if ((!(str >> dec >> startPoint.x >> startPoint.y >> startPoint.z)) || (startPoint.x >= 5) || (startPoint.y >= 5))
+            throw TrailException("TrailCoreInKernelAtCWorkItem::load(): invalid work item.");
+    }
+    else
+        throw TrailException("TrailCoreInKernelAtCWorkItem::load(): invalid work item.");
+}
+
 TrailCoreInKernelAtC::TrailCoreInKernelAtC(const vector<SliceValue>& backgroundAtA,
                                            const vector<SliceValue>& aTabooAtB,
                                            unsigned int aMaxWeight,
@@ -36,6 +73,10 @@ TrailCoreInKernelAtC::TrailCoreInKernelAtC(const vector<SliceValue>& backgroundA
     partialHammingWeightAtD = 0; 
     partialNrActiveRowsAtD = 0;  
 
+    isRestricted = false;
+    firstVortexPending = false;
+    rootVisited = false;
+
     populateStatesWithBackground(backgroundAtA);
 
     nrActiveRowsAtA  = getNrActiveRows(stateAtA);
@@ -118,9 +159,7 @@ void TrailCoreInKernelAtC::addPoint(const BitPosition& pB, bool toKnotSlice, boo
 
     // Dealing with the impact at B and D
     if (toKnotSlice) {
-        weightAtB -= getWeight(stateAtB[pB.z]);
-        setBitToOne(stateAtB, pB);
-        weightAtB += getWeight(stateAtB[pB.z]);
+        weightAtB += setBitToOneAndGetDeltaWeight(stateAtB, pB);
 
         KnotInformation newKnotInfo;
         bool hasBackground = (knotsWithBackground.count(pB.z) != 0);
@@ -187,9 +226,7 @@ void TrailCoreInKernelAtC::removePoint(bool fromKnotSlice)
             knots.erase(pB.z);
         }
         else {
-            weightAtB -= getWeight(stateAtB[pB.z]);
-            setBitToZero(stateAtB, pB);
-            weightAtB += getWeight(stateAtB[pB.z]);
+            weightAtB += setBitToZeroAndGetDeltaWeight(stateAtB, pB);
 
             KnotInformation oldKnotInfo = knots[pB.z];
             KnotInformation updatedKnotInfo;
@@ -254,7 +291,7 @@ bool TrailCoreInKernelAtC::mayBeStartPointSliceAndGoThere(unsigned int& z, bool
 
 unsigned int TrailCoreInKernelAtC::computeLowerWeightAssumingVortexIsAdded()
 {
-    const VortexInfo& v = vortexBase[outCore.back().vortexLength/2][outCore.back().vortexIndex];
+    const VortexBase::Vortex& v = vortexBase->getVortex(outCore.back().vortexLength/2, outCore.back().vortexIndex);
 
     unsigned int localNrActiveRowsAtA = max(outCore.back().nrActiveRowsAtA, v.nrActiveRowsAtA);
     unsigned int localLowerWeight = getLowerBoundOnReverseWeightGivenHammingWeightAndNrActiveRows(
@@ -275,7 +312,9 @@ bool TrailCoreInKernelAtC::next()
 {
     do {
         if (outCore.empty()){
+            if (isRestricted && (workItem.type != TrailCoreInKernelAtCWorkItem::firstChain) && rootVisited) return false;
             if (!nextWithKnots()) return false;
+            rootVisited = true;
             CoreInfo workCoreInfo;
             
             workCoreInfo.hammingWeightAtA = hammingWeightAtA;
@@ -308,20 +347,27 @@ bool TrailCoreInKernelAtC::next()
         }
         else {
             bool foundGoodVortexToAdd = true;
-            if ((!knots.empty() || (outCore.size() > 1)) && // In absence of knots, the first vortex has a fixed position: vortexZOffset = 0
-                    (outCore.back().vortexIndex < vortexBase[outCore.back().vortexLength/2].size()) &&  // vortexIndex must point to an existing entry
+            if (firstVortexPending) // The first vortex is given by the work item and is tried as is.
+                firstVortexPending = false;
+            else if (isRestricted && (workItem.type == TrailCoreInKernelAtCWorkItem::firstVortex) && (outCore.size() == 1)) {
+                // The first vortex is given by the work item, so there is no other one to try.
+                outCore.pop_back();
+                foundGoodVortexToAdd = false;
+            }
+            else if ((!knots.empty() || (outCore.size() > 1)) && // In absence of knots, the first vortex has a fixed position: vortexZOffset = 0
+                    (outCore.back().vortexIndex < vortexBase->getNumberOfVortices(outCore.back().vortexLength/2)) &&  // vortexIndex must point to an existing entry
                     (outCore.back().vortexZOffset < laneSize-1)) { 
                 outCore.back().vortexZOffset += 1;
                 if ((outCore.size() > 1) && 
                         (outCore[0].vortexLength == outCore.back().vortexLength) && 
                         (outCore[0].vortexIndex  == outCore.back().vortexIndex ))   {
-                    vector<unsigned int> zPattern(laneSize, 0);
+                    UINT64 zPattern = 0;
                     for (unsigned int i=0 ; i<outCore.size() ; i++)
-                        zPattern[outCore[i].vortexZOffset] = 1;
-                    foundGoodVortexToAdd = isMinimalSymmetrically(zPattern);
+                        zPattern |= (UINT64)1 << outCore[i].vortexZOffset;
+                    foundGoodVortexToAdd = isMinimalSymmetricallyPacked(zPattern, laneSize);
                 }
             }
-            else if ((int)outCore.back().vortexIndex < (int)vortexBase[outCore.back().vortexLength/2].size()-1) {
+            else if ((int)outCore.back().vortexIndex < (int)vortexBase->getNumberOfVortices(outCore.back().vortexLength/2)-1) {
                 outCore.back().vortexZOffset = 0;
                 outCore.back().vortexIndex += 1;
             }
@@ -329,11 +375,11 @@ bool TrailCoreInKernelAtC::next()
                 outCore.back().vortexZOffset = 0;
                 outCore.back().vortexIndex = 0;
                 outCore.back().vortexLength += 2;
-                if (outCore.back().vortexLength/2 >= vortexBase.size()) {
+                if (outCore.back().vortexLength/2 >= vortexBase->size()) {
                     outCore.pop_back();
                     foundGoodVortexToAdd = false;
                 }
-                else if (vortexBase[outCore.back().vortexLength/2].empty())
+                else if (vortexBase->getNumberOfVortices(outCore.back().vortexLength/2) == 0)
                     foundGoodVortexToAdd = false;
                 else if (outCore.back().partialWeight + 2*outCore.back().vortexLength > maxWeight) {
                     outCore.pop_back();
@@ -343,23 +389,25 @@ bool TrailCoreInKernelAtC::next()
 
             if (foundGoodVortexToAdd) { 
                 foundGoodVortexToAdd = foundGoodVortexToAdd && (computeLowerWeightAssumingVortexIsAdded() <= maxWeight);
-                const VortexInfo& v = vortexBase[outCore.back().vortexLength/2][outCore.back().vortexIndex];
+                const VortexBase::Vortex& v = vortexBase->getVortex(outCore.back().vortexLength/2, outCore.back().vortexIndex);
                 if (foundGoodVortexToAdd) { // Now test the vortex to add for overlap with the state up to now and its tabooAtB
-                    map<unsigned int,SliceValue>::const_iterator it = v.stateAtB.slices.begin();
-                    while (foundGoodVortexToAdd && (it != v.stateAtB.slices.end())){
-                        unsigned int localZ = ((it->first)+outCore.back().vortexZOffset)%laneSize;
+                    const VortexBase::Slice *it = vortexBase->beginSlices(v);
+                    const VortexBase::Slice *end = vortexBase->endSlices(v);
+                    while (foundGoodVortexToAdd && (it != end)){
+                        unsigned int localZ = ((it->z)+outCore.back().vortexZOffset)%laneSize;
                         foundGoodVortexToAdd = (outCore.back().stateAtB[localZ] == 0);
-                        foundGoodVortexToAdd = foundGoodVortexToAdd  && (((tabooAtB[localZ])&(it->second)) == 0);
+                        foundGoodVortexToAdd = foundGoodVortexToAdd  && (((tabooAtB[localZ])&(it->value)) == 0);
                         it++;
                     }
                 }
                 if (foundGoodVortexToAdd) { // Now really adding the vortex
                     outCore.push_back(outCore.back());
-                    map<unsigned int,SliceValue>::const_iterator it = v.stateAtB.slices.begin();
-                    while (it != v.stateAtB.slices.end()){
-                        unsigned int localZ = ((it->first)+outCore.back().vortexZOffset)%laneSize;
-                        outCore.back().stateAtB[localZ] = it->second;
-                        outCore.back().partialStateAtC[localZ] = it->second;
+                    const VortexBase::Slice *it = vortexBase->beginSlices(v);
+                    const VortexBase::Slice *end = vortexBase->endSlices(v);
+                    while (it != end){
+                        unsigned int localZ = ((it->z)+outCore.back().vortexZOffset)%laneSize;
+                        outCore.back().stateAtB[localZ] = it->value;
+                        outCore.back().partialStateAtC[localZ] = it->value;
                         it++;
                     }
                     outCore.back().weightAtB += 2*outCore.back().vortexLength;
@@ -391,6 +439,111 @@ const TrailCoreInKernelAtC::CoreInfo& TrailCoreInKernelAtC::getTopCoreInfo() con
     return outCore.back();
 }
 
+void TrailCoreInKernelAtC::getTrail(Trail& trail) const
+{
+    const CoreInfo& core = outCore.back();
+    vector<SliceValue> localStateAtA(laneSize);
+    reverseLambda(core.stateAtB, localStateAtA);
+    trail.clear();
+    trail.setFirstStateReverseMinimumWeight(getMinReverseWeight(localStateAtA));
+    trail.append(core.stateAtB, core.weightAtB);
+}
+
+void TrailCoreInKernelAtC::getWorkItems(vector<TrailCoreInKernelAtCWorkItem>& items)
+{
+    items.clear();
+    // The vortices added to the empty state, in the order next() tries them.
+    if (!outCore.empty()) {
+        for(unsigned int u=1; (u<vortexBase->size()) && (outCore[0].partialWeight + 4*u <= maxWeight); u++)
+            for(unsigned int i=0; i<vortexBase->getNumberOfVortices(u); i++)
+                items.push_back(TrailCoreInKernelAtCWorkItem(2*u, i));
+    }
+    if ((!knots.empty()) && isStateAtBWellFormed())
+        items.push_back(TrailCoreInKernelAtCWorkItem());
+    vector<BitPosition> startPoints;
+    getFirstChainStartPoints(startPoints);
+    for(unsigned int i=0; i<startPoints.size(); i++)
+        items.push_back(TrailCoreInKernelAtCWorkItem(startPoints[i]));
+}
+
+void TrailCoreInKernelAtC::setWorkItem(const TrailCoreInKernelAtCWorkItem& item)
+{
+    isRestricted = true;
+    workItem = item;
+    if (item.type == TrailCoreInKernelAtCWorkItem::firstVortex) {
+        if (outCore.empty())
+            throw TrailException("TrailCoreInKernelAtC::setWorkItem(): a first vortex requires a zero background.");
+        if ((item.vortexLength/2 >= vortexBase->size()) || (item.vortexIndex >= vortexBase->getNumberOfVortices(item.vortexLength/2)))
+            throw TrailException("TrailCoreInKernelAtC::setWorkItem(): the vortex is not in the vortex base.");
+        outCore.resize(1);
+        outCore[0].vortexLength = item.vortexLength;
+        outCore[0].vortexIndex = item.vortexIndex;
+        outCore[0].vortexZOffset = 0;
+        firstVortexPending = true;
+        rootVisited = true;
+    }
+    else {
+        outCore.clear();
+        rootVisited = false;
+        if (item.type == TrailCoreInKernelAtCWorkItem::firstChain) {
+            if ((item.startPoint.z >= laneSize) || (getBit(stateAtB, item.startPoint) != 0) || (getBit(tabooAtB, item.startPoint) != 0))
+                throw TrailException("TrailCoreInKernelAtC::setWorkItem(): invalid start point for the first chain.");
+            isFirstChainStartPointFixed = true;
+            firstChainStartPoint.set(item.startPoint.x, item.startPoint.y, item.startPoint.z);
+        }
+    }
+}
+
+/** This task explores one part of the search with its own copy of the TrailCoreInKernelAtC object.
+  */
+class TrailCoresInKernelAtCTask : public Task {
+protected:
+    const TrailCoreInKernelAtC& prototype;
+    TrailCoreInKernelAtCWorkItem item;
+    TrailFetcher& trailsOut;
+    atomic<UINT64>& count;
+public:
+    TrailCoresInKernelAtCTask(const TrailCoreInKernelAtC& aPrototype, const TrailCoreInKernelAtCWorkItem& anItem,
+        TrailFetcher& aTrailsOut, atomic<UINT64>& aCount)
+        : prototype(aPrototype), item(anItem), trailsOut(aTrailsOut), count(aCount) {}
+    void run()
+    {
+        TrailCoreInKernelAtC search(prototype);
+        search.setWorkItem(item);
+        Trail trail;
+        UINT64 n = 0;
+        while(search.next()) {
+            search.getTrail(trail);
+            trailsOut.fetchTrail(trail);
+            n++;
+        }
+        count += n;
+    }
+};
+
+UINT64 generateThreeRoundTrailCoresInKernelAtC(const vector<SliceValue>& backgroundAtA,
+                                               const vector<SliceValue>& aTabooAtB,
+                                               unsigned int aMaxWeight,
+                                               const KeccakFDCLC& aParent,
+                                               KeccakFPropagation::DCorLC aDCorLC,
+                                               TrailFetcher& trailsOut,
+                                               unsigned int nrThreads)
+{
+    if (nrThreads == 0)
+        nrThreads = 1;
+    TrailCoreInKernelAtC prototype(backgroundAtA, aTabooAtB, aMaxWeight, aParent, aDCorLC);
+    vector<TrailCoreInKernelAtCWorkItem> items;
+    prototype.getWorkItems(items);
+    SynchronizedTrailFetcher synchronizedTrailsOut(trailsOut);
+    TrailFetcher& sharedTrailsOut = trailsOut.isThreadSafe() ? trailsOut : synchronizedTrailsOut;
+    atomic<UINT64> count(0);
+    TaskScheduler tasks(nrThreads);
+    for(unsigned int j=0; j<items.size(); j++)
+        tasks.submit(new TrailCoresInKernelAtCTask(prototype, items[j], sharedTrailsOut, count));
+    tasks.wait();
+    return count;
+}
+
 ostream& operator<<(ostream& fout, const TrailCoreInKernelAtC& aL)
 {
     for(unsigned int chainNr = 0 ; chainNr < aL.chains.size() ; chainNr++) {
@@ -20,9 +20,52 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #include "Keccak-fTrailCore3Rounds.h"
 #include "Keccak-fState.h"
 #include "Keccak-fDCLC.h"
+#include "Keccak-fTrails.h"
+#include "taskscheduler.h"
+#include <iostream>
 #include <stack>
 #include <set>
 
+/** This class describes a part of the search of TrailCoreInKernelAtC that can be explored independently.
+  * The search is partitioned by its root, which is either
+  * - the first vortex from vortexBase added to the empty state, when the background is zero;
+  * - the background alone, when it is already well formed;
+  * - or the start point at B of the first chain.
+  * Work items can be saved and loaded as text, so that an interrupted search can be resumed
+  * with the items not yet explored.
+  */
+class TrailCoreInKernelAtCWorkItem {
+public:
+    /** The kind of root of the part of the search. */
+    enum Type { firstVortex = 0, backgroundOnly = 1, firstChain = 2 };
+    /** The kind of root. */
+    Type type;
+    /** If type is firstVortex, the length of the first vortex. */
+    unsigned int vortexLength;
+    /** If type is firstVortex, the index of the first vortex among those of length vortexLength in vortexBase. */
+    unsigned int vortexIndex;
+    /** If type is firstChain, the start point at B of the first chain. */
+    BitPosition startPoint;
+public:
+    /** The default constructor, for the background alone. */
+    TrailCoreInKernelAtCWorkItem() : type(backgroundOnly), vortexLength(0), vortexIndex(0) {}
+    /** The constructor for a first vortex. */
+    TrailCoreInKernelAtCWorkItem(unsigned int aVortexLength, unsigned int aVortexIndex)
+        : type(firstVortex), vortexLength(aVortexLength), vortexIndex(aVortexIndex) {}
+    /** The constructor for a first chain start point. */
+    TrailCoreInKernelAtCWorkItem(const BitPosition& aStartPoint)
+        : type(firstChain), vortexLength(0), vortexIndex(0), startPoint(aStartPoint) {}
+    /** This method saves the work item on one line.
+      * @param  fout    The stream to save to.
+      */
+    void save(ostream& fout) const;
+    /** This method loads a work item saved by save().
+      * An exception TrailException is thrown if the line is not a valid work item.
+      * @param  fin     The stream to load from.
+      */
+    void load(istream& fin);
+};
+
 
 /** Class that implements an iterator over states leading to low weight three round trail cores with C in the kernel
   */
@@ -91,7 +134,7 @@ protected:
        /** Length of the vortex to be added.
          */
         unsigned int vortexLength;
-       /** Index of the vortex to be added in vortexBase[vortexLength/2].
+       /** Index of the vortex to be added among those of length vortexLength in vortexBase.
          */
         unsigned int vortexIndex;
        /** Z offset by which the vortex to be added must be translated.
@@ -105,6 +148,22 @@ protected:
       */
     vector<CoreInfo> outCore;
 
+    /** Whether the iteration is restricted to the part of the search given by workItem.
+      */
+    bool isRestricted;
+
+    /** The part of the search to which the iteration is restricted, if isRestricted is true.
+      */
+    TrailCoreInKernelAtCWorkItem workItem;
+
+    /** Whether the first vortex given by workItem has yet to be tried.
+      */
+    bool firstVortexPending;
+
+    /** Whether the root given by workItem was already visited.
+      */
+    bool rootVisited;
+
 
 protected:
 
@@ -169,10 +228,59 @@ public:
     /** This method returns a constant reference to the current vortex being iterated.
      */
     const CoreInfo& getTopCoreInfo() const;
+
+    /** This method gives the current trail core as a trail,
+      * made of the minimum reverse weight of the state at A and the state at B.
+      * As partialStateAtC only bounds the state at C, the state at D is not included:
+      * the three-round trail cores are obtained by extending this trail forward by one round,
+      * e.g., with KeccakFTrailExtension::forwardExtendTrails().
+      * @param   trail  The trail to fill.
+      */
+    void getTrail(Trail& trail) const;
+
+    /** This method splits the search into independent parts, one per possible first vortex,
+      * per possible start point of the first chain and, if well formed, the background alone.
+      * It must be called before the iteration starts.
+      * @param   items  The resulting work items.
+      */
+    void getWorkItems(vector<TrailCoreInKernelAtCWorkItem>& items);
+
+    /** This method restricts the iteration to a part of the search.
+      * It must be called before the iteration starts.
+      * An exception TrailException is thrown if the work item does not apply to this search.
+      * @param   item   The work item, e.g., as given by getWorkItems().
+      */
+    void setWorkItem(const TrailCoreInKernelAtCWorkItem& item);
     
     /** This function displays the attributes of the TrailCoreInKernelAtC object.
       */
     friend ostream& operator<<(ostream& fout, const TrailCoreInKernelAtC& aL);
 };
 
+/** This function generates all the three-round trail cores with C in the kernel
+  * up to a given weight, as TrailCoreInKernelAtC does, using several threads.
+  * The search is split with TrailCoreInKernelAtC::getWorkItems(),
+  * and each part is a task for a TaskScheduler, which explores it 
+  * with its own copy of the TrailCoreInKernelAtC object.
+  * The trail cores are output, as given by TrailCoreInKernelAtC::getTrail(), in an unspecified order,
+  * i.e., without their state at D.
+  * If @a trailsOut is not thread-safe, the trail cores are given to it
+  * through a SynchronizedTrailFetcher.
+  * @param   backgroundAtA  The background at A.
+  * @param   aTabooAtB      State indicating the bits at B where no active points may be put.
+  * @param   aMaxWeight     The maximum propagation weight up to which one must generate all states.
+  * @param   aParent        Reference to KeccakFDCLC instance defining laneSize.
+  * @param   aDCorLC        Whether to generate DC or LC trail cores.
+  * @param   trailsOut      Where to give the produced trail cores.
+  * @param   nrThreads      The number of threads.
+  * @return The number of trail cores generated.
+  */
+UINT64 generateThreeRoundTrailCoresInKernelAtC(const vector<SliceValue>& backgroundAtA,
+                                               const vector<SliceValue>& aTabooAtB,
+                                               unsigned int aMaxWeight,
+                                               const KeccakFDCLC& aParent,
+                                               KeccakFPropagation::DCorLC aDCorLC,
+                                               TrailFetcher& trailsOut,
+                                               unsigned int nrThreads = TaskScheduler::getDefaultNumberOfThreads());
+
 #endif
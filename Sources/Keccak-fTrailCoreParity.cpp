@@ -13,6 +13,7 @@ and related or neighboring rights to the source code in this file.
 http://creativecommons.org/publicdomain/zero/1.0/
 */
 
+#include <atomic>
 #include <cstdlib>
 #include <fstream>
 #include <sstream>
@@ -20,6 +21,29 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #include <time.h>
 #include "Keccak-fTrailCoreParity.h"
 
+void TrailWithGivenParityWorkItem::save(ostream& fout) const
+{
+    fout << dec << S1_valueIndex.size();
+    for(unsigned int i=0; i<S1_valueIndex.size(); i++)
+        fout << " " << hex << S1_valueIndex[i];
+    fout << dec << endl;
+}
+
+void TrailWithGivenParityWorkItem::load(istream& fin)
+{
+    string line;
+    if (!getline(fin, line))
+        throw TrailException("TrailWithGivenParityWorkItem::load(): no work item to read.");
+    stringstream str(line);
+    unsigned int size;
+    if (!(str >> dec >> size))
+        throw TrailException("TrailWithGivenParityWorkItem::load(): invalid work item.");
+    S1_valueIndex.resize(size);
+    for(unsigned int i=0; i<size; i++)
+        if ((!(str >> hex >> S1_valueIndex[i])) || (S1_valueIndex[i] >= 16))
+            throw TrailException("TrailWithGivenParityWorkItem::load(): invalid work item.");
+}
+
 bool OrbitalPosition::first(const vector<unsigned int>& yMin, unsigned int laneSize)
 {
     x = 0;
@@ -93,54 +117,6 @@ bool OrbitalPosition::successorOf(const OrbitalPosition& other, const vector<uns
     return true;
 }
 
-int KeccakFTwoRoundTrailCoreWithGivenParityIterator::setValueInAffectedColumnAndGetDeltaTotalWeight(vector<SliceValue>& stateAtA, vector<SliceValue>& stateAtB, const ColumnPosition& columnBeforeTheta, ColumnValue valueBeforeTheta) const
-{
-    int delta = 0;
-    for(unsigned int y=0; y<5; y++) {
-        bool bitBeforeTheta = ((valueBeforeTheta >> y) & 1) != 0;
-        BitPosition p(columnBeforeTheta.x, y, columnBeforeTheta.z);
-        if (bitBeforeTheta) {
-            DCorLC.reverseRhoPiBeforeTheta(p);
-            delta += setBitToOneAndGetDeltaMinReverseWeight(stateAtA, p);
-        }
-        else {
-            DCorLC.directRhoPiAfterTheta(p);
-            delta += setBitToOneAndGetDeltaWeight(stateAtB, p);
-        }
-    }
-    return delta;
-}
-
-int KeccakFTwoRoundTrailCoreWithGivenParityIterator::setBitInUnaffectedColumnAndGetDeltaTotalWeight(vector<SliceValue>& stateAtA, vector<SliceValue>& stateAtB, unsigned int x, unsigned int y, unsigned int z) const
-{
-    int delta = 0;
-    {
-        BitPosition p(x, y, z);
-        DCorLC.reverseRhoPiBeforeTheta(p);
-        delta += setBitToOneAndGetDeltaMinReverseWeight(stateAtA, p);
-    }
-    {
-        BitPosition p(x, y, z);
-        DCorLC.directRhoPiAfterTheta(p);
-        delta += setBitToOneAndGetDeltaWeight(stateAtB, p);
-    }
-    return delta;
-}
-
-int KeccakFTwoRoundTrailCoreWithGivenParityIterator::setBitInUnaffectedColumnAndGetDeltaTotalWeight(vector<SliceValue>& stateAtA, vector<SliceValue>& stateAtB, const ColumnPosition& columnBeforeTheta, unsigned int y) const
-{
-    return setBitInUnaffectedColumnAndGetDeltaTotalWeight(stateAtA, stateAtB, columnBeforeTheta.x, y, columnBeforeTheta.z);
-}
-
-int KeccakFTwoRoundTrailCoreWithGivenParityIterator::setOrbitalInUnaffectedColumnAndGetDeltaTotalWeight(vector<SliceValue>& stateAtA, vector<SliceValue>& stateAtB, const OrbitalPosition& orbital) const
-{
-    return 
-        setBitInUnaffectedColumnAndGetDeltaTotalWeight(stateAtA, stateAtB, 
-            orbital.x, orbital.y0, orbital.z)
-    +   setBitInUnaffectedColumnAndGetDeltaTotalWeight(stateAtA, stateAtB, 
-            orbital.x, orbital.y1, orbital.z);
-}
-
 const ColumnValue KeccakFTrailWithGivenParityIterator::evenValues[16] = {
     0x00, 0x03, 0x05, 0x06, 0x09, 0x0A, 0x0C, 0x0F,
     0x11, 0x12, 0x14, 0x17, 0x18, 0x1B, 0x1D, 0x1E };
@@ -168,6 +144,7 @@ KeccakFTrailWithGivenParityIterator::KeccakFTrailWithGivenParityIterator(const K
                 UOcolumns.push_back(ColumnPosition(x, z));
     }
     S1_height = 0;
+    S1_base = 0;
     S2_height = 0;
     S3_height = 0;
 }
@@ -175,7 +152,11 @@ KeccakFTrailWithGivenParityIterator::KeccakFTrailWithGivenParityIterator(const K
 void KeccakFTrailWithGivenParityIterator::initialize()
 {
     index = 0;
-    if (first()) {
+    bool success = true;
+    for(unsigned int i=0; (i<S1_prefix.size()) && success; i++)
+        success = S1_push(S1_prefix[i]);
+    S1_base = S1_height;
+    if (success && first()) {
         getTrail();
         end = false;
         empty = false;
@@ -196,7 +177,7 @@ bool KeccakFTrailWithGivenParityIterator::S1_push(unsigned int valueIndex)
     else
         canAfford = pushValueInAffectedColumn(Acolumns[S1_height], evenValues[valueIndex]);
     if (canAfford) {
-        S1_valueIndex.push(valueIndex);
+        S1_valueIndex.push_back(valueIndex);
         S1_height++;
         return true;
     }
@@ -208,8 +189,8 @@ unsigned int KeccakFTrailWithGivenParityIterator::S1_pop()
 {
     pop();
     S1_height--;
-    unsigned int valueIndex = S1_valueIndex.top();
-    S1_valueIndex.pop();
+    unsigned int valueIndex = S1_valueIndex.back();
+    S1_valueIndex.pop_back();
     return valueIndex;
 }
 
@@ -243,10 +224,10 @@ bool KeccakFTrailWithGivenParityIterator::S1_first()
         while((S1_height < Acolumns.size()) && success) {
             success = S1_firstTop();
         }
-        while((S1_height > 0) && (!success)) {
+        while((S1_height > S1_base) && (!success)) {
             success = S1_nextTop();
         }
-        if (S1_height == 0)
+        if (S1_height == S1_base)
             return false;
     }
     return true;
@@ -254,16 +235,28 @@ bool KeccakFTrailWithGivenParityIterator::S1_first()
 
 bool KeccakFTrailWithGivenParityIterator::S1_next()
 {
-    bool success = true;
-    do {
+    bool success = false;
+    while((S1_height > S1_base) && (!success))
         success = S1_nextTop();
-    } while((S1_height > 0) && (!success));
-    if (S1_height == 0)
+    if (!success)
         return false;
     else
         return S1_first();
 }
 
+void KeccakFTrailWithGivenParityIterator::S1_split(unsigned int depth, vector<TrailWithGivenParityWorkItem>& items)
+{
+    if (S1_height >= depth) {
+        items.push_back(TrailWithGivenParityWorkItem(S1_valueIndex));
+        return;
+    }
+    for(unsigned int valueIndex=0; valueIndex<16; valueIndex++)
+        if (S1_push(valueIndex)) {
+            S1_split(depth, items);
+            S1_pop();
+        }
+}
+
 bool KeccakFTrailWithGivenParityIterator::S2_push(unsigned int y)
 {
     bool canAfford = pushBitInUnaffectedOddColumn(UOcolumns[S2_height], y);
@@ -488,90 +481,198 @@ const Trail& KeccakFTrailWithGivenParityIterator::operator*()
     return trail;
 }
 
+void KeccakFTrailWithGivenParityIterator::setWorkItem(const TrailWithGivenParityWorkItem& item)
+{
+    if (initialized)
+        throw KeccakException("KeccakFTrailWithGivenParityIterator::setWorkItem() must be called before the iteration starts.");
+    if (item.S1_valueIndex.size() > Acolumns.size())
+        throw KeccakException("KeccakFTrailWithGivenParityIterator::setWorkItem(): the work item has too many affected columns.");
+    for(unsigned int i=0; i<item.S1_valueIndex.size(); i++)
+        if (item.S1_valueIndex[i] >= 16)
+            throw KeccakException("KeccakFTrailWithGivenParityIterator::setWorkItem(): invalid column value.");
+    S1_prefix = item.S1_valueIndex;
+}
+
+TrailWithGivenParityWorkItem KeccakFTrailWithGivenParityIterator::getWorkItem(unsigned int depth)
+{
+    if (!initialized) initialize();
+    if (depth < S1_prefix.size())
+        depth = S1_prefix.size();
+    if (depth > S1_valueIndex.size())
+        depth = S1_valueIndex.size();
+    return TrailWithGivenParityWorkItem(vector<unsigned int>(S1_valueIndex.begin(), S1_valueIndex.begin() + depth));
+}
+
+void KeccakFTrailWithGivenParityIterator::split(unsigned int depth, vector<TrailWithGivenParityWorkItem>& items)
+{
+    if (initialized)
+        throw KeccakException("KeccakFTrailWithGivenParityIterator::split() must be called before the iteration starts.");
+    items.clear();
+    if (depth > Acolumns.size())
+        depth = Acolumns.size();
+    bool success = true;
+    for(unsigned int i=0; (i<S1_prefix.size()) && success; i++)
+        success = S1_push(S1_prefix[i]);
+    if (success)
+        S1_split(depth, items);
+    while(S1_height > 0)
+        S1_pop();
+}
+
 KeccakFTwoRoundTrailCoreWithGivenParityIterator::KeccakFTwoRoundTrailCoreWithGivenParityIterator(const KeccakFPropagation& aDCorLC,
         const vector<RowValue>& aParity, int aMaxWeight, bool aOrbitals)
-    : KeccakFTrailWithGivenParityIterator(aDCorLC,aParity, aOrbitals), maxWeight(aMaxWeight)
+    : KeccakFTrailWithGivenParityIterator(aDCorLC,aParity, aOrbitals), maxWeight(aMaxWeight),
+    stateAtA(laneSize, 0), stateAtB(laneSize, 0)
 {
-    stack_stateAtA.push(StateAsVectorOfSlices(laneSize, 0));
-    stack_stateAtB.push(StateAsVectorOfSlices(laneSize, 0));
-    stack_weight.push(0);
+    stack_weightAtA.push_back(0);
+    stack_weightAtB.push_back(0);
 }
 
-int KeccakFTwoRoundTrailCoreWithGivenParityIterator::setBitToOneAndGetDeltaWeight(vector<SliceValue>& state, const BitPosition& p) const
+void KeccakFTwoRoundTrailCoreWithGivenParityIterator::setBitAtA(unsigned int x, unsigned int y, unsigned int z, int& deltaWeightAtA)
 {
-    int weightBefore = DCorLC.getWeight(state[p.z]);
-    setBitToOne(state, p.x, p.y, p.z);
-    return (int)DCorLC.getWeight(state[p.z]) - weightBefore;
+    BitPosition p(x, y, z);
+    DCorLC.reverseRhoPiBeforeTheta(p);
+    SliceChange change = { false, p.z, stateAtA[p.z] };
+    undoLog.push_back(change);
+    deltaWeightAtA += DCorLC.setBitToOneAndGetDeltaMinReverseWeight(stateAtA, p);
 }
 
-int KeccakFTwoRoundTrailCoreWithGivenParityIterator::setBitToOneAndGetDeltaMinReverseWeight(vector<SliceValue>& state, const BitPosition& p) const
+void KeccakFTwoRoundTrailCoreWithGivenParityIterator::setBitAtB(unsigned int x, unsigned int y, unsigned int z, int& deltaWeightAtB)
 {
-    int weightBefore = DCorLC.getMinReverseWeight(state[p.z]);
-    setBitToOne(state, p.x, p.y, p.z);
-    return (int)DCorLC.getMinReverseWeight(state[p.z]) - weightBefore;
+    BitPosition p(x, y, z);
+    DCorLC.directRhoPiAfterTheta(p);
+    SliceChange change = { true, p.z, stateAtB[p.z] };
+    undoLog.push_back(change);
+    deltaWeightAtB += DCorLC.setBitToOneAndGetDeltaWeight(stateAtB, p);
 }
 
-bool KeccakFTwoRoundTrailCoreWithGivenParityIterator::pushValueInAffectedColumn(const ColumnPosition& columnBeforeTheta, ColumnValue valueBeforeTheta)
+void KeccakFTwoRoundTrailCoreWithGivenParityIterator::setBitInUnaffectedColumn(unsigned int x, unsigned int y, unsigned int z, int& deltaWeightAtA, int& deltaWeightAtB)
 {
-    stack_stateAtA.push(stack_stateAtA.top());
-    stack_stateAtB.push(stack_stateAtB.top());
-    int deltaWeight = setValueInAffectedColumnAndGetDeltaTotalWeight(stack_stateAtA.top(), stack_stateAtB.top(), columnBeforeTheta, valueBeforeTheta);
-    int newWeight = deltaWeight + stack_weight.top();
-    if (newWeight <= maxWeight) {
-        stack_weight.push(newWeight);
+    setBitAtA(x, y, z, deltaWeightAtA);
+    setBitAtB(x, y, z, deltaWeightAtB);
+}
+
+bool KeccakFTwoRoundTrailCoreWithGivenParityIterator::commitOrUndo(size_t undoMark, int deltaWeightAtA, int deltaWeightAtB)
+{
+    int weightAtA = stack_weightAtA.back() + deltaWeightAtA;
+    int weightAtB = stack_weightAtB.back() + deltaWeightAtB;
+    if (weightAtA + weightAtB <= maxWeight) {
+        stack_undoMark.push_back(undoMark);
+        stack_weightAtA.push_back(weightAtA);
+        stack_weightAtB.push_back(weightAtB);
         return true;
     }
     else {
-        stack_stateAtA.pop();
-        stack_stateAtB.pop();
+        undo(undoMark);
         return false;
     }
 }
 
-bool KeccakFTwoRoundTrailCoreWithGivenParityIterator::pushBitInUnaffectedOddColumn(const ColumnPosition& columnBeforeTheta, unsigned int y)
+void KeccakFTwoRoundTrailCoreWithGivenParityIterator::undo(size_t undoMark)
 {
-    stack_stateAtA.push(stack_stateAtA.top());
-    stack_stateAtB.push(stack_stateAtB.top());
-    int deltaWeight = setBitInUnaffectedColumnAndGetDeltaTotalWeight(stack_stateAtA.top(), stack_stateAtB.top(), columnBeforeTheta, y);
-    int newWeight = deltaWeight + stack_weight.top();
-    if (newWeight <= maxWeight) {
-        stack_weight.push(newWeight);
-        return true;
+    while(undoLog.size() > undoMark) {
+        const SliceChange& change = undoLog.back();
+        if (change.atB)
+            stateAtB[change.z] = change.before;
+        else
+            stateAtA[change.z] = change.before;
+        undoLog.pop_back();
     }
-    else {
-        stack_stateAtA.pop();
-        stack_stateAtB.pop();
-        return false;
+}
+
+bool KeccakFTwoRoundTrailCoreWithGivenParityIterator::pushValueInAffectedColumn(const ColumnPosition& columnBeforeTheta, ColumnValue valueBeforeTheta)
+{
+    size_t undoMark = undoLog.size();
+    int deltaWeightAtA = 0, deltaWeightAtB = 0;
+    for(unsigned int y=0; y<5; y++) {
+        // In an affected column, a bit is active either before θ or after θ.
+        if (((valueBeforeTheta >> y) & 1) != 0)
+            setBitAtA(columnBeforeTheta.x, y, columnBeforeTheta.z, deltaWeightAtA);
+        else
+            setBitAtB(columnBeforeTheta.x, y, columnBeforeTheta.z, deltaWeightAtB);
     }
+    return commitOrUndo(undoMark, deltaWeightAtA, deltaWeightAtB);
+}
+
+bool KeccakFTwoRoundTrailCoreWithGivenParityIterator::pushBitInUnaffectedOddColumn(const ColumnPosition& columnBeforeTheta, unsigned int y)
+{
+    size_t undoMark = undoLog.size();
+    int deltaWeightAtA = 0, deltaWeightAtB = 0;
+    setBitInUnaffectedColumn(columnBeforeTheta.x, y, columnBeforeTheta.z, deltaWeightAtA, deltaWeightAtB);
+    return commitOrUndo(undoMark, deltaWeightAtA, deltaWeightAtB);
 }
 
 bool KeccakFTwoRoundTrailCoreWithGivenParityIterator::pushOrbitalInUnaffectedColumn(const OrbitalPosition& orbital)
 {
-    stack_stateAtA.push(stack_stateAtA.top());
-    stack_stateAtB.push(stack_stateAtB.top());
-    int deltaWeight = setOrbitalInUnaffectedColumnAndGetDeltaTotalWeight(stack_stateAtA.top(), stack_stateAtB.top(), orbital);
-    int newWeight = deltaWeight + stack_weight.top();
-    if (newWeight <= maxWeight) {
-        stack_weight.push(newWeight);
-        return true;
-    }
-    else {
-        stack_stateAtA.pop();
-        stack_stateAtB.pop();
-        return false;
-    }
+    size_t undoMark = undoLog.size();
+    int deltaWeightAtA = 0, deltaWeightAtB = 0;
+    setBitInUnaffectedColumn(orbital.x, orbital.y0, orbital.z, deltaWeightAtA, deltaWeightAtB);
+    setBitInUnaffectedColumn(orbital.x, orbital.y1, orbital.z, deltaWeightAtA, deltaWeightAtB);
+    return commitOrUndo(undoMark, deltaWeightAtA, deltaWeightAtB);
 }
 
 void KeccakFTwoRoundTrailCoreWithGivenParityIterator::pop()
 {
-    stack_stateAtA.pop();
-    stack_stateAtB.pop();
-    stack_weight.pop();
+    undo(stack_undoMark.back());
+    stack_undoMark.pop_back();
+    stack_weightAtA.pop_back();
+    stack_weightAtB.pop_back();
 }
 
 void KeccakFTwoRoundTrailCoreWithGivenParityIterator::getTrail()
 {
     trail.clear();
-    trail.setFirstStateReverseMinimumWeight(DCorLC.getMinReverseWeight(stack_stateAtA.top()));
-    trail.append(stack_stateAtB.top(), DCorLC.getWeight(stack_stateAtB.top()));
+    trail.setFirstStateReverseMinimumWeight(stack_weightAtA.back());
+    trail.append(stateAtB, stack_weightAtB.back());
+}
+
+/** This task iterates on the trail cores of a subtree and outputs them.
+  */
+class TwoRoundTrailCoresWithGivenParityTask : public Task {
+protected:
+    const KeccakFPropagation& DCorLC;
+    const vector<RowValue>& parity;
+    int maxWeight;
+    bool orbitals;
+    TrailWithGivenParityWorkItem item;
+    TrailFetcher& trailsOut;
+    atomic<UINT64>& count;
+public:
+    TwoRoundTrailCoresWithGivenParityTask(const KeccakFPropagation& aDCorLC, const vector<RowValue>& aParity, int aMaxWeight, bool anOrbitals,
+        const TrailWithGivenParityWorkItem& anItem, TrailFetcher& aTrailsOut, atomic<UINT64>& aCount)
+        : DCorLC(aDCorLC), parity(aParity), maxWeight(aMaxWeight), orbitals(anOrbitals), item(anItem), trailsOut(aTrailsOut), count(aCount) {}
+    void run()
+    {
+        KeccakFTwoRoundTrailCoreWithGivenParityIterator i(DCorLC, parity, maxWeight, orbitals);
+        i.setWorkItem(item);
+        UINT64 n = 0;
+        for( ; !i.isEnd(); ++i) {
+            trailsOut.fetchTrail(*i);
+            n++;
+        }
+        count += n;
+    }
+};
+
+UINT64 generateTwoRoundTrailCoresWithGivenParity(const KeccakFPropagation& DCorLC, const vector<RowValue>& parity, 
+    int maxWeight, TrailFetcher& trailsOut, bool orbitals, unsigned int nrThreads)
+{
+    if (nrThreads == 0)
+        nrThreads = 1;
+    // The subtrees are made smaller until there are enough of them to balance the load.
+    const UINT64 minNrItems = 16*nrThreads;
+    vector<TrailWithGivenParityWorkItem> items(1);
+    {
+        KeccakFTwoRoundTrailCoreWithGivenParityIterator i(DCorLC, parity, maxWeight, orbitals);
+        for(unsigned int depth=1; (depth<=i.getNumberOfAffectedColumns()) && (items.size() > 0) && (items.size() < minNrItems); depth++)
+            i.split(depth, items);
+    }
+    SynchronizedTrailFetcher synchronizedTrailsOut(trailsOut);
+    TrailFetcher& sharedTrailsOut = trailsOut.isThreadSafe() ? trailsOut : synchronizedTrailsOut;
+    atomic<UINT64> count(0);
+    TaskScheduler tasks(nrThreads);
+    for(unsigned int j=0; j<items.size(); j++)
+        tasks.submit(new TwoRoundTrailCoresWithGivenParityTask(DCorLC, parity, maxWeight, orbitals, items[j], sharedTrailsOut, count));
+    tasks.wait();
+    return count;
 }
@@ -23,6 +23,7 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #include "Keccak-fTrails.h"
 #include "Keccak-fState.h"
 #include "progress.h"
+#include "taskscheduler.h"
 
 typedef vector<SliceValue> StateAsVectorOfSlices;
 
@@ -59,8 +60,39 @@ public:
     bool successorOf(const OrbitalPosition& other, const vector<unsigned int>& yMin, unsigned int laneSize);
 };
 
+/** This structure describes a subtree of the search done by KeccakFTrailWithGivenParityIterator,
+  * as the values of the first affected columns, i.e., the bottom of the stack 1.
+  * Each value is given as an index in the list of even or odd column values, 
+  * depending on the parity of the column.
+  * Work items can be saved and loaded as text, so that subtrees can be
+  * distributed to threads or to other processes.
+  */
+class TrailWithGivenParityWorkItem {
+public:
+    /** The indexes of the values of the first affected columns. */
+    vector<unsigned int> S1_valueIndex;
+public:
+    /** The default constructor, for the whole search. */
+    TrailWithGivenParityWorkItem() {}
+    /** The constructor from the values of the first affected columns. */
+    TrailWithGivenParityWorkItem(const vector<unsigned int>& aS1_valueIndex)
+        : S1_valueIndex(aS1_valueIndex) {}
+    /** This method saves the work item on one line.
+      * @param  fout    The stream to save to.
+      */
+    void save(ostream& fout) const;
+    /** This method loads a work item saved by save().
+      * An exception TrailException is thrown if the line is not a valid work item.
+      * @param  fin     The stream to load from.
+      */
+    void load(istream& fin);
+};
+
 /** This abstract class iterates on all 2-round trail cores with a given parity, 
   * limited by some budget defined in a derived class.
+  * The iteration can be restricted to a subtree given as a TrailWithGivenParityWorkItem,
+  * and the search can be split into such subtrees with split(), 
+  * so that independent iterators can explore them in parallel.
   */
 class KeccakFTrailWithGivenParityIterator : public TrailIterator
 {
@@ -120,7 +152,12 @@ protected:
     
     // Stack 1 for affected columns
     unsigned int S1_height;
-    stack<unsigned int> S1_valueIndex;
+    /** The values in stack 1, kept as a vector so that its contents can be given as a work item. */
+    vector<unsigned int> S1_valueIndex;
+    /** The values at the bottom of stack 1 that the iteration does not change. */
+    vector<unsigned int> S1_prefix;
+    /** The height of stack 1 once @a S1_prefix is pushed. */
+    unsigned int S1_base;
     static const ColumnValue evenValues[16], oddValues[16];
     bool S1_push(unsigned int valueIndex);
     unsigned int S1_pop();
@@ -128,6 +165,7 @@ protected:
     bool S1_nextTop();
     bool S1_first();
     bool S1_next();
+    void S1_split(unsigned int depth, vector<TrailWithGivenParityWorkItem>& items);
     
     // Stack 2 for unaffected odd columns
     unsigned int S2_height;
@@ -174,17 +212,55 @@ public:
     void operator++();
     /** See TrailIterator::operator*(). */
     const Trail& operator*();
+    /** This method restricts the iteration to the subtree given by the work item.
+      * It must be called before the iteration starts.
+      * @param  item    The work item, e.g., as given by split().
+      */
+    void setWorkItem(const TrailWithGivenParityWorkItem& item);
+    /** This method returns the subtree containing the current trail core
+      * and whose first @a depth affected columns have the same values.
+      * @param  depth   The number of affected columns to fix, 
+      *                 at least that of the work item set with setWorkItem().
+      */
+    TrailWithGivenParityWorkItem getWorkItem(unsigned int depth);
+    /** This method splits the search, or the subtree set with setWorkItem(),
+      * into the subtrees obtained by fixing the values of the first affected columns.
+      * The values that the budget does not allow are not listed.
+      * It must be called before the iteration starts.
+      * @param  depth   The number of affected columns to fix, 
+      *                 limited by getNumberOfAffectedColumns().
+      * @param  items   The resulting work items.
+      */
+    void split(unsigned int depth, vector<TrailWithGivenParityWorkItem>& items);
+    /** This method returns the number of columns affected by θ for the given parity. */
+    inline unsigned int getNumberOfAffectedColumns() const { return Acolumns.size(); }
 };
 
 /** This class iterates on all 2-round trail cores with a given parity, 
  * such that the weight of the core is not greater than a given value.
+ * The states at A and at B are modified in place, and the slices changed 
+ * by each push are saved so that pop() restores them.
+ * The weights of both states are updated incrementally from the per-row tables
+ * and kept per push, so that neither the states nor their weights are recomputed.
  */
 class KeccakFTwoRoundTrailCoreWithGivenParityIterator : public KeccakFTrailWithGivenParityIterator 
 {
 protected:
     int maxWeight;
-    stack<StateAsVectorOfSlices> stack_stateAtA, stack_stateAtB;
-    stack<unsigned int> stack_weight;
+    /** The state at A=λ<sup>-1</sup>(B) and at B. */
+    StateAsVectorOfSlices stateAtA, stateAtB;
+    /** The value of a slice before a push modified it. */
+    struct SliceChange {
+        bool atB;
+        unsigned int z;
+        SliceValue before;
+    };
+    /** The slices modified by the pushes, in order. */
+    vector<SliceChange> undoLog;
+    /** Per push, the size of @a undoLog before the push. */
+    vector<size_t> stack_undoMark;
+    /** Per push, the minimum reverse weight of the state at A and the weight of the state at B. */
+    vector<int> stack_weightAtA, stack_weightAtB;
 public: 
     /** The constructor.
       * @param   DCorLC The propagation context of the trail, 
@@ -196,12 +272,11 @@ public:
     KeccakFTwoRoundTrailCoreWithGivenParityIterator(const KeccakFPropagation& aDCorLC,
         const vector<RowValue>& aParity, int aMaxWeight, bool aOrbitals = true);
 private:
-    int setBitToOneAndGetDeltaWeight(vector<SliceValue>& state, const BitPosition& p) const;
-    int setBitToOneAndGetDeltaMinReverseWeight(vector<SliceValue>& state, const BitPosition& p) const;
-    int setValueInAffectedColumnAndGetDeltaTotalWeight(vector<SliceValue>& stateAtA, vector<SliceValue>& stateAtB, const ColumnPosition& columnBeforeTheta, ColumnValue valueBeforeTheta) const;
-    int setBitInUnaffectedColumnAndGetDeltaTotalWeight(vector<SliceValue>& stateAtA, vector<SliceValue>& stateAtB, unsigned int x, unsigned int y, unsigned int z) const;
-    int setBitInUnaffectedColumnAndGetDeltaTotalWeight(vector<SliceValue>& stateAtA, vector<SliceValue>& stateAtB, const ColumnPosition& columnBeforeTheta, unsigned int y) const;
-    int setOrbitalInUnaffectedColumnAndGetDeltaTotalWeight(vector<SliceValue>& stateAtA, vector<SliceValue>& stateAtB, const OrbitalPosition& orbital) const;
+    void setBitAtA(unsigned int x, unsigned int y, unsigned int z, int& deltaWeightAtA);
+    void setBitAtB(unsigned int x, unsigned int y, unsigned int z, int& deltaWeightAtB);
+    void setBitInUnaffectedColumn(unsigned int x, unsigned int y, unsigned int z, int& deltaWeightAtA, int& deltaWeightAtB);
+    bool commitOrUndo(size_t undoMark, int deltaWeightAtA, int deltaWeightAtB);
+    void undo(size_t undoMark);
 protected:
     bool pushValueInAffectedColumn(const ColumnPosition& columnBeforeTheta, ColumnValue valueBeforeTheta);
     bool pushBitInUnaffectedOddColumn(const ColumnPosition& columnBeforeTheta, unsigned int y);
@@ -210,4 +285,26 @@ protected:
     void getTrail();
 };
 
+/** This function generates all the 2-round trail cores with a given parity
+  * and up to a given weight, as KeccakFTwoRoundTrailCoreWithGivenParityIterator does,
+  * using several threads.
+  * The search is split with KeccakFTrailWithGivenParityIterator::split()
+  * into enough subtrees to keep the threads busy, and each subtree is a task
+  * for a TaskScheduler, whose idle threads steal the pending tasks of the others.
+  * The trail cores are output in an unspecified order.
+  * If @a trailsOut is not thread-safe, the trail cores are given to it
+  * through a SynchronizedTrailFetcher.
+  * @param   DCorLC The propagation context of the trails, 
+  *                 as a reference to a KeccakFPropagation object.
+  * @param  parity  The parity as a vector of row values.
+  * @param  maxWeight   The maximum trail core weight.
+  * @param  trailsOut   Where to give the produced trail cores.
+  * @param  orbitals    See KeccakFTrailWithGivenParityIterator::KeccakFTrailWithGivenParityIterator().
+  * @param  nrThreads   The number of threads.
+  * @return The number of trail cores generated.
+  */
+UINT64 generateTwoRoundTrailCoresWithGivenParity(const KeccakFPropagation& DCorLC, const vector<RowValue>& parity, 
+    int maxWeight, TrailFetcher& trailsOut, bool orbitals = true, 
+    unsigned int nrThreads = TaskScheduler::getDefaultNumberOfThreads());
+
 #endif
@@ -13,193 +13,176 @@ and related or neighboring rights to the source code in this file.
 http://creativecommons.org/publicdomain/zero/1.0/
 */
 
+#include <algorithm>
 #include <sstream>
 #include "Keccak-fTrailCoreRows.h"
+#include "translationsymmetry.h"
 
 KeccakFTrailCoreRows::KeccakFTrailCoreRows(const KeccakFDCLC& aParent, KeccakFPropagation::DCorLC aDCorLC)
-    : KeccakFPropagation(aParent, aDCorLC)
+    : KeccakFPropagation(aParent, aDCorLC), nrThreads(1)
 {
 }
 
+/** This task generates the trail cores whose list of rows starts with given rows.
+  */
+class TrailCoreRowsTask : public Task {
+protected:
+    KeccakFTrailCoreRows& rows;
+    TrailFetcher& trailsOut;
+    const KeccakFTrailCoreRows::GenerationParameters& parameters;
+    vector<ActiveRow> prefix;
+    int weight;
+public:
+    TrailCoreRowsTask(KeccakFTrailCoreRows& aRows, TrailFetcher& aTrailsOut, const KeccakFTrailCoreRows::GenerationParameters& aParameters, const vector<ActiveRow>& aPrefix, int aWeight)
+        : rows(aRows), trailsOut(aTrailsOut), parameters(aParameters), prefix(aPrefix), weight(aWeight) {}
+    void run()
+    {
+        vector<SliceValue> state(rows.laneSize, 0);
+        vector<SliceValue> stateAfterLambda;
+        for(unsigned int i=0; i<prefix.size(); i++)
+            state[prefix[i].z] ^= getSliceFromRow(prefix[i].value, prefix[i].y);
+        rows.recurseGenerateTrailCores(trailsOut, parameters, prefix, state, stateAfterLambda, weight);
+    }
+};
+
 void KeccakFTrailCoreRows::generateTrailCoresBasedOnRows(TrailFetcher& trailsOut, int maxNrRowsAtA, int maxNrRowsAtB, int maxWeight)
 {
-    if ((maxNrRowsAtA > 3) && (maxNrRowsAtB > 3))
-        throw KeccakException("This method generates up to 3 rows only.");
-    generateTrailCoresBasedOnRows(trailsOut, (maxNrRowsAtA < maxNrRowsAtB), maxNrRowsAtA, maxNrRowsAtB, maxWeight);
+    GenerationParameters parameters;
+    parameters.startingFromA = (maxNrRowsAtA < maxNrRowsAtB);
+    parameters.upToGivenWeight = false;
+    parameters.maxNrRowsAtA = maxNrRowsAtA;
+    parameters.maxNrRowsAtB = maxNrRowsAtB;
+    parameters.maxMinRevWeightAtA = maxWeight;
+    parameters.maxWeightAtB = maxWeight;
+    parameters.maxWeight = maxWeight;
+    parameters.maxNrRows = max(0, parameters.startingFromA ? maxNrRowsAtA : maxNrRowsAtB);
+    parameters.maxRowWeight = maxWeight;
+    initializeParameters(parameters);
+    generateTrailCores(trailsOut, parameters);
 }
 
 void KeccakFTrailCoreRows::generateTrailCoresUpToGivenWeight(TrailFetcher& trailsOut, int maxMinRevWeightAtA, int maxWeightAtB, int maxWeight)
 {
-    if ((maxMinRevWeightAtA > 7) && (maxWeightAtB > 7))
-        throw KeccakException("This method generates up to 3 rows only.");
-    generateTrailCoresUpToGivenWeight(trailsOut, (maxMinRevWeightAtA < maxWeightAtB), maxMinRevWeightAtA, maxWeightAtB, maxWeight);
+    GenerationParameters parameters;
+    parameters.startingFromA = (maxMinRevWeightAtA < maxWeightAtB);
+    parameters.upToGivenWeight = true;
+    parameters.maxNrRowsAtA = parameters.maxNrRowsAtB = 5*laneSize;
+    parameters.maxMinRevWeightAtA = maxMinRevWeightAtA;
+    parameters.maxWeightAtB = maxWeightAtB;
+    parameters.maxWeight = maxWeight;
+    parameters.maxNrRows = 5*laneSize;
+    parameters.maxRowWeight = min(maxWeight, parameters.startingFromA ? maxMinRevWeightAtA : maxWeightAtB);
+    initializeParameters(parameters);
+    generateTrailCores(trailsOut, parameters);
 }
 
-void KeccakFTrailCoreRows::generateTrailCoresBasedOnRows(TrailFetcher& trailsOut, bool startingFromA, int maxNrRowsAtA, int maxNrRowsAtB, int maxWeight)
+void KeccakFTrailCoreRows::initializeParameters(GenerationParameters& parameters) const
 {
-    int maxNrRows = (startingFromA ? maxNrRowsAtA : maxNrRowsAtB);
-    if (maxNrRows >= 1) {
-        const unsigned int z = 0;
-        for(unsigned int y=0; y<5; y++)
-        for(RowValue a=1; a<32; a++) {
-            vector<SliceValue> in(laneSize, 0);
-            in[z] = getSliceFromRow(a, y);
-            filterGeneratedTrailCores(trailsOut, in, startingFromA, maxNrRowsAtA, maxNrRowsAtB, maxWeight);
-        }
+    vector<pair<int, RowValue> > valuesByWeight;
+    for(RowValue a=1; a<32; a++) {
+        int weight = (parameters.startingFromA ? getMinReverseWeightRow(a) : getWeightRow(a));
+        valuesByWeight.push_back(make_pair(weight, a));
     }
-    if (maxNrRows >= 2) {
-        progress.stack("Generating 2 rows");
-        const unsigned int z1 = 0;
-        for(unsigned int y1=0; y1<5; y1++)
-        for(unsigned int z2=0; z2<=laneSize/2; z2++)
-        for(unsigned int y2=0; y2<5; y2++)
-        if ((z1 != z2) || (y1 < y2)) {
-            for(RowValue a1=1; a1<32; a1++)
-            for(RowValue a2=1; a2<32; a2++) {
-                vector<SliceValue> in(laneSize, 0);
-                in[z1] ^= getSliceFromRow(a1, y1);
-                in[z2] ^= getSliceFromRow(a2, y2);
-                filterGeneratedTrailCores(trailsOut, in, startingFromA, maxNrRowsAtA, maxNrRowsAtB, maxWeight);
-            }
-            ++progress;
-        }
-        progress.unstack();
-    }
-    if (maxNrRows >= 3) {
-        progress.stack("Generating 3 rows");
-        const unsigned int z1 = 0;
-        for(unsigned int z2=0; z2<laneSize; z2++)
-        for(unsigned int z3=z2; z3<laneSize; z3++) {
-            LaneValue test1 = (LaneValue)1 | ((LaneValue)1 << z2) | ((LaneValue)1 << z3);
-            LaneValue test2 = test1;
-            parent.ROL(test2, -(int)z2);
-            LaneValue test3 = test1;
-            parent.ROL(test3, -(int)z3);
-            if ((test1 <= test2) && (test1 <= test3)) {
-                {
-                    stringstream str;
-                    str << "Rows in slices " << dec << z1 << ", " << z2 << ", " << z3;
-                    progress.stack(str.str());
-                }
-                for(unsigned int y1=0; y1<5; y1++)
-                for(unsigned int y2=0; y2<5; y2++)
-                for(unsigned int y3=0; y3<5; y3++)
-                if (((z1 != z2) || (y1 < y2)) && ((z2 != z3) || (y2 < y3))) {
-                    for(RowValue a1=1; a1<32; a1++)
-                    for(RowValue a2=1; a2<32; a2++)
-                    for(RowValue a3=1; a3<32; a3++) {
-                        vector<SliceValue> in(laneSize, 0);
-                        in[z1] ^= getSliceFromRow(a1, y1);
-                        in[z2] ^= getSliceFromRow(a2, y2);
-                        in[z3] ^= getSliceFromRow(a3, y3);
-                        filterGeneratedTrailCores(trailsOut, in, startingFromA, maxNrRowsAtA, maxNrRowsAtB, maxWeight);
-                    }
-                    ++progress;
-                }
-                progress.unstack();
-                ++progress;
-            }
-        }
-        progress.unstack();
+    sort(valuesByWeight.begin(), valuesByWeight.end());
+    parameters.values.clear();
+    parameters.weights.clear();
+    for(unsigned int i=0; i<valuesByWeight.size(); i++) {
+        parameters.weights.push_back(valuesByWeight[i].first);
+        parameters.values.push_back(valuesByWeight[i].second);
     }
 }
 
-void KeccakFTrailCoreRows::generateTrailCoresUpToGivenWeight(TrailFetcher& trailsOut, bool startingFromA, int maxMinRevWeightAtA, int maxWeightAtB, int maxWeight)
+void KeccakFTrailCoreRows::generateTrailCores(TrailFetcher& trailsOut, const GenerationParameters& parameters)
 {
-    int maxMinRevWeightAtAorB = (startingFromA ? maxMinRevWeightAtA : maxWeightAtB);
-    int maxNrRows = maxMinRevWeightAtAorB/2;
-    if (maxNrRows >= 1) {
-        const unsigned int z = 0;
-        for(RowValue a=1; a<32; a++) {
-            int weight = (startingFromA ? getMinReverseWeightRow(a) : getWeightRow(a));
-            if (weight <= maxMinRevWeightAtAorB) for(unsigned int y=0; y<5; y++) {
-                vector<SliceValue> in(laneSize, 0);
-                in[z] = getSliceFromRow(a, y);
-                filterGeneratedTrailCoresUpToGivenWeight(trailsOut, in, startingFromA, maxMinRevWeightAtA, maxWeightAtB, maxWeight);
-            }
-        }
+    if (parameters.maxNrRows == 0)
+        return;
+    SynchronizedTrailFetcher synchronizedTrailsOut(trailsOut);
+    TrailFetcher& sharedTrailsOut = ((nrThreads <= 1) || trailsOut.isThreadSafe()) ? trailsOut : synchronizedTrailsOut;
+    TaskScheduler *tasks = (nrThreads > 1) ? new TaskScheduler(nrThreads) : 0;
+    const UINT64 maxPendingTasks = 16*nrThreads;
+    vector<ActiveRow> rows;
+    vector<SliceValue> state(laneSize, 0);
+    vector<SliceValue> stateAfterLambda;
+    {
+        stringstream str;
+        str << "Generating up to " << dec << parameters.maxNrRows << " rows";
+        progress.stack(str.str(), 5*parameters.values.size());
     }
-    if (maxNrRows >= 2) {
-        progress.stack("Generating 2 rows");
-        for(RowValue a1=1; a1<32; a1++)
-        for(RowValue a2=1; a2<32; a2++) {
-            int weight = (startingFromA ? 
-                getMinReverseWeightRow(a1)+getMinReverseWeightRow(a2) 
-              : getWeightRow(a1)+getWeightRow(a2));
-            if (weight <= maxMinRevWeightAtAorB) {
-                {
-                    stringstream str;
-                    str << "Row values " << hex << (int)a1 << "," << (int)a2 
-                        << " of " << (startingFromA ? "min. rev. " : "") << "weight " 
-                        << dec << weight;
-                    progress.stack(str.str());
-                }
-                const unsigned int z1 = 0;
-                for(unsigned int y1=0; y1<5; y1++)
-                for(unsigned int z2=0; z2<=laneSize/2; z2++)
-                for(unsigned int y2=0; y2<5; y2++)
-                if ((z1 != z2) || (y1 < y2)) {
-                    vector<SliceValue> in(laneSize, 0);
-                    in[z1] ^= getSliceFromRow(a1, y1);
-                    in[z2] ^= getSliceFromRow(a2, y2);
-                    filterGeneratedTrailCoresUpToGivenWeight(trailsOut, in, startingFromA, maxMinRevWeightAtA, maxWeightAtB, maxWeight);
-                    ++progress;
+    try {
+        // The first row is in slice 0, as the list of rows would otherwise not be minimal.
+        for(unsigned int y1=0; y1<5; y1++)
+        for(unsigned int i1=0; i1<parameters.values.size(); i1++) {
+            int weight1 = parameters.weights[i1];
+            if (weight1 <= parameters.maxRowWeight) {
+                rows.assign(1, ActiveRow(0, y1, parameters.values[i1]));
+                state[0] = getSliceFromRow(parameters.values[i1], y1);
+                if (tasks == 0)
+                    recurseGenerateTrailCores(sharedTrailsOut, parameters, rows, state, stateAfterLambda, weight1);
+                else {
+                    // The trail core with one row is output here, and a task is spawned per choice of the second row.
+                    filterGeneratedTrailCores(sharedTrailsOut, parameters, state, stateAfterLambda);
+                    if (parameters.maxNrRows >= 2) {
+                        for(unsigned int position=y1+1; position<5*laneSize; position++)
+                        for(unsigned int i2=0; (i2<parameters.values.size()) && (weight1+parameters.weights[i2] <= parameters.maxRowWeight); i2++) {
+                            rows.resize(1);
+                            rows.push_back(ActiveRow(position/5, position%5, parameters.values[i2]));
+                            if (isMinimalListSymmetrically(rows, laneSize)) {
+                                tasks->submit(new TrailCoreRowsTask(*this, sharedTrailsOut, parameters, rows, weight1+parameters.weights[i2]));
+                                tasks->wait(maxPendingTasks);
+                            }
+                        }
+                    }
                 }
-                progress.unstack();
+                state[0] = 0;
             }
             ++progress;
         }
+        if (tasks)
+            tasks->wait();
+    }
+    catch(...) {
+        delete tasks;
         progress.unstack();
+        throw;
     }
-    if (maxNrRows >= 3) {
-        progress.stack("Generating 3 rows");
-        for(RowValue a1=1; a1<32; a1++)
-        for(RowValue a2=1; a2<32; a2++)
-        for(RowValue a3=1; a3<32; a3++) {
-            int weight = (startingFromA ? 
-                getMinReverseWeightRow(a1)+getMinReverseWeightRow(a2)+getMinReverseWeightRow(a3)  
-              : getWeightRow(a1)+getWeightRow(a2)+getWeightRow(a3));
-            if (weight <= maxMinRevWeightAtAorB) {
-                {
-                    stringstream str;
-                    str << "Row values " << hex << (int)a1 << "," << (int)a2 << "," << (int)a3
-                        << " of " << (startingFromA ? "min. rev. " : "") << "weight " 
-                        << dec << weight;
-                    progress.stack(str.str());
-                }
-                const unsigned int z1 = 0;
-                for(unsigned int z2=0; z2<laneSize; z2++)
-                for(unsigned int z3=z2; z3<laneSize; z3++) {
-                    LaneValue test1 = (LaneValue)1 | ((LaneValue)1 << z2) | ((LaneValue)1 << z3);
-                    LaneValue test2 = test1;
-                    parent.ROL(test2, -(int)z2);
-                    LaneValue test3 = test1;
-                    parent.ROL(test3, -(int)z3);
-                    if ((test1 <= test2) && (test1 <= test3)) {
-                        for(unsigned int y1=0; y1<5; y1++)
-                        for(unsigned int y2=0; y2<5; y2++)
-                        for(unsigned int y3=0; y3<5; y3++)
-                        if (((z1 != z2) || (y1 < y2)) && ((z2 != z3) || (y2 < y3))) {
-                            vector<SliceValue> in(laneSize, 0);
-                            in[z1] ^= getSliceFromRow(a1, y1);
-                            in[z2] ^= getSliceFromRow(a2, y2);
-                            in[z3] ^= getSliceFromRow(a3, y3);
-                            filterGeneratedTrailCoresUpToGivenWeight(trailsOut, in, startingFromA, maxMinRevWeightAtA, maxWeightAtB, maxWeight);
-                            ++progress;
-                        }
-                    }
-                }
-                progress.unstack();
+    delete tasks;
+    progress.unstack();
+}
+
+void KeccakFTrailCoreRows::recurseGenerateTrailCores(TrailFetcher& trailsOut, const GenerationParameters& parameters, vector<ActiveRow>& rows, vector<SliceValue>& state, vector<SliceValue>& stateAfterLambda, int weight)
+{
+    filterGeneratedTrailCores(trailsOut, parameters, state, stateAfterLambda);
+    if (rows.size() >= parameters.maxNrRows)
+        return;
+    // The next row comes after the last one, position being 5z+y.
+    const ActiveRow& last = rows.back();
+    for(unsigned int position=5*last.z+last.y+1; position<5*laneSize; position++) {
+        unsigned int z = position/5;
+        unsigned int y = position%5;
+        // The values are sorted by weight, so the loop can stop at the first that exceeds the budget.
+        for(unsigned int i=0; (i<parameters.values.size()) && (weight+parameters.weights[i] <= parameters.maxRowWeight); i++) {
+            rows.push_back(ActiveRow(z, y, parameters.values[i]));
+            if (isMinimalListSymmetrically(rows, laneSize)) {
+                SliceValue row = getSliceFromRow(parameters.values[i], y);
+                state[z] ^= row;
+                recurseGenerateTrailCores(trailsOut, parameters, rows, state, stateAfterLambda, weight+parameters.weights[i]);
+                state[z] ^= row;
             }
-            ++progress;
+            rows.pop_back();
         }
-        progress.unstack();
     }
 }
 
-void KeccakFTrailCoreRows::filterGeneratedTrailCores(TrailFetcher& trailsOut, const vector<SliceValue>& stateAtAorB, bool stateAtA, int maxNrRowsAtA, int maxNrRowsAtB, int maxWeight)
+void KeccakFTrailCoreRows::filterGeneratedTrailCores(TrailFetcher& trailsOut, const GenerationParameters& parameters, const vector<SliceValue>& state, vector<SliceValue>& stateAfterLambda)
+{
+    if (parameters.upToGivenWeight)
+        filterGeneratedTrailCoresUpToGivenWeight(trailsOut, state, stateAfterLambda, parameters.startingFromA, parameters.maxMinRevWeightAtA, parameters.maxWeightAtB, parameters.maxWeight);
+    else
+        filterGeneratedTrailCores(trailsOut, state, stateAfterLambda, parameters.startingFromA, parameters.maxNrRowsAtA, parameters.maxNrRowsAtB, parameters.maxWeight);
+}
+
+void KeccakFTrailCoreRows::filterGeneratedTrailCores(TrailFetcher& trailsOut, const vector<SliceValue>& stateAtAorB, vector<SliceValue>& stateAtBorA, bool stateAtA, int maxNrRowsAtA, int maxNrRowsAtB, int maxWeight)
 {
-    vector<SliceValue> stateAtBorA;
     if (stateAtA) {
         directLambda(stateAtAorB, stateAtBorA);
         if (getNrActiveRows(stateAtBorA) > maxNrRowsAtB)
@@ -226,9 +209,8 @@ void KeccakFTrailCoreRows::filterGeneratedTrailCores(TrailFetcher& trailsOut, co
     trailsOut.fetchTrail(trail);
 }
 
-void KeccakFTrailCoreRows::filterGeneratedTrailCoresUpToGivenWeight(TrailFetcher& trailsOut, const vector<SliceValue>& stateAtAorB, bool stateAtA, int maxMinRevWeightAtA, int maxWeightAtB, int maxWeight)
+void KeccakFTrailCoreRows::filterGeneratedTrailCoresUpToGivenWeight(TrailFetcher& trailsOut, const vector<SliceValue>& stateAtAorB, vector<SliceValue>& stateAtBorA, bool stateAtA, int maxMinRevWeightAtA, int maxWeightAtB, int maxWeight)
 {
-    vector<SliceValue> stateAtBorA;
     if (stateAtA) {
         directLambda(stateAtAorB, stateAtBorA);
         if (getWeight(stateAtBorA) > maxWeightAtB)
@@ -19,48 +19,99 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #include "Keccak-fPropagation.h"
 #include "Keccak-fTrails.h"
 #include "progress.h"
+#include "taskscheduler.h"
+
+/** This structure represents an active row of a state, 
+  * as used by KeccakFTrailCoreRows to build states row by row.
+  * The rows are ordered by z, then by y, then by value.
+  */
+struct ActiveRow {
+    unsigned int z;
+    unsigned int y;
+    RowValue value;
+    ActiveRow() : z(0), y(0), value(0) {}
+    ActiveRow(unsigned int aZ, unsigned int aY, RowValue aValue) : z(aZ), y(aY), value(aValue) {}
+    inline bool operator<(const ActiveRow& other) const
+    {
+        if (z != other.z) return z < other.z;
+        if (y != other.y) return y < other.y;
+        return value < other.value;
+    }
+};
 
 /** This class contains a couple of methods to generate 2-round trail cores
-  * by exhaustively generating all patterns with 1, 2 or 3 active rows.
-  * This is exhaustive up to translation along the z axis.
+  * by exhaustively generating all patterns with a given number of active rows.
+  * The states are built row by row, adding each time a row at a larger position,
+  * and a branch is cut as soon as its list of rows is not the smallest among
+  * its translated versions along z (see isMinimalListSymmetrically())
+  * or as soon as the weight of the rows exceeds the budget.
+  * This is exhaustive up to translation along the z axis,
+  * and each state is generated once up to translation.
   */
 class KeccakFTrailCoreRows : public KeccakFPropagation
 {
 protected:
     ProgressMeter progress;
+public:
+    /** The number of threads used to generate the trail cores.
+      * If 1 (the default), the trail cores are generated sequentially.
+      * Otherwise, the search is split into tasks for a TaskScheduler, 
+      * one per combination of the first two rows, 
+      * and the trail cores are output in an unspecified order.
+      * If the TrailFetcher given to the generation methods is not thread-safe,
+      * the trail cores are given to it through a SynchronizedTrailFetcher.
+      */
+    unsigned int nrThreads;
 public:
     /** The constructor. See KeccakFPropagation::KeccakFPropagation(). */
     KeccakFTrailCoreRows(const KeccakFDCLC& aParent, KeccakFPropagation::DCorLC aDCorLC);
     /** This method generates all 2-round trail cores up to a given weight,
       * constrained by the number of rows at A=λ<sup>-1</sup>(B) and at B.
-      * The maximum number of rows that can be generated by this method is 3,
-      * either for A or for B.
+      * The states are generated at A or at B, whichever allows the fewest rows.
       * This is exhaustive up to translation along the z axis.
       * @param  trailsOut   Where to give the produced trails.
       * @param  maxNrRowsAtA    The maximum number of rows at A.
       * @param  maxNrRowsAtB    The maximum number of rows at B.
       * @param  maxWeight   The maximum weight of the 2-round trail core.
-      * @pre    @a maxNrRowsAtA ≤ 3 or @a maxNrRowsAtB ≤ 3.
       */
     void generateTrailCoresBasedOnRows(TrailFetcher& trailsOut, int maxNrRowsAtA, int maxNrRowsAtB, int maxWeight);
     /** This method generates all 2-round trail cores up to a given weight,
       * constrained by the minimum reverse weight at A=λ<sup>-1</sup>(B) 
       * and by the weight at B.
-      * The maximum (min. rev.) weight that can be generated by this method is 7,
-      * either for A or for B.
+      * The states are generated at A or at B, whichever has the lowest weight limit.
       * This is exhaustive up to translation along the z axis.
       * @param  trailsOut   Where to give the produced trails.
       * @param  maxMinRevWeightAtA      The maximum mininimum reverse weight at A.
       * @param  maxWeightAtB    The maximum weight at B.
       * @param  maxWeight   The maximum weight of the 2-round trail core.
-      * @pre    @a maxMinRevWeightAtA ≤ 7 or @a maxWeightAtB ≤ 7.
       */
     void generateTrailCoresUpToGivenWeight(TrailFetcher& trailsOut, int maxMinRevWeightAtA, int maxWeightAtB, int maxWeight);
-protected:    
-    void generateTrailCoresBasedOnRows(TrailFetcher& trailsOut, bool startingFromA, int maxNrRowsAtA, int maxNrRowsAtB, int maxWeight);
-    void generateTrailCoresUpToGivenWeight(TrailFetcher& trailsOut, bool startingFromA, int maxMinRevWeightAtA, int maxWeightAtB, int maxWeight);
-    void filterGeneratedTrailCores(TrailFetcher& trailsOut, const vector<SliceValue>& stateAtAorB, bool stateAtA, int maxNrRowsAtA, int maxNrRowsAtB, int maxWeight);
-    void filterGeneratedTrailCoresUpToGivenWeight(TrailFetcher& trailsOut, const vector<SliceValue>& stateAtAorB, bool stateAtA, int maxMinRevWeightAtA, int maxWeightAtB, int maxWeight);
+protected:
+    /** The parameters of a generation, as given to the recursion and to the tasks. */
+    struct GenerationParameters {
+        /** Whether the states are generated at A, otherwise at B. */
+        bool startingFromA;
+        /** Whether the trail cores are filtered as in generateTrailCoresUpToGivenWeight(), 
+          * otherwise as in generateTrailCoresBasedOnRows(). */
+        bool upToGivenWeight;
+        int maxNrRowsAtA, maxNrRowsAtB, maxMinRevWeightAtA, maxWeightAtB, maxWeight;
+        /** The maximum number of rows of the generated states. */
+        unsigned int maxNrRows;
+        /** The maximum weight of the generated states, counted per row, 
+          * i.e., the minimum reverse weight at A or the weight at B. */
+        int maxRowWeight;
+        /** The non-zero row values, by increasing weight. */
+        vector<RowValue> values;
+        /** The weight of each row value in @a values. */
+        vector<int> weights;
+    };
+    void initializeParameters(GenerationParameters& parameters) const;
+    void generateTrailCores(TrailFetcher& trailsOut, const GenerationParameters& parameters);
+    void recurseGenerateTrailCores(TrailFetcher& trailsOut, const GenerationParameters& parameters, vector<ActiveRow>& rows, vector<SliceValue>& state, vector<SliceValue>& stateAfterLambda, int weight);
+    void filterGeneratedTrailCores(TrailFetcher& trailsOut, const GenerationParameters& parameters, const vector<SliceValue>& state, vector<SliceValue>& stateAfterLambda);
+    void filterGeneratedTrailCores(TrailFetcher& trailsOut, const vector<SliceValue>& stateAtAorB, vector<SliceValue>& stateAtBorA, bool stateAtA, int maxNrRowsAtA, int maxNrRowsAtB, int maxWeight);
+    void filterGeneratedTrailCoresUpToGivenWeight(TrailFetcher& trailsOut, const vector<SliceValue>& stateAtAorB, vector<SliceValue>& stateAtBorA, bool stateAtA, int maxMinRevWeightAtA, int maxWeightAtB, int maxWeight);
+    friend class TrailCoreRowsTask;
 };
 
 #endif
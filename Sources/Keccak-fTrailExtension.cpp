@@ -13,8 +13,12 @@ and related or neighboring rights to the source code in this file.
 http://creativecommons.org/publicdomain/zero/1.0/
 */
 
+#include <cstdio>
 #include <sstream>
+#include <string.h>
+#include <sys/stat.h>
 #include "Keccak-fTrailExtension.h"
+#include "tablecache.h"
 #include "translationsymmetry.h"
 
 LowWeightExclusion::LowWeightExclusion()
@@ -27,6 +31,33 @@ void LowWeightExclusion::excludeBelowWeight(unsigned int nrRounds, int weight)
     minWeight.clear();
 }
 
+void LowWeightExclusion::setProvenLowerBound(unsigned int nrRounds, int weight)
+{
+    map<unsigned int, int>::iterator i = provenWeight.find(nrRounds);
+    if ((i != provenWeight.end()) && (i->second >= weight))
+        return;
+    provenWeight[nrRounds] = weight;
+    if (weight > getMinWeight(nrRounds))
+        excludeBelowWeight(nrRounds, weight);
+}
+
+int LowWeightExclusion::getProvenLowerBound(unsigned int nrRounds) const
+{
+    vector<int> provenMinWeight;
+    for(unsigned int n=1; n<=nrRounds; n++) {
+        int max = 0;
+        map<unsigned int, int>::const_iterator i = provenWeight.find(n);
+        if (i != provenWeight.end())
+            max = i->second;
+        for(unsigned int n1=1; n1<=(n-1); n1++) {
+            int sum = provenMinWeight[n1-1] + provenMinWeight[n-n1-1];
+            if (sum > max) max = sum;
+        }
+        provenMinWeight.push_back(max);
+    }
+    return (nrRounds == 0) ? 0 : provenMinWeight[nrRounds-1];
+}
+
 int LowWeightExclusion::getMinWeight(unsigned int nrRounds)
 {
     if (nrRounds == 0)
@@ -91,31 +122,79 @@ int KnownSmallWeightStates::getMaxCompleteWeight() const
 void KnownSmallWeightStates::connect(const KeccakFPropagation& DCorLC, const vector<SliceValue>& inputState, 
     int maxWeightOut, vector<vector<SliceValue> >& compatibleStates) const
 {
-    unsigned int inputNrRows = getNrActiveRows(inputState);
-    for(unsigned int weight=2; (weight<=maxWeightOut) && (weight<statesAfterChiPerWeight.size()); weight++)
-        for(unsigned int i=0; i<statesAfterChiPerWeight[weight].size(); i++)
-            if (getNrActiveRows(statesAfterChiPerWeight[weight][i]) == inputNrRows)
-                connect(DCorLC, inputState, statesAfterChiPerWeight[weight][i], compatibleStates);
+    UINT64 inputOffsets;
+    UINT64 signature = getSignature(inputState, inputOffsets);
+    map<UINT64, vector<IndexEntry> >::const_iterator i = statesPerSignature.find(signature);
+    if (i == statesPerSignature.end())
+        return;
+    unsigned int inputOffset = getTrailingZeros(inputOffsets);
+    for(unsigned int j=0; j<i->second.size(); j++) {
+        const IndexEntry& entry = i->second[j];
+        if ((entry.weight < 2) || ((int)entry.weight > maxWeightOut))
+            continue;
+        // The translations to check are the offsets of the candidate minus the offset of the input.
+        UINT64 translations = entry.offsets >> inputOffset;
+        if (inputOffset > 0)
+            translations |= entry.offsets << (DCorLC.laneSize - inputOffset);
+        if (DCorLC.laneSize < 64)
+            translations &= ((UINT64)1 << DCorLC.laneSize) - 1;
+        connect(DCorLC, inputState, statesAfterChiPerWeight[entry.weight][entry.index], translations, compatibleStates);
+    }
 }
 
 void KnownSmallWeightStates::connect(const KeccakFPropagation& DCorLC, const vector<SliceValue>& inputState, 
-    const vector<SliceValue>& candidate, vector<vector<SliceValue> >& compatibleStates) const
+    const vector<SliceValue>& candidate, UINT64 translations, vector<vector<SliceValue> >& compatibleStates) const
 {
-    for(unsigned int z=0; z<DCorLC.laneSize; z++) {
+    translations &= DCorLC.getChiCompatibleTranslations(inputState, candidate);
+    while(translations != 0) {
+        unsigned int dz = getTrailingZeros(translations);
+        translations &= translations - 1;
         vector<SliceValue> candidateZ(DCorLC.laneSize);
         for(unsigned int iz=0; iz<DCorLC.laneSize; iz++)
-            candidateZ[iz] = candidate[(iz+z)%DCorLC.laneSize];
-        if (DCorLC.isChiCompatible(inputState, candidateZ)) {
-            vector<SliceValue> candidateZbeforeChi(DCorLC.laneSize);
-            DCorLC.directLambda(candidateZ, candidateZbeforeChi);
-            compatibleStates.push_back(candidateZbeforeChi);
+            candidateZ[iz] = candidate[(iz+dz)%DCorLC.laneSize];
+        vector<SliceValue> candidateZbeforeChi(DCorLC.laneSize);
+        DCorLC.directLambda(candidateZ, candidateZbeforeChi);
+        compatibleStates.push_back(candidateZbeforeChi);
+    }
+}
+
+UINT64 KnownSmallWeightStates::getSignature(const vector<SliceValue>& state, UINT64& offsets)
+{
+    const UINT64 base = 0x100000001B3ULL;
+    unsigned int laneSize = state.size();
+    vector<UINT64> symbols(laneSize);
+    for(unsigned int z=0; z<laneSize; z++) {
+        unsigned int activeRows = 0;
+        for(unsigned int y=0; y<nrRowsAndColumns; y++)
+            if (getRowFromSlice(state[z], y) != 0)
+                activeRows |= 1 << y;
+        symbols[z] = activeRows + 1;
+    }
+    // hash = Σ symbols[(r+i)%laneSize] base^(laneSize-1-i), rolled from r to r+1
+    UINT64 hash = 0;
+    UINT64 leadingPower = 1;
+    for(unsigned int i=0; i<laneSize; i++) {
+        hash = hash*base + symbols[i];
+        if (i > 0)
+            leadingPower *= base;
+    }
+    UINT64 signature = hash;
+    offsets = 1;
+    for(unsigned int r=1; r<laneSize; r++) {
+        hash = (hash - symbols[r-1]*leadingPower)*base + symbols[r-1];
+        if (hash < signature) {
+            signature = hash;
+            offsets = (UINT64)1 << r;
         }
+        else if (hash == signature)
+            offsets |= (UINT64)1 << r;
     }
+    return signature;
 }
 
 void KnownSmallWeightStates::loadFromFile(const KeccakFPropagation& DCorLC, const string& fileName)
 {
-    TrailFileIterator fin(fileName, DCorLC);
+    TrailFileParallelIterator fin(fileName, DCorLC);
     for( ; !fin.isEnd(); ++fin) {
         const Trail& trail = *fin;
         for(unsigned int i=(trail.firstStateSpecified ? 0 : 1); i<trail.weights.size(); i++)
@@ -124,6 +203,92 @@ void KnownSmallWeightStates::loadFromFile(const KeccakFPropagation& DCorLC, cons
     }
 }
 
+/** The header of a binary file of small-weight states. */
+struct KnownSmallWeightStatesHeader {
+    char magic[8];
+    UINT32 byteOrder;
+    UINT32 version;
+    UINT32 width;
+    UINT32 propagationType;
+    UINT32 maxCompleteWeight;
+    UINT32 reserved;
+    UINT64 nrStates;
+    /** The size of the file of trails the states were extracted from. */
+    UINT64 sourceSize;
+    /** The last modification time of the file of trails the states were extracted from. */
+    UINT64 sourceModificationTime;
+};
+
+static const char knownSmallWeightStatesMagic[8] = { 'K', 'T', 'S', 'M', 'A', 'L', 'L', 0 };
+static const UINT32 knownSmallWeightStatesByteOrder = 0x01020304;
+static const UINT32 knownSmallWeightStatesVersion = 2;
+
+/** This function gets the size and the last modification time of a file.
+  * @return False iff the file cannot be found.
+  */
+static bool getFileSizeAndModificationTime(const string& fileName, UINT64& size, UINT64& modificationTime)
+{
+    struct stat status;
+    if (stat(fileName.c_str(), &status) != 0)
+        return false;
+    size = (UINT64)status.st_size;
+    modificationTime = (UINT64)status.st_mtime;
+    return true;
+}
+
+static bool buildHeader(KnownSmallWeightStatesHeader& header, const KeccakFPropagation& DCorLC, int maxCompleteWeight, UINT64 nrStates, const string& sourceFileName)
+{
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, knownSmallWeightStatesMagic, sizeof(header.magic));
+    header.byteOrder = knownSmallWeightStatesByteOrder;
+    header.version = knownSmallWeightStatesVersion;
+    header.width = DCorLC.laneSize*nrRowsAndColumns*nrRowsAndColumns;
+    header.propagationType = (UINT32)DCorLC.getPropagationType();
+    header.maxCompleteWeight = (UINT32)maxCompleteWeight;
+    header.nrStates = nrStates;
+    return getFileSizeAndModificationTime(sourceFileName, header.sourceSize, header.sourceModificationTime);
+}
+
+bool KnownSmallWeightStates::loadFromBinaryFile(const KeccakFPropagation& DCorLC, const string& fileName, const string& sourceFileName)
+{
+    ifstream fin(fileName.c_str(), ios::binary);
+    if (!fin)
+        return false;
+    KnownSmallWeightStatesHeader header, expected;
+    fin.read((char *)&header, sizeof(header));
+    if (!fin)
+        return false;
+    if (!buildHeader(expected, DCorLC, maxCompleteWeight, header.nrStates, sourceFileName))
+        return false;
+    if (memcmp(&header, &expected, sizeof(expected)) != 0)
+        return false;
+    vector<vector<vector<SliceValue> > > loadedStates(maxCompleteWeight+1);
+    vector<SliceValue> stateAfterChi(DCorLC.laneSize);
+    for(UINT64 i=0; i<header.nrStates; i++) {
+        UINT16 weight;
+        UINT8 nrSlices;
+        fin.read((char *)&weight, sizeof(weight));
+        fin.read((char *)&nrSlices, sizeof(nrSlices));
+        if ((!fin) || ((int)weight > maxCompleteWeight) || (nrSlices > DCorLC.laneSize))
+            return false;
+        stateAfterChi.assign(DCorLC.laneSize, 0);
+        for(unsigned int j=0; j<nrSlices; j++) {
+            UINT8 z;
+            SliceValue slice;
+            fin.read((char *)&z, sizeof(z));
+            fin.read((char *)&slice, sizeof(slice));
+            if ((!fin) || (z >= DCorLC.laneSize))
+                return false;
+            stateAfterChi[z] = slice;
+        }
+        loadedStates[weight].push_back(stateAfterChi);
+    }
+    for(unsigned int weight=0; weight<loadedStates.size(); weight++)
+        for(unsigned int i=0; i<loadedStates[weight].size(); i++)
+            addStateAfterChi(weight, loadedStates[weight][i]);
+    return true;
+}
+
 void KnownSmallWeightStates::saveToFile(const KeccakFPropagation& DCorLC, const string& fileName) const
 {
     ofstream fout(fileName.c_str());
@@ -140,45 +305,101 @@ void KnownSmallWeightStates::saveToFile(const KeccakFPropagation& DCorLC, const
     }
 }
 
+bool KnownSmallWeightStates::saveToBinaryFile(const KeccakFPropagation& DCorLC, const string& fileName, const string& sourceFileName) const
+{
+    UINT64 nrStates = 0;
+    for(unsigned int weight=0; weight<statesAfterChiPerWeight.size(); weight++)
+        nrStates += statesAfterChiPerWeight[weight].size();
+    KnownSmallWeightStatesHeader header;
+    if (!buildHeader(header, DCorLC, maxCompleteWeight, nrStates, sourceFileName))
+        return false;
+    string tempFileName = getTemporaryFileName(fileName);
+    {
+        ofstream fout(tempFileName.c_str(), ios::binary);
+        if (!fout)
+            return false;
+        fout.write((const char *)&header, sizeof(header));
+        for(unsigned int weight=0; weight<statesAfterChiPerWeight.size(); weight++)
+            for(unsigned int i=0; i<statesAfterChiPerWeight[weight].size(); i++) {
+                const vector<SliceValue>& state = statesAfterChiPerWeight[weight][i];
+                UINT16 weight16 = weight;
+                UINT8 nrSlices = 0;
+                for(unsigned int z=0; z<state.size(); z++)
+                    if (state[z] != 0)
+                        nrSlices++;
+                fout.write((const char *)&weight16, sizeof(weight16));
+                fout.write((const char *)&nrSlices, sizeof(nrSlices));
+                for(unsigned int z=0; z<state.size(); z++)
+                    if (state[z] != 0) {
+                        UINT8 z8 = z;
+                        fout.write((const char *)&z8, sizeof(z8));
+                        fout.write((const char *)&state[z], sizeof(state[z]));
+                    }
+            }
+        if (!fout) {
+            fout.close();
+            remove(tempFileName.c_str());
+            return false;
+        }
+    }
+#ifdef _WIN32
+    remove(fileName.c_str());
+#endif
+    if (rename(tempFileName.c_str(), fileName.c_str()) != 0) {
+        remove(tempFileName.c_str());
+        return false;
+    }
+    return true;
+}
+
 void KnownSmallWeightStates::addState(const KeccakFPropagation& DCorLC, const vector<SliceValue>& state)
 {
     unsigned int weight = DCorLC.getWeight(state);
     if (weight > maxCompleteWeight) return;
     vector<SliceValue> stateAfterChi;
     DCorLC.reverseLambda(state, stateAfterChi);
+    addStateAfterChi(weight, stateAfterChi);
+}
+
+void KnownSmallWeightStates::addStateAfterChi(unsigned int weight, const vector<SliceValue>& stateAfterChi)
+{
+    IndexEntry entry;
+    entry.weight = weight;
+    entry.index = statesAfterChiPerWeight[weight].size();
+    statesPerSignature[getSignature(stateAfterChi, entry.offsets)].push_back(entry);
     statesAfterChiPerWeight[weight].push_back(stateAfterChi);
 }
 
 KeccakFTrailExtension::KeccakFTrailExtension(const KeccakFDCLC& aParent, KeccakFPropagation::DCorLC aDCorLC)
     : KeccakFPropagation(aParent, aDCorLC),
-        showMinimalTrails(false), allPrefixes(false),
-        knownSmallWeightStates(0)
+        showMinimalTrails(false), allPrefixes(false), weightOrderedBackwardExtension(false),
+        nrThreads(1), checkpointInterval(600), bestFirstMaxTrailsInMemory(1000000), knownSmallWeightStates(0), sharedBounds(0), limitToLightestSharedWeight(false), scheduler(0), resumeOutputPositionKnown(false), resumeOutputPosition(0), previousCheckpoint(0)
 {
-    knownBounds.excludeBelowWeight(1, 2);
-    knownBounds.excludeBelowWeight(2, 8);
+    knownBounds.setProvenLowerBound(1, 2);
+    knownBounds.setProvenLowerBound(2, 8);
     if (parent.getWidth() == 100) {
         if (aDCorLC == KeccakFPropagation::DC) {
-            knownBounds.excludeBelowWeight(3, 19);
-            knownBounds.excludeBelowWeight(4, 30);
+            knownBounds.setProvenLowerBound(3, 19);
+            knownBounds.setProvenLowerBound(4, 30);
         }
         else {
-            knownBounds.excludeBelowWeight(3, 20);
-            knownBounds.excludeBelowWeight(4, 38);
+            knownBounds.setProvenLowerBound(3, 20);
+            knownBounds.setProvenLowerBound(4, 38);
         }
     }
     else if (parent.getWidth() == 200) {
         if (aDCorLC == KeccakFPropagation::DC) {
-            knownBounds.excludeBelowWeight(3, 20);
-            knownBounds.excludeBelowWeight(4, 46);
+            knownBounds.setProvenLowerBound(3, 20);
+            knownBounds.setProvenLowerBound(4, 46);
         }
         else {
-            knownBounds.excludeBelowWeight(3, 20);
-            knownBounds.excludeBelowWeight(4, 46);
+            knownBounds.setProvenLowerBound(3, 20);
+            knownBounds.setProvenLowerBound(4, 46);
         }
     }
     else if (parent.getWidth() == 1600) {
         if (aDCorLC == KeccakFPropagation::DC) {
-            knownBounds.excludeBelowWeight(3, 32);
+            knownBounds.setProvenLowerBound(3, 32);
         }
     }
 }
@@ -189,26 +410,283 @@ KeccakFTrailExtension::~KeccakFTrailExtension()
         delete knownSmallWeightStates;
 }
 
-bool KeccakFTrailExtension::isLessThanMinWeightSoFar(unsigned int nrRounds, int weight)
+bool KeccakFTrailExtension::isMinimalTrail(unsigned int nrRounds, int weight)
 {
+    if (!showMinimalTrails)
+        return false;
+    lock_guard<mutex> guard(minWeightSoFarLock);
     if (nrRounds >= minWeightSoFar.size())
         minWeightSoFar.resize(nrRounds+1, -1);
     if ((minWeightSoFar[nrRounds] < 0) || (weight < minWeightSoFar[nrRounds])) {
         minWeightSoFar[nrRounds] = weight;
+        cout << "! " << dec << nrRounds << "-round trail of weight " << dec << weight << " found" << endl;
         return true;
     }
     else
         return false;
 }
 
+int KeccakFTrailExtension::getMinWeightSoFar(unsigned int nrRounds)
+{
+    lock_guard<mutex> guard(minWeightSoFarLock);
+    if (nrRounds < minWeightSoFar.size())
+        return minWeightSoFar[nrRounds];
+    else
+        return -1;
+}
+
+void KeccakFTrailExtension::exchangeSharedBounds(unsigned int nrRounds)
+{
+    if (sharedBounds == 0)
+        return;
+    for(unsigned int i=1; i<=nrRounds; i++) {
+        int sharedWeight = sharedBounds->getLowerBound(i);
+        knownBounds.setProvenLowerBound(i, sharedWeight);
+    }
+    for(unsigned int i=1; i<=nrRounds; i++)
+        sharedBounds->publishLowerBound(i, knownBounds.getProvenLowerBound(i));
+}
+
+int KeccakFTrailExtension::getLowerBoundOnWeight(unsigned int nrRounds)
+{
+    int weight = knownBounds.getMinWeight(nrRounds);
+    if (sharedBounds != 0)
+        weight = max(weight, sharedBounds->getLowerBound(nrRounds));
+    return weight;
+}
+
+int KeccakFTrailExtension::getMaxTotalWeight(unsigned int nrRounds, int maxTotalWeight, bool bestFirst) const
+{
+    if ((sharedBounds == 0) || !limitToLightestSharedWeight || !(bestFirst || showMinimalTrails))
+        return maxTotalWeight;
+    return min(maxTotalWeight, sharedBounds->getLightestWeight(nrRounds));
+}
+
+bool KeccakFTrailExtension::isTrailToOutput(unsigned int nrRounds, int weight, int maxTotalWeight)
+{
+    bool minTrail = isMinimalTrail(nrRounds, weight);
+    if (weight > getMaxTotalWeight(nrRounds, weight))
+        return false;
+    if ((weight <= maxTotalWeight) || minTrail) {
+        if (sharedBounds != 0)
+            sharedBounds->publishTrailWeight(nrRounds, weight);
+        return true;
+    }
+    else
+        return false;
+}
+
+/** This task extends a trail forwards, possibly restricted to a subtree
+  * of the affine space of its next state.
+  */
+class ForwardExtensionTask : public Task {
+protected:
+    KeccakFTrailExtension& extension;
+    Trail trail;
+    TrailFetcher& trailsOut;
+    unsigned int nrRounds;
+    int maxTotalWeight;
+    bool input;
+    unsigned int subtreeDepth;
+    UINT64 subtreeIndex;
+public:
+    ForwardExtensionTask(KeccakFTrailExtension& anExtension, const Trail& aTrail, TrailFetcher& aTrailsOut, unsigned int aNrRounds, int aMaxTotalWeight, bool anInput, unsigned int aSubtreeDepth = 0, UINT64 aSubtreeIndex = 0)
+        : extension(anExtension), trail(aTrail), trailsOut(aTrailsOut), nrRounds(aNrRounds), maxTotalWeight(aMaxTotalWeight),
+        input(anInput), subtreeDepth(aSubtreeDepth), subtreeIndex(aSubtreeIndex) {}
+    void run()
+    {
+        if (input)
+            extension.forwardExtendTrail(trail, trailsOut, nrRounds, maxTotalWeight);
+        else
+            extension.recurseForwardExtendTrail(trail, trailsOut, nrRounds, maxTotalWeight, subtreeDepth, subtreeIndex);
+    }
+};
+
+/** This task extends a trail backwards.
+  */
+class BackwardExtensionTask : public Task {
+protected:
+    KeccakFTrailExtension& extension;
+    Trail trail;
+    TrailFetcher& trailsOut;
+    unsigned int nrRounds;
+    int maxTotalWeight;
+    bool input;
+    bool allPrefixes;
+public:
+    BackwardExtensionTask(KeccakFTrailExtension& anExtension, const Trail& aTrail, TrailFetcher& aTrailsOut, unsigned int aNrRounds, int aMaxTotalWeight, bool anInput, bool anAllPrefixes)
+        : extension(anExtension), trail(aTrail), trailsOut(aTrailsOut), nrRounds(aNrRounds), maxTotalWeight(aMaxTotalWeight),
+        input(anInput), allPrefixes(anAllPrefixes) {}
+    void run()
+    {
+        if (input)
+            extension.backwardExtendTrail(trail, trailsOut, nrRounds, maxTotalWeight);
+        else
+            extension.recurseBackwardExtendTrail(trail, trailsOut, nrRounds, maxTotalWeight, allPrefixes);
+    }
+};
+
+void KeccakFTrailExtension::extendTrailsInParallel(TrailIterator& trailsIn, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, bool forward)
+{
+    // The minimum weights are computed lazily, so do it before the tasks read them concurrently.
+    knownBounds.getMinWeight(nrRounds);
+    SynchronizedTrailFetcher synchronizedTrailsOut(trailsOut);
+    TrailFetcher& sharedTrailsOut = trailsOut.isThreadSafe() ? trailsOut : synchronizedTrailsOut;
+    TaskScheduler tasks(nrThreads);
+    const UINT64 maxPendingInputTrails = 16*nrThreads;
+    scheduler = &tasks;
+    progress.stack("File", trailsIn.getCount());
+    // Only the position in the input can be resumed, as the tasks run in an unspecified order.
+    bool resumeInside;
+    UINT64 skip = getResumeSkip(0, resumeInside);
+    resumePath.clear();
+    try {
+        for(UINT64 index=0; !trailsIn.isEnd(); ++trailsIn, ++index) {
+            if (index >= skip) {
+                if (forward)
+                    tasks.submit(new ForwardExtensionTask(*this, *trailsIn, sharedTrailsOut, nrRounds, maxTotalWeight, true));
+                else
+                    tasks.submit(new BackwardExtensionTask(*this, *trailsIn, sharedTrailsOut, nrRounds, maxTotalWeight, true, allPrefixes));
+                tasks.wait(maxPendingInputTrails);
+            }
+            ++progress;
+            if (!checkpointDescription.empty() && (difftime(time(NULL), previousCheckpoint) >= checkpointInterval)) {
+                tasks.wait();
+                checkpointIfNecessary(sharedTrailsOut, vector<UINT64>(1, index+1));
+            }
+        }
+        tasks.wait();
+    }
+    catch(...) {
+        tasks.stop();
+        scheduler = 0;
+        progress.unstack();
+        throw;
+    }
+    scheduler = 0;
+    progress.unstack();
+}
+
+void KeccakFTrailExtension::startCheckpoints(const string& direction, unsigned int nrRounds, int maxTotalWeight)
+{
+    stringstream str;
+    str << direction << " " << dec << nrRounds << " " << dec << maxTotalWeight << " " << (allPrefixes ? 1 : 0);
+    if (!resumePath.empty() && (resumeDescription != str.str()))
+        throw KeccakException("KeccakFTrailExtension: the checkpoint does not match the extension to perform.");
+    if (!checkpointFileName.empty())
+        checkpointDescription = str.str();
+    previousCheckpoint = time(NULL);
+}
+
+void KeccakFTrailExtension::checkpointIfNecessary(TrailFetcher& trailsOut, const vector<UINT64>& position)
+{
+    if (checkpointDescription.empty() || (difftime(time(NULL), previousCheckpoint) < checkpointInterval))
+        return;
+    trailsOut.flush();
+    UINT64 outputPosition = 0;
+    bool outputPositionKnown = trailsOut.getOutputPosition(outputPosition);
+    previousCheckpoint = time(NULL);
+    string tempFileName = getTemporaryFileName(checkpointFileName);
+    {
+        ofstream fout(tempFileName.c_str());
+        fout << checkpointDescription << endl;
+        fout << dec << (outputPositionKnown ? 1 : 0) << " " << outputPosition << endl;
+        fout << dec << position.size();
+        for(unsigned int i=0; i<position.size(); i++)
+            fout << " " << position[i];
+        fout << endl;
+        lock_guard<mutex> guard(minWeightSoFarLock);
+        fout << minWeightSoFar.size();
+        for(unsigned int i=0; i<minWeightSoFar.size(); i++)
+            fout << " " << minWeightSoFar[i];
+        fout << endl;
+        fout.close();
+        if (!fout) {
+            remove(tempFileName.c_str());
+            cerr << "The checkpoint could not be written to " << tempFileName << "; the previous one is kept." << endl;
+            return;
+        }
+    }
+#ifdef _WIN32
+    remove(checkpointFileName.c_str());
+#endif
+    if (rename(tempFileName.c_str(), checkpointFileName.c_str()) != 0) {
+        remove(tempFileName.c_str());
+        cerr << "The checkpoint could not be renamed to " << checkpointFileName << "; the previous one is kept." << endl;
+    }
+}
+
+void KeccakFTrailExtension::endCheckpoints()
+{
+    if (!checkpointDescription.empty())
+        remove(checkpointFileName.c_str());
+    checkpointDescription.clear();
+    resumePath.clear();
+}
+
+bool KeccakFTrailExtension::loadCheckpoint()
+{
+    ifstream fin(checkpointFileName.c_str());
+    if (!fin)
+        return false;
+    getline(fin, resumeDescription);
+    unsigned int known;
+    fin >> dec >> known >> resumeOutputPosition;
+    resumeOutputPositionKnown = (known != 0);
+    unsigned int size;
+    fin >> size;
+    resumePath.resize(size);
+    for(unsigned int i=0; i<size; i++)
+        fin >> resumePath[i];
+    fin >> size;
+    minWeightSoFar.resize(size);
+    for(unsigned int i=0; i<size; i++)
+        fin >> minWeightSoFar[i];
+    if (!fin)
+        throw KeccakException("KeccakFTrailExtension::loadCheckpoint(): the checkpoint file is corrupted.");
+    return true;
+}
+
+bool KeccakFTrailExtension::getResumeOutputPosition(UINT64& position) const
+{
+    position = resumeOutputPosition;
+    return resumeOutputPositionKnown;
+}
+
+UINT64 KeccakFTrailExtension::getResumeSkip(unsigned int level, bool& resumeInside)
+{
+    resumeInside = false;
+    if (level >= resumePath.size())
+        return 0;
+    UINT64 skip = resumePath[level];
+    resumeInside = (level+1 < resumePath.size());
+    if (!resumeInside)
+        resumePath.clear();
+    return skip;
+}
+
 void KeccakFTrailExtension::forwardExtendTrails(TrailIterator& trailsIn, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight)
 {
+    exchangeSharedBounds(nrRounds);
+    startCheckpoints("forward", nrRounds, maxTotalWeight);
+    if (nrThreads > 1) {
+        extendTrailsInParallel(trailsIn, trailsOut, nrRounds, maxTotalWeight, true);
+        endCheckpoints();
+        return;
+    }
     progress.stack("File", trailsIn.getCount());
-    for( ; !trailsIn.isEnd(); ++trailsIn) {
-        forwardExtendTrail(*trailsIn, trailsOut, nrRounds, maxTotalWeight);
+    bool resumeInside;
+    UINT64 skip = getResumeSkip(0, resumeInside);
+    for(UINT64 index=0; !trailsIn.isEnd(); ++trailsIn, ++index) {
+        if (index >= skip)
+            forwardExtendTrail(*trailsIn, trailsOut, nrRounds, maxTotalWeight);
+        if (resumeInside && (index == skip))
+            resumePath.clear();
         ++progress;
+        checkpointIfNecessary(trailsOut, progress.getPosition());
     }
     progress.unstack();
+    endCheckpoints();
 }
 
 void KeccakFTrailExtension::forwardExtendTrail(const Trail& trail, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight)
@@ -218,15 +696,55 @@ void KeccakFTrailExtension::forwardExtendTrail(const Trail& trail, TrailFetcher&
     recurseForwardExtendTrail(trail, trailsOut, nrRounds, maxTotalWeight);
 }
 
-void KeccakFTrailExtension::recurseForwardExtendTrail(const Trail& trail, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight)
+/** This function object processes each candidate state after χ
+  * in the forward extension of a given trail.
+  * If sequential, it skips the states before the checkpoint to resume from, if any, 
+  * and saves checkpoints between the states that lead to further recursion.
+  */
+class ForwardExtensionStep {
+protected:
+    KeccakFTrailExtension& extension;
+    const Trail& trail;
+    TrailFetcher& trailsOut;
+    unsigned int nrRounds;
+    int maxTotalWeight;
+    int maxWeightOut;
+    bool sequential;
+    UINT64 index, skip;
+    bool resumeInside;
+public:
+    ForwardExtensionStep(KeccakFTrailExtension& anExtension, const Trail& aTrail, TrailFetcher& aTrailsOut, unsigned int aNrRounds, int aMaxTotalWeight, int aMaxWeightOut)
+        : extension(anExtension), trail(aTrail), trailsOut(aTrailsOut), nrRounds(aNrRounds), maxTotalWeight(aMaxTotalWeight), maxWeightOut(aMaxWeightOut),
+        sequential(anExtension.scheduler == 0), index(0), skip(0), resumeInside(false)
+    {
+        if (sequential)
+            skip = extension.getResumeSkip(extension.progress.height-1, resumeInside);
+    }
+    void operator()(const vector<SliceValue>& state)
+    {
+        if (index >= skip)
+            extension.forwardExtendTrailWithState(trail, state, trailsOut, nrRounds, maxTotalWeight, maxWeightOut);
+        if (resumeInside && (index == skip))
+            extension.resumePath.clear();
+        index++;
+        if (sequential) {
+            ++extension.progress;
+            if (trail.getNumberOfRounds()+1 < nrRounds)
+                extension.checkpointIfNecessary(trailsOut, extension.progress.getPosition());
+        }
+    }
+};
+
+void KeccakFTrailExtension::recurseForwardExtendTrail(const Trail& trail, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, unsigned int subtreeDepth, UINT64 subtreeIndex)
 {
     int baseWeight = trail.totalWeight;
     int baseNrRounds  = trail.getNumberOfRounds();
     int curNrRounds = baseNrRounds + 1;
     int curWeight = trail.weights.back();
+    maxTotalWeight = getMaxTotalWeight(nrRounds, maxTotalWeight);
     int maxWeightOut = maxTotalWeight - baseWeight
-        - knownBounds.getMinWeight(nrRounds-baseNrRounds-1);
-    if (maxWeightOut < knownBounds.getMinWeight(1))
+        - getLowerBoundOnWeight(nrRounds-baseNrRounds-1);
+    if (maxWeightOut < getLowerBoundOnWeight(1))
         return;
     string synopsis;
     {
@@ -241,69 +759,93 @@ void KeccakFTrailExtension::recurseForwardExtendTrail(const Trail& trail, TrailF
             && (maxWeightOut <= knownSmallWeightStates->getMaxCompleteWeight())) {
         vector<vector<SliceValue> > compatibleStates;
         knownSmallWeightStates->connect(*this, trail.states.back(), maxWeightOut, compatibleStates);
-        progress.stack(synopsis + " [known small-weight states]", compatibleStates.size());
-        for(vector<vector<SliceValue> >::const_iterator i=compatibleStates.begin(); i!=compatibleStates.end(); ++i) {
-            int weightOut = getWeight(*i);
-            int curWeight = baseWeight + weightOut;
-            if (curNrRounds == nrRounds) {
-                bool minTrail = showMinimalTrails && isLessThanMinWeightSoFar(curNrRounds, curWeight);
-                if (minTrail)
-                    cout << "! " << dec << curNrRounds << "-round trail of weight " << dec << curWeight << " found" << endl;
-                if ((curWeight <= maxTotalWeight) || minTrail) {
-                    Trail newTrail(trail);
-                    newTrail.append((*i), weightOut);
-                    trailsOut.fetchTrail(newTrail);
-                }
-            }
-            else {
-                if (weightOut <= maxWeightOut) {
-                    Trail newTrail(trail);
-                    newTrail.append((*i), weightOut);
-                    recurseForwardExtendTrail(newTrail, trailsOut, nrRounds, maxTotalWeight);
-                }
-            }
-            ++progress;
+        if (scheduler == 0)
+            progress.stack(synopsis + " [known small-weight states]", compatibleStates.size());
+        ForwardExtensionStep step(*this, trail, trailsOut, nrRounds, maxTotalWeight, maxWeightOut);
+        for(vector<vector<SliceValue> >::const_iterator i=compatibleStates.begin(); i!=compatibleStates.end(); ++i)
+            step(*i);
+        if (scheduler == 0)
+            progress.unstack();
+    }
+    else {
+        // In a parallel extension, a large affine space is split into subtrees,
+        // each extended by a separate task.
+        const int minWeightToSplit = 16;
+        const unsigned int minGeneratorsPerSubtree = 12;
+        if ((scheduler != 0) && (subtreeDepth == 0) && (curWeight >= minWeightToSplit)) {
+            unsigned int depth = 1;
+            while((((UINT64)1 << depth) < 4*scheduler->getNumberOfThreads()) && (depth + minGeneratorsPerSubtree < (unsigned int)curWeight))
+                depth++;
+            for(UINT64 index=0; index<((UINT64)1 << depth); index++)
+                scheduler->submit(new ForwardExtensionTask(*this, trail, trailsOut, nrRounds, maxTotalWeight, false, depth, index));
+            return;
+        }
+        int maxWeightInAffineBase = maxWeightOut;
+        if (showMinimalTrails && (curNrRounds == (int)nrRounds)) {
+            int minWeight = getMinWeightSoFar(nrRounds);
+            if (minWeight < 0)
+                maxWeightInAffineBase = (nrRowsAndColumns-1)*nrRowsAndColumns*laneSize;
+            else if (minWeight - 1 - baseWeight > maxWeightInAffineBase)
+                maxWeightInAffineBase = minWeight - 1 - baseWeight;
+            maxWeightInAffineBase = getMaxTotalWeight(nrRounds, maxWeightInAffineBase + baseWeight) - baseWeight;
+        }
+        DirectStateIterator i(trail.states.back(), *this, maxWeightInAffineBase, subtreeDepth, subtreeIndex);
+        if (scheduler == 0)
+            progress.stack(synopsis + " [affine base]");
+        ForwardExtensionStep step(*this, trail, trailsOut, nrRounds, maxTotalWeight, maxWeightOut);
+        for(; !i.isEnd(); ++i)
+            step(*i);
+        if (scheduler == 0)
+            progress.unstack();
+    }
+}
+
+void KeccakFTrailExtension::forwardExtendTrailWithState(const Trail& trail, const vector<SliceValue>& state, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, int maxWeightOut)
+{
+    unsigned int curNrRounds = trail.getNumberOfRounds() + 1;
+    int weightOut = getWeight(state);
+    int curWeight = trail.totalWeight + weightOut;
+    if (curNrRounds == nrRounds) {
+        if (isTrailToOutput(curNrRounds, curWeight, maxTotalWeight)) {
+            Trail newTrail(trail);
+            newTrail.append(state, weightOut);
+            trailsOut.fetchTrail(newTrail);
         }
-        progress.unstack();
     }
     else {
-        AffineSpaceOfStates base = buildStateBase(trail.states.back());
-        SlicesAffineSpaceIterator i(base.originalGenerators, base.offset);
-        progress.stack(synopsis + " [affine base]", i.getCount());
-        for(; !i.isEnd(); ++i) {
-            int weightOut = getWeight(*i);
-            int curWeight = baseWeight + weightOut;
-            if (curNrRounds == nrRounds) {
-                bool minTrail = showMinimalTrails && isLessThanMinWeightSoFar(curNrRounds, curWeight);
-                if (minTrail)
-                    cout << "! " << dec << curNrRounds << "-round trail of weight " << dec << curWeight << " found" << endl;
-                if ((curWeight <= maxTotalWeight) || minTrail) {
-                    Trail newTrail(trail);
-                    newTrail.append((*i), weightOut);
-                    trailsOut.fetchTrail(newTrail);
-                }
-            }
-            else {
-                if (weightOut <= maxWeightOut) {
-                    Trail newTrail(trail);
-                    newTrail.append((*i), weightOut);
-                    recurseForwardExtendTrail(newTrail, trailsOut, nrRounds, maxTotalWeight);
-                }
-            }
-            ++progress;
+        if (weightOut <= maxWeightOut) {
+            Trail newTrail(trail);
+            newTrail.append(state, weightOut);
+            if (scheduler != 0)
+                scheduler->submit(new ForwardExtensionTask(*this, newTrail, trailsOut, nrRounds, maxTotalWeight, false));
+            else
+                recurseForwardExtendTrail(newTrail, trailsOut, nrRounds, maxTotalWeight);
         }
-        progress.unstack();
     }
 }
 
 void KeccakFTrailExtension::backwardExtendTrails(TrailIterator& trailsIn, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight)
 {
+    exchangeSharedBounds(nrRounds);
+    startCheckpoints("backward", nrRounds, maxTotalWeight);
+    if (nrThreads > 1) {
+        extendTrailsInParallel(trailsIn, trailsOut, nrRounds, maxTotalWeight, false);
+        endCheckpoints();
+        return;
+    }
     progress.stack("File", trailsIn.getCount());
-    for( ; !trailsIn.isEnd(); ++trailsIn) {
-        backwardExtendTrail(*trailsIn, trailsOut, nrRounds, maxTotalWeight);
+    bool resumeInside;
+    UINT64 skip = getResumeSkip(0, resumeInside);
+    for(UINT64 index=0; !trailsIn.isEnd(); ++trailsIn, ++index) {
+        if (index >= skip)
+            backwardExtendTrail(*trailsIn, trailsOut, nrRounds, maxTotalWeight);
+        if (resumeInside && (index == skip))
+            resumePath.clear();
         ++progress;
+        checkpointIfNecessary(trailsOut, progress.getPosition());
     }
     progress.unstack();
+    endCheckpoints();
 }
 
 void KeccakFTrailExtension::backwardExtendTrail(const Trail& trail, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight)
@@ -328,10 +870,7 @@ void KeccakFTrailExtension::recurseBackwardExtendTrail(const Trail& trail, Trail
         reverseLambda(trail.states[0], stateAfterChi);
         int curMinReverseWeight = getMinReverseWeight(stateAfterChi);
         int curWeight = baseWeight + curMinReverseWeight;
-        bool minTrail = showMinimalTrails && isLessThanMinWeightSoFar(nrRounds, curWeight);
-        if (minTrail)
-            cout << "! " << dec << nrRounds << "-round trail of weight " << dec << curWeight << " found" << endl;
-        if ((curWeight <= maxTotalWeight) || minTrail) {
+        if (isTrailToOutput(nrRounds, curWeight, maxTotalWeight)) {
             Trail newTrail;
             newTrail.setFirstStateReverseMinimumWeight(curMinReverseWeight);
             newTrail.append(trail);
@@ -341,13 +880,14 @@ void KeccakFTrailExtension::recurseBackwardExtendTrail(const Trail& trail, Trail
     else {
         int baseWeight = trail.totalWeight;
         int baseNrRounds  = trail.getNumberOfRounds();
+        maxTotalWeight = getMaxTotalWeight(nrRounds, maxTotalWeight);
         int maxWeightOut = maxTotalWeight - baseWeight
-            - knownBounds.getMinWeight(nrRounds-baseNrRounds-1);
-        if (maxWeightOut < knownBounds.getMinWeight(1))
+            - getLowerBoundOnWeight(nrRounds-baseNrRounds-1);
+        if (maxWeightOut < getLowerBoundOnWeight(1))
             return;
         vector<SliceValue> stateAfterChi;
         reverseLambda(trail.states[0], stateAfterChi);
-        ReverseStateIterator i(stateAfterChi, *this, maxWeightOut);
+        ReverseStateIterator i(stateAfterChi, *this, maxWeightOut, weightOrderedBackwardExtension);
         if (i.isEmpty())
             return;
         int curNrRounds = baseNrRounds + 1;
@@ -355,16 +895,20 @@ void KeccakFTrailExtension::recurseBackwardExtendTrail(const Trail& trail, Trail
             stringstream str;
             str << dec << getNrActiveRows(stateAfterChi) << " active rows towards round -" << dec << curNrRounds;
             str << " (limiting weight to " << dec << maxWeightOut << ")";
-            progress.stack(str.str());
+            if (scheduler == 0)
+                progress.stack(str.str());
         }
-        for(; !i.isEnd(); ++i) {
+        bool resumeInside = false;
+        UINT64 skip = (scheduler == 0) ? getResumeSkip(progress.height-1, resumeInside) : 0;
+        for(UINT64 index=0; !i.isEnd(); ++i, ++index) {
+            if (index < skip) {
+                ++progress;
+                continue;
+            }
             int weightOut = getWeight(*i);
             int curWeight = baseWeight + weightOut;
             if (curNrRounds == nrRounds) {
-                bool minTrail = showMinimalTrails && isLessThanMinWeightSoFar(nrRounds, curWeight);
-                if (minTrail)
-                    cout << "! " << dec << nrRounds << "-round trail of weight " << dec << curWeight << " found" << endl;
-                if ((curWeight <= maxTotalWeight) || minTrail) {
+                if (isTrailToOutput(nrRounds, curWeight, maxTotalWeight)) {
                     Trail newTrail(trail);
                     newTrail.prepend((*i), weightOut);
                     trailsOut.fetchTrail(newTrail);
@@ -372,15 +916,282 @@ void KeccakFTrailExtension::recurseBackwardExtendTrail(const Trail& trail, Trail
             }
             else {
                 int minPrevWeight = getMinReverseWeightAfterLambda(*i);
-                if ((curWeight + minPrevWeight + knownBounds.getMinWeight(nrRounds-curNrRounds-1)) <= maxTotalWeight) {
+                if ((curWeight + minPrevWeight + getLowerBoundOnWeight(nrRounds-curNrRounds-1)) <= maxTotalWeight) {
                     Trail newTrail(trail);
                     newTrail.prepend((*i), weightOut);
-                    recurseBackwardExtendTrail(newTrail, trailsOut, nrRounds, maxTotalWeight, allPrefixes);
+                    if (scheduler != 0)
+                        scheduler->submit(new BackwardExtensionTask(*this, newTrail, trailsOut, nrRounds, maxTotalWeight, false, allPrefixes));
+                    else
+                        recurseBackwardExtendTrail(newTrail, trailsOut, nrRounds, maxTotalWeight, allPrefixes);
                 }
             }
-            ++progress;
+            if (resumeInside && (index == skip))
+                resumePath.clear();
+            if (scheduler == 0) {
+                ++progress;
+                checkpointIfNecessary(trailsOut, progress.getPosition());
+            }
         }
-        progress.unstack();
+        if (scheduler == 0)
+            progress.unstack();
     }
 }
 
+
+void BestFirstNode::load(istream& fin)
+{
+    int allPrefixesAsInt;
+    fin >> dec >> bound >> allPrefixesAsInt;
+    allPrefixes = (allPrefixesAsInt != 0);
+    trail.load(fin);
+}
+
+void BestFirstNode::save(ostream& fout) const
+{
+    fout << dec << bound << " " << (allPrefixes ? 1 : 0) << " ";
+    trail.save(fout);
+}
+
+BestFirstQueue::BestFirstQueue(const string& aSpillFileName, UINT64 aMaxNodesInMemory)
+    : spillFileName(getTemporaryFileName(aSpillFileName)), maxNodesInMemory(aMaxNodesInMemory), nrNodesInMemory(0)
+{
+    if (maxNodesInMemory < 2)
+        maxNodesInMemory = 2;
+}
+
+BestFirstQueue::~BestFirstQueue()
+{
+    for(map<int, SpilledNodes>::const_iterator i=nodesOnDisk.begin(); i!=nodesOnDisk.end(); ++i)
+        remove(getSpillFileName(i->first).c_str());
+}
+
+void BestFirstQueue::push(const BestFirstNode& node, int priority)
+{
+    nodesInMemory[priority].push_back(node);
+    nrNodesInMemory++;
+    if (nrNodesInMemory > maxNodesInMemory)
+        spill();
+}
+
+bool BestFirstQueue::isEmpty() const
+{
+    return nodesInMemory.empty() && nodesOnDisk.empty();
+}
+
+int BestFirstQueue::getTopPriority() const
+{
+    if (nodesInMemory.empty())
+        return nodesOnDisk.begin()->first;
+    if (nodesOnDisk.empty())
+        return nodesInMemory.begin()->first;
+    return min(nodesInMemory.begin()->first, nodesOnDisk.begin()->first);
+}
+
+BestFirstNode BestFirstQueue::pop()
+{
+    int priority = getTopPriority();
+    map<int, vector<BestFirstNode> >::iterator i = nodesInMemory.find(priority);
+    if (i == nodesInMemory.end()) {
+        reload(priority);
+        i = nodesInMemory.find(priority);
+    }
+    BestFirstNode node(i->second.back());
+    i->second.pop_back();
+    nrNodesInMemory--;
+    if (i->second.empty())
+        nodesInMemory.erase(i);
+    return node;
+}
+
+UINT64 BestFirstQueue::getSize() const
+{
+    UINT64 size = nrNodesInMemory;
+    for(map<int, SpilledNodes>::const_iterator i=nodesOnDisk.begin(); i!=nodesOnDisk.end(); ++i)
+        size += i->second.count;
+    return size;
+}
+
+void BestFirstQueue::spill()
+{
+    // Move the nodes with the highest priorities to disk, until half of the memory is free.
+    while((nrNodesInMemory > maxNodesInMemory/2) && !nodesInMemory.empty()) {
+        map<int, vector<BestFirstNode> >::iterator i = nodesInMemory.end();
+        --i;
+        ofstream fout(getSpillFileName(i->first).c_str(), ios::app);
+        SpilledNodes& spilled = nodesOnDisk[i->first];
+        if (spilled.count == 0)
+            spilled.readPosition = 0;
+        while((nrNodesInMemory > maxNodesInMemory/2) && !i->second.empty()) {
+            i->second.back().save(fout);
+            i->second.pop_back();
+            nrNodesInMemory--;
+            spilled.count++;
+        }
+        if (!fout)
+            throw KeccakException("BestFirstQueue::spill(): could not write to '" + getSpillFileName(i->first) + "'.");
+        if (i->second.empty())
+            nodesInMemory.erase(i);
+    }
+}
+
+void BestFirstQueue::reload(int priority)
+{
+    map<int, SpilledNodes>::iterator i = nodesOnDisk.find(priority);
+    string fileName = getSpillFileName(priority);
+    ifstream fin(fileName.c_str());
+    fin.seekg(i->second.readPosition);
+    vector<BestFirstNode>& nodes = nodesInMemory[priority];
+    UINT64 toLoad = min(i->second.count, max(maxNodesInMemory/2, (UINT64)1));
+    for(UINT64 j=0; j<toLoad; j++) {
+        BestFirstNode node;
+        node.load(fin);
+        if (!fin)
+            throw KeccakException("BestFirstQueue::reload(): could not read from '" + fileName + "'.");
+        nodes.push_back(node);
+        nrNodesInMemory++;
+    }
+    i->second.count -= toLoad;
+    i->second.readPosition = fin.tellg();
+    fin.close();
+    if (i->second.count == 0) {
+        nodesOnDisk.erase(i);
+        remove(fileName.c_str());
+    }
+}
+
+string BestFirstQueue::getSpillFileName(int priority) const
+{
+    stringstream str;
+    str << spillFileName << "-" << dec << priority;
+    return str.str();
+}
+
+UINT64 KeccakFTrailExtension::forwardExtendTrailsBestFirst(TrailIterator& trailsIn, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, UINT64 maxNrTrails)
+{
+    return extendTrailsBestFirst(trailsIn, trailsOut, nrRounds, maxTotalWeight, maxNrTrails, true);
+}
+
+UINT64 KeccakFTrailExtension::backwardExtendTrailsBestFirst(TrailIterator& trailsIn, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, UINT64 maxNrTrails)
+{
+    return extendTrailsBestFirst(trailsIn, trailsOut, nrRounds, maxTotalWeight, maxNrTrails, false);
+}
+
+UINT64 KeccakFTrailExtension::extendTrailsBestFirst(TrailIterator& trailsIn, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, UINT64 maxNrTrails, bool forward)
+{
+    exchangeSharedBounds(nrRounds);
+    BestFirstQueue queue(bestFirstSpillFileName.empty() ? buildFileName("-best-first") : bestFirstSpillFileName, 
+        bestFirstMaxTrailsInMemory);
+    for( ; !trailsIn.isEnd(); ++trailsIn) {
+        const Trail& trail = *trailsIn;
+        if (forward) {
+            if (trail.stateAfterLastChiSpecified)
+                throw KeccakException("KeccakFTrailExtension::forwardExtendTrailsBestFirst() can work only with trail cores or trail prefixes.");
+            pushBestFirstRoot(trail, false, queue, nrRounds, maxTotalWeight);
+        }
+        else if (trail.firstStateSpecified)
+            pushBestFirstRoot(trail, true, queue, nrRounds, maxTotalWeight);
+        else {
+            Trail prefix;
+            for(unsigned int i=1; i<trail.states.size(); i++)
+                prefix.append(trail.states[i], trail.weights[i]);
+            pushBestFirstRoot(prefix, allPrefixes, queue, nrRounds, maxTotalWeight);
+        }
+    }
+    UINT64 nrTrailsOut = 0;
+    progress.stack(string(forward ? "Forward" : "Backward") + " best-first extension");
+    while(!queue.isEmpty() && ((maxNrTrails == 0) || (nrTrailsOut < maxNrTrails))) {
+        int curMaxTotalWeight = getMaxTotalWeight(nrRounds, maxTotalWeight, true);
+        if (queue.getTopPriority() > curMaxTotalWeight)
+            break;
+        BestFirstNode node(queue.pop());
+        if (node.trail.getNumberOfRounds() == nrRounds) {
+            if (sharedBounds != 0)
+                sharedBounds->publishTrailWeight(nrRounds, node.trail.totalWeight);
+            trailsOut.fetchTrail(node.trail);
+            nrTrailsOut++;
+        }
+        else
+            expandBestFirst(node, queue, nrRounds, curMaxTotalWeight, forward);
+        ++progress;
+    }
+    progress.unstack();
+    trailsOut.flush();
+    return nrTrailsOut;
+}
+
+void KeccakFTrailExtension::pushBestFirstRoot(const Trail& trail, bool nodeAllPrefixes, BestFirstQueue& queue, unsigned int nrRounds, int maxTotalWeight)
+{
+    if (trail.getNumberOfRounds() >= nrRounds)
+        return;
+    int bound = trail.totalWeight + getLowerBoundOnWeight(nrRounds-trail.getNumberOfRounds());
+    if (bound <= maxTotalWeight)
+        queue.push(BestFirstNode(trail, bound, nodeAllPrefixes), bound);
+}
+
+void KeccakFTrailExtension::expandBestFirst(const BestFirstNode& node, BestFirstQueue& queue, unsigned int nrRounds, int maxTotalWeight, bool forward)
+{
+    const Trail& trail = node.trail;
+    int baseWeight = trail.totalWeight;
+    unsigned int remainingNrRounds = nrRounds - trail.getNumberOfRounds();
+    if (!forward && !node.allPrefixes && (remainingNrRounds == 1)) {
+        // The trail core is completed by the minimum reverse weight of its first state.
+        vector<SliceValue> stateAfterChi;
+        reverseLambda(trail.states[0], stateAfterChi);
+        int minReverseWeight = getMinReverseWeight(stateAfterChi);
+        int bound = max(node.bound, baseWeight + minReverseWeight);
+        if (bound <= maxTotalWeight) {
+            BestFirstNode child;
+            child.trail.setFirstStateReverseMinimumWeight(minReverseWeight);
+            child.trail.append(trail);
+            child.bound = bound;
+            child.allPrefixes = node.allPrefixes;
+            queue.push(child, bound);
+        }
+        return;
+    }
+    // Generate all the extensions within maxTotalWeight at once, 
+    // each queued according to its own bound.
+    int minRemainingWeight = getLowerBoundOnWeight(remainingNrRounds-1);
+    int maxWeightOut = maxTotalWeight - baseWeight - minRemainingWeight;
+    if (maxWeightOut < getLowerBoundOnWeight(1))
+        return;
+    if (forward) {
+        const int minWeightInLookingForSmallWeightStates = 16;
+        if (((int)trail.weights.back() >= minWeightInLookingForSmallWeightStates) && (knownSmallWeightStates != 0) 
+                && (maxWeightOut <= knownSmallWeightStates->getMaxCompleteWeight())) {
+            vector<vector<SliceValue> > compatibleStates;
+            knownSmallWeightStates->connect(*this, trail.states.back(), maxWeightOut, compatibleStates);
+            for(unsigned int i=0; i<compatibleStates.size(); i++)
+                pushBestFirstChild(node, compatibleStates[i], queue, nrRounds, maxTotalWeight, forward);
+        }
+        else
+            for(DirectStateIterator i(trail.states.back(), *this, maxWeightOut); !i.isEnd(); ++i)
+                pushBestFirstChild(node, *i, queue, nrRounds, maxTotalWeight, forward);
+    }
+    else {
+        vector<SliceValue> stateAfterChi;
+        reverseLambda(trail.states[0], stateAfterChi);
+        ReverseStateIterator i(stateAfterChi, *this, maxWeightOut);
+        if (!i.isEmpty())
+            for(; !i.isEnd(); ++i)
+                pushBestFirstChild(node, *i, queue, nrRounds, maxTotalWeight, forward);
+    }
+}
+
+void KeccakFTrailExtension::pushBestFirstChild(const BestFirstNode& node, const vector<SliceValue>& state, BestFirstQueue& queue, unsigned int nrRounds, int maxTotalWeight, bool forward)
+{
+    unsigned int remainingNrRounds = nrRounds - node.trail.getNumberOfRounds();
+    int weightOut = getWeight(state);
+    int curWeight = node.trail.totalWeight + weightOut;
+    int bound = max(node.bound, curWeight + getLowerBoundOnWeight(remainingNrRounds-1));
+    if (!forward && (remainingNrRounds > 1))
+        bound = max(bound, curWeight + (int)getMinReverseWeightAfterLambda(state) + getLowerBoundOnWeight(remainingNrRounds-2));
+    if (bound > maxTotalWeight)
+        return;
+    BestFirstNode child(node.trail, bound, node.allPrefixes);
+    if (forward)
+        child.trail.append(state, weightOut);
+    else
+        child.trail.prepend(state, weightOut);
+    queue.push(child, bound);
+}
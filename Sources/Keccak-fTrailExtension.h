@@ -17,9 +17,13 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #define _KECCAKFTRAILEXTENSION_H_
 
 #include <map>
+#include <mutex>
+#include <time.h>
 #include <vector>
 #include "Keccak-fPropagation.h"
 #include "progress.h"
+#include "sharedbounds.h"
+#include "taskscheduler.h"
 
 using namespace std;
 
@@ -28,11 +32,15 @@ using namespace std;
   * This is typically used during trail extension to avoid looking for trails
   * with weight lower than the lower bound, or to exclude a subspace
   * already covered.
+  * The bounds that are proven, i.e., that hold for all trails, are kept
+  * apart so that only those can be shared with other searches.
   */
 class LowWeightExclusion {
 protected:
     /** The explicitly excluded weights per number of rounds. */
     map<unsigned int, int> excludedWeight;
+    /** The proven lower bounds per number of rounds. */
+    map<unsigned int, int> provenWeight;
     /** The interpolated minimum weights per number of rounds. 
       * Note that minWeight[nrRounds-1] contains the minimum weight
       * for nrRounds rounds.
@@ -47,6 +55,20 @@ public:
       * @param  weight  The weight below which trails are to be excluded.
       */
     void excludeBelowWeight(unsigned int nrRounds, int weight);
+    /** This method records that all trails with the given number of rounds
+      * have at least the given weight, and excludes the trails below it
+      * unless a higher weight is already excluded.
+      * @param  nrRounds    The number of rounds.
+      * @param  weight  The proven lower bound on the weight.
+      */
+    void setProvenLowerBound(unsigned int nrRounds, int weight);
+    /** For a given number of rounds, this function returns the lower bound
+      * on the weight that follows from the proven bounds only,
+      * i.e., regardless of the other exclusions.
+      * @param  nrRounds    The number of rounds.
+      * @return The proven lower bound on the weight.
+      */
+    int getProvenLowerBound(unsigned int nrRounds) const;
     /** For a given number of rounds, this function returns the minimum weight
       * to consider.
       * @param  nrRounds    The number of rounds.
@@ -61,6 +83,12 @@ protected:
 /** Class that contains all states C after χ such that D=λ(C) has low weight.
   * This allows to quickly check whether a state B can be connected 
   * to such a state C through χ.
+  *
+  * Since χ is invertible, B and C must have the same active rows.
+  * The states are therefore indexed by a signature of their active-row pattern
+  * that does not depend on translation in z, so that only the states with
+  * the same pattern, and only the translations that align the patterns,
+  * have to be checked.
   */
 class KnownSmallWeightStates {
 protected:
@@ -72,6 +100,19 @@ protected:
      * statesAfterChiPerWeight is complete.
      */
     int maxCompleteWeight;
+    /** This structure refers to a state in statesAfterChiPerWeight from the index. */
+    struct IndexEntry {
+        /** The weight of D=λ(C). */
+        unsigned int weight;
+        /** The position of C in statesAfterChiPerWeight[weight]. */
+        unsigned int index;
+        /** The translation offsets at which the signature is attained,
+          * see getSignature().
+          */
+        UINT64 offsets;
+    };
+    /** The index of the states, per signature of their active-row pattern. */
+    map<UINT64, vector<IndexEntry> > statesPerSignature;
 public:
     /** Constructor that initializes an empty set of states.
       * @param  aMaxCompleteWeight  The intended weight up to which the set is complete.
@@ -95,6 +136,19 @@ public:
       *     The states fetched are interpreted as D=λ(C).
       */
     void loadFromFile(const KeccakFPropagation& DCorLC, const string& fileName);
+    /** Method that loads states from a binary file written by saveToBinaryFile().
+      * The file is rejected if it was produced for another width, 
+      * another propagation type or another value of maxCompleteWeight,
+      * or if the file of trails it was extracted from has changed size
+      * or modification time since.
+      * @param  DCorLC The propagation context, 
+      *                 as a reference to a KeccakFPropagation object.
+      * @param  fileName    The name of the binary file.
+      * @param  sourceFileName  The name of the file of trails the states were extracted from,
+      *     see loadFromFile().
+      * @return True iff the file could be read and matches the parameters.
+      */
+    bool loadFromBinaryFile(const KeccakFPropagation& DCorLC, const string& fileName, const string& sourceFileName);
     /** Method that returns maxCompleteWeight.
       * @return The intended weight up to which the set is complete.
       */
@@ -118,10 +172,111 @@ public:
       * @param  fileName    The name of the file to save to.
       */
     void saveToFile(const KeccakFPropagation& DCorLC, const string& fileName) const;
+    /** Method that stores all the states in a compact binary file,
+      * which can be read back much faster than a file of trails.
+      * The states C are saved slice by slice, omitting the zero slices.
+      * @param  DCorLC The propagation context, 
+      *                 as a reference to a KeccakFPropagation object.
+      * @param  fileName    The name of the file to save to.
+      * @param  sourceFileName  The name of the file of trails the states were extracted from,
+      *     whose size and modification time are recorded, see loadFromBinaryFile().
+      * @return True iff the file could be written.
+      */
+    bool saveToBinaryFile(const KeccakFPropagation& DCorLC, const string& fileName, const string& sourceFileName) const;
 protected:
     void addState(const KeccakFPropagation& DCorLC, const vector<SliceValue>& state);
+    void addStateAfterChi(unsigned int weight, const vector<SliceValue>& stateAfterChi);
     void connect(const KeccakFPropagation& DCorLC, const vector<SliceValue>& inputState, 
-        const vector<SliceValue>& candidate, vector<vector<SliceValue> >& compatibleStates) const;
+        const vector<SliceValue>& candidate, UINT64 translations, vector<vector<SliceValue> >& compatibleStates) const;
+    /** This function computes a signature of the active-row pattern of a state
+      * that is invariant under translation in z.
+      * The pattern is seen as a cyclic string of slices, each slice being 
+      * represented by the set of its active rows. A polynomial hash is
+      * rolled over all the rotations of this string and the signature is the
+      * smallest of these hashes.
+      * @param  state   The state to compute the signature of.
+      * @param  offsets The set of rotations, as a bit mask, 
+      *     for which the smallest hash is attained.
+      *     If the active rows of a state B in slice z are those of a state C 
+      *     in slice z+dz for all z, then dz+o is an offset of C
+      *     for any offset o of B.
+      * @return The signature.
+      */
+    static UINT64 getSignature(const vector<SliceValue>& state, UINT64& offsets);
+};
+
+/** This structure contains a trail waiting to be extended 
+  * in a best-first trail extension, see BestFirstQueue.
+  */
+struct BestFirstNode {
+    /** The trail to extend. */
+    Trail trail;
+    /** A lower bound on the weight of the trails obtained by extending @a trail. */
+    int bound;
+    /** In a backward extension, whether to look for all prefixes or just for trail cores. */
+    bool allPrefixes;
+    /** This constructor creates a node with an empty trail. */
+    BestFirstNode() : bound(0), allPrefixes(false) {}
+    /** This constructor creates a node with the given trail. */
+    BestFirstNode(const Trail& aTrail, int aBound, bool anAllPrefixes)
+        : trail(aTrail), bound(aBound), allPrefixes(anAllPrefixes) {}
+    /** This method loads the node from a stream, as written by save(). */
+    void load(istream& fin);
+    /** This method outputs the node to a stream, on a single line. */
+    void save(ostream& fout) const;
+};
+
+/** This class implements a priority queue of BestFirstNode objects,
+  * with integer priorities. The nodes with the lowest priority come first.
+  * When the number of nodes in memory exceeds a given limit, the nodes
+  * with the highest priorities are moved to disk, in one file per priority, 
+  * and they are loaded back when their priority is reached.
+  */
+class BestFirstQueue {
+protected:
+    /** The nodes in memory, per priority. */
+    map<int, vector<BestFirstNode> > nodesInMemory;
+    /** This structure describes the nodes of a given priority moved to disk. */
+    struct SpilledNodes {
+        /** The number of nodes in the file not yet loaded back. */
+        UINT64 count;
+        /** The position in the file of the first node not yet loaded back. */
+        streamoff readPosition;
+    };
+    /** The nodes on disk, per priority. */
+    map<int, SpilledNodes> nodesOnDisk;
+    /** The prefix of the names of the files where the nodes are moved. */
+    string spillFileName;
+    /** The maximum number of nodes in memory. */
+    UINT64 maxNodesInMemory;
+    /** The current number of nodes in memory. */
+    UINT64 nrNodesInMemory;
+public:
+    /** The constructor.
+      * @param  aSpillFileName  The prefix of the names of the files where the nodes are moved.
+      *     It is made unique to the process and to the queue with getTemporaryFileName(),
+      *     so that several queues can share it.
+      * @param  aMaxNodesInMemory   The maximum number of nodes in memory.
+      */
+    BestFirstQueue(const string& aSpillFileName, UINT64 aMaxNodesInMemory);
+    /** The destructor removes the files still in use. */
+    ~BestFirstQueue();
+    /** This method adds a node with the given priority. */
+    void push(const BestFirstNode& node, int priority);
+    /** This method returns true iff the queue is empty. */
+    bool isEmpty() const;
+    /** This method returns the lowest priority in the queue. The queue must not be empty. */
+    int getTopPriority() const;
+    /** This method removes one of the nodes with the lowest priority and returns it.
+      * The queue must not be empty.
+      */
+    BestFirstNode pop();
+    /** This method returns the number of nodes in the queue, in memory or on disk. */
+    UINT64 getSize() const;
+protected:
+    void spill();
+    void reload(int priority);
+    string getSpillFileName(int priority) const;
 };
 
 /** This class provides trail extension services.
@@ -137,6 +292,39 @@ public:
       * not just trail cores.
       */
     bool allPrefixes;
+    /** If true, the backward extension visits the states before χ
+      * in nondecreasing weight order (see ReverseStateIterator), 
+      * so that the lightest trails are found first.
+      * This takes more memory, as the iterator keeps a frontier of combinations.
+      */
+    bool weightOrderedBackwardExtension;
+    /** The number of threads used by forwardExtendTrails() and backwardExtendTrails().
+      * If 1 (the default), the trails are processed sequentially.
+      * Otherwise, the extension of each trail is a task for a TaskScheduler,
+      * which spawns a task per extended trail and, for large affine spaces, 
+      * per subtree of the DirectStateIterator.
+      * The trails are then output in an unspecified order.
+      */
+    unsigned int nrThreads;
+    /** If not empty, forwardExtendTrails() and backwardExtendTrails() periodically save 
+      * their position in the search to the file with this name, and remove it when done.
+      * Each checkpoint is written to a temporary file and then renamed,
+      * so the previous one is kept if saving fails.
+      * See also loadCheckpoint().
+      */
+    string checkpointFileName;
+    /** The minimum time between two checkpoints, in seconds. */
+    unsigned int checkpointInterval;
+    /** The maximum number of trails that forwardExtendTrailsBestFirst() and
+      * backwardExtendTrailsBestFirst() keep in memory before moving some to disk.
+      */
+    UINT64 bestFirstMaxTrailsInMemory;
+    /** The prefix of the names of the files where forwardExtendTrailsBestFirst() and
+      * backwardExtendTrailsBestFirst() move trails to, typically the name of the output file. 
+      * If empty, the name is built with buildFileName(), in the current directory.
+      * See BestFirstQueue::BestFirstQueue().
+      */
+    string bestFirstSpillFileName;
     /** This LowWeightExclusion object specifies search areas to exclude,
       * primarily because bounds are known. For instance, this expresses
       * that any 2-round trail in Keccak-f has at least weight 8, 
@@ -149,9 +337,44 @@ public:
       * trail extension.
       */
     KnownSmallWeightStates *knownSmallWeightStates;
+    /** This optional SharedWeightBounds object pointer provides bounds shared
+      * with other searches, possibly in other threads or processes.
+      * When set, the extension imports its lower bounds as proven bounds into
+      * @a knownBounds and publishes the proven bounds of @a knownBounds in return,
+      * but not the other exclusions. During the search, it reads the shared
+      * lower bounds again each time it bounds the weight of the remaining rounds,
+      * and it publishes the weight of each trail it outputs.
+      * See also @a limitToLightestSharedWeight.
+      * This object is not freed by the destructor.
+      */
+    SharedWeightBounds *sharedBounds;
+    /** If true (default is false), and if @a sharedBounds is set, the searches for 
+      * the lightest trails, i.e., forwardExtendTrailsBestFirst(), backwardExtendTrailsBestFirst() and
+      * the other extensions with @a showMinimalTrails, do not look for trails heavier than 
+      * the lightest one published with the target number of rounds,
+      * consulting the shared value at every recursion step.
+      * As the shared value changes during the search, the trails output then depend on timing.
+      * Otherwise, all the trails up to the requested maximum weight are output.
+      */
+    bool limitToLightestSharedWeight;
 protected:
     vector<int> minWeightSoFar;
+    mutex minWeightSoFarLock;
     ProgressMeter progress;
+    /** The scheduler running the tasks, if in a parallel extension, or 0 otherwise.
+      * The progress meter is only used if sequential. */
+    TaskScheduler *scheduler;
+    /** The position to resume from, as the index at each level of the progress meter. */
+    vector<UINT64> resumePath;
+    /** The description of the extension to resume. */
+    string resumeDescription;
+    /** Whether the checkpoint to resume from records the length of the output. */
+    bool resumeOutputPositionKnown;
+    /** The length of the output at the checkpoint to resume from, in bytes. */
+    UINT64 resumeOutputPosition;
+    /** The description of the extension being checkpointed, or empty if none. */
+    string checkpointDescription;
+    time_t previousCheckpoint;
 public:
     /** The constructor. See KeccakFPropagation::KeccakFPropagation(). */
     KeccakFTrailExtension(const KeccakFDCLC& aParent, KeccakFPropagation::DCorLC aDCorLC);
@@ -201,10 +424,70 @@ public:
       * @param  maxTotalWeight  The maximum total weight to consider.
       */
     void backwardExtendTrails(TrailIterator& trailsIn, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight);
+    /** This method loads the checkpoint saved in the file @a checkpointFileName, if any,
+      * so that the next call to forwardExtendTrails() or backwardExtendTrails() resumes from it.
+      * This call must have the same input trails and parameters as the interrupted one.
+      * The trails output since the checkpoint are output again, so the caller 
+      * has to truncate the output to the length recorded in the checkpoint,
+      * see getResumeOutputPosition() and TrailAppendToFile.
+      * With several threads, the checkpoints are saved only between input trails.
+      * @return True iff a checkpoint was loaded.
+      */
+    bool loadCheckpoint();
+    /** This method gives the length of the output when the checkpoint loaded by
+      * loadCheckpoint() was saved, as given by TrailFetcher::getOutputPosition().
+      * @param  position    The length of the output, in bytes.
+      * @return True iff the checkpoint records it.
+      */
+    bool getResumeOutputPosition(UINT64& position) const;
+    /** This function looks for the same trails as forwardExtendTrails(), 
+      * but it outputs them in nondecreasing weight order. This way, one can ask 
+      * for the @a maxNrTrails lightest trails and set @a maxTotalWeight 
+      * generously, as the search stops once enough trails are found.
+      * The partial trails are kept in a BestFirstQueue, ordered by their weight
+      * plus the minimum weight of the remaining rounds according to @a knownBounds.
+      * When a partial trail comes first in the queue, its extensions within 
+      * @a maxTotalWeight are generated once and queued according to their own bound.
+      * @param  trailsIn    The starting trail cores or trail prefixes.
+      * @param  trailsOut   Where to output the found trails.
+      * @param  nrRounds    The target number of rounds.
+      * @param  maxTotalWeight  The maximum total weight to consider.
+      * @param  maxNrTrails The number of trails after which to stop, or 0 to output all trails.
+      * @return The number of trails output.
+      */
+    UINT64 forwardExtendTrailsBestFirst(TrailIterator& trailsIn, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, UINT64 maxNrTrails = 0);
+    /** This function is like forwardExtendTrailsBestFirst(), 
+      * but for the trails found by backwardExtendTrails().
+      * @param  trailsIn    The starting trail cores or trail prefixes.
+      * @param  trailsOut   Where to output the found trails.
+      * @param  nrRounds    The target number of rounds.
+      * @param  maxTotalWeight  The maximum total weight to consider.
+      * @param  maxNrTrails The number of trails after which to stop, or 0 to output all trails.
+      * @return The number of trails output.
+      */
+    UINT64 backwardExtendTrailsBestFirst(TrailIterator& trailsIn, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, UINT64 maxNrTrails = 0);
 protected:
-    void recurseForwardExtendTrail(const Trail& trail, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight);
+    void recurseForwardExtendTrail(const Trail& trail, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, unsigned int subtreeDepth = 0, UINT64 subtreeIndex = 0);
+    void forwardExtendTrailWithState(const Trail& trail, const vector<SliceValue>& state, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, int maxWeightOut);
     void recurseBackwardExtendTrail(const Trail& trail, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, bool allPrefixes);
-    bool isLessThanMinWeightSoFar(unsigned int nrRounds, int weight);
+    void extendTrailsInParallel(TrailIterator& trailsIn, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, bool forward);
+    void startCheckpoints(const string& direction, unsigned int nrRounds, int maxTotalWeight);
+    void checkpointIfNecessary(TrailFetcher& trailsOut, const vector<UINT64>& position);
+    void endCheckpoints();
+    UINT64 getResumeSkip(unsigned int level, bool& resumeInside);
+    bool isMinimalTrail(unsigned int nrRounds, int weight);
+    int getMinWeightSoFar(unsigned int nrRounds);
+    int getLowerBoundOnWeight(unsigned int nrRounds);
+    void exchangeSharedBounds(unsigned int nrRounds);
+    int getMaxTotalWeight(unsigned int nrRounds, int maxTotalWeight, bool bestFirst = false) const;
+    bool isTrailToOutput(unsigned int nrRounds, int weight, int maxTotalWeight);
+    UINT64 extendTrailsBestFirst(TrailIterator& trailsIn, TrailFetcher& trailsOut, unsigned int nrRounds, int maxTotalWeight, UINT64 maxNrTrails, bool forward);
+    void pushBestFirstRoot(const Trail& trail, bool nodeAllPrefixes, BestFirstQueue& queue, unsigned int nrRounds, int maxTotalWeight);
+    void expandBestFirst(const BestFirstNode& node, BestFirstQueue& queue, unsigned int nrRounds, int maxTotalWeight, bool forward);
+    void pushBestFirstChild(const BestFirstNode& node, const vector<SliceValue>& state, BestFirstQueue& queue, unsigned int nrRounds, int maxTotalWeight, bool forward);
+    friend class ForwardExtensionStep;
+    friend class ForwardExtensionTask;
+    friend class BackwardExtensionTask;
 };
 
 #endif
@@ -13,10 +13,24 @@ and related or neighboring rights to the source code in this file.
 http://creativecommons.org/publicdomain/zero/1.0/
 */
 
+#include <atomic>
+#include <cstdio>
 #include <fstream>
+#include <map>
+#include <sstream>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "Keccak-fDisplay.h"
 #include "Keccak-fPropagation.h"
 #include "Keccak-fTrails.h"
+#include "tablecache.h"
+#include "taskscheduler.h"
+#include "translationsymmetry.h"
 
 using namespace std;
 
@@ -271,6 +285,139 @@ void Trail::load(istream& fin)
     }
 }
 
+static void appendUINT16(string& buffer, unsigned int value)
+{
+    buffer += (char)(value & 0xFF);
+    buffer += (char)((value >> 8) & 0xFF);
+}
+
+static void appendUINT32(string& buffer, UINT32 value)
+{
+    for(unsigned int i=0; i<4; i++)
+        buffer += (char)((value >> (8*i)) & 0xFF);
+}
+
+static void appendUINT64(string& buffer, UINT64 value)
+{
+    for(unsigned int i=0; i<8; i++)
+        buffer += (char)((value >> (8*i)) & 0xFF);
+}
+
+static unsigned int readUINT16(const unsigned char *data)
+{
+    return (unsigned int)data[0] | ((unsigned int)data[1] << 8);
+}
+
+static UINT32 readUINT32(const unsigned char *data)
+{
+    return (UINT32)data[0] | ((UINT32)data[1] << 8) | ((UINT32)data[2] << 16) | ((UINT32)data[3] << 24);
+}
+
+static UINT64 readUINT64(const unsigned char *data)
+{
+    UINT64 value = 0;
+    for(unsigned int i=0; i<8; i++)
+        value |= (UINT64)data[i] << (8*i);
+    return value;
+}
+
+static void appendSparseState(string& buffer, const vector<SliceValue>& state)
+{
+    unsigned int nrActiveSlices = 0;
+    for(unsigned int z=0; z<state.size(); z++)
+        if (state[z] != 0)
+            nrActiveSlices++;
+    appendUINT16(buffer, nrActiveSlices);
+    for(unsigned int z=0; z<state.size(); z++)
+        if (state[z] != 0) {
+            appendUINT16(buffer, z);
+            appendUINT32(buffer, state[z]);
+        }
+}
+
+static void readSparseState(const unsigned char *&data, const unsigned char *end, unsigned int laneSize, vector<SliceValue>& state)
+{
+    if (end - data < 2)
+        throw TrailException("Truncated binary trail.");
+    unsigned int nrActiveSlices = readUINT16(data);
+    data += 2;
+    if ((size_t)(end - data) < 6*(size_t)nrActiveSlices)
+        throw TrailException("Truncated binary trail.");
+    state.assign(laneSize, 0);
+    for(unsigned int i=0; i<nrActiveSlices; i++) {
+        unsigned int z = readUINT16(data);
+        if (z >= laneSize)
+            throw TrailException("Invalid binary trail.");
+        state[z] = readUINT32(data+2);
+        data += 6;
+    }
+}
+
+// The binary form of a trail is, in little-endian order:
+// the size of the rest of the record (32 bits), the flags (8 bits: firstStateSpecified, stateAfterLastChiSpecified),
+// the lane size (16 bits), the number of weights (16 bits), the total weight (32 bits), the weights (16 bits each),
+// then the states that are specified and the state after the last χ if specified, each as
+// a number of non-zero slices (16 bits) followed by their z coordinate (16 bits) and value (32 bits).
+void Trail::saveBinary(string& buffer) const
+{
+    size_t start = buffer.size();
+    appendUINT32(buffer, 0);
+    unsigned int laneSize = 0;
+    for(unsigned int i=0; (i<states.size()) && (laneSize == 0); i++)
+        laneSize = states[i].size();
+    buffer += (char)((firstStateSpecified ? 1 : 0) | (stateAfterLastChiSpecified ? 2 : 0));
+    appendUINT16(buffer, laneSize);
+    appendUINT16(buffer, weights.size());
+    appendUINT32(buffer, totalWeight);
+    for(unsigned int i=0; i<weights.size(); i++)
+        appendUINT16(buffer, weights[i]);
+    for(unsigned int i=(firstStateSpecified ? 0 : 1); i<states.size(); i++)
+        appendSparseState(buffer, states[i]);
+    if (stateAfterLastChiSpecified)
+        appendSparseState(buffer, stateAfterLastChi);
+    UINT32 size = buffer.size() - start - 4;
+    for(unsigned int i=0; i<4; i++)
+        buffer[start+i] = (char)((size >> (8*i)) & 0xFF);
+}
+
+size_t Trail::loadBinary(const unsigned char *data, size_t size)
+{
+    if (size < 4)
+        throw TrailException("Truncated binary trail.");
+    size_t recordSize = 4 + (size_t)readUINT32(data);
+    if ((recordSize > size) || (recordSize < 13))
+        throw TrailException("Truncated binary trail.");
+    const unsigned char *end = data + recordSize;
+    data += 4;
+    if ((data[0] & ~3) != 0)
+        throw TrailException("Invalid binary trail.");
+    firstStateSpecified = ((data[0] & 1) != 0);
+    stateAfterLastChiSpecified = ((data[0] & 2) != 0);
+    unsigned int laneSize = readUINT16(data+1);
+    unsigned int nrWeights = readUINT16(data+3);
+    totalWeight = readUINT32(data+5);
+    data += 9;
+    if ((size_t)(end - data) < 2*(size_t)nrWeights)
+        throw TrailException("Truncated binary trail.");
+    weights.resize(nrWeights);
+    for(unsigned int i=0; i<nrWeights; i++)
+        weights[i] = readUINT16(data + 2*i);
+    data += 2*nrWeights;
+    states.clear();
+    if (!firstStateSpecified)
+        states.push_back(vector<SliceValue>());
+    while(states.size() < nrWeights) {
+        states.push_back(vector<SliceValue>());
+        readSparseState(data, end, laneSize, states.back());
+    }
+    stateAfterLastChi.clear();
+    if (stateAfterLastChiSpecified)
+        readSparseState(data, end, laneSize, stateAfterLastChi);
+    if (data != end)
+        throw TrailException("Invalid binary trail.");
+    return recordSize;
+}
+
 void Trail::append(const Trail& otherTrail)
 {
     for(unsigned int i=0; i<otherTrail.weights.size(); i++)
@@ -468,3 +615,878 @@ void TrailSaveToFile::fetchTrail(const Trail& trail)
 {
     trail.save(fout);
 }
+
+void TrailSaveToFile::flush()
+{
+    fout.flush();
+}
+
+bool TrailSaveToFile::getOutputPosition(UINT64& position)
+{
+    streampos current = fout.tellp();
+    if (current < 0)
+        return false;
+    position = current;
+    return true;
+}
+
+TrailAppendToFile::TrailAppendToFile(const string& fileName, UINT64 length)
+{
+    UINT64 fileLength;
+    {
+        ifstream fin(fileName.c_str(), ios::binary);
+        fin.seekg(0, ios::end);
+        if (!fin)
+            throw TrailException("File '" + fileName + "' cannot be read.");
+        fileLength = fin.tellg();
+    }
+    if (fileLength < length)
+        throw TrailException("File '" + fileName + "' is shorter than recorded in the checkpoint.");
+    if (fileLength > length) {
+#ifdef _WIN32
+        string tempFileName = getTemporaryFileName(fileName);
+        {
+            ifstream fin(fileName.c_str(), ios::binary);
+            ofstream ftemp(tempFileName.c_str(), ios::binary);
+            vector<char> buffer(1 << 20);
+            for(UINT64 copied=0; copied<length; ) {
+                size_t size = (size_t)min((UINT64)buffer.size(), length-copied);
+                fin.read(&buffer[0], size);
+                ftemp.write(&buffer[0], size);
+                copied += size;
+            }
+            if (!fin || !ftemp) {
+                ftemp.close();
+                remove(tempFileName.c_str());
+                throw TrailException("File '" + fileName + "' cannot be truncated.");
+            }
+        }
+        remove(fileName.c_str());
+        if (rename(tempFileName.c_str(), fileName.c_str()) != 0) {
+            remove(tempFileName.c_str());
+            throw TrailException("File '" + fileName + "' cannot be truncated.");
+        }
+#else
+        if (truncate(fileName.c_str(), (off_t)length) != 0)
+            throw TrailException("File '" + fileName + "' cannot be truncated.");
+#endif
+    }
+    fout.open(fileName.c_str(), ios::in | ios::out | ios::binary);
+    fout.seekp(0, ios::end);
+    if (!fout)
+        throw TrailException("File '" + fileName + "' cannot be written.");
+}
+
+void TrailAppendToFile::fetchTrail(const Trail& trail)
+{
+    trail.save(fout);
+}
+
+void TrailAppendToFile::flush()
+{
+    fout.flush();
+}
+
+bool TrailAppendToFile::getOutputPosition(UINT64& position)
+{
+    streampos current = fout.tellp();
+    if (current < 0)
+        return false;
+    position = current;
+    return true;
+}
+
+SynchronizedTrailFetcher::SynchronizedTrailFetcher(TrailFetcher& aTrailsOut)
+    : trailsOut(aTrailsOut)
+{
+}
+
+void SynchronizedTrailFetcher::fetchTrail(const Trail& trail)
+{
+    lock_guard<mutex> guard(lock);
+    trailsOut.fetchTrail(trail);
+}
+
+void SynchronizedTrailFetcher::flush()
+{
+    lock_guard<mutex> guard(lock);
+    trailsOut.flush();
+}
+
+bool SynchronizedTrailFetcher::getOutputPosition(UINT64& position)
+{
+    lock_guard<mutex> guard(lock);
+    return trailsOut.getOutputPosition(position);
+}
+
+// -------------------------------------------------------------
+//
+// Binary trail files
+//
+// -------------------------------------------------------------
+
+// A binary trail file starts with a header: the magic string (8 bytes), the version (32 bits) and 
+// a reserved field (32 bits). Then come the trails as saved by Trail::saveBinary().
+// From version 2, the file ends with an index: for each trail, its offset (64 bits), its total weight (32 bits)
+// and its number of rounds (32 bits), followed by the offset of the index (64 bits), 
+// the number of trails (64 bits) and the index magic string (8 bytes).
+static const char binaryTrailFileMagic[8] = { 'K', 'T', 'T', 'R', 'A', 'I', 'L', 0 };
+static const char binaryTrailIndexMagic[8] = { 'K', 'T', 'T', 'I', 'N', 'D', 'E', 'X' };
+static const UINT32 binaryTrailFileVersion = 2;
+static const size_t binaryTrailFileHeaderSize = 16;
+static const size_t binaryTrailIndexEntrySize = 16;
+static const size_t binaryTrailIndexTrailerSize = 24;
+
+TrailSaveToBinaryFile::TrailSaveToBinaryFile(const string& aFileName)
+    : fileName(aFileName), fout(aFileName.c_str(), ios::binary), position(0)
+{
+    if (!fout)
+        throw TrailException("File '" + fileName + "' cannot be written.");
+    string header(binaryTrailFileMagic, sizeof(binaryTrailFileMagic));
+    appendUINT32(header, binaryTrailFileVersion);
+    appendUINT32(header, 0);
+    fout.write(header.data(), header.size());
+    position = header.size();
+}
+
+TrailSaveToBinaryFile::~TrailSaveToBinaryFile()
+{
+    if (fout.is_open()) {
+        try {
+            close();
+        }
+        catch(TrailException e) {
+            cerr << e.reason << endl;
+        }
+    }
+}
+
+void TrailSaveToBinaryFile::fetchTrail(const Trail& trail)
+{
+    buffer.clear();
+    trail.saveBinary(buffer);
+    fetchBinaryTrail((const unsigned char *)buffer.data(), buffer.size());
+}
+
+void TrailSaveToBinaryFile::fetchBinaryTrail(const unsigned char *record, size_t recordSize)
+{
+    BinaryTrailIndexEntry entry;
+    entry.offset = position;
+    entry.nrRounds = readUINT16(record+7);
+    entry.totalWeight = readUINT32(record+9);
+    index.push_back(entry);
+    fout.write((const char *)record, recordSize);
+    position += recordSize;
+}
+
+void TrailSaveToBinaryFile::flush()
+{
+    fout.flush();
+}
+
+UINT64 TrailSaveToBinaryFile::close()
+{
+    string footer;
+    for(UINT64 i=0; i<index.size(); i++) {
+        appendUINT64(footer, index[i].offset);
+        appendUINT32(footer, index[i].totalWeight);
+        appendUINT32(footer, index[i].nrRounds);
+    }
+    appendUINT64(footer, position);
+    appendUINT64(footer, index.size());
+    footer.append(binaryTrailIndexMagic, sizeof(binaryTrailIndexMagic));
+    fout.write(footer.data(), footer.size());
+    fout.close();
+    if (!fout)
+        throw TrailException("File '" + fileName + "' cannot be written.");
+    return index.size();
+}
+
+BinaryTrailFile::BinaryTrailFile(const string& aFileName)
+    : fileName(aFileName), data(0), size(0), mapping(0), indexData(0), nrTrails(0)
+{
+#ifndef _WIN32
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw TrailException("File '" + fileName + "' cannot be read.");
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw TrailException("File '" + fileName + "' cannot be read.");
+    }
+    size = info.st_size;
+    if (size > 0) {
+        void *address = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED) {
+            close(fd);
+            throw TrailException("File '" + fileName + "' cannot be mapped.");
+        }
+        mapping = address;
+        data = (const unsigned char *)address;
+    }
+    close(fd);
+#else
+    ifstream fin(fileName.c_str(), ios::binary);
+    if (!fin)
+        throw TrailException("File '" + fileName + "' cannot be read.");
+    ownedData.assign(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+    size = ownedData.size();
+    data = (size > 0) ? &ownedData[0] : 0;
+#endif
+    if ((size < binaryTrailFileHeaderSize) || (memcmp(data, binaryTrailFileMagic, sizeof(binaryTrailFileMagic)) != 0)
+            || (readUINT32(data+8) == 0) || (readUINT32(data+8) > binaryTrailFileVersion)) {
+#ifndef _WIN32
+        if (mapping != 0)
+            munmap(mapping, size);
+#endif
+        throw TrailException("File '" + fileName + "' is not a binary trail file.");
+    }
+    bool indexed = false;
+    if (size >= binaryTrailFileHeaderSize + binaryTrailIndexTrailerSize) {
+        const unsigned char *trailer = data + size - binaryTrailIndexTrailerSize;
+        if (memcmp(trailer+16, binaryTrailIndexMagic, sizeof(binaryTrailIndexMagic)) == 0) {
+            UINT64 indexOffset = readUINT64(trailer);
+            nrTrails = readUINT64(trailer+8);
+            indexed = (indexOffset >= binaryTrailFileHeaderSize) && (indexOffset <= size)
+                && (nrTrails <= (size - indexOffset)/binaryTrailIndexEntrySize)
+                && (indexOffset + nrTrails*binaryTrailIndexEntrySize + binaryTrailIndexTrailerSize == size);
+            if (indexed)
+                indexData = data + indexOffset;
+        }
+    }
+    if (!indexed)
+        rebuildIndex();
+}
+
+BinaryTrailFile::~BinaryTrailFile()
+{
+#ifndef _WIN32
+    if (mapping != 0)
+        munmap(mapping, size);
+#endif
+}
+
+void BinaryTrailFile::rebuildIndex()
+{
+    indexData = 0;
+    rebuiltIndex.clear();
+    // The records are decoded, so that the scan stops at the first one that is truncated or invalid.
+    Trail trail;
+    UINT64 offset = binaryTrailFileHeaderSize;
+    while(offset < size) {
+        UINT64 recordSize;
+        try {
+            recordSize = trail.loadBinary(data+offset, size-offset);
+        }
+        catch(TrailException) {
+            break;
+        }
+        BinaryTrailIndexEntry entry;
+        entry.offset = offset;
+        entry.nrRounds = readUINT16(data+offset+7);
+        entry.totalWeight = readUINT32(data+offset+9);
+        rebuiltIndex.push_back(entry);
+        offset += recordSize;
+    }
+    nrTrails = rebuiltIndex.size();
+}
+
+BinaryTrailIndexEntry BinaryTrailFile::getIndexEntry(UINT64 index) const
+{
+    if (index >= nrTrails)
+        throw TrailException("BinaryTrailFile::getIndexEntry(): index out of range.");
+    if (indexData == 0)
+        return rebuiltIndex[index];
+    const unsigned char *entryData = indexData + index*binaryTrailIndexEntrySize;
+    BinaryTrailIndexEntry entry;
+    entry.offset = readUINT64(entryData);
+    entry.totalWeight = readUINT32(entryData+8);
+    entry.nrRounds = readUINT32(entryData+12);
+    return entry;
+}
+
+void BinaryTrailFile::getTrail(UINT64 index, Trail& trail) const
+{
+    UINT64 offset = getIndexEntry(index).offset;
+    if (offset >= size)
+        throw TrailException("BinaryTrailFile::getTrail(): invalid offset.");
+    trail.loadBinary(data + offset, size - offset);
+}
+
+TrailBinaryFileIterator::TrailBinaryFileIterator(const string& aFileName, const KeccakFPropagation& aDCorLC)
+    : TrailIterator(aDCorLC), file(aFileName)
+{
+    initialize();
+}
+
+TrailBinaryFileIterator::TrailBinaryFileIterator(const string& aFileName, const KeccakFPropagation& aDCorLC, TrailFilter *aFilter)
+    : TrailIterator(aDCorLC, aFilter), file(aFileName)
+{
+    initialize();
+}
+
+void TrailBinaryFileIterator::initialize()
+{
+    // With a filter, the trails that pass it are counted as they are read.
+    count = filter ? ~(UINT64)0 : file.getNumberOfTrails();
+    position = 0;
+    i = 0;
+    next();
+    if (end)
+        count = 0;
+}
+
+void TrailBinaryFileIterator::next()
+{
+    end = true;
+    while(position < file.getNumberOfTrails()) {
+        file.getTrail(position, current);
+        position++;
+        if ((!filter) || filter->filter(DCorLC, current)) {
+            end = false;
+            break;
+        }
+    }
+}
+
+bool TrailBinaryFileIterator::isEnd()
+{
+    return end;
+}
+
+bool TrailBinaryFileIterator::isEmpty()
+{
+    return (count == 0);
+}
+
+void TrailBinaryFileIterator::operator++()
+{
+    next();
+    i++;
+    if (end)
+        count = i;
+}
+
+const Trail& TrailBinaryFileIterator::operator*()
+{
+    return current;
+}
+
+bool TrailBinaryFileIterator::isBounded()
+{
+    return (!filter) || end;
+}
+
+UINT64 TrailBinaryFileIterator::getIndex()
+{
+    return i;
+}
+
+UINT64 TrailBinaryFileIterator::getCount()
+{
+    return count;
+}
+
+void TrailBinaryFileIterator::display(ostream& fout) const
+{
+    fout << "'" << file.getFileName() << "' containing ";
+    if (filter)
+        fout << dec << file.getNumberOfTrails() << " trails before filtering";
+    else
+        fout << dec << count << " trails";
+}
+
+ostream& operator<<(ostream& a, const TrailBinaryFileIterator& tbfi)
+{
+    tbfi.display(a);
+    return a;
+}
+
+// -------------------------------------------------------------
+//
+// TrailFileParallelIterator
+//
+// -------------------------------------------------------------
+
+/** The task that parses one chunk of the file. */
+class TrailFileParallelIterator::ChunkTask : public Task {
+protected:
+    TrailFileParallelIterator& iterator;
+    Chunk& chunk;
+public:
+    ChunkTask(TrailFileParallelIterator& anIterator, Chunk& aChunk)
+        : iterator(anIterator), chunk(aChunk) {}
+    void run()
+    {
+        iterator.parseChunk(chunk);
+    }
+};
+
+TrailFileParallelIterator::TrailFileParallelIterator(const string& aFileName, const KeccakFPropagation& aDCorLC, 
+                                                     unsigned int nrThreads, size_t aChunkSize)
+    : TrailIterator(aDCorLC), fileName(aFileName), binaryFile(0), chunkSize(aChunkSize), scheduler(0)
+{
+    initialize(nrThreads);
+}
+
+TrailFileParallelIterator::TrailFileParallelIterator(const string& aFileName, const KeccakFPropagation& aDCorLC, 
+                                                     TrailFilter *aFilter, unsigned int nrThreads, size_t aChunkSize)
+    : TrailIterator(aDCorLC, aFilter), fileName(aFileName), binaryFile(0), chunkSize(aChunkSize), scheduler(0)
+{
+    initialize(nrThreads);
+}
+
+TrailFileParallelIterator::~TrailFileParallelIterator()
+{
+    release();
+}
+
+void TrailFileParallelIterator::initialize(unsigned int nrThreads)
+{
+    if (chunkSize == 0)
+        chunkSize = 1;
+    bool binary;
+    {
+        ifstream fin(fileName.c_str(), ios::binary);
+        if (!fin)
+            throw TrailException((string)"File '" + fileName + (string)"' cannot be read.");
+        char magic[sizeof(binaryTrailFileMagic)];
+        fin.read(magic, sizeof(magic));
+        binary = (fin.gcount() == (streamsize)sizeof(magic)) && (memcmp(magic, binaryTrailFileMagic, sizeof(magic)) == 0);
+        fin.clear();
+        fin.seekg(0, ios::end);
+        fileSize = fin.tellg();
+    }
+    count = ~(UINT64)0;
+    counted = false;
+    if (binary) {
+        binaryFile = new BinaryTrailFile(fileName);
+        UINT64 nrTrails = binaryFile->getNumberOfTrails();
+        UINT64 averageSize = (nrTrails > 0) ? (fileSize/nrTrails) : 1;
+        trailsPerChunk = (averageSize > 0) ? (chunkSize/averageSize) : chunkSize;
+        if (trailsPerChunk == 0)
+            trailsPerChunk = 1;
+        nrChunks = (nrTrails + trailsPerChunk - 1)/trailsPerChunk;
+        if (!filter) {
+            count = nrTrails;
+            counted = true;
+        }
+    }
+    else {
+        trailsPerChunk = 0;
+        nrChunks = (fileSize + chunkSize - 1)/chunkSize;
+    }
+    if (nrThreads == 0)
+        nrThreads = 1;
+    maxChunksAhead = 2*nrThreads;
+    nextChunkToSubmit = 0;
+    position = 0;
+    i = 0;
+    try {
+        scheduler = new TaskScheduler(nrThreads);
+        submitChunks();
+        next();
+    }
+    catch(...) {
+        release();
+        throw;
+    }
+    empty = end;
+    if (end) {
+        count = 0;
+        counted = true;
+    }
+}
+
+void TrailFileParallelIterator::release()
+{
+    // The threads must be stopped before the chunks they fill are deleted.
+    delete scheduler;
+    scheduler = 0;
+    while(!chunks.empty()) {
+        delete chunks.front();
+        chunks.pop_front();
+    }
+    delete binaryFile;
+    binaryFile = 0;
+}
+
+void TrailFileParallelIterator::submitChunks()
+{
+    while((chunks.size() < maxChunksAhead) && (nextChunkToSubmit < nrChunks)) {
+        Chunk *chunk = new Chunk(nextChunkToSubmit);
+        nextChunkToSubmit++;
+        chunks.push_back(chunk);
+        scheduler->submit(new ChunkTask(*this, *chunk));
+    }
+}
+
+void TrailFileParallelIterator::parseChunk(Chunk& chunk)
+{
+    vector<Trail> trails;
+    exception_ptr error;
+    try {
+        if (binaryFile) {
+            UINT64 first = chunk.index*trailsPerChunk;
+            UINT64 last = first + trailsPerChunk;
+            if (last > binaryFile->getNumberOfTrails())
+                last = binaryFile->getNumberOfTrails();
+            Trail trail;
+            for(UINT64 j=first; j<last; j++) {
+                binaryFile->getTrail(j, trail);
+                if ((!filter) || filter->filter(DCorLC, trail))
+                    trails.push_back(trail);
+            }
+        }
+        else
+            parseTextChunk(chunk.index, trails);
+    }
+    catch(...) {
+        error = current_exception();
+    }
+    lock_guard<mutex> guard(lock);
+    chunk.trails.swap(trails);
+    chunk.error = error;
+    chunk.ready = true;
+    chunkReady.notify_all();
+}
+
+void TrailFileParallelIterator::parseTextChunk(UINT64 index, vector<Trail>& trails)
+{
+    ifstream fin(fileName.c_str(), ios::binary);
+    if (!fin)
+        throw TrailException((string)"File '" + fileName + (string)"' cannot be read anymore.");
+    // The chunk contains the records, i.e., the lines, that start between begin and limit.
+    UINT64 begin = index*chunkSize;
+    UINT64 limit = begin + chunkSize;
+    UINT64 offset = begin;
+    string line;
+    if (begin > 0) {
+        // Skip the end of the record that starts in the previous chunk.
+        fin.seekg(begin-1);
+        getline(fin, line);
+        offset = begin - 1 + line.size() + 1;
+    }
+    while((offset < limit) && getline(fin, line)) {
+        offset += line.size() + 1;
+        if (line.find_first_not_of(" \t\r") == string::npos)
+            continue;
+        try {
+            istringstream sin(line);
+            Trail trail(sin);
+            if ((!filter) || filter->filter(DCorLC, trail))
+                trails.push_back(trail);
+        }
+        catch(TrailException) {
+        }
+    }
+}
+
+void TrailFileParallelIterator::countTextRecords()
+{
+    ifstream fin(fileName.c_str(), ios::binary);
+    if (!fin)
+        throw TrailException((string)"File '" + fileName + (string)"' cannot be read anymore.");
+    vector<char> buffer(1 << 20);
+    bool nonEmpty = false;
+    count = 0;
+    while(fin) {
+        fin.read(&buffer[0], buffer.size());
+        streamsize n = fin.gcount();
+        for(streamsize j=0; j<n; j++) {
+            char c = buffer[j];
+            if (c == '\n') {
+                if (nonEmpty)
+                    count++;
+                nonEmpty = false;
+            }
+            else if ((c != ' ') && (c != '\t') && (c != '\r'))
+                nonEmpty = true;
+        }
+    }
+    if (nonEmpty)
+        count++;
+    counted = true;
+}
+
+void TrailFileParallelIterator::next()
+{
+    while(!chunks.empty()) {
+        Chunk *chunk = chunks.front();
+        {
+            unique_lock<mutex> guard(lock);
+            while(!chunk->ready)
+                chunkReady.wait(guard);
+        }
+        if (chunk->error)
+            rethrow_exception(chunk->error);
+        if (position < chunk->trails.size()) {
+            end = false;
+            return;
+        }
+        delete chunk;
+        chunks.pop_front();
+        position = 0;
+        submitChunks();
+    }
+    end = true;
+}
+
+bool TrailFileParallelIterator::isEnd()
+{
+    return end;
+}
+
+bool TrailFileParallelIterator::isEmpty()
+{
+    return empty;
+}
+
+void TrailFileParallelIterator::operator++()
+{
+    position++;
+    next();
+    i++;
+    if (end) {
+        count = i;
+        counted = true;
+    }
+}
+
+const Trail& TrailFileParallelIterator::operator*()
+{
+    return chunks.front()->trails[position];
+}
+
+bool TrailFileParallelIterator::isBounded()
+{
+    return (filter == 0) || end;
+}
+
+UINT64 TrailFileParallelIterator::getIndex()
+{
+    return i;
+}
+
+UINT64 TrailFileParallelIterator::getCount()
+{
+    if ((!counted) && (!filter))
+        countTextRecords();
+    return count;
+}
+
+void TrailFileParallelIterator::display(ostream& fout)
+{
+    fout << "'" << fileName << "'";
+    if (filter && !counted)
+        fout << " (unknown trail count after filtering)";
+    else
+        fout << " containing " << dec << getCount() << " trails";
+}
+
+ostream& operator<<(ostream& a, TrailFileParallelIterator& tfpi)
+{
+    tfpi.display(a);
+    return a;
+}
+
+UINT64 convertTrailFileToBinary(const string& textFileName, const string& binaryFileName)
+{
+    ifstream fin(textFileName.c_str());
+    if (!fin)
+        throw TrailException("File '" + textFileName + "' cannot be read.");
+    TrailSaveToBinaryFile trailsOut(binaryFileName);
+    while(!(fin.eof())) {
+        try {
+            Trail trail(fin);
+            trailsOut.fetchTrail(trail);
+        }
+        catch(TrailException) {
+        }
+    }
+    return trailsOut.close();
+}
+
+UINT64 convertTrailFileToText(const string& binaryFileName, const string& textFileName)
+{
+    BinaryTrailFile file(binaryFileName);
+    ofstream fout(textFileName.c_str());
+    if (!fout)
+        throw TrailException("File '" + textFileName + "' cannot be written.");
+    Trail trail;
+    for(UINT64 i=0; i<file.getNumberOfTrails(); i++) {
+        file.getTrail(i, trail);
+        trail.save(fout);
+    }
+    return file.getNumberOfTrails();
+}
+
+// -------------------------------------------------------------
+//
+// TranslationDuplicateFilter
+//
+// -------------------------------------------------------------
+
+bool TranslationDuplicateFilter::isNew(const Trail& trail)
+{
+    Trail canonicalTrail(trail);
+    translateToCanonical(canonicalTrail);
+    string key;
+    canonicalTrail.saveBinary(key);
+    UINT64 h = 0xCBF29CE484222325ULL;
+    for(unsigned int i=0; i<key.size(); i++)
+        h = (h ^ (unsigned char)key[i]) * 0x100000001B3ULL;
+    unsigned int bucket = (unsigned int)(h % nrBuckets);
+    lock_guard<mutex> guard(locks[bucket]);
+    return canonicalTrails[bucket].insert(key).second;
+}
+
+void TranslationDuplicateFilter::translateToCanonical(Trail& trail)
+{
+    vector<vector<SliceValue> *> parts;
+    for(unsigned int i=0; i<trail.states.size(); i++)
+        if (trail.states[i].size() > 0)
+            parts.push_back(&trail.states[i]);
+    if (trail.stateAfterLastChiSpecified)
+        parts.push_back(&trail.stateAfterLastChi);
+    if (parts.size() == 0)
+        return;
+    unsigned int laneSize = parts[0]->size();
+    vector<vector<SliceValue> > slicesPerZ(laneSize, vector<SliceValue>(parts.size()));
+    for(unsigned int i=0; i<parts.size(); i++)
+        for(unsigned int z=0; z<laneSize; z++)
+            slicesPerZ[z][i] = (*parts[i])[z];
+    unsigned int dz = getSymmetricMinimumTranslation(slicesPerZ);
+    for(unsigned int i=0; i<parts.size(); i++)
+        for(unsigned int z=0; z<laneSize; z++)
+            (*parts[i])[(z+dz)%laneSize] = slicesPerZ[z][i];
+}
+
+// -------------------------------------------------------------
+//
+// ShardedTrailFetcher
+//
+// -------------------------------------------------------------
+
+static atomic<UINT64> nextShardedTrailFetcherIdentifier(1);
+
+ShardedTrailFetcher::ShardedTrailFetcher(const string& aFileName, bool aBinary, TrailDuplicateFilter *aDuplicateFilter, size_t aBufferSize)
+    : fileName(aFileName), binary(aBinary), duplicateFilter(aDuplicateFilter), bufferSize(aBufferSize),
+    identifier(nextShardedTrailFetcherIdentifier++), merged(false)
+{
+}
+
+ShardedTrailFetcher::~ShardedTrailFetcher()
+{
+    if (!merged) {
+        try {
+            merge();
+        }
+        catch(TrailException e) {
+            cerr << e.reason << endl;
+        }
+    }
+    for(unsigned int i=0; i<shards.size(); i++)
+        delete shards[i];
+}
+
+ShardedTrailFetcher::Shard& ShardedTrailFetcher::getShard()
+{
+    // Each thread remembers its shard for each ShardedTrailFetcher it used.
+    static thread_local map<UINT64, Shard *> cachedShards;
+    map<UINT64, Shard *>::const_iterator i = cachedShards.find(identifier);
+    if (i != cachedShards.end())
+        return *i->second;
+    lock_guard<mutex> guard(shardsLock);
+    Shard *shard = new Shard();
+    stringstream str;
+    str << fileName << "-shard-" << dec << shards.size();
+    shard->fileName = str.str();
+    shard->fout.open(shard->fileName.c_str(), ios::binary);
+    if (!shard->fout) {
+        delete shard;
+        throw TrailException("ShardedTrailFetcher: cannot write to '" + str.str() + "'.");
+    }
+    shard->count = 0;
+    shards.push_back(shard);
+    cachedShards[identifier] = shard;
+    return *shard;
+}
+
+void ShardedTrailFetcher::writeBuffer(Shard& shard)
+{
+    shard.fout.write(shard.buffer.data(), shard.buffer.size());
+    shard.buffer.clear();
+}
+
+void ShardedTrailFetcher::fetchTrail(const Trail& trail)
+{
+    if ((duplicateFilter != 0) && !duplicateFilter->isNew(trail))
+        return;
+    Shard& shard = getShard();
+    if (binary)
+        trail.saveBinary(shard.buffer);
+    else {
+        stringstream str;
+        trail.save(str);
+        shard.buffer += str.str();
+    }
+    shard.count++;
+    if (shard.buffer.size() >= bufferSize)
+        writeBuffer(shard);
+}
+
+void ShardedTrailFetcher::flush()
+{
+    lock_guard<mutex> guard(shardsLock);
+    for(unsigned int i=0; i<shards.size(); i++) {
+        writeBuffer(*shards[i]);
+        shards[i]->fout.flush();
+    }
+}
+
+UINT64 ShardedTrailFetcher::merge()
+{
+    flush();
+    lock_guard<mutex> guard(shardsLock);
+    merged = true;
+    UINT64 count = 0;
+    if (binary) {
+        // The trails are copied one by one, to build the index.
+        TrailSaveToBinaryFile trailsOut(fileName);
+        vector<unsigned char> record;
+        for(unsigned int i=0; i<shards.size(); i++) {
+            shards[i]->fout.close();
+            {
+                ifstream fin(shards[i]->fileName.c_str(), ios::binary);
+                for(UINT64 j=0; j<shards[i]->count; j++) {
+                    record.resize(4);
+                    fin.read((char *)&record[0], 4);
+                    record.resize(4 + (size_t)readUINT32(&record[0]));
+                    fin.read((char *)&record[4], record.size()-4);
+                    if (!fin)
+                        throw TrailException("ShardedTrailFetcher: cannot read '" + shards[i]->fileName + "'.");
+                    trailsOut.fetchBinaryTrail(&record[0], record.size());
+                }
+            }
+            remove(shards[i]->fileName.c_str());
+        }
+        count = trailsOut.close();
+    }
+    else {
+        ofstream fout(fileName.c_str(), ios::binary);
+        for(unsigned int i=0; i<shards.size(); i++) {
+            shards[i]->fout.close();
+            {
+                ifstream fin(shards[i]->fileName.c_str(), ios::binary);
+                if (shards[i]->count > 0)
+                    fout << fin.rdbuf();
+            }
+            remove(shards[i]->fileName.c_str());
+            count += shards[i]->count;
+        }
+        if (!fout)
+            throw TrailException("ShardedTrailFetcher: cannot write to '" + fileName + "'.");
+    }
+    return count;
+}
@@ -16,11 +16,17 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #ifndef _KECCAKFTRAILS_H_
 #define _KECCAKFTRAILS_H_
 
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <set>
 #include "Keccak-fParts.h"
 
 class KeccakFPropagation;
+class TaskScheduler;
 
 /**
  * Exception that can be thrown by the class Trail.
@@ -135,6 +141,19 @@ public:
       * @param  fout    The stream to save the trail to.
       */
     void save(ostream& fout) const;
+    /** This method appends the trail in a compact binary form to a buffer. 
+      * Only the non-zero slices of the states are stored, with their z coordinate.
+      * The record starts with its length, so that a reader can skip it.
+      * @param  buffer  The buffer to append the trail to.
+      */
+    void saveBinary(string& buffer) const;
+    /** This method loads the trail from its binary form, as written by saveBinary().
+      * @param  data    The address of the record.
+      * @param  size    The number of bytes available at @a data.
+      * @return The number of bytes taken by the record.
+      * An exception TrailException is thrown if the record is truncated or invalid.
+      */
+    size_t loadBinary(const unsigned char *data, size_t size);
     /** This function reads all the trails in a file, checks their consistency
       * and then produces a report.
       * The report is output in a file with the same file name plus ".txt".
@@ -316,6 +335,217 @@ protected:
     void next();
 };
 
+/** This structure describes a trail in the index of a binary trail file.
+  */
+struct BinaryTrailIndexEntry {
+    /** The position of the trail record in the file. */
+    UINT64 offset;
+    /** The total weight of the trail. */
+    unsigned int totalWeight;
+    /** The number of rounds of the trail. */
+    unsigned int nrRounds;
+};
+
+/** This class gives random access to the trails of a binary trail file,
+  * as written by TrailSaveToBinaryFile.
+  * The file is memory-mapped, and its index gives the position, 
+  * the weight and the number of rounds of each trail without decoding it.
+  * If the file has no index, e.g., because the process writing it was interrupted,
+  * the index is rebuilt by going through the complete trails in the file.
+  */
+class BinaryTrailFile {
+protected:
+    string fileName;
+    /** The file contents, pointing either to ownedData or to the mapped file. */
+    const unsigned char *data;
+    UINT64 size;
+    vector<unsigned char> ownedData;
+    /** The address of the mapping, or 0 if the file is not mapped. */
+    void *mapping;
+    /** The index in the file, or 0 if the index was rebuilt in @a rebuiltIndex. */
+    const unsigned char *indexData;
+    vector<BinaryTrailIndexEntry> rebuiltIndex;
+    UINT64 nrTrails;
+public:
+    /** The constructor opens the file. 
+      * An exception TrailException is thrown if it cannot be read or is not a binary trail file.
+      * @param  aFileName   The name of the file to read from.
+      */
+    BinaryTrailFile(const string& aFileName);
+    /** The destructor releases the mapping, if any. */
+    ~BinaryTrailFile();
+    /** This method returns the name of the file. */
+    inline const string& getFileName() const { return fileName; }
+    /** This method returns the number of trails in the file. */
+    inline UINT64 getNumberOfTrails() const { return nrTrails; }
+    /** This method returns the index entry of a trail.
+      * @param  index   The position of the trail in the file, from 0 to getNumberOfTrails()-1.
+      */
+    BinaryTrailIndexEntry getIndexEntry(UINT64 index) const;
+    /** This method decodes a trail.
+      * @param  index   The position of the trail in the file, from 0 to getNumberOfTrails()-1.
+      * @param  trail   The trail to load.
+      */
+    void getTrail(UINT64 index, Trail& trail) const;
+protected:
+    void rebuildIndex();
+private:
+    BinaryTrailFile(const BinaryTrailFile&);
+    BinaryTrailFile& operator=(const BinaryTrailFile&);
+};
+
+/** This class implements an iterator on the trails of a binary trail file,
+  * as written by TrailSaveToBinaryFile.
+  */
+class TrailBinaryFileIterator : public TrailIterator {
+protected:
+    BinaryTrailFile file;
+    UINT64 position, i, count;
+    bool end;
+    Trail current;
+public:
+    /** The constructor of the iterator.
+      * @param  aFileName   The name of the file to read from.
+      * @param   DCorLC     The propagation context of the trails, 
+      *                     as a reference to a KeccakFPropagation object.
+      */
+    TrailBinaryFileIterator(const string& aFileName, const KeccakFPropagation& aDCorLC);
+    /** The constructor of the iterator, with one filter.
+      * The trails are decoded only once, so the number of trails that pass the filter
+      * is known only when the end is reached, see isBounded().
+      * @param  aFileName   The name of the file to read from.
+      * @param   DCorLC     The propagation context of the trails, 
+      *                     as a reference to a KeccakFPropagation object.
+      * @param  aFilter A pointer to the filter.
+      */
+    TrailBinaryFileIterator(const string& aFileName, const KeccakFPropagation& aDCorLC, TrailFilter *aFilter);
+    /** See TrailIterator::isEnd(). */
+    virtual bool isEnd();
+    /** See TrailIterator::isEmpty(). */
+    virtual bool isEmpty();
+    /** See TrailIterator::operator++(). */
+    virtual void operator++();
+    /** See TrailIterator::operator*(). */
+    virtual const Trail& operator*();
+    /** See TrailIterator::isBounded(). */
+    virtual bool isBounded();
+    /** See TrailIterator::getIndex(). */
+    virtual UINT64 getIndex();
+    /** See TrailIterator::getCount(). */
+    virtual UINT64 getCount();
+    /** This method gives random access to the file, regardless of the filter. */
+    inline const BinaryTrailFile& getFile() const { return file; }
+    /** This method displays information about the file being read.
+      * @param  fout    The stream to display to.
+      */
+    void display(ostream& fout) const;
+    friend ostream& operator<<(ostream& a, const TrailBinaryFileIterator& tbfi);
+protected:
+    void initialize();
+    void next();
+};
+
+/** This class implements an iterator on a set of trails read from a file,
+  * either in text form, as saved by Trail::save(), or in binary form,
+  * as written by TrailSaveToBinaryFile; the format is detected from the file header.
+  * The file is split into chunks at record boundaries, and the chunks are parsed
+  * by background threads, a bounded number of chunks ahead of the consumer,
+  * so that the consumer only waits if the parsing cannot keep up.
+  * The trails are given in the order of the file, as with TrailFileIterator.
+  * For a binary file, the number of trails is taken from its index.
+  * For a text file, it is the number of non-empty lines, which are counted
+  * without being parsed when getCount() is first called; the lines that 
+  * fail to parse are skipped by the iterator but counted, so this is 
+  * an upper bound, suitable for displaying progress.
+  * If a filter is given, it is applied by the background threads, so it must
+  * support concurrent calls, and the number of trails is unknown.
+  * In all cases, the exact number of trails given is known once the end is reached.
+  */
+class TrailFileParallelIterator : public TrailIterator {
+protected:
+    /** The trails parsed from a part of the file. */
+    class Chunk {
+    public:
+        UINT64 index;
+        bool ready;
+        vector<Trail> trails;
+        exception_ptr error;
+        Chunk(UINT64 anIndex) : index(anIndex), ready(false) {}
+    };
+    class ChunkTask;
+    string fileName;
+    BinaryTrailFile *binaryFile;
+    UINT64 fileSize;
+    size_t chunkSize;
+    /** The number of trails per chunk, for a binary file. */
+    UINT64 trailsPerChunk;
+    UINT64 nrChunks, nextChunkToSubmit;
+    unsigned int maxChunksAhead;
+    TaskScheduler *scheduler;
+    /** The lock protecting the ready and error attributes of the chunks. */
+    mutex lock;
+    condition_variable chunkReady;
+    /** The chunks submitted, starting with the one being consumed. */
+    deque<Chunk *> chunks;
+    /** The position of the current trail in the first chunk. */
+    size_t position;
+    UINT64 i, count;
+    bool counted, empty, end;
+public:
+    /** The constructor of the iterator.
+      * @param  aFileName   The name of the file to read from.
+      * @param   DCorLC     The propagation context of the trails, 
+      *                     as a reference to a KeccakFPropagation object.
+      * @param  nrThreads   The number of threads parsing the file, in addition to
+      *                     the threads of the consumer, e.g., of a parallel trail extension.
+      * @param  aChunkSize  The approximate size in bytes of the chunks parsed by one thread at a time.
+      */
+    TrailFileParallelIterator(const string& aFileName, const KeccakFPropagation& aDCorLC, 
+        unsigned int nrThreads = 1, size_t aChunkSize = 1 << 18);
+    /** The constructor of the iterator, with one filter.
+      * @param  aFileName   The name of the file to read from.
+      * @param   DCorLC     The propagation context of the trails, 
+      *                     as a reference to a KeccakFPropagation object.
+      * @param  aFilter     A pointer to the filter.
+      * @param  nrThreads   The number of threads parsing the file.
+      * @param  aChunkSize  The size of the chunks, see above.
+      */
+    TrailFileParallelIterator(const string& aFileName, const KeccakFPropagation& aDCorLC, 
+        TrailFilter *aFilter, unsigned int nrThreads = 1, size_t aChunkSize = 1 << 18);
+    /** The destructor stops the threads. */
+    ~TrailFileParallelIterator();
+    /** See TrailIterator::isEnd(). */
+    virtual bool isEnd();
+    /** See TrailIterator::isEmpty(). */
+    virtual bool isEmpty();
+    /** See TrailIterator::operator++(). */
+    virtual void operator++();
+    /** See TrailIterator::operator*(). */
+    virtual const Trail& operator*();
+    /** See TrailIterator::isBounded(). */
+    virtual bool isBounded();
+    /** See TrailIterator::getIndex(). */
+    virtual UINT64 getIndex();
+    /** See TrailIterator::getCount(). */
+    virtual UINT64 getCount();
+    /** This method displays information about the file being read.
+      * @param  fout    The stream to display to.
+      */
+    void display(ostream& fout);
+    friend ostream& operator<<(ostream& a, TrailFileParallelIterator& tfpi);
+protected:
+    void initialize(unsigned int nrThreads);
+    void release();
+    void submitChunks();
+    void parseChunk(Chunk& chunk);
+    void parseTextChunk(UINT64 index, vector<Trail>& trails);
+    void countTextRecords();
+    void next();
+private:
+    TrailFileParallelIterator(const TrailFileParallelIterator&);
+    TrailFileParallelIterator& operator=(const TrailFileParallelIterator&);
+};
+
 /** This base class represents the output of trails, which can be 
   * for instance saved or further processed. 
   */
@@ -325,6 +555,22 @@ public:
       * @param  trail   The trail to save or to process.
       */
     virtual void fetchTrail(const Trail& trail) = 0;
+    /** Method to call to make sure that all the trails produced so far
+      * are saved or processed, e.g., before saving a checkpoint.
+      */
+    virtual void flush() {}
+    /** This method tells whether fetchTrail() can be called from several threads at once.
+      * If not, a SynchronizedTrailFetcher must be put in front of it.
+      */
+    virtual bool isThreadSafe() const { return false; }
+    /** This method gives the number of bytes output so far, for a TrailFetcher
+      * that saves the trails to a file, so that a checkpoint can record it.
+      * It is meaningful only after flush().
+      * @param  position    The number of bytes output so far.
+      * @return True iff the position is known.
+      */
+    virtual bool getOutputPosition(UINT64& /* position */) { return false; }
+    virtual ~TrailFetcher() {}
 };
 
 /** This class implements a TrailFetcher and saves the trails in a file.
@@ -339,6 +585,203 @@ public:
     TrailSaveToFile(ostream& aFout);
     /** See TrailFetcher::fetchTrail().*/
     void fetchTrail(const Trail& trail);
+    /** See TrailFetcher::flush().*/
+    void flush();
+    /** See TrailFetcher::getOutputPosition().*/
+    bool getOutputPosition(UINT64& position);
+};
+
+/** This class implements a TrailFetcher and saves the trails in a binary file.
+  * The file starts with a header with a version number, followed by the trails
+  * as saved by Trail::saveBinary(), and ends with an index giving, for each trail,
+  * its position in the file, its total weight and its number of rounds.
+  * The index is written by close() or by the destructor.
+  * See TrailBinaryFileIterator to read such a file.
+  */
+class TrailSaveToBinaryFile : public TrailFetcher {
+protected:
+    string fileName;
+    ofstream fout;
+    UINT64 position;
+    vector<BinaryTrailIndexEntry> index;
+    string buffer;
+public:
+    /** The constructor.
+      * @param  aFileName   The name of the file to save the trails to.
+      */
+    TrailSaveToBinaryFile(const string& aFileName);
+    /** The destructor closes the file, if not done yet, 
+      * and reports on cerr if this fails. */
+    ~TrailSaveToBinaryFile();
+    /** See TrailFetcher::fetchTrail().*/
+    void fetchTrail(const Trail& trail);
+    /** This method appends a trail already in binary form.
+      * @param  record  The trail as saved by Trail::saveBinary().
+      * @param  recordSize  The size of @a record in bytes.
+      */
+    void fetchBinaryTrail(const unsigned char *record, size_t recordSize);
+    /** See TrailFetcher::flush().*/
+    void flush();
+    /** This method writes the index and closes the file.
+      * @return The number of trails in the file.
+      */
+    UINT64 close();
+};
+
+/** This class implements a TrailFetcher that appends the trails to a file,
+  * after truncating it to a given length.
+  * This allows one to resume an interrupted search from a checkpoint:
+  * the file is truncated to the length recorded in the checkpoint,
+  * so that the trails found after it, which the search produces again, 
+  * as well as an incomplete last line, are removed from the file.
+  * See KeccakFTrailExtension::loadCheckpoint().
+  */
+class TrailAppendToFile : public TrailFetcher {
+protected:
+    ofstream fout;
+public:
+    /** The constructor.
+      * @param  fileName    The name of the file to append the trails to.
+      * @param  length      The length in bytes to truncate the file to.
+      *     If the file is shorter, a TrailException is thrown.
+      */
+    TrailAppendToFile(const string& fileName, UINT64 length);
+    /** See TrailFetcher::fetchTrail().*/
+    void fetchTrail(const Trail& trail);
+    /** See TrailFetcher::flush().*/
+    void flush();
+    /** See TrailFetcher::getOutputPosition().*/
+    bool getOutputPosition(UINT64& position);
 };
 
+/** This class implements a TrailFetcher that forwards the trails to another
+  * TrailFetcher, one at a time, so that it can be called from several threads.
+  */
+class SynchronizedTrailFetcher : public TrailFetcher {
+protected:
+    TrailFetcher& trailsOut;
+    mutex lock;
+public:
+    /** The constructor.
+      * @param  aTrailsOut  The TrailFetcher to forward the trails to.
+      */
+    SynchronizedTrailFetcher(TrailFetcher& aTrailsOut);
+    /** See TrailFetcher::fetchTrail().*/
+    void fetchTrail(const Trail& trail);
+    /** See TrailFetcher::flush().*/
+    void flush();
+    /** See TrailFetcher::getOutputPosition().*/
+    bool getOutputPosition(UINT64& position);
+};
+
+/** This base class represents a filter that drops trails equivalent to 
+  * a trail already seen, to be used with the class ShardedTrailFetcher.
+  * The method isNew() can be called from several threads at once.
+  */
+class TrailDuplicateFilter {
+public:
+    /** This method tells whether the trail is the first of its class to be seen,
+      * and records it if so.
+      * @param  trail   The trail to consider.
+      * @return True iff no equivalent trail was seen before.
+      */
+    virtual bool isNew(const Trail& trail) = 0;
+    virtual ~TrailDuplicateFilter() {}
+};
+
+/** This class implements a TrailDuplicateFilter that considers trails
+  * equivalent up to translation along z. The smallest translated version 
+  * of each trail seen is kept in binary form, as saved by Trail::saveBinary(),
+  * in sets protected by separate locks to limit contention.
+  */
+class TranslationDuplicateFilter : public TrailDuplicateFilter {
+protected:
+    static const unsigned int nrBuckets = 64;
+    set<string> canonicalTrails[nrBuckets];
+    mutex locks[nrBuckets];
+public:
+    /** See TrailDuplicateFilter::isNew(). */
+    bool isNew(const Trail& trail);
+    /** This function translates a trail along z to the smallest of its translated versions.
+      * The slices of all the states at a given z are grouped, so that all states 
+      * are translated together, and the translation is found with 
+      * getSymmetricMinimumTranslation(), in time linear in the lane size.
+      * @param  trail   The trail to translate.
+      */
+    static void translateToCanonical(Trail& trail);
+};
+
+/** This class implements a TrailFetcher that can be called from several threads at once.
+  * Each thread appends the trails to its own buffer, which is written, when full,
+  * to its own shard file, named after the output file with a suffix "-shard-" and a number.
+  * The shards are concatenated into the output file by merge() or by the destructor.
+  * The trails are saved either as by Trail::save() or, optionally, in binary form
+  * as by TrailSaveToBinaryFile.
+  * An optional TrailDuplicateFilter drops trails before they are buffered.
+  * The order of the trails in the output file is unspecified.
+  */
+class ShardedTrailFetcher : public TrailFetcher {
+protected:
+    struct Shard {
+        string fileName;
+        ofstream fout;
+        string buffer;
+        UINT64 count;
+    };
+    string fileName;
+    bool binary;
+    TrailDuplicateFilter *duplicateFilter;
+    size_t bufferSize;
+    /** A number that identifies this object in the per-thread cache of shards. */
+    UINT64 identifier;
+    vector<Shard *> shards;
+    mutex shardsLock;
+    bool merged;
+public:
+    /** The constructor.
+      * @param  aFileName   The name of the output file.
+      * @param  aBinary     Whether to save the trails in binary form.
+      * @param  aDuplicateFilter    If not 0, a pointer to the filter that drops duplicate trails.
+      *                     It is not freed by the destructor.
+      * @param  aBufferSize The size in bytes above which a buffer is written to its shard.
+      */
+    ShardedTrailFetcher(const string& aFileName, bool aBinary = false, 
+        TrailDuplicateFilter *aDuplicateFilter = 0, size_t aBufferSize = 1 << 20);
+    /** The destructor merges the shards, if not done yet. */
+    ~ShardedTrailFetcher();
+    /** See TrailFetcher::fetchTrail().*/
+    void fetchTrail(const Trail& trail);
+    /** See TrailFetcher::flush(). This writes all buffers to their shards,
+      * and must not be called while other threads call fetchTrail().
+      */
+    void flush();
+    /** See TrailFetcher::isThreadSafe().*/
+    bool isThreadSafe() const { return true; }
+    /** This method concatenates the shards into the output file and removes them.
+      * It must not be called while other threads call fetchTrail(), 
+      * and no trail can be fetched afterwards.
+      * @return The number of trails in the output file.
+      */
+    UINT64 merge();
+protected:
+    Shard& getShard();
+    void writeBuffer(Shard& shard);
+};
+
+/** This function converts a file of trails in text form, as saved by Trail::save(),
+  * into a binary file, as saved by TrailSaveToBinaryFile.
+  * @param  textFileName    The name of the file to read from.
+  * @param  binaryFileName  The name of the file to write to.
+  * @return The number of trails converted.
+  */
+UINT64 convertTrailFileToBinary(const string& textFileName, const string& binaryFileName);
+
+/** This function converts a binary file of trails, as saved by TrailSaveToBinaryFile,
+  * into a file in text form, as saved by Trail::save().
+  * @param  binaryFileName  The name of the file to read from.
+  * @param  textFileName    The name of the file to write to.
+  * @return The number of trails converted.
+  */
+UINT64 convertTrailFileToText(const string& binaryFileName, const string& textFileName);
+
 #endif
@@ -14,6 +14,7 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string.h>
 #include "duplex.h"
@@ -25,6 +26,7 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #include "Keccak-fDCLC.h"
 #include "Keccak-fEquations.h"
 #include "Keccak-fPropagation.h"
+#include "Keccak-fTrailCoreInKernelAtC.h"
 #include "Keccak-fTrailExtension.h"
 #include "Keccak-fTrails.h"
 
@@ -439,8 +441,10 @@ void generateTrailFromDinurDunkelmanShamirCollision()
   *     KeccakFTrailExtension::knownSmallWeightStates.
   * @param  maxSmallWeight  Up to which weight the small-weight state file
   *     is complete.
+  * @param  nrThreads   The number of threads to extend the trails with.
+  *     With more than one thread, the order of the output trails varies from run to run.
   */
-void extendTrails(KeccakFPropagation::DCorLC DCLC, unsigned int width, const string& inFileName, unsigned int nrRounds, int maxWeight, bool reverse, bool allPrefixes=false, const string& knownSmallWeightStateFileName="", int maxSmallWeight=0)
+void extendTrails(KeccakFPropagation::DCorLC DCLC, unsigned int width, const string& inFileName, unsigned int nrRounds, int maxWeight, bool reverse, bool allPrefixes=false, const string& knownSmallWeightStateFileName="", int maxSmallWeight=0, unsigned int nrThreads=1)
 {
     try {
         cout << "Initializing... " << flush;
@@ -451,25 +455,48 @@ void extendTrails(KeccakFPropagation::DCorLC DCLC, unsigned int width, const str
 
         if (knownSmallWeightStateFileName != "") {
             keccakFTE.knownSmallWeightStates = new KnownSmallWeightStates(maxSmallWeight);
-            keccakFTE.knownSmallWeightStates->loadFromFile(keccakFTE, knownSmallWeightStateFileName);
+            // The states are cached in binary form next to the file of trails,
+            // and the cache is rebuilt when the file of trails changes.
+            string binaryFileName = knownSmallWeightStateFileName + "-states.bin";
+            if (!keccakFTE.knownSmallWeightStates->loadFromBinaryFile(keccakFTE, binaryFileName, knownSmallWeightStateFileName)) {
+                keccakFTE.knownSmallWeightStates->loadFromFile(keccakFTE, knownSmallWeightStateFileName);
+                keccakFTE.knownSmallWeightStates->saveToBinaryFile(keccakFTE, binaryFileName, knownSmallWeightStateFileName);
+            }
             cout << "Using '" << knownSmallWeightStateFileName << "'" << endl;
         }
+        keccakFTE.nrThreads = nrThreads;
 
         try {
-            TrailFileIterator trailsIn(inFileName, keccakFTE);
+            TrailFileParallelIterator trailsIn(inFileName, keccakFTE);
             cout << trailsIn << endl;
             string outFileName = inFileName + (reverse ? string("-rev") : string("-dir"));
-            ofstream fout(outFileName.c_str());
-            TrailSaveToFile trailsOut(fout);
+            // If a previous run was interrupted, resume from its last checkpoint.
+            keccakFTE.checkpointFileName = outFileName + "-checkpoint";
+            ofstream fout;
+            unique_ptr<TrailFetcher> trailsOut;
+            if (keccakFTE.loadCheckpoint()) {
+                cout << "Resuming from '" << keccakFTE.checkpointFileName << "'" << endl;
+                // The trails output after the checkpoint are removed, as they will be found again.
+                UINT64 outputLength;
+                if (!keccakFTE.getResumeOutputPosition(outputLength))
+                    throw TrailException("The checkpoint '" + keccakFTE.checkpointFileName + "' does not record the length of the output.");
+                trailsOut.reset(new TrailAppendToFile(outFileName, outputLength));
+            }
+            else {
+                fout.open(outFileName.c_str());
+                trailsOut.reset(new TrailSaveToFile(fout));
+            }
             if (reverse) {
                 keccakFTE.showMinimalTrails = true;
                 keccakFTE.allPrefixes = allPrefixes;
-                keccakFTE.backwardExtendTrails(trailsIn, trailsOut, nrRounds, maxWeight);
+                keccakFTE.backwardExtendTrails(trailsIn, *trailsOut, nrRounds, maxWeight);
             }
             else {
                 keccakFTE.showMinimalTrails = true;
-                keccakFTE.forwardExtendTrails(trailsIn, trailsOut, nrRounds, maxWeight);
+                keccakFTE.forwardExtendTrails(trailsIn, *trailsOut, nrRounds, maxWeight);
             }
+            trailsOut.reset();
+            fout.close();
             Trail::produceHumanReadableFile(keccakFTE, outFileName);
         }
         catch(TrailException e) {
@@ -490,6 +517,90 @@ void extendTrails()
     extendTrails(KeccakFPropagation::LC, 1600, "LCKeccakF-1600-trailcores", 4, 100, false);
 }
 
+/** Example function that takes trails from a file and outputs
+  * the lightest forward extensions up to a given number of rounds,
+  * in nondecreasing weight order.
+  * @param  DCLC    Whether linear or differential trails are processed.
+  * @param  width   The Keccak-f width.
+  * @param  inFileName  The name of the file containing trails.
+  * @param  nrRounds    The target number of rounds.
+  * @param  maxWeight   The maximum weight of the trails to be produced.
+  * @param  maxNrTrails The number of trails to produce.
+  */
+void extendTrailsBestFirst(KeccakFPropagation::DCorLC DCLC, unsigned int width, const string& inFileName, unsigned int nrRounds, int maxWeight, UINT64 maxNrTrails)
+{
+    try {
+        KeccakFDCLC keccakF(width);
+        KeccakFTrailExtension keccakFTE(keccakF, DCLC);
+        cout << keccakF << endl;
+        try {
+            TrailFileParallelIterator trailsIn(inFileName, keccakFTE);
+            cout << trailsIn << endl;
+            string outFileName = inFileName + "-best";
+            keccakFTE.bestFirstSpillFileName = outFileName;
+            ofstream fout(outFileName.c_str());
+            TrailSaveToFile trailsOut(fout);
+            UINT64 n = keccakFTE.forwardExtendTrailsBestFirst(trailsIn, trailsOut, nrRounds, maxWeight, maxNrTrails);
+            cout << dec << n << " trails found" << endl;
+            fout.close();
+            Trail::produceHumanReadableFile(keccakFTE, outFileName);
+        }
+        catch(TrailException e) {
+            cout << e.reason << endl;
+        }
+    }
+    catch(KeccakException e) {
+        cout << e.reason << endl;
+    }
+}
+
+/** Example function that looks for the three-round trail cores
+  * with C in the kernel up to a given weight, using several threads.
+  * The search gives the states at B, which are then extended forward by one round
+  * to produce the three-round trail cores.
+  * @param  DCLC    Whether linear or differential trail cores are generated.
+  * @param  width   The Keccak-f width.
+  * @param  maxWeight   The maximum weight of the trail cores to be produced.
+  * @param  nrThreads   The number of threads to generate the trail cores with.
+  *     With more than one thread, the order of the output trail cores varies from run to run.
+  */
+void generateTrailCoresInKernelAtC(KeccakFPropagation::DCorLC DCLC, unsigned int width, unsigned int maxWeight, unsigned int nrThreads)
+{
+    try {
+        KeccakFDCLC keccakF(width);
+        KeccakFTrailExtension keccakFTE(keccakF, DCLC);
+        cout << keccakF << endl;
+        try {
+            vector<SliceValue> backgroundAtA(keccakF.getLaneSize(), 0);
+            vector<SliceValue> tabooAtB(keccakF.getLaneSize(), 0);
+            stringstream str;
+            str << "-InKernelAtC-" << dec << maxWeight;
+            string fileName = keccakFTE.buildFileName(str.str());
+            {
+                ofstream fout(fileName.c_str());
+                TrailSaveToFile trailsOut(fout);
+                UINT64 n = generateThreeRoundTrailCoresInKernelAtC(backgroundAtA, tabooAtB, maxWeight, keccakF, DCLC, trailsOut, nrThreads);
+                cout << dec << n << " states at B found" << endl;
+            }
+            string outFileName = fileName + "-dir";
+            {
+                TrailFileParallelIterator trailsIn(fileName, keccakFTE);
+                ofstream fout(outFileName.c_str());
+                TrailSaveToFile trailsOut(fout);
+                keccakFTE.nrThreads = nrThreads;
+                keccakFTE.forwardExtendTrails(trailsIn, trailsOut, 3, maxWeight);
+            }
+            Trail::produceHumanReadableFile(keccakFTE, outFileName);
+        }
+        catch(TrailException e) {
+            cout << e.reason << endl;
+        }
+    }
+    catch(KeccakException e) {
+        cout << e.reason << endl;
+    }
+}
+
 int main(int argc, char *argv[])
 {
     try {
@@ -509,6 +620,8 @@ int main(int argc, char *argv[])
         //verifyChallenges();
         //generateTrailFromDinurDunkelmanShamirCollision();
         //extendTrails();
+        //extendTrailsBestFirst(KeccakFPropagation::DC, 1600, "DCKeccakF-1600-FSE2012-3round-trailcores", 5, 100, 10);
+        //generateTrailCoresInKernelAtC(KeccakFPropagation::DC, 200, 30, 4);
     }
     catch(SpongeException e) {
         cout << e.reason << endl;
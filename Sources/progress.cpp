@@ -109,3 +109,11 @@ void ProgressMeter::display()
             nrDisplaysSinceFullDisplay = 0;
     }
 }
+
+vector<UINT64> ProgressMeter::getPosition() const
+{
+    vector<UINT64> position(index);
+    if (height > 0)
+        position.push_back(topIndex);
+    return position;
+}
@@ -39,6 +39,10 @@ public:
     void unstack();
     void operator++();
     void clear();
+    /** This method returns the index at each level of the stack,
+      * from the bottom to the top.
+      */
+    vector<UINT64> getPosition() const;
 protected:
     void display();
     void displayIfNecessary();
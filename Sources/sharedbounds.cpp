@@ -0,0 +1,194 @@
+/*
+KeccakTools
+
+The Keccak sponge function, designed by Guido Bertoni, Joan Daemen,
+Michaël Peeters and Gilles Van Assche. For more information, feedback or
+questions, please refer to our website: http://keccak.noekeon.org/
+
+Implementation by the designers,
+hereby denoted as "the implementer".
+
+To the extent possible under law, the implementer has waived all copyright
+and related or neighboring rights to the source code in this file.
+http://creativecommons.org/publicdomain/zero/1.0/
+*/
+
+#include <new>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "sharedbounds.h"
+
+/** The header of a bounds file. */
+struct SharedWeightBoundsHeader {
+    char magic[8];
+    UINT32 byteOrder;
+    UINT32 version;
+    UINT32 width;
+    UINT32 maxNrRounds;
+    char tag[32];
+};
+
+/** The layout of a bounds file: the header, followed by the lightest weights
+  * and then by the lower bounds, one atomic integer per number of rounds.
+  * The atomic integers are operated on in place by all the processes that 
+  * map the file, so they must be lock-free and have the size of a plain int.
+  */
+struct SharedWeightBoundsFile {
+    SharedWeightBoundsHeader header;
+    atomic<int> lightestWeight[SharedWeightBounds::maxNrRounds];
+    atomic<int> lowerBound[SharedWeightBounds::maxNrRounds];
+};
+
+static const char sharedWeightBoundsMagic[8] = { 'K', 'T', 'B', 'O', 'U', 'N', 'D', 0 };
+static const UINT32 sharedWeightBoundsByteOrder = 0x01020304;
+static const UINT32 sharedWeightBoundsVersion = 1;
+
+SharedWeightBounds::SharedWeightBounds()
+    : mapping(0), mappingLength(0)
+{
+    initializeInMemory();
+}
+
+SharedWeightBounds::SharedWeightBounds(const string& fileName, const string& tag, unsigned int width)
+    : mapping(0), mappingLength(0)
+{
+    if (!mapFile(fileName, tag, width))
+        initializeInMemory();
+}
+
+SharedWeightBounds::~SharedWeightBounds()
+{
+#ifndef _WIN32
+    if (mapping != 0)
+        munmap(mapping, mappingLength);
+#endif
+}
+
+void SharedWeightBounds::initializeInMemory()
+{
+    vector<atomic<int> > bounds(2*maxNrRounds);
+    ownedBounds.swap(bounds);
+    lightestWeight = &ownedBounds[0];
+    lowerBound = &ownedBounds[maxNrRounds];
+    for(unsigned int i=0; i<maxNrRounds; i++) {
+        lightestWeight[i].store(unknownWeight);
+        lowerBound[i].store(0);
+    }
+}
+
+bool SharedWeightBounds::mapFile(const string& fileName, const string& tag, unsigned int width)
+{
+#if !defined(_WIN32) && (ATOMIC_INT_LOCK_FREE == 2)
+    static_assert(sizeof(atomic<int>) == sizeof(int), "atomic<int> must have the layout of an int to be mapped from a file");
+    SharedWeightBoundsHeader expected;
+    memset(&expected, 0, sizeof(expected));
+    memcpy(expected.magic, sharedWeightBoundsMagic, sizeof(expected.magic));
+    expected.byteOrder = sharedWeightBoundsByteOrder;
+    expected.version = sharedWeightBoundsVersion;
+    expected.width = width;
+    expected.maxNrRounds = maxNrRounds;
+    strncpy(expected.tag, tag.c_str(), sizeof(expected.tag)-1);
+    size_t length = sizeof(SharedWeightBoundsFile);
+
+    int fd = open(fileName.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+        return false;
+    // The lock makes sure that only one process initializes the file.
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return false;
+    }
+    // A file of another size is not ours to reset, as other processes may still use it.
+    struct stat info;
+    bool valid = (fstat(fd, &info) == 0);
+    bool isNew = valid && (info.st_size == 0);
+    if (isNew)
+        valid = (ftruncate(fd, length) == 0);
+    else if (valid)
+        valid = ((size_t)info.st_size == length);
+    if (!valid) {
+        flock(fd, LOCK_UN);
+        close(fd);
+        return false;
+    }
+    void *address = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        flock(fd, LOCK_UN);
+        close(fd);
+        return false;
+    }
+    SharedWeightBoundsFile *file = (SharedWeightBoundsFile *)address;
+    // The header is written last, so a zero magic number means that 
+    // the initialization of the file was interrupted.
+    static const char noMagic[sizeof(expected.magic)] = { 0 };
+    if (isNew || (memcmp(file->header.magic, noMagic, sizeof(noMagic)) == 0)) {
+        for(unsigned int i=0; i<maxNrRounds; i++) {
+            new (&file->lightestWeight[i]) atomic<int>(unknownWeight);
+            new (&file->lowerBound[i]) atomic<int>(0);
+        }
+        memcpy(&file->header, &expected, sizeof(expected));
+    }
+    else if (memcmp(&file->header, &expected, sizeof(expected)) != 0) {
+        // The file holds other bounds, so leave it untouched.
+        munmap(address, length);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return false;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    lightestWeight = file->lightestWeight;
+    lowerBound = file->lowerBound;
+    mapping = address;
+    mappingLength = length;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool SharedWeightBounds::publishTrailWeight(unsigned int nrRounds, int weight)
+{
+    if ((nrRounds == 0) || (nrRounds > maxNrRounds))
+        return false;
+    atomic<int>& bound = lightestWeight[nrRounds-1];
+    int current = bound.load(memory_order_relaxed);
+    while(weight < current)
+        if (bound.compare_exchange_weak(current, weight, memory_order_relaxed))
+            return true;
+    return false;
+}
+
+bool SharedWeightBounds::publishLowerBound(unsigned int nrRounds, int weight)
+{
+    if ((nrRounds == 0) || (nrRounds > maxNrRounds))
+        return false;
+    atomic<int>& bound = lowerBound[nrRounds-1];
+    int current = bound.load(memory_order_relaxed);
+    while(weight > current)
+        if (bound.compare_exchange_weak(current, weight, memory_order_relaxed))
+            return true;
+    return false;
+}
+
+ostream& operator<<(ostream& out, const SharedWeightBounds& bounds)
+{
+    for(unsigned int nrRounds=1; nrRounds<=SharedWeightBounds::maxNrRounds; nrRounds++) {
+        int lower = bounds.getLowerBound(nrRounds);
+        int lightest = bounds.getLightestWeight(nrRounds);
+        if ((lower == 0) && (lightest == SharedWeightBounds::unknownWeight))
+            continue;
+        out.width(2); out.fill(' '); out << dec << nrRounds << " rounds: ";
+        out.width(3); out.fill(' '); out << dec << lower << " <= weight";
+        if (lightest != SharedWeightBounds::unknownWeight)
+            out << " <= " << dec << lightest;
+        out << endl;
+    }
+    return out;
+}
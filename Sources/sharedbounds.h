@@ -0,0 +1,110 @@
+/*
+KeccakTools
+
+The Keccak sponge function, designed by Guido Bertoni, Joan Daemen,
+Michaël Peeters and Gilles Van Assche. For more information, feedback or
+questions, please refer to our website: http://keccak.noekeon.org/
+
+Implementation by the designers,
+hereby denoted as "the implementer".
+
+To the extent possible under law, the implementer has waived all copyright
+and related or neighboring rights to the source code in this file.
+http://creativecommons.org/publicdomain/zero/1.0/
+*/
+
+#ifndef _SHAREDBOUNDS_H_
+#define _SHAREDBOUNDS_H_
+
+#include <atomic>
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "types.h"
+
+using namespace std;
+
+/** This class holds weight bounds per number of rounds that several searches
+  * can consult and tighten concurrently. For each number of rounds, it keeps
+  * the weight of the lightest trail found so far, which only decreases,
+  * and a lower bound on the weight of any trail, which only increases.
+  * The bounds are updated with atomic operations, so that an object can be
+  * shared between threads. It can also be backed by a file mapped in memory,
+  * so that searches running in separate processes on the same machine see
+  * each other's improvements as soon as they are published.
+  * The file starts with a header that identifies the bounds (a tag) and
+  * the Keccak-<i>f</i> width; when it does not match, the file is left untouched,
+  * as other processes may still use it, and the bounds are kept in memory.
+  */
+class SharedWeightBounds {
+public:
+    /** The largest number of rounds for which bounds are kept. */
+    static const unsigned int maxNrRounds = 64;
+    /** The value returned by getLightestWeight() when no trail is known. */
+    static const int unknownWeight = 0x7FFFFFFF;
+private:
+    /** The lightest weight found per number of rounds, at index nrRounds-1. */
+    atomic<int> *lightestWeight;
+    /** The lower bound per number of rounds, at index nrRounds-1. */
+    atomic<int> *lowerBound;
+    /** The bounds, when not mapped from a file. */
+    vector<atomic<int> > ownedBounds;
+    /** The address of the mapping, or 0 if the bounds are not mapped. */
+    void *mapping;
+    /** The length of the mapping in bytes. */
+    size_t mappingLength;
+public:
+    /** This constructor initializes bounds in memory, to be shared between threads. */
+    SharedWeightBounds();
+    /** This constructor maps the bounds from a file, creating it if necessary,
+      * to be shared between processes. If the file is not supported on this
+      * platform, or if it holds bounds for another tag or width, 
+      * the bounds are kept in memory, see isMapped().
+      * @param  fileName    The name of the file.
+      * @param  tag         A short string (at most 31 characters) identifying the bounds,
+      *                     typically whether they apply to DC or LC.
+      * @param  width       The Keccak-<i>f</i> width the bounds apply to.
+      */
+    SharedWeightBounds(const string& fileName, const string& tag, unsigned int width);
+    /** The destructor releases the mapping, if any. */
+    ~SharedWeightBounds();
+    /** This method returns the weight of the lightest trail found so far
+      * with the given number of rounds, or unknownWeight if none.
+      */
+    inline int getLightestWeight(unsigned int nrRounds) const
+    {
+        if ((nrRounds == 0) || (nrRounds > maxNrRounds))
+            return unknownWeight;
+        return lightestWeight[nrRounds-1].load(memory_order_relaxed);
+    }
+    /** This method returns the lower bound on the weight of trails
+      * with the given number of rounds, or 0 if none.
+      */
+    inline int getLowerBound(unsigned int nrRounds) const
+    {
+        if ((nrRounds == 0) || (nrRounds > maxNrRounds))
+            return 0;
+        return lowerBound[nrRounds-1].load(memory_order_relaxed);
+    }
+    /** This method publishes that a trail with the given number of rounds
+      * and the given weight was found.
+      * @return True iff this trail is lighter than any published before.
+      */
+    bool publishTrailWeight(unsigned int nrRounds, int weight);
+    /** This method publishes that no trail with the given number of rounds
+      * has weight below the given one.
+      * @return True iff this bound is tighter than any published before.
+      */
+    bool publishLowerBound(unsigned int nrRounds, int weight);
+    /** This method returns whether the bounds are mapped from a file. */
+    inline bool isMapped() const { return mapping != 0; }
+    friend ostream& operator<<(ostream& out, const SharedWeightBounds& bounds);
+private:
+    void initializeInMemory();
+    bool mapFile(const string& fileName, const string& tag, unsigned int width);
+    SharedWeightBounds(const SharedWeightBounds&);
+    SharedWeightBounds& operator=(const SharedWeightBounds&);
+};
+
+#endif
@@ -0,0 +1,192 @@
+/*
+KeccakTools
+
+The Keccak sponge function, designed by Guido Bertoni, Joan Daemen,
+Michaël Peeters and Gilles Van Assche. For more information, feedback or
+questions, please refer to our website: http://keccak.noekeon.org/
+
+Implementation by the designers,
+hereby denoted as "the implementer".
+
+To the extent possible under law, the implementer has waived all copyright
+and related or neighboring rights to the source code in this file.
+http://creativecommons.org/publicdomain/zero/1.0/
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
+#include "tablecache.h"
+
+/** The header of a cache file, followed by the table itself.
+  * Its size is a multiple of 64 bytes, so that the table is aligned
+  * in the mapped file.
+  */
+struct CachedTableHeader {
+    char magic[8];
+    UINT32 byteOrder;
+    UINT32 version;
+    UINT32 width;
+    UINT32 reserved;
+    UINT64 size;
+    char tag[32];
+};
+
+static const char cachedTableMagic[8] = { 'K', 'T', 'C', 'A', 'C', 'H', 'E', 0 };
+static const UINT32 cachedTableByteOrder = 0x01020304;
+
+static void buildHeader(CachedTableHeader& header, const string& tag, unsigned int width, unsigned int version, size_t size)
+{
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cachedTableMagic, sizeof(header.magic));
+    header.byteOrder = cachedTableByteOrder;
+    header.version = version;
+    header.width = width;
+    header.size = size;
+    strncpy(header.tag, tag.c_str(), sizeof(header.tag)-1);
+}
+
+CachedTable::CachedTable()
+    : data(0), size(0), mapping(0), mappingLength(0)
+{
+}
+
+CachedTable::~CachedTable()
+{
+    release();
+}
+
+void CachedTable::release()
+{
+#ifndef _WIN32
+    if (mapping != 0)
+        munmap(mapping, mappingLength);
+#endif
+    mapping = 0;
+    mappingLength = 0;
+    ownedData.clear();
+    data = 0;
+    size = 0;
+}
+
+unsigned char *CachedTable::allocate(size_t aSize)
+{
+    release();
+    ownedData.assign(aSize, 0);
+    size = aSize;
+    data = (aSize > 0) ? &ownedData[0] : 0;
+    return (aSize > 0) ? &ownedData[0] : 0;
+}
+
+bool CachedTable::load(const string& fileName, const string& tag, unsigned int width, unsigned int version, size_t expectedSize)
+{
+    return loadFile(fileName, tag, width, version, false, expectedSize);
+}
+
+bool CachedTable::load(const string& fileName, const string& tag, unsigned int width, unsigned int version)
+{
+    return loadFile(fileName, tag, width, version, true, 0);
+}
+
+bool CachedTable::loadFile(const string& fileName, const string& tag, unsigned int width, unsigned int version, bool anySize, size_t expectedSize)
+{
+    CachedTableHeader expected;
+#ifndef _WIN32
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if ((fstat(fd, &info) != 0) || ((size_t)info.st_size < sizeof(expected))) {
+        close(fd);
+        return false;
+    }
+    if (anySize)
+        expectedSize = (size_t)info.st_size - sizeof(expected);
+    if ((size_t)info.st_size != sizeof(expected) + expectedSize) {
+        close(fd);
+        return false;
+    }
+    buildHeader(expected, tag, width, version, expectedSize);
+    void *address = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+        return false;
+    if (memcmp(address, &expected, sizeof(expected)) != 0) {
+        munmap(address, info.st_size);
+        return false;
+    }
+    release();
+    mapping = address;
+    mappingLength = info.st_size;
+    data = (const unsigned char *)address + sizeof(expected);
+    size = expectedSize;
+    return true;
+#else
+    ifstream fin(fileName.c_str(), ios::binary);
+    if (!fin)
+        return false;
+    CachedTableHeader header;
+    fin.read((char *)&header, sizeof(header));
+    if (!fin)
+        return false;
+    if (anySize)
+        expectedSize = (size_t)header.size;
+    buildHeader(expected, tag, width, version, expectedSize);
+    if (memcmp(&header, &expected, sizeof(expected)) != 0)
+        return false;
+    unsigned char *target = allocate(expectedSize);
+    fin.read((char *)target, expectedSize);
+    if ((size_t)fin.gcount() != expectedSize) {
+        release();
+        return false;
+    }
+    return true;
+#endif
+}
+
+string getTemporaryFileName(const string& fileName)
+{
+    static atomic<unsigned int> counter(0);
+    stringstream str;
+    str << fileName << "." << getpid() << "-" << counter++ << ".tmp";
+    return str.str();
+}
+
+bool CachedTable::save(const string& fileName, const string& tag, unsigned int width, unsigned int version) const
+{
+    CachedTableHeader header;
+    buildHeader(header, tag, width, version, size);
+    string tempFileName = getTemporaryFileName(fileName);
+    {
+        ofstream fout(tempFileName.c_str(), ios::binary);
+        if (!fout)
+            return false;
+        fout.write((const char *)&header, sizeof(header));
+        if (size > 0)
+            fout.write((const char *)data, size);
+        fout.close();
+        if (!fout) {
+            remove(tempFileName.c_str());
+            return false;
+        }
+    }
+#ifdef _WIN32
+    remove(fileName.c_str());
+#endif
+    if (rename(tempFileName.c_str(), fileName.c_str()) != 0) {
+        remove(tempFileName.c_str());
+        return false;
+    }
+    return true;
+}
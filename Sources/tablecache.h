@@ -0,0 +1,112 @@
+/*
+KeccakTools
+
+The Keccak sponge function, designed by Guido Bertoni, Joan Daemen,
+Michaël Peeters and Gilles Van Assche. For more information, feedback or
+questions, please refer to our website: http://keccak.noekeon.org/
+
+Implementation by the designers,
+hereby denoted as "the implementer".
+
+To the extent possible under law, the implementer has waived all copyright
+and related or neighboring rights to the source code in this file.
+http://creativecommons.org/publicdomain/zero/1.0/
+*/
+
+#ifndef _TABLECACHE_H_
+#define _TABLECACHE_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "types.h"
+
+using namespace std;
+
+/** This class holds a read-only look-up table, either computed in memory
+  * or memory-mapped from a cache file.
+  * A cache file starts with a header that identifies the table (a tag),
+  * the Keccak-<i>f</i> width, the version of the table layout and its size.
+  * When the header does not match what the caller expects, the file is ignored
+  * so that the table can be recomputed and the file overwritten.
+  * Mapping the file read-only allows several processes to share the same pages.
+  */
+class CachedTable {
+private:
+    /** The table contents, pointing either to ownedData or to the mapped file. */
+    const unsigned char *data;
+    /** The size of the table in bytes. */
+    size_t size;
+    /** The table contents, when computed or read in memory. */
+    vector<unsigned char> ownedData;
+    /** The address of the mapping, or 0 if the table is not mapped. */
+    void *mapping;
+    /** The length of the mapping in bytes. */
+    size_t mappingLength;
+public:
+    /** This constructor initializes an empty table. */
+    CachedTable();
+    /** The destructor releases the mapping, if any. */
+    ~CachedTable();
+    /** This method attempts to load the table from a cache file.
+      * @param  fileName    The name of the cache file.
+      * @param  tag         A short string (at most 31 characters) identifying the table.
+      * @param  width       The Keccak-<i>f</i> width the table was computed for.
+      * @param  version     The version of the table layout.
+      * @param  expectedSize    The expected size of the table in bytes.
+      * @return True iff the file exists and its header matches the parameters.
+      */
+    bool load(const string& fileName, const string& tag, unsigned int width, unsigned int version, size_t expectedSize);
+    /** This method attempts to load a table of variable size from a cache file.
+      * The size of the table is the one given in the header of the file.
+      * @param  fileName    The name of the cache file.
+      * @param  tag         A short string (at most 31 characters) identifying the table.
+      * @param  width       The Keccak-<i>f</i> width the table was computed for.
+      * @param  version     The version of the table layout.
+      * @return True iff the file exists and its header matches the parameters.
+      */
+    bool load(const string& fileName, const string& tag, unsigned int width, unsigned int version);
+    /** This method releases any previous content and allocates a table
+      * of the given size in memory, initialized to zero,
+      * so that the caller can compute it.
+      * @param  aSize   The size of the table in bytes.
+      * @return A pointer to the writable table.
+      */
+    unsigned char *allocate(size_t aSize);
+    /** This method saves the table to a cache file, with a header built
+      * from the given parameters. The file is first written under a temporary name
+      * unique to the process and the call, and then renamed, so that concurrent
+      * processes never see a partial file nor write into the same temporary file.
+      * @param  fileName    The name of the cache file.
+      * @param  tag         A short string (at most 31 characters) identifying the table.
+      * @param  width       The Keccak-<i>f</i> width the table was computed for.
+      * @param  version     The version of the table layout.
+      * @return True iff the file could be written.
+      */
+    bool save(const string& fileName, const string& tag, unsigned int width, unsigned int version) const;
+    /** This method returns the size of the table in bytes. */
+    inline size_t getSize() const { return size; }
+    /** This method returns whether the table is mapped from a file. */
+    inline bool isMapped() const { return mapping != 0; }
+    /** This method returns the byte at the given index. */
+    inline unsigned char operator[](size_t i) const { return data[i]; }
+    /** This method returns the table as an array of the given type.
+      * The contents are suitably aligned for types of up to 64 bits.
+      */
+    template<class T> inline const T *getDataAs() const { return (const T *)data; }
+private:
+    void release();
+    bool loadFile(const string& fileName, const string& tag, unsigned int width, unsigned int version, bool anySize, size_t expectedSize);
+    CachedTable(const CachedTable&);
+    CachedTable& operator=(const CachedTable&);
+};
+
+/** This function returns the name of a temporary file next to the given one,
+  * unique to this process and to this call, so that processes or threads
+  * writing the same file at once never write into the same temporary file.
+  * @param  fileName    The name of the file to be replaced, once written, by renaming the temporary file.
+  * @return The name of the temporary file.
+  */
+string getTemporaryFileName(const string& fileName);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+KeccakTools
+
+The Keccak sponge function, designed by Guido Bertoni, Joan Daemen,
+Michaël Peeters and Gilles Van Assche. For more information, feedback or
+questions, please refer to our website: http://keccak.noekeon.org/
+
+Implementation by the designers,
+hereby denoted as "the implementer".
+
+To the extent possible under law, the implementer has waived all copyright
+and related or neighboring rights to the source code in this file.
+http://creativecommons.org/publicdomain/zero/1.0/
+*/
+
+#include "taskscheduler.h"
+
+static thread_local TaskScheduler *currentScheduler = 0;
+static thread_local unsigned int currentWorker = 0;
+
+TaskScheduler::TaskScheduler(unsigned int nrThreads)
+    : pending(0), queued(0), nextWorker(0), stopping(false)
+{
+    if (nrThreads < 1)
+        nrThreads = 1;
+    for(unsigned int i=0; i<nrThreads; i++)
+        workers.push_back(new Worker);
+    for(unsigned int i=0; i<nrThreads; i++)
+        threads.push_back(thread(&TaskScheduler::work, this, i));
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    stop();
+    for(unsigned int i=0; i<workers.size(); i++)
+        delete workers[i];
+}
+
+void TaskScheduler::submit(Task *task)
+{
+    if (stopping) {
+        delete task;
+        return;
+    }
+    unsigned int index;
+    {
+        lock_guard<mutex> guard(lock);
+        pending++;
+        if (currentScheduler == this)
+            index = currentWorker;
+        else
+            index = (nextWorker++) % workers.size();
+    }
+    {
+        lock_guard<mutex> guard(workers[index]->lock);
+        workers[index]->tasks.push_back(task);
+    }
+    // The task is counted as queued only once it is in a queue,
+    // so that a thread that reserves it in work() is sure to find it.
+    {
+        lock_guard<mutex> guard(lock);
+        queued++;
+    }
+    workAvailable.notify_one();
+}
+
+void TaskScheduler::wait(UINT64 maxPending)
+{
+    unique_lock<mutex> guard(lock);
+    while((pending > maxPending) && !error)
+        taskFinished.wait(guard);
+    if (error) {
+        exception_ptr e = error;
+        guard.unlock();
+        stop();
+        rethrow_exception(e);
+    }
+}
+
+void TaskScheduler::stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    for(unsigned int i=0; i<threads.size(); i++)
+        if (threads[i].joinable())
+            threads[i].join();
+    for(unsigned int i=0; i<workers.size(); i++) {
+        while(!workers[i]->tasks.empty()) {
+            delete workers[i]->tasks.back();
+            workers[i]->tasks.pop_back();
+        }
+    }
+}
+
+unsigned int TaskScheduler::getNumberOfThreads() const
+{
+    return threads.size();
+}
+
+unsigned int TaskScheduler::getDefaultNumberOfThreads()
+{
+    unsigned int n = thread::hardware_concurrency();
+    return (n > 0) ? n : 1;
+}
+
+Task *TaskScheduler::take(unsigned int index)
+{
+    // The caller has reserved a task in work(), so one is in a queue;
+    // it may only be missed while other threads push or take tasks, in which case the queues are scanned again.
+    while(true) {
+        {
+            Worker& own = *workers[index];
+            lock_guard<mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                Task *task = own.tasks.back();
+                own.tasks.pop_back();
+                return task;
+            }
+        }
+        for(unsigned int i=1; i<workers.size(); i++) {
+            Worker& other = *workers[(index+i) % workers.size()];
+            lock_guard<mutex> guard(other.lock);
+            if (!other.tasks.empty()) {
+                Task *task = other.tasks.front();
+                other.tasks.pop_front();
+                return task;
+            }
+        }
+        this_thread::yield();
+    }
+}
+
+void TaskScheduler::work(unsigned int index)
+{
+    currentScheduler = this;
+    currentWorker = index;
+    while(true) {
+        // An idle thread blocks until a task is queued, and reserves it before taking it.
+        {
+            unique_lock<mutex> guard(lock);
+            while((queued == 0) && !stopping)
+                workAvailable.wait(guard);
+            if (stopping)
+                break;
+            queued--;
+        }
+        Task *task = take(index);
+        try {
+            task->run();
+        }
+        catch(...) {
+            // The other threads stop after their current task; the queued tasks are deleted by stop().
+            {
+                lock_guard<mutex> guard(lock);
+                if (!error)
+                    error = current_exception();
+                stopping = true;
+            }
+            workAvailable.notify_all();
+        }
+        delete task;
+        {
+            lock_guard<mutex> guard(lock);
+            pending--;
+        }
+        taskFinished.notify_all();
+    }
+}
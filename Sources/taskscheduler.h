@@ -0,0 +1,108 @@
+/*
+KeccakTools
+
+The Keccak sponge function, designed by Guido Bertoni, Joan Daemen,
+Michaël Peeters and Gilles Van Assche. For more information, feedback or
+questions, please refer to our website: http://keccak.noekeon.org/
+
+Implementation by the designers,
+hereby denoted as "the implementer".
+
+To the extent possible under law, the implementer has waived all copyright
+and related or neighboring rights to the source code in this file.
+http://creativecommons.org/publicdomain/zero/1.0/
+*/
+
+#ifndef _TASKSCHEDULER_H_
+#define _TASKSCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "types.h"
+
+using namespace std;
+
+/** This abstract class represents a unit of work to be executed by a TaskScheduler.
+  */
+class Task {
+public:
+    virtual ~Task() {}
+    /** This method performs the work. It may submit further tasks
+      * to the scheduler that runs it.
+      */
+    virtual void run() = 0;
+};
+
+/** This class runs tasks on a fixed number of threads.
+  * Each thread has its own double-ended queue of tasks.
+  * A task submitted from a thread of the scheduler goes to the back of the queue 
+  * of that thread, which takes its next task from the back as well, 
+  * so that each thread works depth first on the tasks it generates.
+  * A thread whose queue is empty steals the oldest task from the queue of another thread.
+  * A thread with nothing to do blocks until a task is submitted.
+  * If a task throws an exception, the scheduler stops: the threads finish their current task,
+  * the tasks still queued are not run, and wait() rethrows the exception.
+  */
+class TaskScheduler {
+private:
+    /** The queue of tasks of one thread. */
+    class Worker {
+    public:
+        mutex lock;
+        deque<Task *> tasks;
+    };
+    vector<Worker *> workers;
+    vector<thread> threads;
+    /** The lock protecting pending, queued and error. */
+    mutex lock;
+    condition_variable workAvailable;
+    condition_variable taskFinished;
+    /** The number of tasks submitted but not yet finished. */
+    UINT64 pending;
+    /** The number of tasks in the queues and not yet reserved by a thread. */
+    UINT64 queued;
+    /** The index of the next queue for tasks submitted from outside the scheduler. */
+    unsigned int nextWorker;
+    atomic<bool> stopping;
+    exception_ptr error;
+public:
+    /** The constructor starts the threads.
+      * @param  nrThreads   The number of threads, at least 1.
+      */
+    TaskScheduler(unsigned int nrThreads);
+    /** The destructor stops the threads and deletes the tasks that were not run.
+      * To let all the tasks complete, call wait() first.
+      */
+    ~TaskScheduler();
+    /** This method submits a task to the scheduler, which takes ownership of it.
+      * @param  task    The task to run, allocated with new.
+      */
+    void submit(Task *task);
+    /** This method blocks until at most @a maxPending tasks remain
+      * submitted but not finished.
+      * If a task has thrown an exception, it stops the scheduler
+      * and rethrows this exception.
+      * @param  maxPending  The number of pending tasks to wait for.
+      */
+    void wait(UINT64 maxPending = 0);
+    /** This method stops the threads once they finish their current task.
+      * The tasks that were not run are deleted.
+      */
+    void stop();
+    /** This method returns the number of threads. */
+    unsigned int getNumberOfThreads() const;
+    /** This method returns the number of threads supported by the hardware, or 1 if unknown. */
+    static unsigned int getDefaultNumberOfThreads();
+private:
+    void work(unsigned int index);
+    Task *take(unsigned int index);
+    TaskScheduler(const TaskScheduler&);
+    TaskScheduler& operator=(const TaskScheduler&);
+};
+
+#endif
@@ -16,7 +16,9 @@ http://creativecommons.org/publicdomain/zero/1.0/
 #ifndef _TRANSLATIONSYMMETRY_H_
 #define _TRANSLATIONSYMMETRY_H_
 
+#include <algorithm>
 #include <vector>
+#include "types.h"
 
 /** This function defines an order between vectors.
   * @param  a   The first vector to compare.
@@ -52,8 +54,47 @@ bool isSmallerAfterTranslation(const std::vector<T>& a, unsigned int dz)
     return (a[z] > a[(z+dz)%size]);
 }
 
+/** This function returns the amount of translation that gives the minimum
+  * among the translated versions of the given vector, in the order of isSmaller().
+  * It uses Booth's least-rotation algorithm, reading the vector from its last element,
+  * so that it runs in time linear in the size of the vector.
+  * @param  a   The vector to translate.
+  * @return The amount @a dz such that Translate(@a a, @a dz) is minimal,
+  *     with aDz[(z+dz)%size] = a[z]. If several ones do, the smallest is returned.
+  */
+template<class T>
+unsigned int getSymmetricMinimumTranslation(const std::vector<T>& a)
+{
+    const int size = a.size();
+    if (size <= 1)
+        return 0;
+    // Element i of the sequence that Booth's algorithm sees is a[size-1-(i%size)].
+    std::vector<int> failure(2*size, -1);
+    int k = 0;
+    for(int j=1; j<2*size; j++) {
+        const T& sj = a[size-1-(j%size)];
+        int i = failure[j-k-1];
+        while((i != -1) && (sj != a[size-1-((k+i+1)%size)])) {
+            if (sj < a[size-1-((k+i+1)%size)])
+                k = j-i-1;
+            i = failure[i];
+        }
+        if (sj != a[size-1-((k+i+1)%size)]) {
+            // Here i == -1.
+            if (sj < a[size-1-(k%size)])
+                k = j;
+            failure[j-k] = -1;
+        }
+        else
+            failure[j-k] = i+1;
+    }
+    return k % size;
+}
+
 /** This function returns whether the given vector without translation
   * is the smallest among the translated versions of itself.
+  * Unlike getSymmetricMinimumTranslation(), it stops at the first translation found to be smaller,
+  * which in practice is faster for vectors that are not minimal.
   * @param  a   The vector to test.
   * @return True iff @a a is smaller than Translate(@a a, @a dz) for all @a dz ≠ 0.
   */
@@ -76,15 +117,164 @@ bool isMinimalSymmetrically(const std::vector<T>& a)
 template<class T>
 void getSymmetricMinimum(const std::vector<T>& a, std::vector<T>& aMin)
 {
-    aMin = a;
-    unsigned int laneSize = a.size();
-    for(unsigned int dz=1; dz<laneSize; dz++) {
-        std::vector<T> aDz(a.size());
-        for(unsigned int z=0; z<laneSize; z++)
-            aDz[(z+dz)%laneSize] = a[z];
-        if (isSmaller(aDz, aMin))
+    unsigned int size = a.size();
+    unsigned int dz = getSymmetricMinimumTranslation(a);
+    aMin.resize(size);
+    for(unsigned int z=0; z<size; z++)
+        aMin[(z+dz)%size] = a[z];
+}
+
+/** This function translates a vector of @a size units of @a unitSize bits each,
+  * packed in a 64-bit word with unit z at bits unitSize*z to unitSize*(z+1)-1,
+  * such as a PackedParity (with @a unitSize=5) or a lane (with @a unitSize=1).
+  * @param  a   The packed vector to translate.
+  * @param  size    The number of units, with @a size * @a unitSize ≤ 64.
+  * @param  unitSize    The number of bits per unit.
+  * @param  dz  The amount of translation, smaller than @a size.
+  * @return The packed vector with unit z moved to position (z+dz)%size.
+  */
+inline UINT64 translatePacked(UINT64 a, unsigned int size, unsigned int unitSize, unsigned int dz)
+{
+    const unsigned int nrBits = size*unitSize;
+    if (dz == 0)
+        return a;
+    UINT64 result = (a << (dz*unitSize)) | (a >> (nrBits - dz*unitSize));
+    return (nrBits == 64) ? result : (result & (((UINT64)1 << nrBits) - 1));
+}
+
+/** This function returns the minimum among the translated versions
+  * of the given packed vector, see translatePacked().
+  * As unit z is more significant than the units below it,
+  * this is also the minimum in the order of isSmaller().
+  * Each translation takes a few word operations, so that the time is linear in @a size.
+  * @param  a   The packed vector to translate.
+  * @param  size    The number of units.
+  * @param  unitSize    The number of bits per unit.
+  * @return The minimum translated version of @a a.
+  */
+inline UINT64 getSymmetricMinimumPacked(UINT64 a, unsigned int size, unsigned int unitSize = 1)
+{
+    UINT64 aMin = a;
+    for(unsigned int dz=1; dz<size; dz++) {
+        UINT64 aDz = translatePacked(a, size, unitSize, dz);
+        if (aDz < aMin)
             aMin = aDz;
     }
+    return aMin;
+}
+
+/** This function returns whether the given packed vector without translation
+  * is the smallest among the translated versions of itself, see getSymmetricMinimumPacked().
+  */
+inline bool isMinimalSymmetricallyPacked(UINT64 a, unsigned int size, unsigned int unitSize = 1)
+{
+    for(unsigned int dz=1; dz<size; dz++)
+        if (translatePacked(a, size, unitSize, dz) < a)
+            return false;
+    return true;
+}
+
+/** This class tests, while a vector is being generated, whether it can still be
+  * the smallest among its translated versions, as given by isMinimalSymmetrically().
+  * The elements are appended from the last one (the most significant in isSmaller()) down to the first,
+  * and the test follows the prenecklace recurrence of Fredricksen, Kessler and Maiorana:
+  * it takes constant time per element, and a generation can cut a branch as soon as push() fails.
+  */
+template<class T>
+class SymmetricMinimumPrefix {
+protected:
+    /** The elements appended so far, the first one being the last element of the vector. */
+    std::vector<T> elements;
+    /** At index i, the period of the first i+1 elements, i.e., the length of their longest Lyndon prefix. */
+    std::vector<unsigned int> periods;
+public:
+    /** This constructor starts with no element. */
+    SymmetricMinimumPrefix() {}
+    /** This method appends the given element, unless no vector starting with
+      * the current elements followed by it can be minimal.
+      * @param  value   The element to append, i.e., the next one going down in z.
+      * @return True iff the element was appended.
+      */
+    bool push(const T& value)
+    {
+        if (elements.empty()) {
+            elements.push_back(value);
+            periods.push_back(1);
+            return true;
+        }
+        unsigned int period = periods.back();
+        const T& reference = elements[elements.size()-period];
+        if (value < reference)
+            return false;
+        if (reference < value)
+            period = elements.size()+1;
+        elements.push_back(value);
+        periods.push_back(period);
+        return true;
+    }
+    /** This method removes the element appended last. */
+    void pop()
+    {
+        elements.pop_back();
+        periods.pop_back();
+    }
+    /** This method returns the number of elements appended so far. */
+    unsigned int size() const
+    {
+        return elements.size();
+    }
+    /** This method tells whether the vector made of the elements appended so far,
+      * taken as the complete vector, is the smallest among its translated versions.
+      */
+    bool isMinimal() const
+    {
+        return elements.empty() || ((elements.size() % periods.back()) == 0);
+    }
+};
+
+/** This function returns whether the given list of units, sorted in increasing order,
+  * is the smallest in lexicographic order among the lists obtained 
+  * by translating all its units by the same amount along z, each sorted as well.
+  * The type T must have an attribute z, giving the position of the unit along z,
+  * and an operator < that compares the z coordinates first.
+  * If a list is not the smallest, no list obtained by appending larger units to it is,
+  * so that a search adding units in increasing order can cut such a branch immediately.
+  * @param  units   The sorted list of units to test.
+  * @param  laneSize    The number of positions along z.
+  * @return True iff @a units is the smallest among its translated versions.
+  */
+template<class T>
+bool isMinimalListSymmetrically(const std::vector<T>& units, unsigned int laneSize)
+{
+    if (units.empty())
+        return true;
+    // The translation bringing the first unit to z=0 would give a smaller list.
+    if (units[0].z != 0)
+        return false;
+    // Only translations bringing a unit to z=0 can give a list starting with a unit at z=0.
+    std::vector<T> translated;
+    for(unsigned int i=1; i<units.size(); i++) {
+        if (units[i].z == units[i-1].z)
+            continue;
+        // The first unit of the translated list is units[i] brought to z=0,
+        // and in most cases comparing it to units[0] suffices.
+        T first = units[i];
+        first.z = 0;
+        if (units[0] < first)
+            continue;
+        if (first < units[0])
+            return false;
+        unsigned int dz = laneSize - units[i].z;
+        translated.resize(units.size());
+        for(unsigned int j=0; j<units.size(); j++) {
+            translated[j] = units[j];
+            translated[j].z = (units[j].z + dz) % laneSize;
+        }
+        std::sort(translated.begin(), translated.end());
+        if (std::lexicographical_compare(translated.begin(), translated.end(), units.begin(), units.end()))
+            return false;
+    }
+    return true;
 }
 
 #endif